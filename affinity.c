@@ -0,0 +1,331 @@
+/*
+ * affinity.c
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For CPU_SET, sched_getcpu, and pthread affinity
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+#include "stat_tracking.h"
+#include "print_thread.h"
+#include "config.h"
+
+//From linux/mempolicy.h, which isn't always installed
+#define AFFINITY_MPOL_PREFERRED 1
+
+typedef struct affinity_thread
+{
+	struct affinity_thread* next;
+	pthread_t thread;
+	AffinityRole role;
+	int index;
+} AffinityThread;
+
+static struct
+{
+	//Topology, read once at startup
+	int node_count;
+	short cpu_node[CPU_SETSIZE];
+	cpu_set_t all; //Every CPU the process may use
+
+	//Set by affinity_set
+	bool active;
+	cpu_set_t hot;
+	cpu_set_t housekeeping;
+	cpu_set_t node_hot[AFFINITY_MAX_NODES];
+	int hot_cpus[CPU_SETSIZE];
+	int hot_count;
+
+	pthread_mutex_t lock;
+	AffinityThread* threads;
+
+	unsigned next_node; //For connections with no known CPU
+	unsigned next_scheduler;
+} affinity;
+
+static __thread int thread_node = -1;
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU LISTS
+///////////////////////////////////////////////////////////////////////////////
+
+//Parse a kernel-style CPU list, like "0-3,8,10-11". Returns 0, or -1.
+static int parse_cpu_list(const char* list, cpu_set_t* set)
+{
+	CPU_ZERO(set);
+	const char* at = list;
+	while(*at && *at != '\n')
+	{
+		char* end;
+		long first = strtol(at, &end, 10);
+		long last = first;
+		if(end == at)
+			return -1;
+		if(*end == '-')
+		{
+			at = end + 1;
+			last = strtol(at, &end, 10);
+			if(end == at)
+				return -1;
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for(long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+
+		at = end;
+		if(*at == ',')
+			++at;
+		else if(*at && *at != '\n')
+			return -1;
+	}
+	return 0;
+}
+
+static void read_topology()
+{
+	affinity.node_count = 1;
+	for(int node = 0; node < AFFINITY_MAX_NODES; ++node)
+	{
+		char path[64];
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/node/node%d/cpulist", node);
+		FILE* file = fopen(path, "r");
+		if(!file)
+			continue;
+
+		char list[1024];
+		cpu_set_t cpus;
+		if(fgets(list, sizeof(list), file) && !parse_cpu_list(list, &cpus))
+		{
+			for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				if(CPU_ISSET(cpu, &cpus))
+					affinity.cpu_node[cpu] = node;
+			affinity.node_count = node + 1;
+		}
+		fclose(file);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PLACEMENT
+///////////////////////////////////////////////////////////////////////////////
+
+//The hot CPUs for a thread in a role. Call with affinity active.
+static const cpu_set_t* role_cpus(AffinityRole role, int index, cpu_set_t* one)
+{
+	switch(role)
+	{
+	case affinity_accept: return &affinity.hot;
+	case affinity_scheduler:
+		CPU_ZERO(one);
+		CPU_SET(affinity.hot_cpus[index % affinity.hot_count], one);
+		return one;
+	default: return &affinity.housekeeping;
+	}
+}
+
+static void place(pthread_t thread, AffinityRole role, int index)
+{
+	cpu_set_t one;
+	const cpu_set_t* cpus = role_cpus(role, index, &one);
+	pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+}
+
+//A node that has hot CPUs, for a connection received on cpu
+static int connection_node(int cpu)
+{
+	if(cpu >= 0 && cpu < CPU_SETSIZE)
+	{
+		int node = affinity.cpu_node[cpu];
+		if(CPU_COUNT(&affinity.node_hot[node]))
+			return node;
+	}
+
+	//Every node gets a turn; this always ends, since some CPU is hot
+	int node;
+	do
+	{
+		node = __atomic_fetch_add(&affinity.next_node, 1, __ATOMIC_RELAXED) %
+			affinity.node_count;
+	} while(!CPU_COUNT(&affinity.node_hot[node]));
+	return node;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_AFFINITY_PRI)))
+void init_affinity()
+{
+	if(DEBUG_PRINT) puts("Reading CPU topology");
+	pthread_mutex_init(&affinity.lock, 0);
+	sched_getaffinity(0, sizeof(cpu_set_t), &affinity.all);
+	read_topology();
+}
+
+__attribute__((destructor (MODULE_AFFINITY_PRI)))
+void deinit_affinity()
+{
+	if(DEBUG_PRINT) puts("Clearing thread placement");
+
+	AffinityThread* node = affinity.threads;
+	while(node)
+	{
+		AffinityThread* next = node->next;
+		free(node);
+		node = next;
+	}
+	affinity.threads = 0;
+	pthread_mutex_destroy(&affinity.lock);
+}
+
+int affinity_set(const char* list)
+{
+	cpu_set_t hot;
+	if(parse_cpu_list(list, &hot))
+		return -1;
+	CPU_AND(&hot, &hot, &affinity.all);
+	if(CPU_COUNT(&hot) == 0)
+		return -1;
+
+	pthread_mutex_lock(&affinity.lock);
+
+	affinity.hot = hot;
+	affinity.hot_count = 0;
+	for(int node = 0; node < AFFINITY_MAX_NODES; ++node)
+		CPU_ZERO(&affinity.node_hot[node]);
+	for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if(!CPU_ISSET(cpu, &hot))
+			continue;
+		affinity.hot_cpus[affinity.hot_count++] = cpu;
+		CPU_SET(cpu, &affinity.node_hot[affinity.cpu_node[cpu]]);
+	}
+
+	//If every CPU is hot, housekeeping has to share
+	CPU_XOR(&affinity.housekeeping, &affinity.all, &hot);
+	if(CPU_COUNT(&affinity.housekeeping) == 0)
+		affinity.housekeeping = affinity.all;
+
+	__atomic_store_n(&affinity.active, true, __ATOMIC_RELEASE);
+
+	for(AffinityThread* node = affinity.threads; node; node = node->next)
+		place(node->thread, node->role, node->index);
+
+	pthread_mutex_unlock(&affinity.lock);
+
+	submit_debug(es_printf("Placing connections on %d CPUs across %d NUMA "
+		"nodes", affinity.hot_count, affinity.node_count));
+	return 0;
+}
+
+bool affinity_active()
+{
+	return __atomic_load_n(&affinity.active, __ATOMIC_ACQUIRE);
+}
+
+void affinity_register(pthread_t thread, AffinityRole role, int index)
+{
+	AffinityThread* node = malloc(sizeof(AffinityThread));
+	if(!node)
+		return;
+	node->thread = thread;
+	node->role = role;
+	node->index = index;
+
+	pthread_mutex_lock(&affinity.lock);
+	node->next = affinity.threads;
+	affinity.threads = node;
+	if(affinity.active)
+		place(thread, role, index);
+	pthread_mutex_unlock(&affinity.lock);
+}
+
+int affinity_connection_cpu(int fd)
+{
+	if(!AFFINITY_INCOMING_CPU || !affinity_active())
+		return -1;
+
+	int cpu = -1;
+	socklen_t size = sizeof(cpu);
+	if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) ||
+			cpu >= CPU_SETSIZE)
+		cpu = -1;
+
+	stat_add_affinity_connection(cpu >= 0);
+	return cpu;
+}
+
+void affinity_worker_attr(pthread_attr_t* attributes, int cpu)
+{
+	if(!affinity_active())
+		return;
+	pthread_attr_setaffinity_np(attributes, sizeof(cpu_set_t),
+		&affinity.node_hot[connection_node(cpu)]);
+}
+
+void affinity_helper_attr(pthread_attr_t* attributes)
+{
+	if(!affinity_active())
+		return;
+	pthread_attr_setaffinity_np(attributes, sizeof(cpu_set_t),
+		&affinity.housekeeping);
+}
+
+int affinity_scheduler_for(int cpu, int count)
+{
+	if(!affinity_active())
+		return -1;
+
+	//Scheduler i is on hot_cpus[i % hot_count]
+	if(cpu >= 0)
+		for(int i = 0; i < count && i < affinity.hot_count; ++i)
+			if(affinity.hot_cpus[i] == cpu)
+				return i;
+
+	//Otherwise one on the same node, taking turns
+	int node = connection_node(cpu);
+	unsigned start = __atomic_fetch_add(&affinity.next_scheduler, 1,
+		__ATOMIC_RELAXED);
+	for(int i = 0; i < count; ++i)
+	{
+		int index = (start + i) % count;
+		if(affinity.cpu_node[affinity.hot_cpus[index % affinity.hot_count]] ==
+				node)
+			return index;
+	}
+	return -1;
+}
+
+int affinity_node()
+{
+	if(thread_node < 0)
+	{
+		int cpu = affinity_active() ? sched_getcpu() : -1;
+		thread_node = cpu >= 0 && cpu < CPU_SETSIZE ? affinity.cpu_node[cpu] : 0;
+	}
+	return thread_node;
+}
+
+void affinity_bind_memory(void* memory, size_t size, int node)
+{
+	if(!affinity_active() || affinity.node_count < 2)
+		return;
+
+	unsigned long mask = 1UL << node;
+	syscall(SYS_mbind, memory, size, AFFINITY_MPOL_PREFERRED, &mask,
+		sizeof(mask) * 8, 0);
+}
@@ -0,0 +1,81 @@
+/*
+ * affinity.h
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ *
+ *  CPU and NUMA placement, with -a. The CPUs given are the hot ones: the
+ *  accept loop, connection workers and fiber schedulers run there, and
+ *  everything else (printing, timers, the thread manager, HTTP/2 origins,
+ *  DNS helpers) runs on the CPUs that are left, so it never takes a core
+ *  from a connection.
+ *
+ *  Each connection is kept on one NUMA node. If AFFINITY_INCOMING_CPU is
+ *  set, that's the node whose CPU took the connection's packets off the NIC
+ *  (SO_INCOMING_CPU), so with RSS and IRQs lined up with the hot CPUs, a
+ *  connection's packets, state and buffers all stay on one node; otherwise
+ *  connections are dealt out to nodes in turn. A worker thread can run on
+ *  any hot CPU of its node; a fiber goes to a scheduler on that node,
+ *  preferring the one on the receiving CPU itself. The buffer pool keeps
+ *  separate free lists for each node (see affinity_node).
+ *
+ *  Without -a, none of this happens, and there's one node.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef enum
+{
+	affinity_housekeeping, //Off the hot CPUs
+	affinity_accept, //Any hot CPU
+	affinity_scheduler //One hot CPU: the index'th, wrapping around
+} AffinityRole;
+
+/*
+ * Use the CPUs in list (like "0-7,16-23") for connections. Threads already
+ * registered are moved. Returns 0, or -1 if the list is bad.
+ */
+int affinity_set(const char* list);
+
+//True once affinity_set has succeeded
+bool affinity_active();
+
+/*
+ * Keep a long-lived thread in its place, now and whenever affinity_set is
+ * called. index is only used by schedulers.
+ */
+void affinity_register(pthread_t thread, AffinityRole role, int index);
+
+/*
+ * The CPU that received a new connection's packets, or -1 if it isn't known
+ * or affinity isn't being used.
+ */
+int affinity_connection_cpu(int fd);
+
+/*
+ * Set up the attributes for a connection's worker thread, to run on the hot
+ * CPUs of cpu's node (or the next node in turn, if cpu is -1). No effect
+ * without affinity.
+ */
+void affinity_worker_attr(pthread_attr_t* attributes, int cpu);
+
+//Set up the attributes for a short-lived housekeeping thread
+void affinity_helper_attr(pthread_attr_t* attributes);
+
+/*
+ * Which of count fiber schedulers a connection received on cpu should go to,
+ * or -1 to take the next one in turn.
+ */
+int affinity_scheduler_for(int cpu, int count);
+
+/*
+ * The NUMA node the calling thread runs on; always 0 without affinity. It's
+ * looked up once per thread, since threads stay on their node once pinned.
+ */
+int affinity_node();
+
+//Prefer to back memory with pages from a node. Best effort.
+void affinity_bind_memory(void* memory, size_t size, int node);
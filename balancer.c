@@ -0,0 +1,284 @@
+/*
+ * balancer.c
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "balancer.h"
+#include "stat_tracking.h"
+#include "config.h"
+
+struct upstream
+{
+	Upstream* next;
+	struct sockaddr_in address;
+
+	//Microseconds; 0 until there's a sample
+	double connect_time;
+	double first_byte_time;
+
+	unsigned in_flight;
+	unsigned failures; //In a row
+	uint64_t ejected_until; //Milliseconds
+	uint64_t used; //Milliseconds, when it was last picked or finished
+	uint64_t sampled; //Milliseconds, when it was last picked
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	Upstream* buckets[UPSTREAM_TABLE_BUCKETS];
+	uint64_t swept;
+} balancer;
+
+//Most addresses considered for one pick; the rest of a longer list is ignored
+#define MAX_CANDIDATES 32
+
+static inline uint64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//xorshift, per thread; it only has to spread picks, not be unpredictable
+static inline uint32_t random_below(uint32_t limit)
+{
+	static __thread uint32_t state;
+	if(!state)
+		state = (uint32_t)(uintptr_t)&state ^ (uint32_t)now_ms() ^ 0x9E3779B9u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state % limit;
+}
+
+static inline Upstream** bucket_for(const struct sockaddr_in* address)
+{
+	uint32_t hash = (address->sin_addr.s_addr ^ address->sin_port * 0x10001u) *
+		0x9E3779B1u;
+	return &balancer.buckets[(hash ^ hash >> 16) % UPSTREAM_TABLE_BUCKETS];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE TABLE
+///////////////////////////////////////////////////////////////////////////////
+
+//All of these must be called with the lock
+
+//Forget addresses nobody has used in a while
+static void sweep(uint64_t now)
+{
+	balancer.swept = now;
+	uint64_t idle = UPSTREAM_IDLE_TIMEOUT * 1000;
+
+	for(int i = 0; i < UPSTREAM_TABLE_BUCKETS; ++i)
+	{
+		Upstream** link = &balancer.buckets[i];
+		while(*link)
+		{
+			Upstream* upstream = *link;
+			if(upstream->in_flight == 0 && now - upstream->used >= idle)
+			{
+				*link = upstream->next;
+				free(upstream);
+			}
+			else
+			{
+				link = &upstream->next;
+			}
+		}
+	}
+}
+
+static Upstream* find_or_add(const struct sockaddr_in* address, uint64_t now)
+{
+	Upstream** bucket = bucket_for(address);
+	for(Upstream* upstream = *bucket; upstream; upstream = upstream->next)
+		if(upstream->address.sin_addr.s_addr == address->sin_addr.s_addr &&
+				upstream->address.sin_port == address->sin_port)
+			return upstream;
+
+	Upstream* upstream = calloc(1, sizeof(Upstream));
+	if(!upstream)
+		return 0;
+	upstream->address = *address;
+	upstream->used = now;
+	upstream->sampled = now - UPSTREAM_REPROBE_TIME * 1000;
+	upstream->next = *bucket;
+	*bucket = upstream;
+	return upstream;
+}
+
+/*
+ * Expected latency, scaled by the queue it would join. Averages go stale: an
+ * address that lost out long enough ago to have recovered since is worth one
+ * more look, so it costs nothing until it's been picked again.
+ */
+static inline double cost(const Upstream* upstream, uint64_t now)
+{
+	if(now - upstream->sampled >= UPSTREAM_REPROBE_TIME * 1000)
+		return 0;
+	return (upstream->connect_time + upstream->first_byte_time) *
+		(upstream->in_flight + 1);
+}
+
+static inline void average(double* ewma, unsigned long sample)
+{
+	*ewma = *ewma ? *ewma + UPSTREAM_EWMA_WEIGHT * (sample - *ewma) : sample;
+}
+
+static inline void fail(Upstream* upstream)
+{
+	if(++upstream->failures >= UPSTREAM_EJECT_FAILURES)
+	{
+		upstream->ejected_until = now_ms() + UPSTREAM_EJECT_TIME * 1000;
+		upstream->failures = 0;
+		stat_add_upstream_ejection();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_BALANCER_PRI)))
+void init_balancer()
+{
+	if(DEBUG_PRINT) puts("Initializing upstream balancer");
+	pthread_mutex_init(&balancer.lock, 0);
+}
+
+__attribute__((destructor (MODULE_BALANCER_PRI)))
+void deinit_balancer()
+{
+	if(DEBUG_PRINT) puts("Clearing upstream balancer");
+	for(int i = 0; i < UPSTREAM_TABLE_BUCKETS; ++i)
+	{
+		Upstream* upstream = balancer.buckets[i];
+		while(upstream)
+		{
+			Upstream* next = upstream->next;
+			free(upstream);
+			upstream = next;
+		}
+		balancer.buckets[i] = 0;
+	}
+	pthread_mutex_destroy(&balancer.lock);
+}
+
+Upstream* upstream_pick(const struct addrinfo* list, const Upstream* avoid)
+{
+	uint64_t now = now_ms();
+	Upstream* all[MAX_CANDIDATES];
+	Upstream* healthy[MAX_CANDIDATES];
+	int all_count = 0, healthy_count = 0;
+
+	pthread_mutex_lock(&balancer.lock);
+
+	if(now - balancer.swept >= UPSTREAM_IDLE_TIMEOUT * 1000)
+		sweep(now);
+
+	for(const struct addrinfo* info = list; info && all_count < MAX_CANDIDATES;
+		info = info->ai_next)
+	{
+		if(info->ai_family != AF_INET)
+			continue;
+		Upstream* upstream = find_or_add((struct sockaddr_in*)info->ai_addr, now);
+		if(!upstream)
+			continue;
+
+		//The same address can come back more than once
+		bool duplicate = false;
+		for(int i = 0; i < all_count; ++i)
+			duplicate |= all[i] == upstream;
+		if(duplicate)
+			continue;
+
+		all[all_count++] = upstream;
+		if(upstream != avoid && upstream->ejected_until <= now)
+			healthy[healthy_count++] = upstream;
+	}
+
+	//Everything's out; try what there is, preferring not to repeat a failure
+	if(healthy_count == 0)
+		for(int i = 0; i < all_count; ++i)
+			if(all[i] != avoid || all_count == 1)
+				healthy[healthy_count++] = all[i];
+
+	Upstream* pick = 0;
+	if(healthy_count == 1)
+	{
+		pick = healthy[0];
+	}
+	else if(healthy_count > 1)
+	{
+		//Power of two choices
+		int first = random_below(healthy_count);
+		int second = random_below(healthy_count - 1);
+		if(second >= first)
+			++second;
+		pick = cost(healthy[second], now) < cost(healthy[first], now) ?
+			healthy[second] : healthy[first];
+		stat_add_upstream_choice();
+	}
+
+	if(pick)
+	{
+		++pick->in_flight;
+		pick->used = pick->sampled = now;
+	}
+
+	pthread_mutex_unlock(&balancer.lock);
+	return pick;
+}
+
+const struct sockaddr_in* upstream_address(const Upstream* upstream)
+{
+	return &upstream->address;
+}
+
+void upstream_connected(Upstream* upstream, bool success,
+	unsigned long microseconds)
+{
+	pthread_mutex_lock(&balancer.lock);
+	if(success)
+		average(&upstream->connect_time, microseconds);
+	else
+		fail(upstream);
+	pthread_mutex_unlock(&balancer.lock);
+}
+
+void upstream_first_byte(Upstream* upstream, unsigned long microseconds)
+{
+	pthread_mutex_lock(&balancer.lock);
+	average(&upstream->first_byte_time, microseconds);
+	upstream->failures = 0;
+	pthread_mutex_unlock(&balancer.lock);
+}
+
+void upstream_failed(Upstream* upstream)
+{
+	pthread_mutex_lock(&balancer.lock);
+	fail(upstream);
+	pthread_mutex_unlock(&balancer.lock);
+}
+
+void upstream_done(Upstream* upstream)
+{
+	if(!upstream)
+		return;
+
+	pthread_mutex_lock(&balancer.lock);
+	--upstream->in_flight;
+	upstream->used = now_ms();
+	pthread_mutex_unlock(&balancer.lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * balancer.h
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ *
+ *  Choosing which of an origin's addresses to connect to. Every address the
+ *  proxy has connected to is tracked: a moving average (EWMA) of its connect
+ *  time and its time to first byte, and how many requests it has in flight.
+ *  A pick takes two of the candidates at random and uses the cheaper, where
+ *  cost is latency times load, so traffic drifts towards the fastest
+ *  addresses without stampeding onto any one of them. Addresses never tried
+ *  cost nothing, so each gets a look, and so do addresses that haven't been
+ *  picked for UPSTREAM_REPROBE_TIME seconds, in case they've got faster.
+ *
+ *  An address that fails UPSTREAM_EJECT_FAILURES times in a row is left out
+ *  of picks for UPSTREAM_EJECT_TIME seconds. If every candidate is out, they
+ *  are all considered anyway, since trying beats refusing outright.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+typedef struct upstream Upstream;
+
+/*
+ * Pick one of the IPv4 addresses in list, other than avoid, unless it's the
+ * only one. The pick counts as in flight until upstream_done. Returns 0 if
+ * the list is empty or it's out of memory.
+ */
+Upstream* upstream_pick(const struct addrinfo* list, const Upstream* avoid);
+
+//The address to connect to
+const struct sockaddr_in* upstream_address(const Upstream* upstream);
+
+//How a connect went, and how long it took. Failures count towards ejection.
+void upstream_connected(Upstream* upstream, bool success,
+	unsigned long microseconds);
+
+/*
+ * Time from sending the request to the first byte of the response, reported
+ * once the whole head has arrived. Only this ends a run of failures; a
+ * connect alone doesn't, since an origin can accept and then not answer.
+ */
+void upstream_first_byte(Upstream* upstream, unsigned long microseconds);
+
+//The origin failed after connecting: no response, or a broken one
+void upstream_failed(Upstream* upstream);
+
+//The request is finished with the address. upstream may be 0.
+void upstream_done(Upstream* upstream);
@@ -0,0 +1,104 @@
+/*
+ * bench_histogram.h
+ *
+ *  Created on: Mar 16, 2014
+ *      Author: nathan
+ *
+ *  Latency histograms and timing shared by the benchmark tools. Latencies are
+ *  kept in microseconds, in log-linear buckets: exact below 32, then 32
+ *  buckets per power of two (about 3% resolution).
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#define SUB_BUCKETS 32
+#define NUM_BUCKETS (SUB_BUCKETS + 59 * SUB_BUCKETS)
+
+typedef struct
+{
+	uint64_t buckets[NUM_BUCKETS];
+	uint64_t count;
+} Histogram;
+
+static inline uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline void sleep_until(uint64_t when_ns)
+{
+	struct timespec when = { when_ns / 1000000000ULL, when_ns % 1000000000ULL };
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, 0) == EINTR);
+}
+
+static inline int bucket_of(uint64_t us)
+{
+	if(us < SUB_BUCKETS) return us;
+	int exponent = 63 - __builtin_clzll(us);
+	int sub = (us >> (exponent - 5)) - SUB_BUCKETS;
+	return SUB_BUCKETS + (exponent - 5) * SUB_BUCKETS + sub;
+}
+
+static inline uint64_t bucket_value(int bucket)
+{
+	if(bucket < SUB_BUCKETS) return bucket;
+	int exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 5;
+	uint64_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+	return sub << (exponent - 5);
+}
+
+static inline void histogram_add(Histogram* histogram, uint64_t us)
+{
+	++histogram->buckets[bucket_of(us)];
+	++histogram->count;
+}
+
+static inline void histogram_merge(Histogram* into, const Histogram* from)
+{
+	for(int bucket = 0; bucket < NUM_BUCKETS; ++bucket)
+		into->buckets[bucket] += from->buckets[bucket];
+	into->count += from->count;
+}
+
+static inline double histogram_percentile_ms(const Histogram* histogram,
+	double percentile)
+{
+	uint64_t rank = (uint64_t)ceil(histogram->count * percentile / 100.0);
+	if(rank == 0) rank = 1;
+
+	uint64_t seen = 0;
+	for(int bucket = 0; bucket < NUM_BUCKETS; ++bucket)
+	{
+		seen += histogram->buckets[bucket];
+		if(seen >= rank) return bucket_value(bucket) / 1000.0;
+	}
+	return 0;
+}
+
+static inline double histogram_max_ms(const Histogram* histogram)
+{
+	for(int bucket = NUM_BUCKETS - 1; bucket >= 0; --bucket)
+		if(histogram->buckets[bucket])
+			return bucket_value(bucket) / 1000.0;
+	return 0;
+}
+
+static inline void histogram_print(FILE* file, const Histogram* histogram)
+{
+	if(histogram->count == 0)
+		return;
+	fprintf(file, "Latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  "
+		"max %.3f\n", histogram_percentile_ms(histogram, 50),
+		histogram_percentile_ms(histogram, 90),
+		histogram_percentile_ms(histogram, 99),
+		histogram_percentile_ms(histogram, 99.9),
+		histogram_max_ms(histogram));
+}
@@ -0,0 +1,436 @@
+/*
+ * bench_load.c
+ *
+ *  Created on: Mar 14, 2014
+ *      Author: nathan
+ *
+ *  An open-loop load generator for the proxy. Requests are scheduled at a
+ *  fixed rate, whether or not earlier ones have finished, and each latency is
+ *  measured from when its request was *scheduled*, so a stalled proxy shows
+ *  up as latency instead of quietly lowering the offered load. Standalone;
+ *  build it with:
+ *
+ *    gcc -std=gnu99 -O2 -pthread bench/bench_load.c -o bench_load -lm
+ *
+ *  Usage: bench_load [options]
+ *    -x host:port  the proxy (127.0.0.1:8080)
+ *    -u url        base URL to fetch (http://127.0.0.1:8090/)
+ *    -r rate       requests per second to offer (100)
+ *    -d seconds    how long to offer it (10)
+ *    -t threads    concurrent requests allowed in flight (64)
+ *    -s sizes      response size distribution, requested from bench_origin
+ *                  as /bytes/N:
+ *                    fixed:N, uniform:MIN:MAX, or pareto:MIN:ALPHA
+ *    -i count      idle connections to hold open at the proxy during the run
+ *    -p pid        the proxy's pid, to report its CPU time and RSS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bench_histogram.h"
+
+#define READ_SIZE (64 * 1024)
+#define MAX_PARETO_SIZE (64UL * 1024 * 1024)
+
+typedef enum { size_none, size_fixed, size_uniform, size_pareto } SizeKind;
+
+static struct
+{
+	const char* proxy;
+	const char* url;
+	double rate;
+	int duration;
+	int threads;
+	SizeKind size_kind;
+	double size_a;
+	double size_b;
+	int idle;
+	int pid;
+} options = { "127.0.0.1:8080", "http://127.0.0.1:8090/", 100, 10, 64,
+	size_none, 0, 0, 0, 0 };
+
+static struct addrinfo* proxy_address;
+
+typedef struct
+{
+	Histogram latency;
+	uint64_t errors;
+	uint64_t late; //Started more than a millisecond after they were scheduled
+	uint64_t bytes;
+	unsigned seed;
+} WorkerStats;
+
+static uint64_t start_ns;
+static uint64_t end_ns;
+static uint64_t next_slot;
+static uint64_t total_completed; //For the progress line
+
+///////////////////////////////////////////////////////////////////////////////
+// REQUESTS
+///////////////////////////////////////////////////////////////////////////////
+
+static unsigned long pick_size(unsigned* seed)
+{
+	double unit = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+	switch(options.size_kind)
+	{
+	case size_fixed:
+		return options.size_a;
+	case size_uniform:
+		return options.size_a + unit * (options.size_b - options.size_a);
+	case size_pareto:
+	{
+		double size = options.size_a / pow(unit, 1.0 / options.size_b);
+		return size > MAX_PARETO_SIZE ? MAX_PARETO_SIZE : size;
+	}
+	default:
+		return 0;
+	}
+}
+
+static int open_proxy_connection()
+{
+	int fd = socket(proxy_address->ai_family, SOCK_STREAM, 0);
+	if(fd < 0) return -1;
+	if(connect(fd, proxy_address->ai_addr, proxy_address->ai_addrlen))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//Fetch one URL through the proxy. Returns the bytes read, or -1 on error.
+static long fetch(unsigned* seed, char* buffer)
+{
+	int fd = open_proxy_connection();
+	if(fd < 0) return -1;
+
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	//The proxy closes after every response, so just read to EOF
+	char request[1024];
+	int request_size;
+	const char* host = strstr(options.url, "://");
+	host = host ? host + 3 : options.url;
+	int host_size = strcspn(host, "/");
+
+	if(options.size_kind == size_none)
+		request_size = snprintf(request, sizeof(request),
+			"GET %s HTTP/1.1\r\nHost: %.*s\r\nConnection: close\r\n\r\n",
+			options.url, host_size, host);
+	else
+		request_size = snprintf(request, sizeof(request),
+			"GET http://%.*s/bytes/%lu HTTP/1.1\r\nHost: %.*s\r\n"
+			"Connection: close\r\n\r\n",
+			host_size, host, pick_size(seed), host_size, host);
+
+	if(send(fd, request, request_size, MSG_NOSIGNAL) != request_size)
+	{
+		close(fd);
+		return -1;
+	}
+
+	long total = 0;
+	ssize_t amount;
+	while((amount = recv(fd, buffer, READ_SIZE, 0)) > 0)
+	{
+		//Check the status on the first read
+		if(total == 0 && (amount < 12 || strncmp(buffer + 9, "200", 3) != 0))
+		{
+			close(fd);
+			return -1;
+		}
+		total += amount;
+	}
+	close(fd);
+
+	return amount < 0 || total == 0 ? -1 : total;
+}
+
+static void* worker_thread(void* arg)
+{
+	WorkerStats* stats = arg;
+	char* buffer = malloc(READ_SIZE);
+
+	while(1)
+	{
+		uint64_t slot = __sync_fetch_and_add(&next_slot, 1);
+		uint64_t scheduled = start_ns + (uint64_t)(slot * 1e9 / options.rate);
+		if(scheduled >= end_ns)
+			break;
+
+		sleep_until(scheduled);
+		if(now_ns() > scheduled + 1000000)
+			++stats->late;
+
+		long bytes = fetch(&stats->seed, buffer);
+		uint64_t latency_us = (now_ns() - scheduled) / 1000;
+
+		if(bytes < 0)
+		{
+			++stats->errors;
+			continue;
+		}
+
+		histogram_add(&stats->latency, latency_us);
+		stats->bytes += bytes;
+		__sync_add_and_fetch(&total_completed, 1);
+	}
+
+	free(buffer);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE PROXY'S RESOURCE USAGE
+///////////////////////////////////////////////////////////////////////////////
+
+//utime + stime of a process, in seconds
+static double process_cpu(int pid)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/stat", pid);
+	FILE* file = fopen(path, "r");
+	if(!file) return 0;
+
+	//Skip to after the command name, which can contain spaces
+	char line[1024];
+	size_t size = fread(line, 1, sizeof(line) - 1, file);
+	fclose(file);
+	line[size] = '\0';
+	char* fields = strrchr(line, ')');
+	if(!fields) return 0;
+
+	unsigned long utime = 0, stime = 0;
+	sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime);
+	return (utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+//A field (in kB) of /proc/pid/status, like VmRSS or VmHWM
+static unsigned long process_memory(int pid, const char* field)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/status", pid);
+	FILE* file = fopen(path, "r");
+	if(!file) return 0;
+
+	char line[256];
+	unsigned long value = 0;
+	size_t field_size = strlen(field);
+	while(fgets(line, sizeof(line), file))
+		if(strncmp(line, field, field_size) == 0 && line[field_size] == ':')
+			value = strtoul(line + field_size + 1, 0, 10);
+	fclose(file);
+	return value;
+}
+
+static unsigned long process_threads(int pid)
+{
+	return process_memory(pid, "Threads");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IDLE CONNECTIONS
+///////////////////////////////////////////////////////////////////////////////
+
+static int* open_idle_connections(int count, int* opened)
+{
+	//10k idle sockets needs a bigger descriptor limit than the usual 1024
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	int* fds = malloc(count * sizeof(int));
+	*opened = 0;
+	for(int i = 0; i < count; ++i)
+	{
+		fds[i] = open_proxy_connection();
+		if(fds[i] >= 0) ++*opened;
+	}
+	return fds;
+}
+
+//How many are still open. The proxy closes them when its idle timeout fires.
+static int count_open(int* fds, int count)
+{
+	int open = 0;
+	char byte;
+	for(int i = 0; i < count; ++i)
+	{
+		if(fds[i] < 0) continue;
+		ssize_t amount = recv(fds[i], &byte, 1, MSG_DONTWAIT | MSG_PEEK);
+		if(amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			++open;
+	}
+	return open;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+
+static bool parse_sizes(const char* text)
+{
+	if(sscanf(text, "fixed:%lf", &options.size_a) == 1)
+		options.size_kind = size_fixed;
+	else if(sscanf(text, "uniform:%lf:%lf", &options.size_a,
+			&options.size_b) == 2)
+		options.size_kind = size_uniform;
+	else if(sscanf(text, "pareto:%lf:%lf", &options.size_a,
+			&options.size_b) == 2 && options.size_b > 0)
+		options.size_kind = size_pareto;
+	else
+		return false;
+	return true;
+}
+
+static bool resolve_proxy()
+{
+	char host[256];
+	const char* colon = strrchr(options.proxy, ':');
+	if(!colon || colon - options.proxy >= (long)sizeof(host))
+		return false;
+	snprintf(host, sizeof(host), "%.*s", (int)(colon - options.proxy),
+		options.proxy);
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM };
+	return getaddrinfo(host, colon + 1, &hints, &proxy_address) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	int option;
+	while((option = getopt(argc, argv, "x:u:r:d:t:s:i:p:")) != -1)
+	{
+		switch(option)
+		{
+		case 'x': options.proxy = optarg; break;
+		case 'u': options.url = optarg; break;
+		case 'r': options.rate = atof(optarg); break;
+		case 'd': options.duration = atoi(optarg); break;
+		case 't': options.threads = atoi(optarg); break;
+		case 'i': options.idle = atoi(optarg); break;
+		case 'p': options.pid = atoi(optarg); break;
+		case 's':
+			if(parse_sizes(optarg)) break;
+			//Fall through
+		default:
+			fprintf(stderr, "Usage: %s [-x host:port] [-u url] [-r rate] "
+				"[-d seconds] [-t threads] [-s sizes] [-i idle] [-p pid]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if(options.rate <= 0 || options.duration <= 0 || options.threads <= 0 ||
+			!resolve_proxy())
+	{
+		fprintf(stderr, "bench_load: bad proxy address or parameters\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int* idle_fds = 0;
+	int idle_opened = 0;
+	if(options.idle)
+	{
+		idle_fds = open_idle_connections(options.idle, &idle_opened);
+		printf("Opened %d of %d idle connections\n", idle_opened,
+			options.idle);
+	}
+
+	double cpu_before = options.pid ? process_cpu(options.pid) : 0;
+	unsigned long rss_peak = 0;
+
+	WorkerStats* stats = calloc(options.threads, sizeof(WorkerStats));
+	pthread_t* threads = malloc(options.threads * sizeof(pthread_t));
+
+	start_ns = now_ns() + 10000000; //Give the threads a moment to start
+	end_ns = start_ns + options.duration * 1000000000ULL;
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, 256 * 1024);
+	for(int i = 0; i < options.threads; ++i)
+	{
+		stats[i].seed = i * 7919 + 1;
+		pthread_create(&threads[i], &attributes, &worker_thread, &stats[i]);
+	}
+
+	//Once a second: progress, and a sample of the proxy's RSS
+	uint64_t last_completed = 0;
+	for(int second = 1; second <= options.duration; ++second)
+	{
+		sleep_until(start_ns + second * 1000000000ULL);
+		uint64_t completed = total_completed;
+		unsigned long rss = options.pid ? process_memory(options.pid, "VmRSS") : 0;
+		if(rss > rss_peak) rss_peak = rss;
+
+		fprintf(stderr, "%3ds: %6llu req/s", second,
+			(unsigned long long)(completed - last_completed));
+		if(options.pid)
+			fprintf(stderr, ", proxy RSS %.1f MB, %lu threads", rss / 1024.0,
+				process_threads(options.pid));
+		fputc('\n', stderr);
+		last_completed = completed;
+	}
+
+	for(int i = 0; i < options.threads; ++i)
+		pthread_join(threads[i], 0);
+	double elapsed = (now_ns() - start_ns) / 1e9;
+	double cpu_after = options.pid ? process_cpu(options.pid) : 0;
+
+	//Merge the workers' results
+	static Histogram latency;
+	uint64_t errors = 0, late = 0, bytes = 0;
+	for(int i = 0; i < options.threads; ++i)
+	{
+		histogram_merge(&latency, &stats[i].latency);
+		errors += stats[i].errors;
+		late += stats[i].late;
+		bytes += stats[i].bytes;
+	}
+	uint64_t completed = latency.count;
+
+	printf("Offered %.0f req/s for %d s with %d threads\n", options.rate,
+		options.duration, options.threads);
+	printf("Completed %llu requests (%llu errors, %llu started late), "
+		"%.1f req/s, %.2f MB/s\n", (unsigned long long)completed,
+		(unsigned long long)errors, (unsigned long long)late,
+		completed / elapsed, bytes / elapsed / (1024 * 1024));
+	histogram_print(stdout, &latency);
+	if(options.pid)
+		printf("Proxy: %.1f%% of one core, RSS peak %.1f MB (lifetime high "
+			"water mark %.1f MB)\n", 100 * (cpu_after - cpu_before) / elapsed,
+			rss_peak / 1024.0, process_memory(options.pid, "VmHWM") / 1024.0);
+	if(options.idle)
+		printf("Idle connections: %d opened, %d still open\n", idle_opened,
+			count_open(idle_fds, options.idle));
+
+	free(threads);
+	free(stats);
+	freeaddrinfo(proxy_address);
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * bench_origin.c
+ *
+ *  Created on: Mar 14, 2014
+ *      Author: nathan
+ *
+ *  A stand-in origin server for benchmarking the proxy. It answers every GET
+ *  or POST with a body of filler bytes, so runs don't depend on (or hammer)
+ *  real sites. Standalone; build it with:
+ *
+ *    gcc -std=gnu99 -O2 -pthread bench/bench_origin.c -o bench_origin
+ *
+ *  Usage: bench_origin [-p port] [-s size] [-t think_ms] [-c] [-k] [-m max_age]
+ *    -p: port to listen on (8090)
+ *    -s: default body size. A path of /bytes/N asks for N bytes instead, so
+ *        the load generator controls the size distribution.
+ *    -t: think time, in milliseconds, before each response
+ *    -c: send bodies chunked instead of with Content-Length
+ *    -k: honor keep-alive (otherwise close after every response)
+ *    -m: send Cache-Control: max-age=N (by default, no-store, so the proxy's
+ *        cache stays out of the way)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_HEAD_SIZE (64 * 1024)
+#define FILL_SIZE (64 * 1024)
+#define CHUNK_SIZE (16 * 1024)
+
+static struct
+{
+	int port;
+	unsigned long size;
+	int think_ms;
+	bool chunked;
+	bool keep_alive;
+	int max_age; //-1 for no-store
+} options = { 8090, 1024, 0, false, false, -1 };
+
+static char fill[FILL_SIZE];
+
+static int send_all(int fd, const char* data, size_t size)
+{
+	while(size)
+	{
+		ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if(sent <= 0) return -1;
+		data += sent;
+		size -= sent;
+	}
+	return 0;
+}
+
+//Send size filler bytes, raw or as chunks
+static int send_body(int fd, unsigned long size)
+{
+	while(size)
+	{
+		size_t piece = size < (options.chunked ? CHUNK_SIZE : FILL_SIZE) ?
+			size : (options.chunked ? CHUNK_SIZE : FILL_SIZE);
+
+		if(options.chunked)
+		{
+			char chunk_head[32];
+			int head_size = sprintf(chunk_head, "%zx\r\n", piece);
+			if(send_all(fd, chunk_head, head_size)) return -1;
+		}
+		if(send_all(fd, fill, piece)) return -1;
+		if(options.chunked && send_all(fd, "\r\n", 2)) return -1;
+		size -= piece;
+	}
+	return options.chunked ? send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+//Find a header's value in a request head. Case-insensitive name match.
+static const char* find_value(const char* head, const char* name)
+{
+	size_t name_size = strlen(name);
+	for(const char* line = strstr(head, "\n"); line; line = strstr(line, "\n"))
+	{
+		++line;
+		if(strncasecmp(line, name, name_size) == 0 && line[name_size] == ':')
+			return line + name_size + 1;
+	}
+	return 0;
+}
+
+//Serve one request. Returns true if the connection should stay open.
+static bool serve_request(int fd, char* head, size_t* buffered)
+{
+	//Read until the end of the head
+	char* end;
+	while(!(end = strstr(head, "\r\n\r\n")))
+	{
+		if(*buffered >= MAX_HEAD_SIZE - 1) return false;
+		ssize_t amount = recv(fd, head + *buffered,
+			MAX_HEAD_SIZE - 1 - *buffered, 0);
+		if(amount <= 0) return false;
+		*buffered += amount;
+		head[*buffered] = '\0';
+	}
+	end += 4;
+
+	//Throw away any request body
+	const char* length_text = find_value(head, "Content-Length");
+	unsigned long body_size = length_text ? strtoul(length_text, 0, 10) : 0;
+	size_t head_size = end - head;
+	size_t body_buffered = *buffered - head_size;
+	if(body_buffered > body_size) body_buffered = body_size;
+
+	bool close_after = !options.keep_alive ||
+		(find_value(head, "Connection") &&
+			strncasecmp(find_value(head, "Connection") + 1, "close", 5) == 0);
+
+	//The path picks the size
+	unsigned long size = options.size;
+	const char* path = strstr(head, "/bytes/");
+	if(path && path < strstr(head, "\r\n"))
+		size = strtoul(path + 7, 0, 10);
+
+	//Keep any pipelined bytes past this request's body
+	size_t consumed = head_size + body_buffered;
+	memmove(head, head + consumed, *buffered - consumed);
+	*buffered -= consumed;
+	head[*buffered] = '\0';
+
+	char discard[FILL_SIZE];
+	for(unsigned long left = body_size - body_buffered; left; )
+	{
+		ssize_t amount = recv(fd, discard, left < FILL_SIZE ? left : FILL_SIZE, 0);
+		if(amount <= 0) return false;
+		left -= amount;
+	}
+
+	if(options.think_ms)
+		usleep(options.think_ms * 1000);
+
+	char response_head[512];
+	char cache_control[64];
+	if(options.max_age >= 0)
+		sprintf(cache_control, "max-age=%d", options.max_age);
+	else
+		strcpy(cache_control, "no-store");
+
+	int response_head_size;
+	if(options.chunked)
+		response_head_size = sprintf(response_head,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Cache-Control: %s\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"Connection: %s\r\n\r\n",
+			cache_control, close_after ? "close" : "keep-alive");
+	else
+		response_head_size = sprintf(response_head,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Cache-Control: %s\r\n"
+			"Content-Length: %lu\r\n"
+			"Connection: %s\r\n\r\n",
+			cache_control, size, close_after ? "close" : "keep-alive");
+
+	if(send_all(fd, response_head, response_head_size))
+		return false;
+	if(strncmp(head, "HEAD", 4) != 0 && send_body(fd, size))
+		return false;
+
+	return !close_after;
+}
+
+static void* connection_thread(void* arg)
+{
+	int fd = (int)(long)arg;
+	char* head = malloc(MAX_HEAD_SIZE);
+	size_t buffered = 0;
+	head[0] = '\0';
+
+	while(serve_request(fd, head, &buffered));
+
+	free(head);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int option;
+	while((option = getopt(argc, argv, "p:s:t:ckm:")) != -1)
+	{
+		switch(option)
+		{
+		case 'p': options.port = atoi(optarg); break;
+		case 's': options.size = strtoul(optarg, 0, 10); break;
+		case 't': options.think_ms = atoi(optarg); break;
+		case 'c': options.chunked = true; break;
+		case 'k': options.keep_alive = true; break;
+		case 'm': options.max_age = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-s size] [-t think_ms] "
+				"[-c] [-k] [-m max_age]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(fill, 'x', sizeof(fill));
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in address = { .sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(options.port) };
+	if(bind(listener, (struct sockaddr*)&address, sizeof(address)) ||
+			listen(listener, 4096))
+	{
+		perror("bench_origin");
+		return 1;
+	}
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attributes, 256 * 1024);
+
+	while(1)
+	{
+		int fd = accept(listener, 0, 0);
+		if(fd < 0) continue;
+
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		pthread_t thread;
+		if(pthread_create(&thread, &attributes, &connection_thread,
+				(void*)(long)fd))
+			close(fd);
+	}
+}
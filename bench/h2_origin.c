@@ -0,0 +1,539 @@
+/*
+ * h2_origin.c
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ *
+ *  An HTTP/2 cleartext (prior knowledge) stand-in origin, for trying out and
+ *  benchmarking the proxy's -2 upstreams. Like bench_origin, it answers every
+ *  request with filler bytes, but each stream is answered on its own thread,
+ *  so responses to one connection's requests interleave, and obey flow
+ *  control both ways. Build it with the proxy's HPACK:
+ *
+ *    gcc -std=gnu99 -O2 -pthread -I. bench/h2_origin.c hpack.c \
+ *      EasyString/easy_string.c -o h2_origin
+ *
+ *  Usage: h2_origin [-p port] [-s size] [-t think_ms] [-m max_age]
+ *    [-x max_streams] [-n] [-g streams]
+ *    -p: port to listen on (8091)
+ *    -s: default body size. A path of /bytes/N asks for N bytes instead.
+ *    -t: think time, in milliseconds, before each response
+ *    -m: send Cache-Control: max-age=N (by default, no-store)
+ *    -x: SETTINGS_MAX_CONCURRENT_STREAMS; streams past it are refused (100)
+ *    -n: leave out content-length, so the proxy has to send bodies chunked
+ *    -g: send GOAWAY after this many streams on a connection, and close it
+ *        once they're answered
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "h2.h"
+#include "hpack.h"
+
+static struct
+{
+	int port;
+	unsigned long size;
+	int think_ms;
+	int max_age; //-1 for no-store
+	unsigned max_streams;
+	bool no_length;
+	unsigned goaway_after; //0 for never
+} options = { 8091, 1024, 0, -1, 100, false, 0 };
+
+static char fill[H2_DEFAULT_FRAME_SIZE];
+
+typedef struct stream Stream;
+
+typedef struct
+{
+	int fd;
+	pthread_mutex_t lock; //Everything below, and writes to fd
+	pthread_cond_t window_opened;
+	int references; //The reader, and each responder
+	bool closed;
+
+	int64_t send_window;
+	int64_t initial_window;
+	uint32_t frame_size;
+	unsigned streams_started;
+	uint32_t last_stream;
+	bool going_away;
+
+	Stream* streams;
+} Connection;
+
+struct stream
+{
+	Stream* next;
+	Connection* connection;
+	uint32_t id;
+	int64_t send_window;
+	bool reset;
+	bool head;
+	unsigned long size;
+};
+
+static int send_all(int fd, const char* data, size_t size)
+{
+	while(size)
+	{
+		ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if(sent <= 0) return -1;
+		data += sent;
+		size -= sent;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, char* data, size_t size)
+{
+	while(size)
+	{
+		ssize_t received = recv(fd, data, size, 0);
+		if(received <= 0) return -1;
+		data += received;
+		size -= received;
+	}
+	return 0;
+}
+
+//Send a frame. The connection must be locked.
+static void send_frame(Connection* connection, uint8_t type, uint8_t flags,
+	uint32_t stream, StringRef payload)
+{
+	String frame = es_empty_string;
+	h2_append_frame(&frame, type, flags, stream, payload);
+	if(!connection->closed && send_all(connection->fd, es_ref(&frame).begin,
+			frame.size))
+	{
+		connection->closed = true;
+		shutdown(connection->fd, SHUT_RDWR);
+		pthread_cond_broadcast(&connection->window_opened);
+	}
+	es_free(&frame);
+}
+
+static void send_u32_frame(Connection* connection, uint8_t type,
+	uint32_t stream, uint32_t value)
+{
+	char payload[4];
+	h2_write32(payload, value);
+	send_frame(connection, type, 0, stream, es_tempn(payload, 4));
+}
+
+//Drop a reference; the last one out frees the connection
+static void release(Connection* connection)
+{
+	pthread_mutex_lock(&connection->lock);
+	bool last = --connection->references == 0;
+	if(connection->going_away && !connection->streams)
+		shutdown(connection->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&connection->lock);
+
+	if(!last)
+		return;
+
+	close(connection->fd);
+	pthread_mutex_destroy(&connection->lock);
+	pthread_cond_destroy(&connection->window_opened);
+	free(connection);
+}
+
+static Stream* find_stream(Connection* connection, uint32_t id)
+{
+	for(Stream* stream = connection->streams; stream; stream = stream->next)
+		if(stream->id == id)
+			return stream;
+	return 0;
+}
+
+static void remove_stream(Connection* connection, Stream* stream)
+{
+	for(Stream** link = &connection->streams; *link; link = &(*link)->next)
+	{
+		if(*link == stream)
+		{
+			*link = stream->next;
+			return;
+		}
+	}
+}
+
+//Wait for room in both windows. Returns how much, or 0 if it's over.
+static size_t wait_for_window(Stream* stream, size_t wanted)
+{
+	Connection* connection = stream->connection;
+	while(!connection->closed && !stream->reset &&
+		(stream->send_window <= 0 || connection->send_window <= 0))
+		pthread_cond_wait(&connection->window_opened, &connection->lock);
+
+	if(connection->closed || stream->reset)
+		return 0;
+
+	size_t size = wanted < connection->frame_size ? wanted :
+		connection->frame_size;
+	if(size > (size_t)stream->send_window) size = stream->send_window;
+	if(size > (size_t)connection->send_window) size = connection->send_window;
+	if(size > sizeof(fill)) size = sizeof(fill);
+	return size;
+}
+
+static void* respond(void* arg)
+{
+	Stream* stream = arg;
+	Connection* connection = stream->connection;
+
+	if(options.think_ms)
+		usleep(options.think_ms * 1000);
+
+	char number[32];
+	String block = es_empty_string;
+	hpack_encode(&block, es_temp(":status"), es_temp("200"));
+	hpack_encode(&block, es_temp("content-type"),
+		es_temp("application/octet-stream"));
+	String cache_control = options.max_age >= 0 ?
+		es_printf("max-age=%d", options.max_age) :
+		es_copy(es_temp("no-store"));
+	hpack_encode(&block, es_temp("cache-control"), es_ref(&cache_control));
+	es_free(&cache_control);
+	if(!options.no_length)
+	{
+		sprintf(number, "%lu", stream->size);
+		hpack_encode(&block, es_temp("content-length"), es_temp(number));
+	}
+
+	bool no_body = stream->head || stream->size == 0;
+
+	pthread_mutex_lock(&connection->lock);
+	send_frame(connection, h2_headers, h2_flag_end_headers |
+		(no_body ? h2_flag_end_stream : 0), stream->id, es_ref(&block));
+	es_free(&block);
+
+	for(unsigned long left = no_body ? 0 : stream->size; left; )
+	{
+		size_t size = wait_for_window(stream, left);
+		if(!size)
+			break;
+
+		stream->send_window -= size;
+		connection->send_window -= size;
+		left -= size;
+		send_frame(connection, h2_data, left ? 0 : h2_flag_end_stream,
+			stream->id, es_tempn(fill, size));
+	}
+
+	remove_stream(connection, stream);
+	pthread_mutex_unlock(&connection->lock);
+
+	free(stream);
+	release(connection);
+	return 0;
+}
+
+//The request is all here; answer it on its own thread
+static void start_response(Connection* connection, Stream* stream)
+{
+	++connection->references;
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attributes, 256 * 1024);
+
+	pthread_t thread;
+	if(pthread_create(&thread, &attributes, respond, stream))
+	{
+		--connection->references;
+		remove_stream(connection, stream);
+		free(stream);
+	}
+	pthread_attr_destroy(&attributes);
+}
+
+typedef struct
+{
+	bool head;
+	unsigned long size;
+} RequestHead;
+
+static void read_request_header(void* arg, StringRef name, StringRef value)
+{
+	RequestHead* request = arg;
+	if(es_compare(name, es_temp(":method")) == 0)
+		request->head = es_compare(value, es_temp("HEAD")) == 0;
+	else if(es_compare(name, es_temp(":path")) == 0 && value.size > 7 &&
+			strncmp(value.begin, "/bytes/", 7) == 0)
+		request->size = strtoul(value.begin + 7, 0, 10);
+}
+
+//A complete request header block. The connection is locked.
+static int handle_request(Connection* connection, HpackTable* table,
+	uint32_t id, StringRef block, bool end)
+{
+	RequestHead request = { .size = options.size };
+	if(hpack_decode(table, block, read_request_header, &request))
+		return -1;
+
+	//Past the limit, or after saying goodbye
+	unsigned open = 0;
+	for(Stream* stream = connection->streams; stream; stream = stream->next)
+		++open;
+	if(open >= options.max_streams || connection->going_away)
+	{
+		send_u32_frame(connection, h2_rst_stream, id, h2_refused_stream);
+		return 0;
+	}
+
+	Stream* stream = calloc(1, sizeof(Stream));
+	stream->connection = connection;
+	stream->id = id;
+	stream->send_window = connection->initial_window;
+	stream->head = request.head;
+	stream->size = request.size;
+	stream->next = connection->streams;
+	connection->streams = stream;
+	connection->last_stream = id;
+
+	if(options.goaway_after &&
+			++connection->streams_started == options.goaway_after)
+	{
+		char payload[8];
+		h2_write32(payload, id);
+		h2_write32(payload + 4, h2_no_error);
+		send_frame(connection, h2_goaway, 0, 0, es_tempn(payload, 8));
+		connection->going_away = true;
+	}
+
+	if(end)
+		start_response(connection, stream);
+	return 0;
+}
+
+static void handle_settings(Connection* connection, H2Frame* frame,
+	const char* payload)
+{
+	if(frame->flags & h2_flag_ack)
+		return;
+
+	for(uint32_t i = 0; i + 6 <= frame->length; i += 6)
+	{
+		uint16_t id = (unsigned char)payload[i] << 8 |
+			(unsigned char)payload[i + 1];
+		uint32_t value = h2_read32(payload + i + 2);
+		if(id == h2_settings_initial_window_size)
+		{
+			for(Stream* stream = connection->streams; stream;
+					stream = stream->next)
+				stream->send_window += (int64_t)value -
+					connection->initial_window;
+			connection->initial_window = value;
+		}
+		else if(id == h2_settings_max_frame_size)
+			connection->frame_size = value;
+	}
+
+	send_frame(connection, h2_settings, h2_flag_ack, 0, es_temp(""));
+	pthread_cond_broadcast(&connection->window_opened);
+}
+
+static void* connection_thread(void* arg)
+{
+	Connection* connection = arg;
+	HpackTable table;
+	hpack_init(&table, 4096);
+	String block = es_empty_string;
+	uint32_t block_stream = 0;
+	bool block_end = false;
+	char* payload = malloc(H2_DEFAULT_FRAME_SIZE);
+
+	char preface[sizeof(H2_PREFACE) - 1];
+	if(recv_all(connection->fd, preface, sizeof(preface)) ||
+			memcmp(preface, H2_PREFACE, sizeof(preface)))
+		goto done;
+
+	String settings = es_empty_string;
+	h2_append_setting(&settings, h2_settings_max_concurrent_streams,
+		options.max_streams);
+	pthread_mutex_lock(&connection->lock);
+	send_frame(connection, h2_settings, 0, 0, es_ref(&settings));
+	pthread_mutex_unlock(&connection->lock);
+	es_free(&settings);
+
+	char header[H2_FRAME_HEADER_SIZE];
+	while(recv_all(connection->fd, header, sizeof(header)) == 0)
+	{
+		H2Frame frame = h2_parse_frame(header);
+		if(frame.length > H2_DEFAULT_FRAME_SIZE ||
+				recv_all(connection->fd, payload, frame.length))
+			break;
+
+		StringRef data = es_tempn(payload, frame.length);
+		if(frame.flags & h2_flag_padded &&
+			(frame.type == h2_data || frame.type == h2_headers))
+		{
+			size_t padding = (unsigned char)payload[0];
+			data = es_slice(data, 1, frame.length - 1 - padding);
+		}
+
+		pthread_mutex_lock(&connection->lock);
+		Stream* stream = find_stream(connection, frame.stream);
+		int error = 0;
+		switch(frame.type)
+		{
+		//Request bodies are thrown away, and credited right back
+		case h2_data:
+			if(frame.length)
+			{
+				send_u32_frame(connection, h2_window_update, 0, frame.length);
+				if(!(frame.flags & h2_flag_end_stream))
+					send_u32_frame(connection, h2_window_update, frame.stream,
+						frame.length);
+			}
+			if(stream && frame.flags & h2_flag_end_stream)
+				start_response(connection, stream);
+			break;
+
+		case h2_headers:
+			if(frame.flags & h2_flag_priority)
+				data = es_slice(data, 5, data.size);
+			es_append(&block, data);
+			block_stream = frame.stream;
+			block_end = frame.flags & h2_flag_end_stream;
+			if(frame.flags & h2_flag_end_headers)
+			{
+				error = handle_request(connection, &table, block_stream,
+					es_ref(&block), block_end);
+				es_clear(&block);
+			}
+			break;
+
+		case h2_continuation:
+			es_append(&block, data);
+			if(frame.flags & h2_flag_end_headers)
+			{
+				error = handle_request(connection, &table, block_stream,
+					es_ref(&block), block_end);
+				es_clear(&block);
+			}
+			break;
+
+		case h2_settings:
+			handle_settings(connection, &frame, payload);
+			break;
+
+		case h2_window_update:
+			if(frame.stream == 0)
+				connection->send_window += h2_read32(payload) & 0x7fffffff;
+			else if(stream)
+				stream->send_window += h2_read32(payload) & 0x7fffffff;
+			pthread_cond_broadcast(&connection->window_opened);
+			break;
+
+		case h2_rst_stream:
+			if(stream)
+				stream->reset = true;
+			pthread_cond_broadcast(&connection->window_opened);
+			break;
+
+		case h2_ping:
+			if(!(frame.flags & h2_flag_ack))
+				send_frame(connection, h2_ping, h2_flag_ack, 0, data);
+			break;
+
+		case h2_goaway:
+			error = -1;
+			break;
+		}
+		pthread_mutex_unlock(&connection->lock);
+
+		if(error)
+			break;
+	}
+
+done:
+	pthread_mutex_lock(&connection->lock);
+	connection->closed = true;
+	shutdown(connection->fd, SHUT_RDWR);
+	pthread_cond_broadcast(&connection->window_opened);
+	pthread_mutex_unlock(&connection->lock);
+
+	free(payload);
+	es_free(&block);
+	hpack_free(&table);
+	release(connection);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int option;
+	while((option = getopt(argc, argv, "p:s:t:m:x:ng:")) != -1)
+	{
+		switch(option)
+		{
+		case 'p': options.port = atoi(optarg); break;
+		case 's': options.size = strtoul(optarg, 0, 10); break;
+		case 't': options.think_ms = atoi(optarg); break;
+		case 'm': options.max_age = atoi(optarg); break;
+		case 'x': options.max_streams = strtoul(optarg, 0, 10); break;
+		case 'n': options.no_length = true; break;
+		case 'g': options.goaway_after = strtoul(optarg, 0, 10); break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-s size] [-t think_ms] "
+				"[-m max_age] [-x max_streams] [-n] [-g streams]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(fill, 'x', sizeof(fill));
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in address = { .sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(options.port) };
+	if(bind(listener, (struct sockaddr*)&address, sizeof(address)) ||
+			listen(listener, 4096))
+	{
+		perror("h2_origin");
+		return 1;
+	}
+
+	while(1)
+	{
+		int fd = accept(listener, 0, 0);
+		if(fd < 0) continue;
+
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		Connection* connection = calloc(1, sizeof(Connection));
+		connection->fd = fd;
+		connection->references = 1;
+		connection->send_window = H2_DEFAULT_WINDOW;
+		connection->initial_window = H2_DEFAULT_WINDOW;
+		connection->frame_size = H2_DEFAULT_FRAME_SIZE;
+		pthread_mutex_init(&connection->lock, 0);
+		pthread_cond_init(&connection->window_opened, 0);
+
+		pthread_t thread;
+		if(pthread_create(&thread, 0, connection_thread, connection))
+			release(connection);
+		else
+			pthread_detach(thread);
+	}
+}
@@ -0,0 +1,511 @@
+/*
+ * microbench.c
+ *
+ *  Created on: Mar 15, 2014
+ *      Author: nathan
+ *
+ *  Microbenchmarks for the proxy's hot functions, run in isolation on
+ *  in-memory corpora: request and response parsing (fed through a
+ *  socketpair, since the readers take a file descriptor), filter matching
+ *  against large filter sets, header lookup, serialization, and print queue
+ *  contention. Each one reports ns/op, allocations/op and bytes/sec.
+ *
+ *  This links against the proxy itself, so build it along with every .c file
+ *  but main.c, plus the ones in EasyString and ReadableRegex:
+ *
+ *    gcc -std=gnu99 -O2 -pthread -I. bench/microbench.c \
+ *      $(ls *.c | grep -v '^main.c$') <library sources> -o microbench -lz
+ *
+ *  Usage: microbench [-t ms] [-o results] [-b baseline] [name...]
+ *    -t: minimum time to run each benchmark (500 ms)
+ *    -o: save the results, to compare against later
+ *    -b: compare against results saved by an earlier run
+ *    name: only run benchmarks whose names contain one of these
+ *
+ *  A before/after comparison is two runs: microbench -o before on the old
+ *  tree, then microbench -b before on the new one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "filters.h"
+#include "print_thread.h"
+
+#define MAX_RESULTS 64
+
+///////////////////////////////////////////////////////////////////////////////
+// ALLOCATION COUNTING
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Every allocation in the process is counted, by wrapping glibc's allocator.
+ * Background threads (the print thread, the timer thread) are idle during a
+ * run, so nearly everything counted belongs to the benchmark.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+static unsigned long long allocations;
+
+void* malloc(size_t size)
+{
+	__sync_add_and_fetch(&allocations, 1);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	__sync_add_and_fetch(&allocations, 1);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+	__sync_add_and_fetch(&allocations, 1);
+	return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer)
+{
+	__libc_free(pointer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CORPORA
+///////////////////////////////////////////////////////////////////////////////
+
+//A typical browser request, as the proxy sees it
+static const char request_corpus[] =
+	"GET http://www.reddit.com/r/programming/comments/?sort=top HTTP/1.1\r\n"
+	"Host: www.reddit.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:27.0) "
+		"Gecko/20100101 Firefox/27.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.reddit.com/r/programming/\r\n"
+	"Cookie: reddit_session=1234567%2C2014-03-15T00%3A00%3A00%2Cabcdef; "
+		"pc=ab; __utma=55650728.1.1.1.1.1\r\n"
+	"X-Requested-With: XMLHttpRequest\r\n"
+	"DNT: 1\r\n"
+	"Proxy-Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"\r\n";
+
+static const char response_corpus[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/html; charset=UTF-8\r\n"
+	"Content-Length: 0\r\n"
+	"Date: Sat, 15 Mar 2014 04:12:00 GMT\r\n"
+	"Server: cloudflare-nginx\r\n"
+	"Cache-Control: private, max-age=0, must-revalidate\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"Set-Cookie: __cfduid=d1234567890abcdef; expires=Mon, 23-Dec-2019 "
+		"23:50:00 GMT; path=/; domain=.reddit.com; HttpOnly\r\n"
+	"X-Frame-Options: SAMEORIGIN\r\n"
+	"X-Content-Type-Options: nosniff\r\n"
+	"X-XSS-Protection: 1; mode=block\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+///////////////////////////////////////////////////////////////////////////////
+// THE RUNNER
+///////////////////////////////////////////////////////////////////////////////
+
+//Run a benchmark's operation iterations times
+typedef void (*BenchFunc)(size_t iterations);
+
+typedef struct
+{
+	char name[64];
+	double ns_per_op;
+	double allocs_per_op;
+	double bytes_per_sec; //0 if the benchmark doesn't process bytes
+} Result;
+
+static struct
+{
+	long min_ms;
+	const char* save_path;
+	const char* baseline_path;
+	char** names;
+	int num_names;
+} options = { 500, 0, 0, 0, 0 };
+
+static Result results[MAX_RESULTS];
+static int num_results;
+
+static Result baseline[MAX_RESULTS];
+static int num_baseline;
+
+static FILE* output; //Results go here; stdout belongs to the print thread
+
+static inline uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static bool selected(const char* name)
+{
+	if(options.num_names == 0)
+		return true;
+	for(int i = 0; i < options.num_names; ++i)
+		if(strstr(name, options.names[i]))
+			return true;
+	return false;
+}
+
+static const Result* find_baseline(const char* name)
+{
+	for(int i = 0; i < num_baseline; ++i)
+		if(strcmp(baseline[i].name, name) == 0)
+			return &baseline[i];
+	return 0;
+}
+
+static void report(const Result* result)
+{
+	fprintf(output, "%-32s %12.1f ns/op %8.2f allocs/op", result->name,
+		result->ns_per_op, result->allocs_per_op);
+	if(result->bytes_per_sec)
+		fprintf(output, " %10.1f MB/s", result->bytes_per_sec / (1024 * 1024));
+
+	const Result* before = find_baseline(result->name);
+	if(before)
+		fprintf(output, "   [%+6.1f%% time, %+.2f allocs]",
+			100 * (result->ns_per_op - before->ns_per_op) / before->ns_per_op,
+			result->allocs_per_op - before->allocs_per_op);
+	fputc('\n', output);
+	fflush(output);
+}
+
+/*
+ * Run a benchmark, doubling the iterations until a run takes at least the
+ * minimum time. bytes_per_op is how much input one operation processes.
+ */
+static void run(const char* name, BenchFunc func, size_t bytes_per_op)
+{
+	if(!selected(name) || num_results == MAX_RESULTS)
+		return;
+
+	func(1); //Warm up
+
+	size_t iterations = 1;
+	uint64_t elapsed;
+	unsigned long long allocated;
+	while(1)
+	{
+		unsigned long long allocations_before = allocations;
+		uint64_t start = now_ns();
+		func(iterations);
+		elapsed = now_ns() - start;
+		allocated = allocations - allocations_before;
+
+		if(elapsed >= options.min_ms * 1000000ULL)
+			break;
+		iterations *= 2;
+	}
+
+	Result* result = &results[num_results++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->ns_per_op = (double)elapsed / iterations;
+	result->allocs_per_op = (double)allocated / iterations;
+	result->bytes_per_sec = bytes_per_op ?
+		bytes_per_op * iterations / (elapsed / 1e9) : 0;
+	report(result);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PARSING
+///////////////////////////////////////////////////////////////////////////////
+
+//The reader's end and the writer's end of the corpus socketpair
+static int reader;
+static int writer;
+
+static inline void feed(const char* corpus, size_t size)
+{
+	if(write(writer, corpus, size) != (ssize_t)size)
+		abort();
+}
+
+//The cost of the transport alone, to subtract from the parsing numbers
+static void bench_transport(size_t iterations)
+{
+	char buffer[sizeof(request_corpus)];
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		feed(request_corpus, sizeof(request_corpus) - 1);
+		for(size_t got = 0; got < sizeof(request_corpus) - 1; )
+			got += recv(reader, buffer, sizeof(buffer) - got, 0);
+	}
+}
+
+static void bench_parse_request(size_t iterations)
+{
+	HTTP_Message message = empty_message;
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		feed(request_corpus, sizeof(request_corpus) - 1);
+		if(read_request_line(&message, reader) ||
+				read_headers(&message, reader))
+			abort();
+		clear_request(&message);
+	}
+}
+
+static void bench_parse_response(size_t iterations)
+{
+	HTTP_Message message = empty_message;
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		feed(response_corpus, sizeof(response_corpus) - 1);
+		if(read_response_line(&message, reader) ||
+				read_headers(&message, reader))
+			abort();
+		clear_response(&message);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HEADER LOOKUP AND SERIALIZATION
+///////////////////////////////////////////////////////////////////////////////
+
+static HTTP_Message parsed_request;
+static HTTP_Message parsed_response;
+
+static void parse_corpora()
+{
+	feed(request_corpus, sizeof(request_corpus) - 1);
+	feed(response_corpus, sizeof(response_corpus) - 1);
+	if(read_request_line(&parsed_request, reader) ||
+			read_headers(&parsed_request, reader) ||
+			read_response_line(&parsed_response, reader) ||
+			read_headers(&parsed_response, reader))
+		abort();
+}
+
+static volatile const HTTP_Header* lookup_sink;
+
+static void bench_find_well_known(size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		lookup_sink = find_header(&parsed_request, es_temp("cache-control"));
+}
+
+static void bench_find_unknown(size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		lookup_sink = find_header(&parsed_request, es_temp("x-requested-with"));
+}
+
+static void bench_find_missing(size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		lookup_sink = find_header(&parsed_request, es_temp("x-forwarded-for"));
+}
+
+static void bench_serialize_head(size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		String head = serialize_response_head(&parsed_response);
+		es_free(&head);
+	}
+}
+
+//write_response through the socketpair, drained after each write
+static void bench_write_response(size_t iterations)
+{
+	char buffer[sizeof(response_corpus) * 2];
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		if(write_response(&parsed_response, writer))
+			abort();
+		while(recv(reader, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FILTERS
+///////////////////////////////////////////////////////////////////////////////
+
+static int num_filters;
+
+//Bring the global filter set up to count entries. Filters can't be removed.
+static void grow_filters(int count)
+{
+	for(; num_filters < count; ++num_filters)
+	{
+		char filter[64];
+		snprintf(filter, sizeof(filter), "ads%d.tracker%d.com", num_filters,
+			num_filters % 97);
+		filter_add(es_copy(es_temp(filter)));
+	}
+}
+
+static volatile bool filter_sink;
+
+//A domain that matches nothing, so every filter gets checked
+static void bench_filter_miss(size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		filter_sink = filter_match_any(es_temp("www.reddit.com"));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PRINT QUEUE CONTENTION
+///////////////////////////////////////////////////////////////////////////////
+
+static int print_threads;
+static size_t prints_per_thread;
+
+static void* print_worker(void* arg)
+{
+	for(size_t i = 0; i < prints_per_thread; ++i)
+		submit_print(es_copy(es_temp("127.0.0.1: GET http://www.reddit.com/")));
+	return 0;
+}
+
+//iterations is the total across all the threads
+static void bench_submit_print(size_t iterations)
+{
+	pthread_t threads[print_threads];
+	prints_per_thread = (iterations + print_threads - 1) / print_threads;
+	for(int i = 0; i < print_threads; ++i)
+		pthread_create(&threads[i], 0, &print_worker, 0);
+	for(int i = 0; i < print_threads; ++i)
+		pthread_join(threads[i], 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SAVED RESULTS
+///////////////////////////////////////////////////////////////////////////////
+
+static void load_baseline(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+	{
+		perror(path);
+		exit(1);
+	}
+
+	Result* result = baseline;
+	while(num_baseline < MAX_RESULTS && fscanf(file, "%63s %lf %lf %lf",
+			result->name, &result->ns_per_op, &result->allocs_per_op,
+			&result->bytes_per_sec) == 4)
+		++result, ++num_baseline;
+	fclose(file);
+}
+
+static void save_results(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if(!file)
+	{
+		perror(path);
+		exit(1);
+	}
+
+	for(int i = 0; i < num_results; ++i)
+		fprintf(file, "%s %f %f %f\n", results[i].name, results[i].ns_per_op,
+			results[i].allocs_per_op, results[i].bytes_per_sec);
+	fclose(file);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+	int option;
+	while((option = getopt(argc, argv, "t:o:b:")) != -1)
+	{
+		switch(option)
+		{
+		case 't': options.min_ms = atol(optarg); break;
+		case 'o': options.save_path = optarg; break;
+		case 'b': options.baseline_path = optarg; break;
+		default:
+			fprintf(stderr, "Usage: %s [-t ms] [-o results] [-b baseline] "
+				"[name...]\n", argv[0]);
+			return 1;
+		}
+	}
+	options.names = argv + optind;
+	options.num_names = argc - optind;
+
+	if(options.baseline_path)
+		load_baseline(options.baseline_path);
+
+	//The print queue's output (and any debug output) goes nowhere
+	fflush(stdout);
+	output = fdopen(dup(STDOUT_FILENO), "w");
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+	{
+		perror("socketpair");
+		return 1;
+	}
+	reader = pair[0];
+	writer = pair[1];
+
+	run("transport", &bench_transport, sizeof(request_corpus) - 1);
+	run("parse_request", &bench_parse_request, sizeof(request_corpus) - 1);
+	run("parse_response", &bench_parse_response, sizeof(response_corpus) - 1);
+
+	parse_corpora();
+	run("find_header/well_known", &bench_find_well_known, 0);
+	run("find_header/unknown", &bench_find_unknown, 0);
+	run("find_header/missing", &bench_find_missing, 0);
+	run("serialize_response_head", &bench_serialize_head, 0);
+	run("write_response", &bench_write_response, 0);
+	clear_request(&parsed_request);
+	clear_response(&parsed_response);
+
+	static const int filter_counts[] = { 10, 1000, 10000 };
+	for(size_t i = 0; i < sizeof(filter_counts) / sizeof(int); ++i)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "filter_match_any/%d", filter_counts[i]);
+		grow_filters(filter_counts[i]);
+		run(name, &bench_filter_miss, sizeof("www.reddit.com") - 1);
+	}
+
+	static const int thread_counts[] = { 1, 4, 16 };
+	for(size_t i = 0; i < sizeof(thread_counts) / sizeof(int); ++i)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "submit_print/%d_threads",
+			thread_counts[i]);
+		print_threads = thread_counts[i];
+		run(name, &bench_submit_print, 0);
+	}
+
+	if(options.save_path)
+		save_results(options.save_path);
+
+	close(reader);
+	close(writer);
+	return 0;
+}
@@ -0,0 +1,496 @@
+/*
+ * replay.c
+ *
+ *  Created on: Mar 16, 2014
+ *      Author: nathan
+ *
+ *  Replays traffic captured with proxy -c. The recorded requests are sent to
+ *  the proxy, byte for byte, on the recorded schedule (or N times faster),
+ *  and a built-in origin stand-in answers the proxy with the recorded
+ *  responses, after the recorded origin think time. Run the proxy with
+ *  -u 127.0.0.1:<origin port> so everything it fetches comes here.
+ *  Standalone; build it with:
+ *
+ *    gcc -std=gnu99 -O2 -pthread -I. bench/replay.c -o replay -lm
+ *
+ *  Usage: replay [-x host:port] [-o port] [-s speed] [-t threads] capture_file
+ *    -x: the proxy (127.0.0.1:8080)
+ *    -o: port for the origin stand-in (8091)
+ *    -s: speed multiplier for the schedule and think times (1)
+ *    -t: concurrent requests allowed in flight (64)
+ *
+ *  Requests are matched to responses by method and target, in recorded
+ *  order. CONNECT tunnels aren't captured, so they're skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "capture.h"
+#include "bench_histogram.h"
+
+#define MAX_HEAD_SIZE (64 * 1024)
+#define READ_SIZE (64 * 1024)
+#define KEY_SIZE 2048
+
+typedef struct
+{
+	CaptureRecord record;
+	char* request;
+	char* response;
+	char key[KEY_SIZE];
+} Exchange;
+
+static struct
+{
+	const char* proxy;
+	int origin_port;
+	double speed;
+	int threads;
+} options = { "127.0.0.1:8080", 8091, 1, 64 };
+
+static Exchange* exchanges;
+static size_t num_exchanges;
+
+static struct addrinfo* proxy_address;
+
+///////////////////////////////////////////////////////////////////////////////
+// LOADING AND MATCHING
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The key for a request: its method and target, without the scheme, and with
+ * the host lowercased. This is the same for the request the client sent and
+ * the one the proxy forwards, whatever headers the proxy rewrote.
+ */
+static void request_key(const char* head, size_t size, char* key)
+{
+	const char* line_end = memchr(head, '\r', size);
+	size_t line_size = line_end ? (size_t)(line_end - head) : size;
+	size_t out = 0;
+
+	//Method
+	size_t i = 0;
+	while(i < line_size && head[i] != ' ' && out < KEY_SIZE - 1)
+		key[out++] = head[i++];
+	if(i < line_size && out < KEY_SIZE - 1)
+		key[out++] = head[i++];
+
+	//Target, up to the version
+	if(line_size - i >= 7 && strncasecmp(head + i, "http://", 7) == 0)
+		i += 7;
+	bool in_host = true;
+	for(; i < line_size && head[i] != ' ' && out < KEY_SIZE - 1; ++i)
+	{
+		if(head[i] == '/') in_host = false;
+		key[out++] = in_host ? tolower(head[i]) : head[i];
+	}
+	key[out] = '\0';
+}
+
+static bool load_capture(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+
+	CaptureFileHeader header;
+	if(fread(&header, sizeof(header), 1, file) != 1 ||
+			memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+			header.version != CAPTURE_VERSION)
+	{
+		fprintf(stderr, "%s: not a capture file\n", path);
+		fclose(file);
+		return false;
+	}
+
+	size_t capacity = 1024;
+	exchanges = malloc(capacity * sizeof(Exchange));
+
+	CaptureRecord record;
+	while(fread(&record, sizeof(record), 1, file) == 1)
+	{
+		char* request = malloc(record.request_size);
+		char* response = malloc(record.response_size + 1);
+		if(fread(request, 1, record.request_size, file) != record.request_size ||
+				fread(response, 1, record.response_size, file) !=
+					record.response_size)
+		{
+			fprintf(stderr, "%s: truncated record\n", path);
+			free(request);
+			free(response);
+			break;
+		}
+
+		if(record.request_size >= 8 && strncmp(request, "CONNECT ", 8) == 0)
+		{
+			free(request);
+			free(response);
+			continue;
+		}
+
+		if(num_exchanges == capacity)
+			exchanges = realloc(exchanges, (capacity *= 2) * sizeof(Exchange));
+
+		Exchange* exchange = &exchanges[num_exchanges++];
+		exchange->record = record;
+		exchange->request = request;
+		exchange->response = response;
+		request_key(request, record.request_size, exchange->key);
+	}
+
+	fclose(file);
+	return num_exchanges > 0;
+}
+
+/*
+ * The origin's side. Recorded responses are grouped by key, in recorded
+ * order, and repeats of the same request get them in turn, then start over.
+ */
+typedef struct
+{
+	const char* key;
+	const Exchange** responses;
+	size_t count;
+	size_t cursor;
+} ResponseGroup;
+
+static ResponseGroup* groups;
+static size_t num_groups;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_exchanges(const void* a, const void* b)
+{
+	const Exchange* left = *(const Exchange**)a;
+	const Exchange* right = *(const Exchange**)b;
+	int order = strcmp(left->key, right->key);
+	if(order) return order;
+	return left < right ? -1 : left > right;
+}
+
+static int compare_group(const void* key, const void* group)
+{
+	return strcmp(key, ((const ResponseGroup*)group)->key);
+}
+
+static void build_groups()
+{
+	const Exchange** sorted = malloc(num_exchanges * sizeof(Exchange*));
+	size_t num_sorted = 0;
+	for(size_t i = 0; i < num_exchanges; ++i)
+		if(exchanges[i].record.response_size)
+			sorted[num_sorted++] = &exchanges[i];
+	qsort(sorted, num_sorted, sizeof(Exchange*), &compare_exchanges);
+
+	groups = calloc(num_sorted + 1, sizeof(ResponseGroup));
+	for(size_t i = 0; i < num_sorted; ++i)
+	{
+		if(num_groups == 0 || strcmp(groups[num_groups - 1].key,
+				sorted[i]->key) != 0)
+		{
+			groups[num_groups].key = sorted[i]->key;
+			groups[num_groups].responses = &sorted[i];
+			++num_groups;
+		}
+		++groups[num_groups - 1].count;
+	}
+}
+
+static const Exchange* match_response(const char* key)
+{
+	ResponseGroup* group = bsearch(key, groups, num_groups,
+		sizeof(ResponseGroup), &compare_group);
+	if(!group)
+		return 0;
+
+	pthread_mutex_lock(&group_lock);
+	const Exchange* found = group->responses[group->cursor];
+	group->cursor = (group->cursor + 1) % group->count;
+	pthread_mutex_unlock(&group_lock);
+	return found;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE ORIGIN STAND-IN
+///////////////////////////////////////////////////////////////////////////////
+
+static uint64_t origin_misses;
+
+static int send_all(int fd, const char* data, size_t size)
+{
+	while(size)
+	{
+		ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if(sent <= 0) return -1;
+		data += sent;
+		size -= sent;
+	}
+	return 0;
+}
+
+static const char not_recorded[] =
+	"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static void* origin_connection(void* arg)
+{
+	int fd = (int)(long)arg;
+	char* head = malloc(MAX_HEAD_SIZE + 1);
+	size_t buffered = 0;
+
+	//Only the request line matters, but wait for the whole head
+	while(buffered < MAX_HEAD_SIZE)
+	{
+		ssize_t amount = recv(fd, head + buffered, MAX_HEAD_SIZE - buffered, 0);
+		if(amount <= 0) break;
+		buffered += amount;
+		head[buffered] = '\0';
+		if(strstr(head, "\r\n\r\n")) break;
+	}
+
+	if(buffered)
+	{
+		char key[KEY_SIZE];
+		request_key(head, buffered, key);
+
+		const Exchange* exchange = match_response(key);
+		if(exchange)
+		{
+			if(exchange->record.origin_us)
+				usleep(exchange->record.origin_us / options.speed);
+			send_all(fd, exchange->response, exchange->record.response_size);
+		}
+		else
+		{
+			__sync_add_and_fetch(&origin_misses, 1);
+			send_all(fd, not_recorded, sizeof(not_recorded) - 1);
+		}
+	}
+
+	//The proxy reads to EOF for responses without a length
+	shutdown(fd, SHUT_WR);
+	while(recv(fd, head, MAX_HEAD_SIZE, 0) > 0);
+
+	free(head);
+	close(fd);
+	return 0;
+}
+
+static void* origin_thread(void* arg)
+{
+	int listener = (int)(long)arg;
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attributes, 256 * 1024);
+
+	while(1)
+	{
+		int fd = accept(listener, 0, 0);
+		if(fd < 0) continue;
+
+		pthread_t thread;
+		if(pthread_create(&thread, &attributes, &origin_connection,
+				(void*)(long)fd))
+			close(fd);
+	}
+	return 0;
+}
+
+static int start_origin()
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in address = { .sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(options.origin_port) };
+	if(bind(listener, (struct sockaddr*)&address, sizeof(address)) ||
+			listen(listener, 4096))
+		return -1;
+
+	pthread_t thread;
+	return pthread_create(&thread, 0, &origin_thread, (void*)(long)listener);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE CLIENT
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	Histogram latency;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t statuses[6]; //By class: 1xx to 5xx, and 0 for none
+} ReplayStats;
+
+static uint64_t start_ns;
+static size_t next_exchange;
+
+static void* client_thread(void* arg)
+{
+	ReplayStats* stats = arg;
+	char* buffer = malloc(READ_SIZE);
+
+	while(1)
+	{
+		size_t index = __sync_fetch_and_add(&next_exchange, 1);
+		if(index >= num_exchanges)
+			break;
+
+		const Exchange* exchange = &exchanges[index];
+		uint64_t scheduled = start_ns +
+			(uint64_t)(exchange->record.start_us * 1000 / options.speed);
+		sleep_until(scheduled);
+
+		int fd = socket(proxy_address->ai_family, SOCK_STREAM, 0);
+		if(fd < 0 || connect(fd, proxy_address->ai_addr,
+				proxy_address->ai_addrlen) ||
+				send_all(fd, exchange->request, exchange->record.request_size))
+		{
+			if(fd >= 0) close(fd);
+			++stats->errors;
+			continue;
+		}
+
+		//The proxy closes after every response
+		uint64_t total = 0;
+		int status_class = 0;
+		ssize_t amount;
+		while((amount = recv(fd, buffer, READ_SIZE, 0)) > 0)
+		{
+			if(total == 0 && amount >= 10 && buffer[9] >= '1' && buffer[9] <= '5')
+				status_class = buffer[9] - '0';
+			total += amount;
+		}
+		close(fd);
+
+		histogram_add(&stats->latency, (now_ns() - scheduled) / 1000);
+		++stats->statuses[status_class];
+		stats->bytes += total;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIN
+///////////////////////////////////////////////////////////////////////////////
+
+static bool resolve_proxy()
+{
+	char host[256];
+	const char* colon = strrchr(options.proxy, ':');
+	if(!colon || colon - options.proxy >= (long)sizeof(host))
+		return false;
+	snprintf(host, sizeof(host), "%.*s", (int)(colon - options.proxy),
+		options.proxy);
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM };
+	return getaddrinfo(host, colon + 1, &hints, &proxy_address) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	int option;
+	while((option = getopt(argc, argv, "x:o:s:t:")) != -1)
+	{
+		switch(option)
+		{
+		case 'x': options.proxy = optarg; break;
+		case 'o': options.origin_port = atoi(optarg); break;
+		case 's': options.speed = atof(optarg); break;
+		case 't': options.threads = atoi(optarg); break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if(optind != argc - 1 || options.speed <= 0 || options.threads <= 0)
+	{
+		fprintf(stderr, "Usage: %s [-x host:port] [-o port] [-s speed] "
+			"[-t threads] capture_file\n", argv[0]);
+		return 1;
+	}
+
+	if(!resolve_proxy())
+	{
+		fprintf(stderr, "replay: bad proxy address %s\n", options.proxy);
+		return 1;
+	}
+	if(!load_capture(argv[optind]))
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	build_groups();
+
+	if(start_origin())
+	{
+		perror("replay: origin stand-in");
+		return 1;
+	}
+
+	uint64_t recorded_us = exchanges[num_exchanges - 1].record.start_us;
+	printf("Replaying %zu requests recorded over %.1f s at %gx speed\n",
+		num_exchanges, recorded_us / 1e6, options.speed);
+
+	ReplayStats* stats = calloc(options.threads, sizeof(ReplayStats));
+	pthread_t* threads = malloc(options.threads * sizeof(pthread_t));
+
+	start_ns = now_ns() + 10000000;
+	for(int i = 0; i < options.threads; ++i)
+		pthread_create(&threads[i], 0, &client_thread, &stats[i]);
+	for(int i = 0; i < options.threads; ++i)
+		pthread_join(threads[i], 0);
+	double elapsed = (now_ns() - start_ns) / 1e9;
+
+	static Histogram latency;
+	ReplayStats total = { .errors = 0 };
+	for(int i = 0; i < options.threads; ++i)
+	{
+		histogram_merge(&latency, &stats[i].latency);
+		total.errors += stats[i].errors;
+		total.bytes += stats[i].bytes;
+		for(int status = 0; status < 6; ++status)
+			total.statuses[status] += stats[i].statuses[status];
+	}
+
+	printf("Completed %llu requests (%llu errors) in %.1f s, %.1f req/s, "
+		"%.2f MB/s\n", (unsigned long long)latency.count,
+		(unsigned long long)total.errors, elapsed, latency.count / elapsed,
+		total.bytes / elapsed / (1024 * 1024));
+	printf("Responses: %llu 1xx, %llu 2xx, %llu 3xx, %llu 4xx, %llu 5xx, "
+		"%llu none\n", (unsigned long long)total.statuses[1],
+		(unsigned long long)total.statuses[2],
+		(unsigned long long)total.statuses[3],
+		(unsigned long long)total.statuses[4],
+		(unsigned long long)total.statuses[5],
+		(unsigned long long)total.statuses[0]);
+	printf("Origin requests with no recorded response: %llu\n",
+		(unsigned long long)origin_misses);
+	histogram_print(stdout, &latency);
+
+	free(threads);
+	free(stats);
+	freeaddrinfo(proxy_address);
+	return 0;
+}
@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# scenarios.sh
+#
+#  Created on: Mar 14, 2014
+#      Author: nathan
+#
+# Canned benchmark scenarios. Starts bench_origin and the proxy, runs
+# bench_load against them, and tears everything down again.
+#
+# Usage: bench/scenarios.sh path/to/proxy [scenario...]
+#   Scenarios: small large churn idle (default: all of them)
+#
+# Environment:
+#   PROXY_PORT (18080), ORIGIN_PORT (8090), DURATION (20 seconds)
+#   BENCH_DIR: where the tools get built (/tmp/proxy-bench)
+
+set -e
+
+PROXY=$(realpath "${1:?usage: $0 path/to/proxy [scenario...]}")
+shift
+SCENARIOS=${*:-small large churn idle}
+
+PROXY_PORT=${PROXY_PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-8090}
+DURATION=${DURATION:-20}
+BENCH_DIR=${BENCH_DIR:-/tmp/proxy-bench}
+SOURCE_DIR=$(dirname "$0")
+
+mkdir -p "$BENCH_DIR"
+gcc -std=gnu99 -O2 -pthread "$SOURCE_DIR/bench_origin.c" \
+	-o "$BENCH_DIR/bench_origin"
+gcc -std=gnu99 -O2 -pthread "$SOURCE_DIR/bench_load.c" \
+	-o "$BENCH_DIR/bench_load" -lm
+
+# 10k idle connections means 10k proxy threads and sockets
+ulimit -n "$(ulimit -Hn)"
+
+ORIGIN_PID=
+PROXY_PID=
+stop()
+{
+	for pid in $PROXY_PID $ORIGIN_PID
+	do
+		kill "$pid" 2>/dev/null || true
+		wait "$pid" 2>/dev/null || true
+	done
+	PROXY_PID=
+	ORIGIN_PID=
+}
+trap stop EXIT INT TERM
+
+# start origin_args...
+start()
+{
+	"$BENCH_DIR/bench_origin" -p "$ORIGIN_PORT" "$@" &
+	ORIGIN_PID=$!
+	"$PROXY" "$PROXY_PORT" > /dev/null &
+	PROXY_PID=$!
+	sleep 1
+}
+
+# load load_args...
+load()
+{
+	"$BENCH_DIR/bench_load" -x "127.0.0.1:$PROXY_PORT" \
+		-u "http://127.0.0.1:$ORIGIN_PORT/" -d "$DURATION" \
+		-p "$PROXY_PID" "$@" || true
+}
+
+for scenario in $SCENARIOS
+do
+	echo "=== $scenario"
+	case $scenario in
+	small)
+		# Small objects, sized like typical page assets
+		start
+		load -r 2000 -t 128 -s pareto:512:1.5
+		;;
+	large)
+		# Large downloads, chunked by the origin
+		start -c
+		load -r 10 -t 32 -s uniform:8388608:33554432
+		;;
+	churn)
+		# Connection churn: empty bodies at a high rate, so the cost is all
+		# in accepting, connecting and tearing down
+		start
+		load -r 5000 -t 256 -s fixed:0
+		;;
+	idle)
+		# 10k idle client connections held open under a light load
+		start
+		load -r 200 -t 32 -s fixed:4096 -i 10000
+		;;
+	*)
+		echo "Unknown scenario $scenario" >&2
+		;;
+	esac
+	stop
+done
@@ -0,0 +1,237 @@
+/*
+ * buffer_pool.c
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+#include "affinity.h"
+#include "config.h"
+
+typedef struct pool_node
+{
+	struct pool_node* next;
+} PoolNode;
+
+typedef struct pool_chunk
+{
+	struct pool_chunk* next;
+	char* memory;
+} PoolChunk;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	size_t size;
+	PoolNode* free;
+	PoolChunk* chunks;
+	size_t lent;
+} PoolTier;
+
+//Each NUMA node has its own tiers, so its buffers stay in its memory
+static PoolTier tiers[AFFINITY_MAX_NODES][BUFFER_POOL_TIERS];
+
+//Bytes lent from malloc, for sizes over the top tier
+static size_t oversize_lent;
+
+__attribute__((constructor (MODULE_BUFFER_POOL_PRI)))
+void init_buffer_pool()
+{
+	if(DEBUG_PRINT) puts("Initializing buffer pool");
+
+	for(int node = 0; node < AFFINITY_MAX_NODES; ++node)
+	{
+		size_t size = BUFFER_POOL_SMALLEST;
+		for(int i = 0; i < BUFFER_POOL_TIERS; ++i, size *= 4)
+		{
+			PoolTier* tier = &tiers[node][i];
+			pthread_mutex_init(&tier->lock, 0);
+			tier->size = size;
+			tier->free = 0;
+			tier->chunks = 0;
+			tier->lent = 0;
+		}
+	}
+}
+
+__attribute__((destructor (MODULE_BUFFER_POOL_PRI)))
+void deinit_buffer_pool()
+{
+	if(DEBUG_PRINT) puts("Clearing buffer pool");
+
+	for(int node = 0; node < AFFINITY_MAX_NODES; ++node)
+	{
+		for(int i = 0; i < BUFFER_POOL_TIERS; ++i)
+		{
+			PoolTier* tier = &tiers[node][i];
+
+			//Something's still running at exit; leave its memory to the OS
+			if(tier->lent)
+				continue;
+
+			PoolChunk* chunk = tier->chunks;
+			while(chunk)
+			{
+				PoolChunk* next = chunk->next;
+				munmap(chunk->memory, BUFFER_POOL_CHUNK_SIZE);
+				free(chunk);
+				chunk = next;
+			}
+			pthread_mutex_destroy(&tier->lock);
+		}
+	}
+}
+
+//The smallest tier that fits size, or -1 if none does
+static inline int tier_for(size_t size)
+{
+	size_t tier_size = BUFFER_POOL_SMALLEST;
+	for(int i = 0; i < BUFFER_POOL_TIERS; ++i, tier_size *= 4)
+		if(size <= tier_size)
+			return i;
+	return -1;
+}
+
+/*
+ * Map a chunk. With huge pages on, try explicit huge pages first; those have
+ * to be reserved up front (vm.nr_hugepages), so failing that, map an aligned
+ * chunk and ask for transparent huge pages instead.
+ */
+static char* map_chunk()
+{
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	const int prot = PROT_READ | PROT_WRITE;
+
+	if(!BUFFER_POOL_HUGE_PAGES)
+	{
+		char* memory = mmap(0, BUFFER_POOL_CHUNK_SIZE, prot, flags, -1, 0);
+		return memory == MAP_FAILED ? 0 : memory;
+	}
+
+	char* memory = mmap(0, BUFFER_POOL_CHUNK_SIZE, prot, flags | MAP_HUGETLB,
+		-1, 0);
+	if(memory != MAP_FAILED)
+		return memory;
+
+	//Map twice the size, and trim it down to an aligned chunk
+	char* region = mmap(0, 2 * BUFFER_POOL_CHUNK_SIZE, prot, flags, -1, 0);
+	if(region == MAP_FAILED)
+		return 0;
+
+	uintptr_t align = BUFFER_POOL_CHUNK_SIZE;
+	memory = (char*)(((uintptr_t)region + align - 1) & ~(align - 1));
+	if(memory > region)
+		munmap(region, memory - region);
+	munmap(memory + BUFFER_POOL_CHUNK_SIZE,
+		region + BUFFER_POOL_CHUNK_SIZE - memory);
+
+	madvise(memory, BUFFER_POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+	return memory;
+}
+
+//Add a chunk's worth of buffers to a node's tier. Call with the tier's lock.
+static inline int tier_grow(PoolTier* tier, int node)
+{
+	PoolChunk* chunk = malloc(sizeof(PoolChunk));
+	if(!chunk)
+		return -1;
+
+	chunk->memory = map_chunk();
+	if(!chunk->memory)
+	{
+		free(chunk);
+		return -1;
+	}
+	affinity_bind_memory(chunk->memory, BUFFER_POOL_CHUNK_SIZE, node);
+
+	chunk->next = tier->chunks;
+	tier->chunks = chunk;
+
+	//Pushed in reverse, so buffers are handed out from the start of the chunk
+	for(size_t offset = BUFFER_POOL_CHUNK_SIZE; offset >= tier->size;
+		offset -= tier->size)
+	{
+		PoolNode* node = (PoolNode*)(chunk->memory + offset - tier->size);
+		node->next = tier->free;
+		tier->free = node;
+	}
+
+	return 0;
+}
+
+char* buffer_borrow(size_t size)
+{
+	int index = tier_for(size);
+	if(index < 0)
+	{
+		char* buffer = malloc(size);
+		if(buffer) __sync_add_and_fetch(&oversize_lent, size);
+		return buffer;
+	}
+
+	int home = affinity_node();
+	PoolTier* tier = &tiers[home][index];
+	pthread_mutex_lock(&tier->lock);
+
+	if(!tier->free && tier_grow(tier, home))
+	{
+		pthread_mutex_unlock(&tier->lock);
+		return 0;
+	}
+
+	PoolNode* node = tier->free;
+	tier->free = node->next;
+	tier->lent += tier->size;
+
+	pthread_mutex_unlock(&tier->lock);
+	return (char*)node;
+}
+
+void buffer_return(char* buffer, size_t size)
+{
+	if(!buffer) return;
+
+	int index = tier_for(size);
+	if(index < 0)
+	{
+		__sync_sub_and_fetch(&oversize_lent, size);
+		free(buffer);
+		return;
+	}
+
+	//Threads don't leave their node, so this is where it was borrowed
+	PoolTier* tier = &tiers[affinity_node()][index];
+	PoolNode* node = (PoolNode*)buffer;
+
+	pthread_mutex_lock(&tier->lock);
+	node->next = tier->free;
+	tier->free = node;
+	tier->lent -= tier->size;
+	pthread_mutex_unlock(&tier->lock);
+}
+
+void buffer_usage(size_t* lent, size_t* reserved)
+{
+	*lent = __sync_add_and_fetch(&oversize_lent, 0);
+	*reserved = 0;
+
+	for(int node = 0; node < AFFINITY_MAX_NODES; ++node)
+	{
+		for(int i = 0; i < BUFFER_POOL_TIERS; ++i)
+		{
+			PoolTier* tier = &tiers[node][i];
+			pthread_mutex_lock(&tier->lock);
+			*lent += tier->lent;
+			for(PoolChunk* chunk = tier->chunks; chunk; chunk = chunk->next)
+				*reserved += BUFFER_POOL_CHUNK_SIZE;
+			pthread_mutex_unlock(&tier->lock);
+		}
+	}
+}
@@ -0,0 +1,27 @@
+/*
+ * buffer_pool.h
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: nathan
+ *
+ *  Pooled I/O buffers. Instead of every connection owning its buffers for
+ *  its whole life, code borrows one just for the read or relay that needs it
+ *  and gives it straight back, so an idle connection holds none. Sizes are
+ *  rounded up to one of BUFFER_POOL_TIERS tiers (4K, 16K, 64K, 256K), each
+ *  carved from BUFFER_POOL_CHUNK_SIZE mappings that can be backed by huge
+ *  pages. Anything bigger than the top tier comes from malloc. With -a, each
+ *  NUMA node has its own tiers, so a connection's buffers are local to it.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+//Borrow a buffer of at least size bytes. Returns 0 if out of memory.
+char* buffer_borrow(size_t size);
+
+//Give a buffer back. size must be the size it was borrowed with.
+void buffer_return(char* buffer, size_t size);
+
+//Bytes in buffers that are borrowed, and bytes mapped for the pool, right now
+void buffer_usage(size_t* lent, size_t* reserved);
@@ -0,0 +1,252 @@
+/*
+ * cache_policy.c
+ *
+ *  Created on: Mar 7, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For strptime and timegm
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache_policy.h"
+#include "config.h"
+
+typedef struct
+{
+	bool no_store;
+	bool no_cache;
+	bool is_private;
+	long max_age; //-1 if not present
+	long s_maxage; //-1 if not present
+} CacheControl;
+
+//Parse a delta-seconds directive value. Returns -1 if it's malformed.
+static inline long parse_seconds(StringRef value)
+{
+	//Quoted values are allowed, though they shouldn't be used
+	if(value.size >= 2 && value.begin[0] == '"' &&
+			value.begin[value.size-1] == '"')
+		value = es_slice(value, 1, value.size - 2);
+
+	unsigned long seconds;
+	if(es_toul(&seconds, value))
+		return -1;
+	return seconds;
+}
+
+static inline void parse_cache_control(const HTTP_Message* message,
+	CacheControl* control)
+{
+	control->no_store = control->no_cache = control->is_private = false;
+	control->max_age = control->s_maxage = -1;
+
+	const HTTP_Header* header = find_header_id(message, hdr_cache_control);
+	if(!header)
+		return;
+
+	StringRef list = header->value;
+	StringRef directive;
+	while(next_list_element(&list, &directive))
+	{
+		StringRef name = directive, value = es_temp(0);
+		const char* equals = memchr(directive.begin, '=', directive.size);
+		if(equals)
+		{
+			size_t name_size = equals - directive.begin;
+			name = trim_lws(es_slice(directive, 0, name_size));
+			value = trim_lws(es_slice(directive, name_size + 1, directive.size));
+		}
+
+		if(header_names_equal(name, es_temp("no-store")))
+			control->no_store = true;
+		else if(header_names_equal(name, es_temp("no-cache")))
+			control->no_cache = true;
+		else if(header_names_equal(name, es_temp("private")))
+			control->is_private = true;
+		else if(header_names_equal(name, es_temp("max-age")))
+			control->max_age = parse_seconds(value);
+		else if(header_names_equal(name, es_temp("s-maxage")))
+			control->s_maxage = parse_seconds(value);
+	}
+}
+
+//Parse an HTTP-date (RFC 1123 form only). Returns -1 if it's malformed.
+static inline time_t parse_http_date(StringRef value)
+{
+	char buffer[64];
+	if(value.size >= sizeof(buffer))
+		return -1;
+	memcpy(buffer, value.begin, value.size);
+	buffer[value.size] = 0;
+
+	struct tm date;
+	memset(&date, 0, sizeof(date));
+	const char* end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &date);
+	if(!end || *end)
+		return -1;
+	return timegm(&date);
+}
+
+//Statuses that are cacheable by default (RFC 7231 section 6.1)
+static inline bool cacheable_status(int status)
+{
+	switch(status)
+	{
+	case 200: case 203: case 204: case 300: case 301:
+	case 404: case 405: case 410: case 414: case 501:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool cache_request_allowed(const HTTP_Message* request)
+{
+	if(request->request.method != get && request->request.method != head)
+		return false;
+
+	//Partial and authorized requests go to the origin
+	if(find_header_id(request, hdr_range) ||
+			find_header_id(request, hdr_authorization))
+		return false;
+
+	CacheControl control;
+	parse_cache_control(request, &control);
+	if(control.no_store || control.no_cache)
+		return false;
+
+	const HTTP_Header* pragma = find_header_id(request, hdr_pragma);
+	if(pragma && header_names_equal(pragma->value, es_temp("no-cache")))
+		return false;
+
+	return true;
+}
+
+bool cache_response_shareable(const HTTP_Message* response)
+{
+	//Responses that set cookies are someone's private business
+	if(find_header_id(response, hdr_set_cookie))
+		return false;
+
+	//Vary: * means no other request can ever match
+	const HTTP_Header* vary = find_header_id(response, hdr_vary);
+	if(vary && es_compare(trim_lws(vary->value), es_temp("*")) == 0)
+		return false;
+
+	CacheControl control;
+	parse_cache_control(response, &control);
+	return !control.no_store && !control.is_private;
+}
+
+bool cache_response_allowed(const HTTP_Message* request,
+	const HTTP_Message* response, CacheLifetime* lifetime)
+{
+	//Only full GET responses have a body to store
+	if(request->request.method != get || !cache_request_allowed(request))
+		return false;
+
+	//Relayed bodies were never held, so there's nothing to store
+	if(response->unread_body)
+		return false;
+
+	if(!cacheable_status(response->response.status))
+		return false;
+
+	if(!cache_response_shareable(response))
+		return false;
+
+	CacheControl control;
+	parse_cache_control(response, &control);
+	if(control.no_cache)
+		return false;
+
+	time_t now = time(0);
+
+	//Age the response already had
+	lifetime->initial_age = 0;
+	const HTTP_Header* age = find_header_id(response, hdr_age);
+	if(age)
+	{
+		long age_seconds = parse_seconds(age->value);
+		if(age_seconds > 0) lifetime->initial_age = age_seconds;
+	}
+
+	//Freshness lifetime, in order of precedence
+	long freshness = -1;
+	if(control.s_maxage >= 0)
+		freshness = control.s_maxage;
+	else if(control.max_age >= 0)
+		freshness = control.max_age;
+	else
+	{
+		const HTTP_Header* expires = find_header_id(response, hdr_expires);
+		if(expires)
+		{
+			time_t expires_time = parse_http_date(expires->value);
+
+			//Expires is relative to the origin's Date, if it sent one
+			const HTTP_Header* date = find_header_id(response, hdr_date);
+			time_t date_time = date ? parse_http_date(date->value) : -1;
+			if(date_time < 0) date_time = now;
+
+			//A malformed Expires means already expired
+			freshness = expires_time < 0 ? 0 : expires_time - date_time;
+		}
+	}
+
+	if(freshness <= lifetime->initial_age)
+		return false;
+
+	lifetime->expires = now + freshness - lifetime->initial_age;
+	return true;
+}
+
+String cache_key(const HTTP_Message* request)
+{
+	String key = es_tolower(es_ref(&request->request.domain));
+	if(request->request.port.size)
+	{
+		es_append(&key, es_temp(":"));
+		es_append(&key, es_ref(&request->request.port));
+	}
+	es_append(&key, es_temp("/"));
+	es_append(&key, es_ref(&request->request.path));
+	return key;
+}
+
+//FNV-1a, with a final mix so every bit of the result is usable
+uint64_t cache_key_hash(StringRef key)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < key.size; ++i)
+	{
+		hash ^= (unsigned char)key.begin[i];
+		hash *= 1099511628211ull;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+
+	//0 is used to mark empty slots
+	return hash ? hash : 1;
+}
+
+String cache_vary_values(const HTTP_Message* request, StringRef vary_names)
+{
+	String values = es_empty_string;
+
+	StringRef name;
+	while(next_list_element(&vary_names, &name))
+	{
+		StringRef value;
+		if(find_header_value(request, name, &value))
+			es_append(&values, value);
+
+		//Separator, so "ab" + "" and "a" + "b" differ
+		es_append(&values, es_temp("\n"));
+	}
+	return values;
+}
@@ -0,0 +1,62 @@
+/*
+ * cache_policy.h
+ *
+ *  Created on: Mar 7, 2014
+ *      Author: nathan
+ *
+ *  The rules for what can be cached, and for how long. Shared by the memory
+ *  and disk caches. This is a shared cache, so it follows the shared-cache
+ *  rules: no private or authorized responses, and s-maxage wins over max-age.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+typedef struct
+{
+	time_t expires; //When the response stops being fresh
+	long initial_age; //The Age of the response when it was received
+} CacheLifetime;
+
+//What a cache or a collapsed fetch sent to a client, for the log and probes
+typedef struct
+{
+	int status;
+	size_t body_size; //Before any compression. 0 for a HEAD.
+} CacheServed;
+
+//True if a request may be answered from the cache at all
+bool cache_request_allowed(const HTTP_Message* request);
+
+/*
+ * True if a response to a request may be stored. If it may, sets lifetime.
+ * Only responses with explicit freshness (max-age, s-maxage, or Expires) are
+ * stored; there's no heuristic freshness. Size limits are up to each cache.
+ */
+bool cache_response_allowed(const HTTP_Message* request,
+	const HTTP_Message* response, CacheLifetime* lifetime);
+
+/*
+ * True if a response may be handed to clients other than the one that asked
+ * for it (as opposed to stored): it isn't private, no-store, or setting
+ * cookies, and doesn't Vary on everything.
+ */
+bool cache_response_shareable(const HTTP_Message* response);
+
+//The cache key for a request: the lowercased domain, the port, and the path
+String cache_key(const HTTP_Message* request);
+
+//A well-mixed 64 bit hash of a cache key. Never 0.
+uint64_t cache_key_hash(StringRef key);
+
+/*
+ * The values of the request headers named by a response's Vary header,
+ * concatenated. A cached response can only be used for requests that produce
+ * the same string.
+ */
+String cache_vary_values(const HTTP_Message* request, StringRef vary_names);
@@ -0,0 +1,152 @@
+/*
+ * capture.c
+ *
+ *  Created on: Mar 16, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "fiber.h"
+#include "config.h"
+
+static FILE* capture_file;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+
+//The session capture_bytes records into. One per thread, or per fiber.
+#define thread_capture (*(CaptureSession**)fiber_local(fiber_local_capture))
+
+static inline uint64_t microseconds_since(const struct timespec* then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000ULL +
+		(now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+int capture_open(const char* path)
+{
+	capture_file = fopen(path, "wb");
+	if(!capture_file)
+		return -1;
+
+	CaptureFileHeader header = { .version = CAPTURE_VERSION };
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	fwrite(&header, sizeof(header), 1, capture_file);
+
+	clock_gettime(CLOCK_MONOTONIC, &capture_start);
+	return 0;
+}
+
+__attribute__((destructor (MODULE_CAPTURE_PRI)))
+void deinit_capture()
+{
+	if(!capture_file)
+		return;
+	if(DEBUG_PRINT) puts("Closing capture file");
+
+	pthread_mutex_lock(&capture_lock);
+	fclose(capture_file);
+	capture_file = 0;
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_begin(CaptureSession* session, int client_fd)
+{
+	session->active = capture_file != 0;
+	if(!session->active)
+		return;
+
+	session->client_fd = client_fd;
+	session->server_fd = -1;
+	session->flags = 0;
+	session->request = session->response = es_empty_string;
+	session->origin_us = 0;
+	clock_gettime(CLOCK_MONOTONIC, &session->start);
+	thread_capture = session;
+}
+
+void capture_set_server(CaptureSession* session, int server_fd)
+{
+	if(!session->active)
+		return;
+
+	session->server_fd = server_fd;
+	clock_gettime(CLOCK_MONOTONIC, &session->upstream_start);
+}
+
+void capture_bytes(int fd, const char* data, size_t size)
+{
+	CaptureSession* session = thread_capture;
+	if(!session || size == 0)
+		return;
+
+	String* side;
+	uint32_t truncated_flag;
+	if(fd == session->client_fd)
+	{
+		side = &session->request;
+		truncated_flag = CAPTURE_REQUEST_TRUNCATED;
+	}
+	else if(fd == session->server_fd)
+	{
+		//The origin's think time ends at its first byte
+		if(session->response.size == 0)
+			session->origin_us = microseconds_since(&session->upstream_start);
+		side = &session->response;
+		truncated_flag = CAPTURE_RESPONSE_TRUNCATED;
+	}
+	else
+	{
+		return;
+	}
+
+	if(side->size + size > CAPTURE_MAX_MESSAGE)
+	{
+		session->flags |= truncated_flag;
+		size = CAPTURE_MAX_MESSAGE - side->size;
+	}
+	es_append(side, es_tempn(data, size));
+}
+
+void capture_end(CaptureSession* session)
+{
+	if(!session->active)
+		return;
+	session->active = false;
+	thread_capture = 0;
+
+	CaptureRecord record = {
+		.start_us = (session->start.tv_sec - capture_start.tv_sec) * 1000000ULL +
+			(session->start.tv_nsec - capture_start.tv_nsec) / 1000,
+		.origin_us = session->origin_us,
+		.flags = session->flags,
+		.request_size = session->request.size,
+		.response_size = session->response.size };
+
+	//Connections that never sent anything aren't worth replaying
+	if(record.request_size)
+	{
+		pthread_mutex_lock(&capture_lock);
+		if(capture_file)
+		{
+			fwrite(&record, sizeof(record), 1, capture_file);
+			fwrite(es_ref(&session->request).begin, 1, record.request_size,
+				capture_file);
+			fwrite(es_ref(&session->response).begin, 1, record.response_size,
+				capture_file);
+
+			//Whole records only, even if the proxy is killed
+			fflush(capture_file);
+		}
+		pthread_mutex_unlock(&capture_lock);
+	}
+
+	es_free(&session->request);
+	es_free(&session->response);
+}
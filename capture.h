@@ -0,0 +1,80 @@
+/*
+ * capture.h
+ *
+ *  Created on: Mar 16, 2014
+ *      Author: nathan
+ *
+ *  Traffic capture, for replaying real traffic in performance runs (see
+ *  bench/replay.c). When a capture file is open, every byte the proxy reads
+ *  from a client or an origin is recorded, exactly as it arrived, so even
+ *  malformed requests can be reproduced. Each connection becomes one record,
+ *  written when the connection is done.
+ *
+ *  The file is a CaptureFileHeader followed by records. Each record is a
+ *  CaptureRecord followed by request_size bytes of request and response_size
+ *  bytes of response. Numbers are in host byte order.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "EasyString/easy_string.h"
+
+#define CAPTURE_MAGIC "NPCAPTUR"
+#define CAPTURE_VERSION 1
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} CaptureFileHeader;
+
+//Set in CaptureRecord.flags when a side was cut at CAPTURE_MAX_MESSAGE
+#define CAPTURE_REQUEST_TRUNCATED 1
+#define CAPTURE_RESPONSE_TRUNCATED 2
+
+typedef struct
+{
+	uint64_t start_us; //When the connection was accepted, from capture start
+	uint32_t origin_us; //From connecting upstream to the first response byte
+	uint32_t flags;
+	uint32_t request_size;
+	uint32_t response_size;
+} CaptureRecord;
+
+typedef struct
+{
+	bool active;
+	int client_fd;
+	int server_fd;
+	uint32_t flags;
+
+	String request; //Bytes read from the client
+	String response; //Bytes read from the origin
+
+	struct timespec start;
+	struct timespec upstream_start;
+	uint32_t origin_us;
+} CaptureSession;
+
+//Start capturing to a file. Returns 0, or -1 if it can't be created.
+int capture_open(const char* path);
+
+/*
+ * Start recording a connection. The session becomes the calling thread's, so
+ * capture_bytes records into it. Does nothing if there's no capture file.
+ */
+void capture_begin(CaptureSession* session, int client_fd);
+
+//The origin connection's bytes go in the response
+void capture_set_server(CaptureSession* session, int server_fd);
+
+//Record bytes just read from fd on the calling thread's connection
+void capture_bytes(int fd, const char* data, size_t size);
+
+//Write the connection's record, and release the session
+void capture_end(CaptureSession* session);
@@ -0,0 +1,275 @@
+/*
+ * client_limits.c
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "client_limits.h"
+#include "stat_tracking.h"
+#include "config.h"
+
+typedef struct client
+{
+	struct client* next;
+	in_addr_t address;
+
+	double tokens;
+	uint64_t refilled; //Milliseconds, when tokens was last topped up
+	uint64_t seen; //Milliseconds, when it last connected or closed
+	unsigned open;
+} Client;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	Client* buckets[CLIENT_LIMIT_BUCKETS];
+	size_t count;
+	uint64_t swept; //Milliseconds, when idle clients were last cleared out
+} Shard;
+
+static struct
+{
+	bool active;
+	double rate; //Tokens a millisecond
+	double burst;
+	unsigned max_open;
+
+	Shard shards[CLIENT_LIMIT_SHARDS];
+} limits;
+
+static inline uint64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//Spread addresses from the same subnet across shards and buckets
+static inline uint32_t address_hash(in_addr_t address)
+{
+	uint32_t hash = address * 0x9E3779B1u;
+	return hash ^ hash >> 16;
+}
+
+static inline Shard* shard_for(uint32_t hash)
+{
+	return &limits.shards[hash % CLIENT_LIMIT_SHARDS];
+}
+
+static inline Client** bucket_for(Shard* shard, uint32_t hash)
+{
+	return &shard->buckets[(hash / CLIENT_LIMIT_SHARDS) % CLIENT_LIMIT_BUCKETS];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE TABLE
+///////////////////////////////////////////////////////////////////////////////
+
+//All of these must be called with the shard locked
+
+//Forget clients with nothing open that have been quiet long enough
+static void sweep(Shard* shard, uint64_t now)
+{
+	shard->swept = now;
+	uint64_t idle = CLIENT_IDLE_TIMEOUT * 1000;
+
+	for(int i = 0; i < CLIENT_LIMIT_BUCKETS; ++i)
+	{
+		Client** link = &shard->buckets[i];
+		while(*link)
+		{
+			Client* client = *link;
+			if(client->open == 0 && now - client->seen >= idle)
+			{
+				*link = client->next;
+				free(client);
+				--shard->count;
+			}
+			else
+			{
+				link = &client->next;
+			}
+		}
+	}
+}
+
+static Client* find(Shard* shard, uint32_t hash, in_addr_t address)
+{
+	for(Client* client = *bucket_for(shard, hash); client; client = client->next)
+		if(client->address == address)
+			return client;
+	return 0;
+}
+
+//A new client starts with a full bucket
+static Client* add(Shard* shard, uint32_t hash, in_addr_t address,
+	uint64_t now)
+{
+	Client* client = malloc(sizeof(Client));
+	if(!client)
+		return 0;
+
+	Client** bucket = bucket_for(shard, hash);
+	*client = (Client){ .next = *bucket, .address = address,
+		.tokens = limits.burst, .refilled = now, .seen = now };
+	*bucket = client;
+	++shard->count;
+	return client;
+}
+
+static inline void refill(Client* client, uint64_t now)
+{
+	client->tokens += (now - client->refilled) * limits.rate;
+	if(client->tokens > limits.burst)
+		client->tokens = limits.burst;
+	client->refilled = now;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_CLIENT_LIMIT_PRI)))
+void init_client_limits()
+{
+	if(DEBUG_PRINT) puts("Initializing client limits");
+	for(int i = 0; i < CLIENT_LIMIT_SHARDS; ++i)
+		pthread_mutex_init(&limits.shards[i].lock, 0);
+}
+
+__attribute__((destructor (MODULE_CLIENT_LIMIT_PRI)))
+void deinit_client_limits()
+{
+	if(DEBUG_PRINT) puts("Clearing client limits");
+	for(int i = 0; i < CLIENT_LIMIT_SHARDS; ++i)
+	{
+		Shard* shard = &limits.shards[i];
+		for(int b = 0; b < CLIENT_LIMIT_BUCKETS; ++b)
+		{
+			Client* client = shard->buckets[b];
+			while(client)
+			{
+				Client* next = client->next;
+				free(client);
+				client = next;
+			}
+			shard->buckets[b] = 0;
+		}
+		shard->count = 0;
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+int client_limits_set(const char* spec)
+{
+	char* end;
+	unsigned long rate = strtoul(spec, &end, 10);
+	if(end == spec || *end != ':')
+		return -1;
+
+	const char* at = end + 1;
+	unsigned long burst = strtoul(at, &end, 10);
+	if(end == at || *end != ':')
+		return -1;
+
+	at = end + 1;
+	unsigned long max_open = strtoul(at, &end, 10);
+	if(end == at || *end)
+		return -1;
+
+	//A rate with no burst would never let anything through
+	if(rate && !burst)
+		return -1;
+
+	limits.rate = rate / 1000.0;
+	limits.burst = rate ? burst : 0;
+	limits.max_open = max_open;
+	limits.active = rate || max_open;
+	return 0;
+}
+
+ClientVerdict client_admit(const struct sockaddr_in* address)
+{
+	if(!limits.active)
+		return client_admitted;
+
+	in_addr_t key = address->sin_addr.s_addr;
+	uint32_t hash = address_hash(key);
+	Shard* shard = shard_for(hash);
+	uint64_t now = now_ms();
+
+	pthread_mutex_lock(&shard->lock);
+
+	if(now - shard->swept >= CLIENT_IDLE_TIMEOUT * 1000)
+		sweep(shard, now);
+
+	Client* client = find(shard, hash, key);
+	if(!client && !(client = add(shard, hash, key, now)))
+	{
+		//No memory to track it; better to let it through than refuse everyone
+		pthread_mutex_unlock(&shard->lock);
+		return client_admitted;
+	}
+	client->seen = now;
+
+	ClientVerdict verdict = client_admitted;
+	if(limits.max_open && client->open >= limits.max_open)
+	{
+		verdict = client_too_many;
+	}
+	else if(limits.rate)
+	{
+		refill(client, now);
+		if(client->tokens < 1)
+			verdict = client_too_fast;
+		else
+			client->tokens -= 1;
+	}
+
+	if(verdict == client_admitted)
+		++client->open;
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if(verdict != client_admitted)
+		stat_add_client_limited(verdict == client_too_many);
+	return verdict;
+}
+
+void client_release(const struct sockaddr_in* address)
+{
+	if(!limits.active)
+		return;
+
+	in_addr_t key = address->sin_addr.s_addr;
+	uint32_t hash = address_hash(key);
+	Shard* shard = shard_for(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	Client* client = find(shard, hash, key);
+	if(client && client->open)
+	{
+		--client->open;
+		client->seen = now_ms();
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+size_t client_count()
+{
+	size_t count = 0;
+	for(int i = 0; i < CLIENT_LIMIT_SHARDS; ++i)
+	{
+		pthread_mutex_lock(&limits.shards[i].lock);
+		count += limits.shards[i].count;
+		pthread_mutex_unlock(&limits.shards[i].lock);
+	}
+	return count;
+}
@@ -0,0 +1,50 @@
+/*
+ * client_limits.h
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ *
+ *  Per-client limits, with -l. Each client IP address gets a token bucket for
+ *  new connections (a rate, with bursts) and a cap on how many it can have
+ *  open at once. Connections are checked as they're accepted, before a
+ *  worker is started or a byte is read, and anything over a limit is sent a
+ *  prebuilt 429 and closed. Every connection carries a single request, so
+ *  the connection rate is the request rate.
+ *
+ *  Clients live in a hash table split into CLIENT_LIMIT_SHARDS shards, each
+ *  with its own lock, so one busy client only contends with the few others
+ *  in its shard. A client with nothing open is forgotten once it's been
+ *  quiet for CLIENT_IDLE_TIMEOUT seconds.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+typedef enum
+{
+	client_admitted,
+	client_too_fast, //Out of tokens
+	client_too_many //At the concurrent connection cap
+} ClientVerdict;
+
+/*
+ * Turn limits on, from "rate:burst:connections": new connections a second,
+ * how many can come at once, and how many can be open. Any of them can be 0
+ * for no limit. Returns 0, or -1 if the spec is bad.
+ */
+int client_limits_set(const char* spec);
+
+/*
+ * Check a new connection. If it's admitted, it counts as open until
+ * client_release is called for it.
+ */
+ClientVerdict client_admit(const struct sockaddr_in* address);
+
+//An admitted connection has closed
+void client_release(const struct sockaddr_in* address);
+
+//Clients being tracked right now
+size_t client_count();
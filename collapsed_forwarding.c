@@ -0,0 +1,283 @@
+/*
+ * collapsed_forwarding.c
+ *
+ *  Created on: Mar 9, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "collapsed_forwarding.h"
+#include "cache_policy.h"
+#include "stat_tracking.h"
+#include "fiber.h"
+#include "config.h"
+
+#define FLIGHT_SHARDS 16
+#define FLIGHT_BUCKETS 256
+
+typedef enum { flight_pending, flight_done, flight_failed } FlightState;
+
+/*
+ * Flights are reference counted, like cache entries. The leader and every
+ * follower hold a reference; the table doesn't, because a flight leaves the
+ * table the moment it's done, so later requests start a fresh one.
+ */
+struct flight
+{
+	struct flight* bucket_next;
+
+	uint64_t hash;
+	String key;
+
+	FlightState state;
+	FiberCond landed;
+	int waiters;
+	int refs;
+
+	//The shared response. Only valid once the state is flight_done.
+	String head; //Response line, headers, and empty line
+	String body;
+	String vary_names;
+	String vary_values; //The leader's values for the Vary headers
+	int status;
+	bool compressible;
+};
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	Flight* buckets[FLIGHT_BUCKETS];
+} FlightShard;
+
+static FlightShard shards[FLIGHT_SHARDS];
+
+static inline FlightShard* flight_shard(const Flight* flight)
+{
+	return &shards[flight->hash & (FLIGHT_SHARDS - 1)];
+}
+
+static inline Flight** find_flight(FlightShard* shard, uint64_t hash,
+	StringRef key)
+{
+	Flight** link = &shard->buckets[(hash >> 8) % FLIGHT_BUCKETS];
+	while(*link && ((*link)->hash != hash ||
+			es_compare(es_ref(&(*link)->key), key) != 0))
+		link = &(*link)->bucket_next;
+	return link;
+}
+
+//Must be called with the shard locked
+static inline void unlink_flight(FlightShard* shard, Flight* flight)
+{
+	Flight** link = find_flight(shard, flight->hash, es_ref(&flight->key));
+	if(*link == flight)
+		*link = flight->bucket_next;
+}
+
+static inline void free_flight(Flight* flight)
+{
+	fiber_cond_destroy(&flight->landed);
+	es_free(&flight->key);
+	es_free(&flight->head);
+	es_free(&flight->body);
+	es_free(&flight->vary_names);
+	es_free(&flight->vary_values);
+	free(flight);
+}
+
+void flight_release(Flight* flight)
+{
+	if(__sync_sub_and_fetch(&flight->refs, 1) == 0)
+		free_flight(flight);
+}
+
+__attribute__((constructor (MODULE_COLLAPSE_PRI)))
+void init_collapsed_forwarding()
+{
+	if(DEBUG_PRINT) puts("Initializing collapsed forwarding");
+	for(int i = 0; i < FLIGHT_SHARDS; ++i)
+		pthread_mutex_init(&shards[i].lock, 0);
+}
+
+__attribute__((destructor (MODULE_COLLAPSE_PRI)))
+void deinit_collapsed_forwarding()
+{
+	if(DEBUG_PRINT) puts("Clearing collapsed forwarding");
+	for(int i = 0; i < FLIGHT_SHARDS; ++i)
+		pthread_mutex_destroy(&shards[i].lock);
+}
+
+bool flight_allowed(const HTTP_Message* request)
+{
+	//Cookies usually mean a personalized response, even without Vary
+	return request->request.method == get &&
+		cache_request_allowed(request) &&
+		!find_header_id(request, hdr_cookie);
+}
+
+//Follower: true if the landed response can go to this request
+static inline bool flight_matches(const Flight* flight,
+	const HTTP_Message* request)
+{
+	if(flight->state != flight_done)
+		return false;
+	if(flight->vary_names.size == 0)
+		return true;
+
+	String vary_values = cache_vary_values(request, es_ref(&flight->vary_names));
+	bool result = es_compare(es_ref(&vary_values),
+		es_ref(&flight->vary_values)) == 0;
+	es_free(&vary_values);
+	return result;
+}
+
+FlightRole flight_join(const HTTP_Message* request, Flight** flight_out)
+{
+	String key = cache_key(request);
+	uint64_t hash = cache_key_hash(es_ref(&key));
+	FlightShard* shard = &shards[hash & (FLIGHT_SHARDS - 1)];
+
+	pthread_mutex_lock(&shard->lock);
+
+	Flight* flight = *find_flight(shard, hash, es_ref(&key));
+
+	//Nobody's fetching it. We will.
+	if(!flight)
+	{
+		flight = calloc(1, sizeof(Flight));
+		flight->hash = hash;
+		flight->key = key;
+		flight->state = flight_pending;
+		flight->refs = 1;
+		fiber_cond_init(&flight->landed);
+
+		Flight** bucket = &shard->buckets[(hash >> 8) % FLIGHT_BUCKETS];
+		flight->bucket_next = *bucket;
+		*bucket = flight;
+
+		pthread_mutex_unlock(&shard->lock);
+
+		*flight_out = flight;
+		return flight_lead;
+	}
+
+	es_free(&key);
+
+	//Too crowded; a few extra fetches beat an unbounded convoy
+	if(flight->waiters >= COLLAPSE_MAX_WAITERS)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return flight_alone;
+	}
+
+	++flight->waiters;
+	++flight->refs;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += COLLAPSE_WAIT_TIMEOUT;
+
+	/*
+	 * Our reference keeps the flight around while the lock is dropped. On a
+	 * fiber, this parks the fiber, not the thread.
+	 */
+	int wait_result = 0;
+	while(flight->state == flight_pending && wait_result == 0)
+		wait_result = fiber_cond_timedwait(&flight->landed, &shard->lock,
+			&deadline);
+
+	--flight->waiters;
+	bool matches = flight_matches(flight, request);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if(!matches)
+	{
+		flight_release(flight);
+		return flight_alone;
+	}
+
+	stat_add_collapsed();
+	*flight_out = flight;
+	return flight_follow;
+}
+
+//Leader: land the flight, wake everyone, and drop the leader's reference
+static inline void land_flight(Flight* flight, FlightState state)
+{
+	FlightShard* shard = flight_shard(flight);
+
+	pthread_mutex_lock(&shard->lock);
+	unlink_flight(shard, flight);
+	flight->state = state;
+	fiber_cond_broadcast(&flight->landed);
+	pthread_mutex_unlock(&shard->lock);
+
+	flight_release(flight);
+}
+
+void flight_fail(Flight* flight)
+{
+	land_flight(flight, flight_failed);
+}
+
+void flight_finish(Flight* flight, const HTTP_Message* request,
+	HTTP_Message* response)
+{
+	FlightShard* shard = flight_shard(flight);
+	pthread_mutex_lock(&shard->lock);
+	int waiters = flight->waiters;
+	pthread_mutex_unlock(&shard->lock);
+
+	/*
+	 * Nobody waiting means nothing to copy. Anyone who turns up after this
+	 * finds the flight failed and fetches for themselves.
+	 */
+	if(waiters == 0 || response->unread_body ||
+		response->body.size > COLLAPSE_MAX_RESPONSE_SIZE ||
+		!cache_response_shareable(response))
+	{
+		land_flight(flight, flight_failed);
+		return;
+	}
+
+	//Nobody reads these until the state changes, under the lock
+	flight->head = serialize_response_head(response);
+	flight->body = es_copy(es_ref(&response->body));
+	flight->status = response->response.status;
+	flight->compressible = compress_eligible(response);
+
+	const HTTP_Header* vary = find_header_id(response, hdr_vary);
+	if(vary)
+	{
+		flight->vary_names = es_copy(vary->value);
+		flight->vary_values = cache_vary_values(request, vary->value);
+	}
+
+	land_flight(flight, flight_done);
+}
+
+int flight_write(const Flight* flight, int fd, ContentCoding coding,
+	CacheServed* served)
+{
+	served->status = flight->status;
+	served->body_size = flight->body.size;
+
+	if(flight->compressible)
+		return compress_write(es_ref(&flight->head), es_ref(&flight->body),
+			coding, flight->hash, fd);
+
+	struct iovec parts[2] =
+	{
+		{ .iov_base = (void*)es_ref(&flight->head).begin,
+			.iov_len = flight->head.size },
+		{ .iov_base = (void*)es_ref(&flight->body).begin,
+			.iov_len = flight->body.size },
+	};
+	return write_parts(fd, parts, 2);
+}
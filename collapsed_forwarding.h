@@ -0,0 +1,53 @@
+/*
+ * collapsed_forwarding.h
+ *
+ *  Created on: Mar 9, 2014
+ *      Author: nathan
+ *
+ *  Collapsed forwarding. When several clients ask for the same URL at once,
+ *  only the first (the leader) goes to the origin; the rest wait on its
+ *  "flight" and are all sent a copy of the same response. If the leader
+ *  fails, or the response turns out to be private, the waiters just fetch it
+ *  themselves.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "http.h"
+#include "compression.h"
+#include "cache_policy.h"
+
+typedef struct flight Flight;
+
+typedef enum
+{
+	flight_lead, //Fetch it, then call flight_finish or flight_fail
+	flight_follow, //The response is ready; flight_write it, then release
+	flight_alone //Not collapsed. Fetch it normally.
+} FlightRole;
+
+//True if a request looks safe to collapse with identical ones
+bool flight_allowed(const HTTP_Message* request);
+
+/*
+ * Join the flight for a request, starting one if there isn't one. Followers
+ * block here until the leader is done.
+ */
+FlightRole flight_join(const HTTP_Message* request, Flight** flight);
+
+//Leader: hand the response to the waiters, and leave the flight
+void flight_finish(Flight* flight, const HTTP_Message* request,
+	HTTP_Message* response);
+
+//Leader: give up, so the waiters fetch for themselves
+void flight_fail(Flight* flight);
+
+/*
+ * Follower: send the shared response, compressed with coding if it's
+ * eligible, and fill in served. Then release the flight.
+ */
+int flight_write(const Flight* flight, int fd, ContentCoding coding,
+	CacheServed* served);
+void flight_release(Flight* flight);
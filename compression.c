@@ -0,0 +1,645 @@
+/*
+ * compression.c
+ *
+ *  Created on: Mar 21, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "compression.h"
+#include "cache_policy.h"
+#include "memory_budget.h"
+#include "buffer_pool.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "stat_tracking.h"
+#include "fiber.h"
+#include "config.h"
+
+#define VARIANT_BUCKETS 256
+
+//Size of the buffers a relayed body is compressed through
+const static size_t compress_chunk_size = 64 * 1024;
+
+///////////////////////////////////////////////////////////////////////////////
+// NEGOTIATION
+///////////////////////////////////////////////////////////////////////////////
+
+//The q value of an Accept-Encoding element, 1 if it doesn't have one
+static inline double quality(StringRef params)
+{
+	StringRef param;
+	while(params.size)
+	{
+		const char* semicolon = memchr(params.begin, ';', params.size);
+		size_t size = semicolon ? (size_t)(semicolon - params.begin) :
+			params.size;
+		param = trim_lws(es_slice(params, 0, size));
+		params = es_slice(params, semicolon ? size + 1 : size, params.size);
+
+		if(param.size >= 2 && (param.begin[0] == 'q' || param.begin[0] == 'Q')
+				&& param.begin[1] == '=')
+		{
+			char value[16];
+			size_t value_size = param.size - 2 < sizeof(value) - 1 ?
+				param.size - 2 : sizeof(value) - 1;
+			memcpy(value, param.begin + 2, value_size);
+			value[value_size] = 0;
+			return strtod(value, 0);
+		}
+	}
+	return 1;
+}
+
+ContentCoding compress_coding(const HTTP_Message* request)
+{
+	if(!COMPRESS_RESPONSES || request->request.method == head)
+		return coding_identity;
+
+	const HTTP_Header* header = find_header_id(request, hdr_accept_encoding);
+	if(!header)
+		return coding_identity;
+
+	bool gzip = false, deflate = false;
+
+	StringRef list = header->value;
+	StringRef element;
+	while(next_list_element(&list, &element))
+	{
+		const char* semicolon = memchr(element.begin, ';', element.size);
+		size_t name_size = semicolon ? (size_t)(semicolon - element.begin) :
+			element.size;
+		StringRef name = trim_lws(es_slice(element, 0, name_size));
+		bool acceptable = quality(es_slice(element, name_size,
+			element.size)) > 0;
+
+		if(header_names_equal(name, es_temp("gzip")) ||
+				header_names_equal(name, es_temp("x-gzip")))
+			gzip = acceptable;
+		else if(header_names_equal(name, es_temp("deflate")))
+			deflate = acceptable;
+		else if(header_names_equal(name, es_temp("*")))
+			gzip = deflate = acceptable;
+	}
+
+	return gzip ? coding_gzip : deflate ? coding_deflate : coding_identity;
+}
+
+//True if a Content-Type is one of the COMPRESS_TYPES
+static inline bool compressible_type(StringRef type)
+{
+	for(const char* const* prefix = COMPRESS_TYPES; *prefix; ++prefix)
+	{
+		size_t size = strlen(*prefix);
+		if(type.size >= size && strncasecmp(type.begin, *prefix, size) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool compress_eligible(const HTTP_Message* response)
+{
+	if(!COMPRESS_RESPONSES || response->response.status != 200)
+		return false;
+
+	size_t size = response->unread_body ? response->unread_body :
+		response->body.size;
+	if(size < COMPRESS_MIN_SIZE)
+		return false;
+
+	const HTTP_Header* encoding = find_header_id(response,
+		hdr_content_encoding);
+	if(encoding && !header_names_equal(trim_lws(encoding->value),
+			es_temp("identity")))
+		return false;
+
+	if(find_header_id(response, hdr_content_range))
+		return false;
+
+	const HTTP_Header* type = find_header_id(response, hdr_content_type);
+	if(!type || !compressible_type(trim_lws(type->value)))
+		return false;
+
+	//The origin can forbid it
+	const HTTP_Header* control = find_header_id(response, hdr_cache_control);
+	if(control)
+	{
+		StringRef list = control->value;
+		StringRef directive;
+		while(next_list_element(&list, &directive))
+			if(header_names_equal(directive, es_temp("no-transform")))
+				return false;
+	}
+
+	return true;
+}
+
+StringRef compress_vary_line()
+{
+	return es_temp("Vary: Accept-Encoding\r\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE VARIANT CACHE
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A compressed body. It's found by the object's key hash, plus the length
+ * and CRC-32 of the original body (what a gzip trailer identifies it by),
+ * so a changed object never matches an old variant. Reference counted like
+ * the response cache's entries, so it can be evicted while being sent.
+ */
+typedef struct variant
+{
+	struct variant* bucket_next;
+	struct variant* lru_prev; //Towards the most recently used
+	struct variant* lru_next; //Towards the least recently used
+
+	uint64_t hash;
+	uint32_t crc;
+	size_t length;
+	ContentCoding coding;
+
+	String body;
+	int refs;
+} Variant;
+
+static struct
+{
+	pthread_mutex_t lock;
+	Variant* buckets[VARIANT_BUCKETS];
+	Variant* lru_front;
+	Variant* lru_back;
+	size_t bytes;
+} variants;
+
+static inline void variant_release(Variant* variant)
+{
+	if(__sync_sub_and_fetch(&variant->refs, 1) == 0)
+	{
+		es_free(&variant->body);
+		free(variant);
+	}
+}
+
+static inline void lru_unlink(Variant* variant)
+{
+	if(variant->lru_prev) variant->lru_prev->lru_next = variant->lru_next;
+	else variants.lru_front = variant->lru_next;
+	if(variant->lru_next) variant->lru_next->lru_prev = variant->lru_prev;
+	else variants.lru_back = variant->lru_prev;
+}
+
+static inline void lru_push_front(Variant* variant)
+{
+	variant->lru_prev = 0;
+	variant->lru_next = variants.lru_front;
+	if(variants.lru_front) variants.lru_front->lru_prev = variant;
+	else variants.lru_back = variant;
+	variants.lru_front = variant;
+}
+
+//The link pointing at a matching variant, or at the null ending its bucket
+static inline Variant** find_variant(uint64_t hash, uint32_t crc,
+	size_t length, ContentCoding coding)
+{
+	Variant** link = &variants.buckets[hash % VARIANT_BUCKETS];
+	while(*link && !((*link)->hash == hash && (*link)->crc == crc &&
+			(*link)->length == length && (*link)->coding == coding))
+		link = &(*link)->bucket_next;
+	return link;
+}
+
+//Take a variant out of the cache. Call with the lock.
+static inline void remove_variant(Variant** link)
+{
+	Variant* variant = *link;
+	*link = variant->bucket_next;
+	lru_unlink(variant);
+	variants.bytes -= sizeof(Variant) + variant->body.size;
+	variant_release(variant);
+}
+
+//Find a variant, and take a reference to it. Null if there isn't one.
+static Variant* variant_lookup(uint64_t hash, uint32_t crc, size_t length,
+	ContentCoding coding)
+{
+	pthread_mutex_lock(&variants.lock);
+
+	Variant* variant = *find_variant(hash, crc, length, coding);
+	if(variant)
+	{
+		lru_unlink(variant);
+		lru_push_front(variant);
+		__sync_add_and_fetch(&variant->refs, 1);
+	}
+
+	pthread_mutex_unlock(&variants.lock);
+	return variant;
+}
+
+//Keep a compressed body, which the cache takes ownership of
+static void variant_store(uint64_t hash, uint32_t crc, size_t length,
+	ContentCoding coding, String* body)
+{
+	size_t size = sizeof(Variant) + body->size;
+
+	//Don't let one object take over the cache
+	if(size > COMPRESS_CACHE_SIZE / 8)
+	{
+		es_free(body);
+		return;
+	}
+
+	Variant* variant = malloc(sizeof(Variant));
+	variant->hash = hash;
+	variant->crc = crc;
+	variant->length = length;
+	variant->coding = coding;
+	variant->body = es_move(body);
+	variant->refs = 1;
+
+	pthread_mutex_lock(&variants.lock);
+
+	//Someone else may have compressed it at the same time
+	Variant** link = find_variant(hash, crc, length, coding);
+	if(*link)
+		remove_variant(link);
+
+	while(variants.lru_back && variants.bytes + size > COMPRESS_CACHE_SIZE)
+	{
+		Variant* victim = variants.lru_back;
+		remove_variant(find_variant(victim->hash, victim->crc,
+			victim->length, victim->coding));
+	}
+
+	link = &variants.buckets[hash % VARIANT_BUCKETS];
+	variant->bucket_next = *link;
+	*link = variant;
+	lru_push_front(variant);
+	variants.bytes += size;
+
+	pthread_mutex_unlock(&variants.lock);
+}
+
+__attribute__((constructor (MODULE_COMPRESS_PRI)))
+void init_compression()
+{
+	if(DEBUG_PRINT) puts("Initializing compression");
+	memset(&variants, 0, sizeof(variants));
+	pthread_mutex_init(&variants.lock, 0);
+}
+
+__attribute__((destructor (MODULE_COMPRESS_PRI)))
+void deinit_compression()
+{
+	if(DEBUG_PRINT) puts("Clearing compressed variants");
+	for(int i = 0; i < VARIANT_BUCKETS; ++i)
+		while(variants.buckets[i])
+			remove_variant(&variants.buckets[i]);
+	pthread_mutex_destroy(&variants.lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// COMPRESSING
+///////////////////////////////////////////////////////////////////////////////
+
+//CPU time used by this thread, for the stats
+static inline unsigned long long cpu_nanoseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+//HTTP's deflate is the zlib format, not raw deflate
+static inline int start_deflate(z_stream* stream, ContentCoding coding)
+{
+	memset(stream, 0, sizeof(*stream));
+	int window_bits = coding == coding_gzip ? 15 + 16 : 15;
+	return deflateInit2(stream, COMPRESS_LEVEL, Z_DEFLATED, window_bits, 8,
+		Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+static inline StringRef coding_name(ContentCoding coding)
+{
+	return es_temp(coding == coding_gzip ? "gzip" : "deflate");
+}
+
+/*
+ * Rewrite a serialized response head for a compressed body. The length is
+ * the compressed length, or if chunked is set, there's a Transfer-Encoding
+ * instead; without either, the body ends when the connection closes. ETags
+ * are weakened, since the compressed bytes aren't the ones they were for,
+ * and ranges are off.
+ */
+static String coded_head(StringRef head, ContentCoding coding, bool chunked,
+	size_t length)
+{
+	const char* newline = memchr(head.begin, '\n', head.size);
+	size_t line_size = newline ? (size_t)(newline - head.begin) + 1 : head.size;
+
+	String result = es_copy(es_slice(head, 0, line_size));
+
+	StringRef text = es_slice(head, line_size, head.size);
+	StringRef line, name, value;
+	while(next_raw_header(&text, &line, &name, &value) == 0 && line.size)
+	{
+		HeaderID id = intern_header(name);
+		if(id == hdr_content_length || id == hdr_transfer_encoding ||
+				id == hdr_accept_ranges)
+			continue;
+
+		if(id == hdr_etag && !(value.size >= 2 && value.begin[0] == 'W' &&
+				value.begin[1] == '/'))
+		{
+			es_append(&result, es_temp("ETag: W/"));
+			es_append(&result, value);
+			es_append(&result, es_temp("\r\n"));
+			continue;
+		}
+
+		es_append(&result, line);
+	}
+
+	String framing = chunked ?
+		es_copy(es_temp("Transfer-Encoding: chunked\r\n")) :
+		length ? es_printf("Content-Length: %zu\r\n", length) :
+		es_empty_string;
+
+	es_append(&result, es_temp("Content-Encoding: "));
+	es_append(&result, coding_name(coding));
+	es_append(&result, es_temp("\r\n"));
+	es_append(&result, compress_vary_line());
+	es_append(&result, es_ref(&framing));
+	es_append(&result, es_temp("\r\n"));
+
+	es_free(&framing);
+	return result;
+}
+
+/*
+ * Send a head as it is, but for Vary: Accept-Encoding before its empty line,
+ * followed by a body
+ */
+static int write_identity(StringRef head, StringRef body, int fd)
+{
+	StringRef vary = compress_vary_line();
+	struct iovec parts[4] =
+	{
+		{ .iov_base = (void*)head.begin, .iov_len = head.size - 2 },
+		{ .iov_base = (void*)vary.begin, .iov_len = vary.size },
+		{ .iov_base = "\r\n", .iov_len = 2 },
+		{ .iov_base = (void*)body.begin, .iov_len = body.size },
+	};
+	return write_parts(fd, parts, 4);
+}
+
+//Compress a whole body at once. Returns 0, or -1 if it didn't compress.
+static int deflate_all(StringRef body, ContentCoding coding, size_t bound,
+	String* output)
+{
+	z_stream stream;
+	if(start_deflate(&stream, coding))
+		return -1;
+
+	char* buffer = malloc(bound);
+	stream.next_in = (Bytef*)body.begin;
+	stream.avail_in = body.size;
+	stream.next_out = (Bytef*)buffer;
+	stream.avail_out = bound;
+
+	unsigned long long start = cpu_nanoseconds();
+	int status = deflate(&stream, Z_FINISH);
+	unsigned long long cpu = cpu_nanoseconds() - start;
+
+	size_t size = stream.total_out;
+	deflateEnd(&stream);
+
+	stat_add_compressed(body.size, size, cpu);
+
+	//Not worth sending if it didn't get any smaller
+	if(status != Z_STREAM_END || size >= body.size)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	*output = es_move_cstrn(buffer, size);
+	return 0;
+}
+
+int compress_write(StringRef head, StringRef body, ContentCoding coding,
+	uint64_t hash, int fd)
+{
+	if(coding == coding_identity)
+		return write_identity(head, body, fd);
+
+	uint32_t crc = crc32(0, (const Bytef*)body.begin, body.size);
+
+	String compressed = es_empty_string;
+	StringRef output = es_temp(0);
+	size_t charged = 0;
+
+	Variant* variant = variant_lookup(hash, crc, body.size, coding);
+	if(variant)
+	{
+		output = es_ref(&variant->body);
+		stat_add_compress_reused(body.size, output.size);
+	}
+	else
+	{
+		//The deflate state and the whole output are held at once
+		z_stream sizing;
+		if(start_deflate(&sizing, coding) == 0)
+		{
+			size_t bound = deflateBound(&sizing, body.size);
+			deflateEnd(&sizing);
+
+			if(budget_acquire(bound))
+			{
+				charged = bound;
+				if(deflate_all(body, coding, bound, &compressed) == 0)
+					output = es_ref(&compressed);
+			}
+		}
+	}
+
+	int error;
+	if(output.size)
+	{
+		String new_head = coded_head(head, coding, false, output.size);
+		struct iovec parts[2] =
+		{
+			{ .iov_base = (void*)es_ref(&new_head).begin,
+				.iov_len = new_head.size },
+			{ .iov_base = (void*)output.begin, .iov_len = output.size },
+		};
+		error = write_parts(fd, parts, 2);
+		es_free(&new_head);
+	}
+	else
+	{
+		error = write_identity(head, body, fd);
+	}
+
+	if(variant)
+		variant_release(variant);
+	else if(compressed.size)
+		variant_store(hash, crc, body.size, coding, &compressed);
+
+	if(charged)
+		budget_release(charged);
+
+	return error;
+}
+
+//Send a piece of compressed output, as a chunk if chunked
+static inline int send_piece(int fd, char* data, size_t size, bool chunked)
+{
+	char chunk_line[32];
+	int line_size = snprintf(chunk_line, sizeof(chunk_line), "%zx\r\n", size);
+
+	struct iovec parts[3] =
+	{
+		{ .iov_base = chunk_line, .iov_len = line_size },
+		{ .iov_base = data, .iov_len = size },
+		{ .iov_base = "\r\n", .iov_len = 2 },
+	};
+	return chunked ? write_parts(fd, parts, 3) : write_parts(fd, parts + 1, 1);
+}
+
+//Run deflate, sending everything it produces
+static int deflate_out(z_stream* stream, int flush, char* out, int fd,
+	bool chunked, unsigned long long* cpu)
+{
+	do
+	{
+		stream->next_out = (Bytef*)out;
+		stream->avail_out = compress_chunk_size;
+
+		unsigned long long start = cpu_nanoseconds();
+		deflate(stream, flush);
+		*cpu += cpu_nanoseconds() - start;
+
+		size_t produced = compress_chunk_size - stream->avail_out;
+		if(produced && send_piece(fd, out, produced, chunked))
+			return connection_error;
+	} while(stream->avail_out == 0);
+
+	return 0;
+}
+
+/*
+ * Compress a body as it's relayed. Whenever the origin goes quiet, what's
+ * been compressed so far is flushed out, so a slowly generated page still
+ * reaches the client as it's made.
+ */
+static int compress_relay(StringRef head, size_t size, ContentCoding coding,
+	bool chunked, int from_fd, int to_fd)
+{
+	z_stream stream;
+	if(start_deflate(&stream, coding))
+		return connection_error;
+
+	char* in = buffer_borrow(compress_chunk_size);
+	char* out = buffer_borrow(compress_chunk_size);
+	unsigned long long cpu = 0;
+	int error = 0;
+
+	String new_head = coded_head(head, coding, chunked, 0);
+	struct iovec head_part = { .iov_base = (void*)es_ref(&new_head).begin,
+		.iov_len = new_head.size };
+	if(!in || !out || write_parts(to_fd, &head_part, 1))
+		error = connection_error;
+	es_free(&new_head);
+
+	bool unflushed = false;
+	while(!error && size)
+	{
+		size_t want = size < compress_chunk_size ? size : compress_chunk_size;
+		ssize_t amount = recv(from_fd, in, want, MSG_DONTWAIT);
+		if(amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if(unflushed)
+			{
+				error = deflate_out(&stream, Z_SYNC_FLUSH, out, to_fd, chunked,
+					&cpu);
+				unflushed = false;
+				if(error) break;
+			}
+			amount = fiber_recv(from_fd, in, want, 0);
+		}
+		if(amount <= 0)
+		{
+			error = connection_error;
+			break;
+		}
+
+		timer_progress(amount);
+		capture_bytes(from_fd, in, amount);
+		size -= amount;
+
+		stream.next_in = (Bytef*)in;
+		stream.avail_in = amount;
+		error = deflate_out(&stream, size ? Z_NO_FLUSH : Z_FINISH, out, to_fd,
+			chunked, &cpu);
+		unflushed = true;
+	}
+
+	if(!error && chunked)
+	{
+		struct iovec last_chunk = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+		if(write_parts(to_fd, &last_chunk, 1))
+			error = connection_error;
+	}
+
+	stat_add_compressed(stream.total_in, stream.total_out, cpu);
+
+	deflateEnd(&stream);
+	buffer_return(in, compress_chunk_size);
+	buffer_return(out, compress_chunk_size);
+	return error;
+}
+
+int compress_response(const HTTP_Message* request, HTTP_Message* response,
+	ContentCoding coding, int from_fd, int to_fd)
+{
+	String head = serialize_response_head(response);
+	int error;
+
+	if(coding == coding_identity)
+	{
+		error = write_identity(es_ref(&head), es_ref(&response->body), to_fd) ||
+			(response->unread_body &&
+			relay_body(response, from_fd, to_fd)) ? connection_error : 0;
+	}
+	//Chunked needs HTTP/1.1 on both sides. Otherwise it's close-delimited.
+	else if(response->unread_body)
+	{
+		bool chunked = request->request.http_version == '1' &&
+			response->response.http_version == '1';
+		error = compress_relay(es_ref(&head), response->unread_body, coding,
+			chunked, from_fd, to_fd);
+	}
+	else
+	{
+		String key = cache_key(request);
+		error = compress_write(es_ref(&head), es_ref(&response->body), coding,
+			cache_key_hash(es_ref(&key)), to_fd) ? connection_error : 0;
+		es_free(&key);
+	}
+
+	es_free(&head);
+	return error;
+}
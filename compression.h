@@ -0,0 +1,58 @@
+/*
+ * compression.h
+ *
+ *  Created on: Mar 21, 2014
+ *      Author: nathan
+ *
+ *  On-the-fly gzip and deflate of responses, for clients that ask for it.
+ *  Only uncompressed 200s with a COMPRESS_TYPES content type and at least
+ *  COMPRESS_MIN_SIZE bytes of body are touched. Buffered bodies are
+ *  compressed whole, and the results kept in a small LRU cache of compressed
+ *  variants, so a popular object is only compressed once. Relayed bodies are
+ *  compressed as they stream through, and sent chunked. The proxy's own
+ *  caches always hold the original, and compress on the way out.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+
+typedef enum { coding_identity, coding_gzip, coding_deflate } ContentCoding;
+
+/*
+ * The coding to send responses to a request in: the best one its
+ * Accept-Encoding allows, or identity
+ */
+ContentCoding compress_coding(const HTTP_Message* request);
+
+//True if a response is worth compressing, and allowed to be
+bool compress_eligible(const HTTP_Message* response);
+
+/*
+ * The header line every eligible response goes out with, compressed or not,
+ * since which coding it gets depends on the request's Accept-Encoding
+ */
+StringRef compress_vary_line();
+
+/*
+ * Send an eligible buffered response body compressed. head is the serialized
+ * response head, through the empty line; its framing headers are rewritten
+ * for the coding. hash identifies the object (its cache_key_hash) in the
+ * variant cache. With coding_identity, or if there's no room in the memory
+ * budget to compress, the response is sent as it is, but for the Vary line.
+ * Returns 0, or -1 if the write failed.
+ */
+int compress_write(StringRef head, StringRef body, ContentCoding coding,
+	uint64_t hash, int fd);
+
+/*
+ * Send an eligible response, written and relayed, to the client. Its unread
+ * body, if it has one, is read from from_fd and compressed as it arrives.
+ * coding may be identity, to send it as it is, but for the Vary line.
+ * Returns 0 or connection_error.
+ */
+int compress_response(const HTTP_Message* request, HTTP_Message* response,
+	ContentCoding coding, int from_fd, int to_fd);
@@ -21,6 +21,27 @@ const static unsigned long MAX_HEADER_SIZE = 1024 * 1024;
 //Max supported body size
 const static unsigned long MAX_BODY_SIZE = 1024 * 1024 * 1024;
 
+/*
+ * Bodies with a Content-Length over this are relayed from one connection to
+ * the other as they arrive, instead of being read into memory first. They
+ * aren't cached or collapsed.
+ */
+const static unsigned long MAX_BUFFERED_BODY_SIZE = 4 * 1024 * 1024;
+
+/*
+ * A relay stops reading from its source once this much is waiting to be
+ * written, and doesn't start again until it's drained to the low watermark.
+ * The high watermark is the size of each relay's buffer.
+ */
+const static unsigned long RELAY_HIGH_WATERMARK = 256 * 1024;
+const static unsigned long RELAY_LOW_WATERMARK = 64 * 1024;
+
+//Total bytes that in-flight bodies and relay buffers may hold at once
+const static unsigned long MEMORY_BUDGET = 256 * 1024 * 1024;
+
+//Milliseconds to wait for room in the budget before responding 503
+const static int MEMORY_BUDGET_WAIT = 2000;
+
 //Max size of a chunked encoding line
 const static unsigned long MAX_CHUNK_HEADER_SIZE = 1024;
 
@@ -30,9 +51,241 @@ const static unsigned long MAX_CHUNK_SIZE = 1024 * 1024;
 //Max number of headers
 const static int MAX_NUM_HEADERS = 1024;
 
+/*
+ * If true, header blocks are forwarded byte-for-byte, and only the well-known
+ * headers (the ones the proxy might look at or rewrite) are parsed out of
+ * them. If false, every header is validated with the header regex.
+ */
+const static int HEADER_PASSTHROUGH = 1;
+
+//Total size of the in-memory response cache. 0 disables it.
+const static unsigned long CACHE_SIZE = 64 * 1024 * 1024;
+
+//Number of independently locked cache shards. Must be a power of 2.
+#define CACHE_SHARDS 16
+
+//Largest response body the cache will store
+const static unsigned long CACHE_MAX_OBJECT_SIZE = 1024 * 1024;
+
+//Counters per row of each shard's frequency sketch. Must be a power of 2.
+#define CACHE_SKETCH_WIDTH 4096
+
+//Number of slots in the disk cache index. Must be a multiple of 4.
+const static unsigned long DISK_CACHE_SLOTS = 64 * 1024;
+
+//Largest response body the disk cache will store
+const static unsigned long DISK_CACHE_MAX_OBJECT_SIZE = 64 * 1024 * 1024;
+
+/*
+ * Response compression (see compression.h). Responses are compressed for
+ * clients that accept gzip or deflate if they're at least COMPRESS_MIN_SIZE
+ * bytes and their Content-Type starts with one of COMPRESS_TYPES, at zlib
+ * level COMPRESS_LEVEL (1-9). Up to COMPRESS_CACHE_SIZE bytes of compressed
+ * bodies are kept for reuse.
+ */
+const static int COMPRESS_RESPONSES = 1;
+const static int COMPRESS_LEVEL = 6;
+const static unsigned long COMPRESS_MIN_SIZE = 1024;
+const static unsigned long COMPRESS_CACHE_SIZE = 16 * 1024 * 1024;
+const static char* const COMPRESS_TYPES[] =
+{
+	"text/", "application/json", "application/javascript",
+	"application/xml", "application/xhtml+xml", "image/svg+xml", 0
+};
+
+//Most clients that can wait on one collapsed upstream fetch
+const static int COLLAPSE_MAX_WAITERS = 256;
+
+//Largest response that will be handed to waiting clients
+const static unsigned long COLLAPSE_MAX_RESPONSE_SIZE = 16 * 1024 * 1024;
+
+//Seconds a client waits on someone else's fetch before doing its own
+const static int COLLAPSE_WAIT_TIMEOUT = 30;
+
+//Most bytes of a filtered request that are read and thrown away
+const static unsigned long FILTER_DRAIN_LIMIT = 1024 * 1024;
+
+//Seconds to wait for the rest of a filtered request before just closing
+const static int FILTER_DRAIN_TIMEOUT = 1;
+
+//Milliseconds per tick of the connection timer wheel
+const static long TIMER_TICK_MS = 100;
+
+//Seconds a connection may take to send its request line
+const static unsigned long IDLE_TIMEOUT = 30;
+
+//Seconds a client may take to send all its request headers
+const static unsigned long HEADER_TIMEOUT = 10;
+
+/*
+ * Bodies must keep moving at MIN_TRANSFER_RATE bytes per second, averaged
+ * over each TRANSFER_WINDOW seconds, in either direction.
+ */
+const static unsigned long MIN_TRANSFER_RATE = 1024;
+const static unsigned long TRANSFER_WINDOW = 10;
+
+//Seconds to connect to an origin and get the head of its response
+const static unsigned long UPSTREAM_TIMEOUT = 30;
+
+//Seconds a CONNECT tunnel may go without moving a byte
+const static unsigned long TUNNEL_IDLE_TIMEOUT = 300;
+
+//Capacity of each of a tunnel's two pipes
+const static unsigned long TUNNEL_PIPE_SIZE = 256 * 1024;
+
+/*
+ * Ports CONNECT can open tunnels to. Anything else gets a 403, so the proxy
+ * can't be used as a relay to mail servers or other internal services.
+ */
+const static unsigned short CONNECT_PORTS[] = { 443 };
+
+/*
+ * The io_uring backend (-b uring). Each relay, and each direction of a
+ * tunnel, receives into URING_BUFFERS buffers of URING_BUFFER_SIZE bytes.
+ * URING_BUFFERS must be a power of 2. URING_ENTRIES is the submission queue
+ * size of each ring. Up to URING_POOLED_RINGS rings, with their buffers, are
+ * kept between relays instead of being set up again each time.
+ */
+#define URING_BUFFERS 16
+const static unsigned long URING_BUFFER_SIZE = 16 * 1024;
+const static unsigned URING_ENTRIES = 64;
+const static unsigned URING_POOLED_RINGS = 16;
+
+/*
+ * Fibers (-f). Each fiber's stack is FIBER_STACK_SIZE bytes of address space,
+ * plus a guard page; only the pages it touches take memory. Each scheduler
+ * keeps up to FIBER_STACK_CACHE finished stacks for reuse, and takes up to
+ * FIBER_EVENTS events from epoll at a time. A stack and its guard page are
+ * two kernel mappings, so beyond about 30,000 fibers, vm.max_map_count has to
+ * be raised. Calls that can only block (DNS lookups) run on at most
+ * FIBER_HELPERS helper threads, queueing when they're all busy, and a helper
+ * with nothing to do for FIBER_HELPER_IDLE seconds exits.
+ */
+const static unsigned long FIBER_STACK_SIZE = 64 * 1024;
+#define FIBER_STACK_CACHE 256
+#define FIBER_EVENTS 256
+const static int FIBER_HELPERS = 8;
+const static int FIBER_HELPER_IDLE = 10;
+
+/*
+ * Connection state comes from slabs (see slab.h), which grow by
+ * SLAB_CHUNK_SIZE bytes at a time.
+ */
+const static unsigned long SLAB_CHUNK_SIZE = 64 * 1024;
+
+/*
+ * Pooled I/O buffers (see buffer_pool.h). There are BUFFER_POOL_TIERS sizes,
+ * starting at BUFFER_POOL_SMALLEST and going up by 4 times each, so the top
+ * tier should be at least RELAY_HIGH_WATERMARK. Each tier grows by
+ * BUFFER_POOL_CHUNK_SIZE bytes at a time. If BUFFER_POOL_HUGE_PAGES is true,
+ * chunks are backed by huge pages where the kernel can give them, which
+ * saves TLB misses on busy relays but makes every chunk resident.
+ */
+#define BUFFER_POOL_TIERS 4
+const static unsigned long BUFFER_POOL_SMALLEST = 4 * 1024;
+const static unsigned long BUFFER_POOL_CHUNK_SIZE = 2 * 1024 * 1024;
+const static int BUFFER_POOL_HUGE_PAGES = 0;
+
+/*
+ * HTTP/2 upstreams (-2). Each configured origin gets one connection, with up
+ * to H2_MAX_STREAMS requests in flight on it (fewer if the origin says so).
+ * Each stream's receive window is H2_STREAM_WINDOW bytes; the connection's is
+ * big enough for every stream's. H2_HEADER_TABLE_SIZE is the HPACK dynamic
+ * table the origin may use to compress response headers.
+ */
+#define H2_MAX_STREAMS 100
+const static unsigned long H2_STREAM_WINDOW = 256 * 1024;
+const static unsigned long H2_HEADER_TABLE_SIZE = 4096;
+
+/*
+ * Hot upgrades (SIGHUP). The new process has UPGRADE_READY_TIMEOUT seconds to
+ * start accepting, or it's killed and the old one carries on. Once it is, the
+ * old one's connections get UPGRADE_DRAIN_TIMEOUT seconds to finish.
+ */
+const static unsigned long UPGRADE_READY_TIMEOUT = 10;
+const static unsigned long UPGRADE_DRAIN_TIMEOUT = 60;
+
+/*
+ * CPU placement (-a). With AFFINITY_INCOMING_CPU, each connection stays on
+ * the NUMA node of the CPU that received it (SO_INCOMING_CPU); without, they
+ * take turns. Nodes past AFFINITY_MAX_NODES are treated as node 0.
+ */
+const static int AFFINITY_INCOMING_CPU = 1;
+#define AFFINITY_MAX_NODES 8
+
+/*
+ * Per-client limits (-l). Clients are spread over CLIENT_LIMIT_SHARDS locks,
+ * each with a table of CLIENT_LIMIT_BUCKETS chains, and forgotten once idle
+ * with nothing open for CLIENT_IDLE_TIMEOUT seconds.
+ */
+#define CLIENT_LIMIT_SHARDS 64
+#define CLIENT_LIMIT_BUCKETS 256
+const static unsigned long CLIENT_IDLE_TIMEOUT = 60;
+
+/*
+ * Choosing between an origin's addresses; see balancer.h. Each new latency
+ * sample gets UPSTREAM_EWMA_WEIGHT in the average. UPSTREAM_EJECT_FAILURES
+ * failures in a row take an address out for UPSTREAM_EJECT_TIME seconds. A
+ * failed connect moves on to another address, for UPSTREAM_CONNECT_ATTEMPTS
+ * tries in all. An address not picked for UPSTREAM_REPROBE_TIME seconds gets
+ * another try, and one unused for UPSTREAM_IDLE_TIMEOUT seconds is forgotten.
+ */
+const static double UPSTREAM_EWMA_WEIGHT = 0.3;
+const static unsigned UPSTREAM_EJECT_FAILURES = 2;
+const static unsigned long UPSTREAM_EJECT_TIME = 10;
+const static int UPSTREAM_CONNECT_ATTEMPTS = 2;
+const static unsigned long UPSTREAM_REPROBE_TIME = 5;
+const static unsigned long UPSTREAM_IDLE_TIMEOUT = 300;
+#define UPSTREAM_TABLE_BUCKETS 1024
+
+/*
+ * Reverse proxying (-r); see reverse_proxy.h. Every REVERSE_HEALTH_INTERVAL
+ * seconds each backend is sent GET REVERSE_HEALTH_PATH, and has
+ * REVERSE_HEALTH_TIMEOUT seconds to answer 2xx or 3xx. REVERSE_HEALTH_FALL
+ * failures in a row take it out, and REVERSE_HEALTH_RISE passes bring it
+ * back, ramping up to its full share of requests over REVERSE_SLOW_START
+ * seconds.
+ */
+const static char REVERSE_HEALTH_PATH[] = "/";
+const static unsigned long REVERSE_HEALTH_INTERVAL = 5;
+const static unsigned long REVERSE_HEALTH_TIMEOUT = 2;
+const static unsigned REVERSE_HEALTH_FALL = 2;
+const static unsigned REVERSE_HEALTH_RISE = 2;
+const static unsigned long REVERSE_SLOW_START = 30;
+
+//Most bytes captured from each side of a connection; see capture.h
+const static unsigned long CAPTURE_MAX_MESSAGE = 16 * 1024 * 1024;
+
+/*
+ * Socket tuning. Any of these can be 0 to leave the kernel default alone.
+ *   SOCKET_REUSEADDR: let a restarted proxy bind its port right away
+ *   SOCKET_FASTOPEN_QUEUE: accept TCP Fast Open from clients, with this many
+ *     pending. The kernel also needs net.ipv4.tcp_fastopen & 2.
+ *   SOCKET_FASTOPEN_CONNECT: use Fast Open to origins and backends (not for
+ *     tunnels). Needs tcp_fastopen & 1.
+ *   SOCKET_DEFER_ACCEPT: seconds the kernel holds a connection until its
+ *     first data arrives, before handing it to accept anyway
+ *   SOCKET_NODELAY: disable Nagle on client and origin connections
+ *   SOCKET_NOTSENT_LOWAT: most unsent bytes to queue in a socket
+ *   SOCKET_SEND_BUFFER, SOCKET_RECEIVE_BUFFER: fixed buffer sizes. Setting
+ *     these turns off the kernel's buffer autotuning.
+ */
+const static int LISTEN_BACKLOG = 1024;
+const static int SOCKET_REUSEADDR = 1;
+const static int SOCKET_FASTOPEN_QUEUE = 256;
+const static int SOCKET_FASTOPEN_CONNECT = 1;
+const static int SOCKET_DEFER_ACCEPT = 5;
+const static int SOCKET_NODELAY = 1;
+const static int SOCKET_NOTSENT_LOWAT = 128 * 1024;
+const static int SOCKET_SEND_BUFFER = 0;
+const static int SOCKET_RECEIVE_BUFFER = 0;
+
 //If true, debug prints will be sent
 const static int DEBUG_PRINT = 1;
 
+//If 1, the USDT tracing probes in probes.h are compiled in
+#define TRACE_PROBES 1
+
 //If true, thread IDs will be added to print output
 const static int PRINT_TID = 0;
 
@@ -40,5 +293,24 @@ const static int PRINT_TID = 0;
 #define MODULE_STAT_PRI 101
 #define MODULE_FILTER_PRI 101
 #define MODULE_HTTP_REGEX_PRI 101
+#define MODULE_HTTP_INTERN_PRI 101
+#define MODULE_CACHE_PRI 101
+#define MODULE_DISK_CACHE_PRI 101
+#define MODULE_COLLAPSE_PRI 101
+#define MODULE_BUDGET_PRI 101
+#define MODULE_CAPTURE_PRI 101
+#define MODULE_BUFFER_POOL_PRI 101
+#define MODULE_COMPRESS_PRI 101
+#define MODULE_HPACK_PRI 101
+#define MODULE_UPGRADE_PRI 101
+#define MODULE_AFFINITY_PRI 101
+#define MODULE_CLIENT_LIMIT_PRI 101
+#define MODULE_BALANCER_PRI 101
+#define MODULE_URING_PRI 105
 #define MODULE_PRINT_PRI 110
+#define MODULE_TIMER_PRI 110
+#define MODULE_HTTP_WORKER_PRI 120
+#define MODULE_H2_PRI 150
+#define MODULE_REVERSE_PRI 150
+#define MODULE_FIBER_PRI 190
 #define MODULE_HTTP_MANAGE_PRI 200
@@ -0,0 +1,683 @@
+/*
+ * disk_cache.c
+ *
+ *  Created on: Mar 8, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "disk_cache.h"
+#include "cache_policy.h"
+#include "print_thread.h"
+#include "stat_tracking.h"
+#include "memory_budget.h"
+#include "timer_wheel.h"
+#include "fiber.h"
+#include "config.h"
+
+/*
+ * The index is a header followed by DISK_CACHE_SLOTS slots, grouped into sets
+ * of SLOTS_PER_SET. A key can only live in the set its hash picks, and when a
+ * set is full the oldest entry in it is replaced. Each set is protected by
+ * one of a handful of striped locks.
+ *
+ * A content file is named after its hash and a generation number (unique for
+ * every store), and contains, back to back: the key, the Vary header, the
+ * request's values for the Vary'd headers, the response head (without its
+ * empty line), and the body.
+ */
+#define SLOTS_PER_SET 4
+#define DISK_CACHE_LOCKS 64
+#define INDEX_MAGIC 0x4e50436163686521ull
+#define INDEX_VERSION 3
+
+typedef struct
+{
+	uint64_t magic;
+	uint64_t version;
+	uint64_t num_slots;
+	uint64_t reserved;
+} DiskIndexHeader;
+
+typedef struct
+{
+	uint64_t hash; //0 means the slot is empty. Written last.
+	uint64_t generation;
+	int64_t stored_at;
+	int64_t expires;
+	int64_t initial_age;
+	uint64_t body_size;
+	uint32_t key_size;
+	uint32_t vary_names_size;
+	uint32_t vary_values_size;
+	uint32_t head_size;
+	uint32_t compressible; //1 if compress_eligible, so hits can be compressed
+	uint32_t status; //The response's, for the log and probes
+} DiskSlot;
+
+static struct
+{
+	bool open;
+	bool handed_off;
+	int users; //Lookups and stores under way
+	String directory;
+
+	int index_fd;
+	size_t index_size;
+	DiskIndexHeader* header;
+	DiskSlot* slots;
+
+	pthread_mutex_t locks[DISK_CACHE_LOCKS];
+	uint64_t next_generation;
+} disk_cache;
+
+///////////////////////////////////////////////////////////////////////////////
+// SLOTS AND FILES
+///////////////////////////////////////////////////////////////////////////////
+
+static inline size_t set_of(uint64_t hash)
+{
+	return (hash >> 8) % (DISK_CACHE_SLOTS / SLOTS_PER_SET);
+}
+
+static inline pthread_mutex_t* set_lock(size_t set)
+{
+	return &disk_cache.locks[set % DISK_CACHE_LOCKS];
+}
+
+static inline DiskSlot* set_slots(size_t set)
+{
+	return &disk_cache.slots[set * SLOTS_PER_SET];
+}
+
+//Everything before the head in a content file
+static inline size_t slot_meta_size(const DiskSlot* slot)
+{
+	return (size_t)slot->key_size + slot->vary_names_size +
+		slot->vary_values_size;
+}
+
+static inline size_t slot_file_size(const DiskSlot* slot)
+{
+	return slot_meta_size(slot) + slot->head_size + slot->body_size;
+}
+
+//The path of the content file for a slot. Buffer must be PATH_MAX.
+static inline void slot_path(char* buffer, const DiskSlot* slot,
+	const char* suffix)
+{
+	snprintf(buffer, PATH_MAX, "%.*s/%016llx-%llu%s",
+		ES_STRINGPRINT(&disk_cache.directory),
+		(unsigned long long)slot->hash,
+		(unsigned long long)slot->generation,
+		suffix);
+}
+
+static inline void unlink_slot_file(const DiskSlot* slot)
+{
+	char path[PATH_MAX];
+	slot_path(path, slot, "");
+	unlink(path);
+}
+
+//Write a whole buffer to a file
+static inline int read_all(int fd, char* buffer, size_t size, off_t offset)
+{
+	while(size)
+	{
+		ssize_t amount = pread(fd, buffer, size, offset);
+		if(amount < 0 && errno == EINTR)
+			continue;
+		if(amount <= 0)
+			return -1;
+		buffer += amount;
+		size -= amount;
+		offset += amount;
+	}
+	return 0;
+}
+
+static inline int write_all(int fd, StringRef data)
+{
+	while(data.size)
+	{
+		ssize_t written = write(fd, data.begin, data.size);
+		if(written < 0)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		data = es_slice(data, written, data.size);
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// INIT
+///////////////////////////////////////////////////////////////////////////////
+
+//Drop every slot whose file is gone, damaged, or expired
+static inline void load_index()
+{
+	time_t now = time(0);
+	unsigned loaded = 0;
+
+	for(size_t i = 0; i < DISK_CACHE_SLOTS; ++i)
+	{
+		DiskSlot* slot = &disk_cache.slots[i];
+		if(!slot->hash)
+			continue;
+
+		char path[PATH_MAX];
+		slot_path(path, slot, "");
+
+		struct stat file_info;
+		bool valid = slot->expires > now &&
+			stat(path, &file_info) == 0 &&
+			(size_t)file_info.st_size == slot_file_size(slot);
+
+		if(slot->generation >= disk_cache.next_generation)
+			disk_cache.next_generation = slot->generation + 1;
+
+		if(valid)
+		{
+			++loaded;
+		}
+		else
+		{
+			unlink(path);
+			memset(slot, 0, sizeof(DiskSlot));
+		}
+	}
+
+	/*
+	 * Stores that were cut short by a crash leave their temporary files
+	 * behind. Only one process writes the cache at a time, so any there now
+	 * are dead.
+	 */
+	DIR* directory = opendir(es_cstrc(&disk_cache.directory));
+	struct dirent* entry;
+	while(directory && (entry = readdir(directory)))
+	{
+		size_t length = strlen(entry->d_name);
+		if(length > 4 && strcmp(entry->d_name + length - 4, ".tmp") == 0)
+			unlinkat(dirfd(directory), entry->d_name, 0);
+	}
+	if(directory)
+		closedir(directory);
+
+	submit_debug(es_printf("Disk cache: loaded %u entries", loaded));
+}
+
+int disk_cache_open(const char* directory)
+{
+	if(mkdir(directory, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	disk_cache.directory = es_copy(es_temp(directory));
+
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/index", directory);
+	disk_cache.index_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(disk_cache.index_fd < 0)
+	{
+		es_free(&disk_cache.directory);
+		return -1;
+	}
+
+	//An index of the wrong size is thrown out and started over
+	disk_cache.index_size = sizeof(DiskIndexHeader) +
+		DISK_CACHE_SLOTS * sizeof(DiskSlot);
+
+	struct stat index_info;
+	fstat(disk_cache.index_fd, &index_info);
+	if((size_t)index_info.st_size != disk_cache.index_size)
+	{
+		if(ftruncate(disk_cache.index_fd, 0) < 0 ||
+				ftruncate(disk_cache.index_fd, disk_cache.index_size) < 0)
+		{
+			close(disk_cache.index_fd);
+			es_free(&disk_cache.directory);
+			return -1;
+		}
+	}
+
+	void* index = mmap(0, disk_cache.index_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, disk_cache.index_fd, 0);
+	if(index == MAP_FAILED)
+	{
+		close(disk_cache.index_fd);
+		es_free(&disk_cache.directory);
+		return -1;
+	}
+
+	disk_cache.header = index;
+	disk_cache.slots = (DiskSlot*)(disk_cache.header + 1);
+
+	//Same for one from an incompatible version
+	if(disk_cache.header->magic != INDEX_MAGIC ||
+			disk_cache.header->version != INDEX_VERSION ||
+			disk_cache.header->num_slots != DISK_CACHE_SLOTS)
+	{
+		memset(index, 0, disk_cache.index_size);
+		disk_cache.header->magic = INDEX_MAGIC;
+		disk_cache.header->version = INDEX_VERSION;
+		disk_cache.header->num_slots = DISK_CACHE_SLOTS;
+	}
+
+	disk_cache.next_generation = 1;
+	load_index();
+
+	disk_cache.open = true;
+	return 0;
+}
+
+__attribute__((constructor (MODULE_DISK_CACHE_PRI)))
+void init_disk_cache()
+{
+	for(int i = 0; i < DISK_CACHE_LOCKS; ++i)
+		pthread_mutex_init(&disk_cache.locks[i], 0);
+}
+
+__attribute__((destructor (MODULE_DISK_CACHE_PRI)))
+void deinit_disk_cache()
+{
+	if(disk_cache.open)
+	{
+		if(DEBUG_PRINT) puts("Closing disk cache");
+		msync(disk_cache.header, disk_cache.index_size, MS_SYNC);
+		munmap(disk_cache.header, disk_cache.index_size);
+		close(disk_cache.index_fd);
+		es_free(&disk_cache.directory);
+		disk_cache.open = false;
+	}
+
+	for(int i = 0; i < DISK_CACHE_LOCKS; ++i)
+		pthread_mutex_destroy(&disk_cache.locks[i]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LOOKUP
+///////////////////////////////////////////////////////////////////////////////
+
+//Find a fresh slot for a hash, and copy it out. False if there isn't one.
+static inline bool find_slot(uint64_t hash, DiskSlot* result)
+{
+	size_t set = set_of(hash);
+	bool found = false;
+	time_t now = time(0);
+
+	pthread_mutex_lock(set_lock(set));
+	DiskSlot* slots = set_slots(set);
+	for(int i = 0; i < SLOTS_PER_SET; ++i)
+	{
+		if(slots[i].hash == hash && slots[i].expires > now)
+		{
+			*result = slots[i];
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(set_lock(set));
+
+	return found;
+}
+
+//The Age line, with the empty line after it. Returns its size.
+static inline int age_line(char* line, size_t size, const DiskSlot* slot)
+{
+	long age = slot->initial_age + (time(0) - slot->stored_at);
+	return snprintf(line, size, "Age: %ld\r\n\r\n", age);
+}
+
+//Send the head and Age, then sendfile the body
+static inline int send_from_file(int fd, int file, const DiskSlot* slot,
+	StringRef head, bool head_only)
+{
+	char age[64];
+	int age_size = age_line(age, sizeof(age), slot);
+
+	//Cork, so the head goes out in the same segments as the body
+	int cork = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+	//Eligible responses vary on Accept-Encoding even when sent as they are
+	StringRef vary = slot->compressible ? compress_vary_line() : es_temp(0);
+	struct iovec parts[3] =
+	{
+		{ .iov_base = (void*)head.begin, .iov_len = head.size },
+		{ .iov_base = (void*)vary.begin, .iov_len = vary.size },
+		{ .iov_base = age, .iov_len = age_size },
+	};
+	int error = write_parts(fd, parts, 3);
+
+	/*
+	 * Non-blocking, waiting for room with poll, so each partial send counts
+	 * as progress for the connection timer.
+	 */
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	off_t offset = slot_meta_size(slot) + slot->head_size;
+	size_t remaining = head_only ? 0 : slot->body_size;
+	while(!error && remaining)
+	{
+		ssize_t sent = sendfile(fd, file, &offset, remaining);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			struct pollfd writable = { .fd = fd, .events = POLLOUT };
+			fiber_poll(&writable, 1, -1);
+			continue;
+		}
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			error = -1;
+		else
+		{
+			timer_progress(sent);
+			remaining -= sent;
+		}
+	}
+
+	fcntl(fd, F_SETFL, flags);
+
+	cork = 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	return error;
+}
+
+/*
+ * Read the body into memory and send it compressed, through the variant
+ * cache like any other cached object. Returns 0, -1 if the write failed, or 1
+ * if it couldn't be read, so it should be sent from the file instead.
+ */
+static inline int compress_from_file(int fd, int file, const DiskSlot* slot,
+	StringRef head, ContentCoding coding)
+{
+	if(!budget_acquire(slot->body_size))
+		return 1;
+
+	char* body = malloc(slot->body_size);
+	int result = 1;
+	if(read_all(file, body, slot->body_size,
+			slot_meta_size(slot) + slot->head_size) == 0)
+	{
+		char age[64];
+		int age_size = age_line(age, sizeof(age), slot);
+		String full_head = es_copy(head);
+		es_append(&full_head, es_tempn(age, age_size));
+
+		result = compress_write(es_ref(&full_head),
+			es_tempn(body, slot->body_size), coding, slot->hash, fd);
+		es_free(&full_head);
+	}
+
+	free(body);
+	budget_release(slot->body_size);
+	return result;
+}
+
+static int serve_from_disk(const HTTP_Message* request, int fd,
+	bool head_only, ContentCoding coding, CacheServed* served)
+{
+	String key = cache_key(request);
+	DiskSlot slot;
+	if(!find_slot(cache_key_hash(es_ref(&key)), &slot))
+	{
+		es_free(&key);
+		return 0;
+	}
+
+	char path[PATH_MAX];
+	slot_path(path, &slot, "");
+	int file = open(path, O_RDONLY);
+	if(file < 0)
+	{
+		es_free(&key);
+		return 0;
+	}
+
+	//Read everything up to the body, and make sure it's really our key
+	size_t prefix_size = slot_meta_size(&slot) + slot.head_size;
+	char* prefix = malloc(prefix_size);
+	int result = 0;
+
+	#define RETURN(CODE) { free(prefix); close(file); es_free(&key); \
+		return (CODE); }
+
+	if(pread(file, prefix, prefix_size, 0) != (ssize_t)prefix_size)
+		RETURN(0)
+
+	StringRef stored = es_tempn(prefix, prefix_size);
+	StringRef stored_key = es_slice(stored, 0, slot.key_size);
+	StringRef vary_names = es_slice(stored, slot.key_size,
+		slot.vary_names_size);
+	StringRef vary_values = es_slice(stored,
+		slot.key_size + slot.vary_names_size, slot.vary_values_size);
+	StringRef head = es_slice(stored, slot_meta_size(&slot), slot.head_size);
+
+	if(es_compare(stored_key, es_ref(&key)) != 0)
+		RETURN(0)
+
+	if(vary_names.size)
+	{
+		String request_values = cache_vary_values(request, vary_names);
+		bool variant_match = es_compare(es_ref(&request_values),
+			vary_values) == 0;
+		es_free(&request_values);
+		if(!variant_match)
+			RETURN(0)
+	}
+
+	served->status = slot.status;
+	served->body_size = head_only ? 0 : slot.body_size;
+
+	//Compressing means reading it in; sendfile is only for the original
+	int error = 1;
+	if(slot.compressible && !head_only && coding != coding_identity)
+		error = compress_from_file(fd, file, &slot, head, coding);
+	if(error == 1)
+		error = send_from_file(fd, file, &slot, head, head_only);
+
+	result = error ? -1 : 1;
+	if(result == 1) stat_add_disk_cache_hit();
+
+	RETURN(result)
+	#undef RETURN
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// STORE
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Put a slot in its set, replacing one with the same hash, an empty or expired
+ * one, or failing those, the oldest. The replaced slot's file is removed.
+ */
+static inline void insert_slot(const DiskSlot* new_slot)
+{
+	size_t set = set_of(new_slot->hash);
+	time_t now = time(0);
+	DiskSlot old_slot;
+
+	pthread_mutex_lock(set_lock(set));
+
+	DiskSlot* slots = set_slots(set);
+	DiskSlot* target = &slots[0];
+	for(int i = 0; i < SLOTS_PER_SET; ++i)
+	{
+		if(slots[i].hash == new_slot->hash || !slots[i].hash ||
+				slots[i].expires <= now)
+		{
+			target = &slots[i];
+			break;
+		}
+		if(slots[i].stored_at < target->stored_at)
+			target = &slots[i];
+	}
+	old_slot = *target;
+
+	//Mark it empty while it's being filled in, so a crash can't leave junk
+	target->hash = 0;
+	__sync_synchronize();
+	DiskSlot filled = *new_slot;
+	filled.hash = 0;
+	*target = filled;
+	__sync_synchronize();
+	target->hash = new_slot->hash;
+
+	pthread_mutex_unlock(set_lock(set));
+
+	if(old_slot.hash)
+		unlink_slot_file(&old_slot);
+}
+
+static void store_to_disk(const HTTP_Message* request, HTTP_Message* response)
+{
+	if(response->body.size > DISK_CACHE_MAX_OBJECT_SIZE)
+		return;
+
+	CacheLifetime lifetime;
+	if(!cache_response_allowed(request, response, &lifetime))
+		return;
+
+	//Head without the empty line, so Age can go on the end
+	remove_header(response, header_id_name(hdr_age));
+	String head = serialize_response_head(response);
+	StringRef head_ref = es_slice(es_ref(&head), 0, head.size - 2);
+
+	String key = cache_key(request);
+	const HTTP_Header* vary = find_header_id(response, hdr_vary);
+	StringRef vary_names = vary ? vary->value : es_temp(0);
+	String vary_values = vary ?
+		cache_vary_values(request, vary_names) : es_empty_string;
+
+	DiskSlot slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.hash = cache_key_hash(es_ref(&key));
+	slot.generation = __sync_fetch_and_add(&disk_cache.next_generation, 1);
+	slot.stored_at = time(0);
+	slot.expires = lifetime.expires;
+	slot.initial_age = lifetime.initial_age;
+	slot.body_size = response->body.size;
+	slot.key_size = key.size;
+	slot.vary_names_size = vary_names.size;
+	slot.vary_values_size = vary_values.size;
+	slot.head_size = head_ref.size;
+	slot.compressible = compress_eligible(response);
+	slot.status = response->response.status;
+
+	//Write it to a temporary file, and only rename it into place when done
+	char temp_path[PATH_MAX], path[PATH_MAX];
+	slot_path(temp_path, &slot, ".tmp");
+	slot_path(path, &slot, "");
+
+	int file = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool written = file >= 0 &&
+		write_all(file, es_ref(&key)) == 0 &&
+		write_all(file, vary_names) == 0 &&
+		write_all(file, es_ref(&vary_values)) == 0 &&
+		write_all(file, head_ref) == 0 &&
+		write_all(file, es_ref(&response->body)) == 0;
+	if(file >= 0 && close(file) < 0)
+		written = false;
+
+	if(written && rename(temp_path, path) == 0)
+	{
+		insert_slot(&slot);
+		stat_add_disk_cache_store();
+	}
+	else
+	{
+		unlink(temp_path);
+	}
+
+	es_free(&head);
+	es_free(&key);
+	es_free(&vary_values);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// USE AND HAND-OFF
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Count a lookup or store as under way, if the cache is open, so a hand-off
+ * can wait for it. Pair with done_using.
+ */
+static inline bool start_using()
+{
+	__atomic_add_fetch(&disk_cache.users, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&disk_cache.open, __ATOMIC_SEQ_CST))
+		return true;
+	__atomic_sub_fetch(&disk_cache.users, 1, __ATOMIC_SEQ_CST);
+	return false;
+}
+
+static inline void done_using()
+{
+	__atomic_sub_fetch(&disk_cache.users, 1, __ATOMIC_SEQ_CST);
+}
+
+int disk_cache_serve(const HTTP_Message* request, int fd, bool head_only,
+	ContentCoding coding, CacheServed* served)
+{
+	if(!start_using())
+		return 0;
+	int result = serve_from_disk(request, fd, head_only, coding, served);
+	done_using();
+	return result;
+}
+
+void disk_cache_store(const HTTP_Message* request, HTTP_Message* response)
+{
+	if(!start_using())
+		return;
+	store_to_disk(request, response);
+	done_using();
+}
+
+void disk_cache_hand_off()
+{
+	if(!__atomic_exchange_n(&disk_cache.open, false, __ATOMIC_SEQ_CST))
+		return;
+	disk_cache.handed_off = true;
+
+	//The index stays mapped until exit; it's just not touched any more
+	struct timespec wait = { .tv_sec = 0, .tv_nsec = 1000000 };
+	while(__atomic_load_n(&disk_cache.users, __ATOMIC_SEQ_CST))
+		nanosleep(&wait, 0);
+}
+
+void disk_cache_take_back()
+{
+	if(!disk_cache.handed_off)
+		return;
+	disk_cache.handed_off = false;
+
+	//The process that failed to take over may have stored entries meanwhile
+	for(size_t i = 0; i < DISK_CACHE_SLOTS; ++i)
+		if(disk_cache.slots[i].generation >= disk_cache.next_generation)
+			disk_cache.next_generation = disk_cache.slots[i].generation + 1;
+
+	__atomic_store_n(&disk_cache.open, true, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,49 @@
+/*
+ * disk_cache.h
+ *
+ *  Created on: Mar 8, 2014
+ *      Author: nathan
+ *
+ *  The on-disk response cache. Each stored response is a content file in the
+ *  cache directory holding its key, the serialized response head, and the
+ *  body; an index file of fixed-size slots, memory-mapped, says what's where.
+ *  Because the index is just a file, a restarted proxy picks up right where
+ *  the last one left off. Hits are sent with the head from the file followed
+ *  by sendfile() of the body, so the body never passes through user space;
+ *  the exception is a hit to be compressed, which is read in and goes through
+ *  the compressed variant cache like a memory hit.
+ *
+ *  It's only used if a directory is given with disk_cache_open.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "http.h"
+#include "compression.h"
+#include "cache_policy.h"
+
+//Open (or create) the cache in a directory, and load its index. 0 on success.
+int disk_cache_open(const char* directory);
+
+/*
+ * Try to answer a request from the disk cache, compressed with coding if
+ * it's eligible. Returns 1 if the response was sent, 0 on a miss, and -1 if
+ * sending the response failed. Fills in served unless it's a miss.
+ */
+int disk_cache_serve(const HTTP_Message* request, int fd, bool head_only,
+	ContentCoding coding, CacheServed* served);
+
+//Store the response to a request, if the cache policy allows it
+void disk_cache_store(const HTTP_Message* request, HTTP_Message* response);
+
+/*
+ * Stop using the cache, so a new process can take it over (see upgrade.h).
+ * Returns once the lookups and stores already under way have finished, so
+ * only one process ever writes the index and the entry files.
+ */
+void disk_cache_hand_off();
+
+//Start using the cache again, because the new process never took over
+void disk_cache_take_back();
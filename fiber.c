@@ -0,0 +1,802 @@
+/*
+ * fiber.c
+ *
+ *  Created on: Mar 19, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For MAP_STACK
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "fiber.h"
+#include "print_thread.h"
+#include "affinity.h"
+#include "config.h"
+
+typedef struct fiber Fiber;
+typedef struct scheduler Scheduler;
+
+///////////////////////////////////////////////////////////////////////////////
+// CONTEXT SWITCHING
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__x86_64__)
+
+/*
+ * A context is just a stack pointer. fiber_switch pushes the callee-saved
+ * registers (and the SSE and x87 control words) onto the current stack,
+ * saves the stack pointer, loads the other one and pops the same things back
+ * off it. Everything else is saved by the caller, as for any function call.
+ */
+typedef void* FiberContext;
+
+void fiber_switch(FiberContext* from, FiberContext* to)
+	__attribute__((visibility("hidden")));
+void fiber_entry() __attribute__((visibility("hidden")));
+void fiber_main(Fiber* fiber) __attribute__((visibility("hidden"), noreturn));
+
+__asm__(
+	".text\n"
+	".globl fiber_switch\n"
+	".hidden fiber_switch\n"
+	".type fiber_switch, @function\n"
+	"fiber_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size fiber_switch, .-fiber_switch\n"
+
+	//A new fiber's first switch "returns" here, with the fiber in r12
+	".globl fiber_entry\n"
+	".hidden fiber_entry\n"
+	".type fiber_entry, @function\n"
+	"fiber_entry:\n"
+	"	movq %r12, %rdi\n"
+	"	call fiber_main\n"
+	"	ud2\n"
+	".size fiber_entry, .-fiber_entry\n"
+);
+
+//Lay out a stack so that switching to it starts fiber_main(fiber)
+static inline void context_init(FiberContext* context, char* stack,
+	size_t size, Fiber* fiber)
+{
+	uint64_t* top = (uint64_t*)(((uintptr_t)(stack + size) & ~(uintptr_t)15) - 16);
+	top[-1] = (uint64_t)fiber_entry; //Return address
+	top[-2] = 0; //rbp
+	top[-3] = 0; //rbx
+	top[-4] = (uint64_t)fiber; //r12
+	top[-5] = top[-6] = top[-7] = 0; //r13, r14, r15
+	top[-8] = 0x1f80 | (uint64_t)0x037f << 32; //Default MXCSR and x87 CW
+	*context = &top[-8];
+}
+
+#else
+
+#include <ucontext.h>
+
+//Anywhere else, fall back on ucontext, which is slower but portable
+typedef ucontext_t FiberContext;
+
+static void fiber_main(Fiber* fiber) __attribute__((noreturn));
+static __thread Fiber* starting_fiber;
+
+static void fiber_entry()
+{
+	fiber_main(starting_fiber);
+}
+
+static inline void fiber_switch(FiberContext* from, FiberContext* to)
+{
+	swapcontext(from, to);
+}
+
+static inline void context_init(FiberContext* context, char* stack,
+	size_t size, Fiber* fiber)
+{
+	getcontext(context);
+	context->uc_stack.ss_sp = stack;
+	context->uc_stack.ss_size = size;
+	context->uc_link = 0;
+	makecontext(context, fiber_entry, 0); //Finds its fiber in starting_fiber
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// FIBERS AND SCHEDULERS
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The fiber's own bookkeeping lives at the top of its stack mapping, so a
+ * fiber is one mmap (or none, with a cached stack):
+ *
+ *   [guard page][stack, growing down ...][Fiber]
+ */
+struct fiber
+{
+	FiberContext context;
+	Scheduler* scheduler;
+	Fiber* next; //In the ready queue, or the incoming list
+	void* (*entry)(void*);
+	void* arg;
+	bool waiting; //Parked until one of its file descriptors is ready
+	bool finished;
+	void* locals[fiber_locals];
+};
+
+struct scheduler
+{
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd; //An eventfd, for new fibers and shutdown
+	FiberContext context; //The scheduler loop's own context
+	Fiber* current;
+	unsigned live;
+
+	//Fibers ready to run. Only touched by the scheduler's thread.
+	Fiber* ready_begin;
+	Fiber* ready_end;
+
+	//Shared with fiber_spawn
+	pthread_mutex_t lock;
+	Fiber* incoming;
+	char* free_stacks[FIBER_STACK_CACHE];
+	int free_stack_count;
+	bool shutdown;
+};
+
+static Scheduler* schedulers;
+static int scheduler_count;
+static unsigned next_scheduler;
+
+static __thread Scheduler* this_scheduler;
+static __thread void* thread_locals[fiber_locals];
+
+static size_t page_size;
+
+static inline size_t mapping_size()
+{
+	return page_size + FIBER_STACK_SIZE;
+}
+
+static inline Fiber* mapping_fiber(char* mapping)
+{
+	return (Fiber*)(mapping + mapping_size()) - 1;
+}
+
+static inline char* fiber_mapping(Fiber* fiber)
+{
+	return (char*)(fiber + 1) - mapping_size();
+}
+
+static char* map_stack()
+{
+	char* mapping = mmap(0, mapping_size(), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if(mapping == MAP_FAILED)
+		return 0;
+
+	//An overflow hits the guard page and faults, instead of corrupting memory
+	if(mprotect(mapping, page_size, PROT_NONE))
+	{
+		munmap(mapping, mapping_size());
+		return 0;
+	}
+	return mapping;
+}
+
+static inline void push_ready(Scheduler* scheduler, Fiber* fiber)
+{
+	fiber->next = 0;
+	if(scheduler->ready_end)
+		scheduler->ready_end->next = fiber;
+	else
+		scheduler->ready_begin = fiber;
+	scheduler->ready_end = fiber;
+}
+
+static inline Fiber* pop_ready(Scheduler* scheduler)
+{
+	Fiber* fiber = scheduler->ready_begin;
+	if(fiber)
+	{
+		scheduler->ready_begin = fiber->next;
+		if(!scheduler->ready_begin)
+			scheduler->ready_end = 0;
+	}
+	return fiber;
+}
+
+static inline void wake(Scheduler* scheduler)
+{
+	uint64_t one = 1;
+	if(write(scheduler->wake_fd, &one, sizeof(one))) {}
+}
+
+//Move new fibers to the ready queue. Returns true if shutting down.
+static inline bool take_incoming(Scheduler* scheduler)
+{
+	pthread_mutex_lock(&scheduler->lock);
+	Fiber* incoming = scheduler->incoming;
+	scheduler->incoming = 0;
+	bool shutdown = scheduler->shutdown;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	//They were pushed on the front, so reverse them back into order
+	Fiber* reversed = 0;
+	while(incoming)
+	{
+		Fiber* next = incoming->next;
+		incoming->next = reversed;
+		reversed = incoming;
+		incoming = next;
+	}
+	while(reversed)
+	{
+		Fiber* next = reversed->next;
+		push_ready(scheduler, reversed);
+		++scheduler->live;
+		reversed = next;
+	}
+	return shutdown;
+}
+
+static void release_fiber(Scheduler* scheduler, Fiber* fiber)
+{
+	char* mapping = fiber_mapping(fiber);
+	--scheduler->live;
+
+	pthread_mutex_lock(&scheduler->lock);
+	bool cached = scheduler->free_stack_count < FIBER_STACK_CACHE;
+	if(cached)
+		scheduler->free_stacks[scheduler->free_stack_count++] = mapping;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if(!cached)
+		munmap(mapping, mapping_size());
+}
+
+static inline void run_fiber(Scheduler* scheduler, Fiber* fiber)
+{
+	scheduler->current = fiber;
+#if !defined(__x86_64__)
+	starting_fiber = fiber;
+#endif
+	fiber_switch(&scheduler->context, &fiber->context);
+	scheduler->current = 0;
+
+	if(fiber->finished)
+		release_fiber(scheduler, fiber);
+}
+
+//Switch back to the scheduler until something wakes the fiber
+static inline void park()
+{
+	Scheduler* scheduler = this_scheduler;
+	Fiber* fiber = scheduler->current;
+	fiber->waiting = true;
+	fiber_switch(&fiber->context, &scheduler->context);
+}
+
+void fiber_main(Fiber* fiber)
+{
+	fiber->entry(fiber->arg);
+	fiber_exit();
+}
+
+void fiber_exit()
+{
+	Scheduler* scheduler = this_scheduler;
+	Fiber* fiber = scheduler->current;
+	fiber->finished = true;
+	fiber_switch(&fiber->context, &scheduler->context);
+	__builtin_unreachable();
+}
+
+static void* scheduler_thread(void* arg)
+{
+	Scheduler* scheduler = arg;
+	this_scheduler = scheduler;
+
+	struct epoll_event events[FIBER_EVENTS];
+	while(1)
+	{
+		bool shutdown = take_incoming(scheduler);
+
+		Fiber* fiber;
+		while((fiber = pop_ready(scheduler)))
+			run_fiber(scheduler, fiber);
+
+		//Like the thread manager, finish the connections we have first
+		if(shutdown && scheduler->live == 0)
+			break;
+
+		int count = epoll_wait(scheduler->epoll_fd, events, FIBER_EVENTS, -1);
+		for(int i = 0; i < count; ++i)
+		{
+			fiber = events[i].data.ptr;
+			if(!fiber)
+			{
+				uint64_t value;
+				if(read(scheduler->wake_fd, &value, sizeof(value))) {}
+			}
+			else if(fiber->waiting)
+			{
+				fiber->waiting = false;
+				push_ready(scheduler, fiber);
+			}
+		}
+	}
+	return 0;
+}
+
+void end_fibers();
+
+int fiber_start(int count)
+{
+	if(schedulers || count <= 0)
+		return -1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	schedulers = calloc(count, sizeof(Scheduler));
+
+	for(int i = 0; i < count; ++i)
+	{
+		Scheduler* scheduler = &schedulers[i];
+		scheduler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		scheduler->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		pthread_mutex_init(&scheduler->lock, 0);
+
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = 0 };
+		if(scheduler->epoll_fd < 0 || scheduler->wake_fd < 0 ||
+			epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, scheduler->wake_fd,
+				&event) ||
+			pthread_create(&scheduler->thread, 0, scheduler_thread, scheduler))
+		{
+			//Nothing has been spawned yet, so the started ones can just go
+			scheduler_count = i + 1;
+			end_fibers();
+			return -1;
+		}
+		scheduler_count = i + 1;
+		affinity_register(scheduler->thread, affinity_scheduler, i);
+	}
+
+	submit_debug(es_printf("Started %d fiber schedulers", count));
+	return 0;
+}
+
+bool fibers_running()
+{
+	return scheduler_count > 0;
+}
+
+int fiber_spawn(void* (*entry)(void*), void* arg, int cpu)
+{
+	int index = affinity_scheduler_for(cpu, scheduler_count);
+	if(index < 0)
+		index = __atomic_fetch_add(&next_scheduler, 1, __ATOMIC_RELAXED) %
+			scheduler_count;
+	Scheduler* scheduler = &schedulers[index];
+
+	pthread_mutex_lock(&scheduler->lock);
+	char* mapping = scheduler->free_stack_count ?
+		scheduler->free_stacks[--scheduler->free_stack_count] : 0;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if(!mapping && !(mapping = map_stack()))
+		return -1;
+
+	Fiber* fiber = mapping_fiber(mapping);
+	memset(fiber, 0, sizeof(*fiber));
+	fiber->scheduler = scheduler;
+	fiber->entry = entry;
+	fiber->arg = arg;
+	context_init(&fiber->context, mapping + page_size,
+		(char*)fiber - (mapping + page_size), fiber);
+
+	pthread_mutex_lock(&scheduler->lock);
+	bool was_empty = !scheduler->incoming;
+	fiber->next = scheduler->incoming;
+	scheduler->incoming = fiber;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	//If it wasn't empty, the scheduler has a wakeup coming already
+	if(was_empty)
+		wake(scheduler);
+	return 0;
+}
+
+bool fiber_current()
+{
+	return this_scheduler && this_scheduler->current;
+}
+
+void** fiber_local(int slot)
+{
+	if(this_scheduler && this_scheduler->current)
+		return &this_scheduler->current->locals[slot];
+	return &thread_locals[slot];
+}
+
+/*
+ * Stop the schedulers, once they've finished their fibers. Priority is just
+ * after the thread manager, so connections end the same way in either mode,
+ * while printing and the timer wheel are still running.
+ */
+__attribute__((destructor (MODULE_FIBER_PRI)))
+void end_fibers()
+{
+	if(!schedulers)
+		return;
+
+	submit_debug_c("Finishing remaining fibers");
+	for(int i = 0; i < scheduler_count; ++i)
+	{
+		pthread_mutex_lock(&schedulers[i].lock);
+		schedulers[i].shutdown = true;
+		pthread_mutex_unlock(&schedulers[i].lock);
+		wake(&schedulers[i]);
+	}
+
+	for(int i = 0; i < scheduler_count; ++i)
+	{
+		Scheduler* scheduler = &schedulers[i];
+		pthread_join(scheduler->thread, 0);
+		for(int s = 0; s < scheduler->free_stack_count; ++s)
+			munmap(scheduler->free_stacks[s], mapping_size());
+		close(scheduler->epoll_fd);
+		close(scheduler->wake_fd);
+		pthread_mutex_destroy(&scheduler->lock);
+	}
+
+	free(schedulers);
+	schedulers = 0;
+	scheduler_count = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BLOCKING HELPERS
+///////////////////////////////////////////////////////////////////////////////
+
+//Wake the current fiber when fd is ready. One-shot, so it's quiet after.
+static inline void watch(int fd, short events)
+{
+	Scheduler* scheduler = this_scheduler;
+	struct epoll_event event = {
+		.events = EPOLLONESHOT |
+			(events & POLLIN ? EPOLLIN : 0) |
+			(events & POLLOUT ? EPOLLOUT : 0),
+		.data.ptr = scheduler->current };
+
+	//Registrations die with their descriptor, so most are already there
+	if(epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_MOD, fd, &event) &&
+			errno == ENOENT)
+		epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static inline long now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+int fiber_poll(struct pollfd* fds, nfds_t count, int timeout)
+{
+	if(!fiber_current())
+		return poll(fds, count, timeout);
+
+	int ready = poll(fds, count, 0);
+	if(ready != 0 || timeout == 0)
+		return ready;
+
+	//The timeout is a timerfd, so it wakes the fiber like anything else
+	int timer_fd = -1;
+	long deadline = 0;
+	if(timeout > 0)
+	{
+		deadline = now_ms() + timeout;
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct itimerspec expiry = { .it_value = {
+			.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L } };
+		timerfd_settime(timer_fd, 0, &expiry, 0);
+	}
+
+	//Wakeups can be spurious, so check again each time
+	while(ready == 0)
+	{
+		for(nfds_t i = 0; i < count; ++i)
+			if(fds[i].fd >= 0 && fds[i].events)
+				watch(fds[i].fd, fds[i].events);
+		if(timer_fd >= 0)
+			watch(timer_fd, POLLIN);
+
+		park();
+
+		ready = poll(fds, count, 0);
+		if(ready == 0 && timer_fd >= 0 && now_ms() >= deadline)
+			break;
+	}
+
+	if(timer_fd >= 0)
+		close(timer_fd);
+	return ready;
+}
+
+ssize_t fiber_recv(int fd, void* buffer, size_t size, int flags)
+{
+	if(!fiber_current())
+		return recv(fd, buffer, size, flags);
+
+	while(1)
+	{
+		ssize_t amount = recv(fd, buffer, size, flags | MSG_DONTWAIT);
+		if(amount >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR))
+			return amount;
+
+		struct pollfd readable = { .fd = fd, .events = POLLIN };
+		if(fiber_poll(&readable, 1, -1) < 0)
+			return -1;
+	}
+}
+
+int fiber_connect(int fd, const struct sockaddr* address, socklen_t size)
+{
+	if(!fiber_current())
+		return connect(fd, address, size);
+
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	int result = connect(fd, address, size);
+	if(result < 0 && errno == EINPROGRESS)
+	{
+		struct pollfd writable = { .fd = fd, .events = POLLOUT };
+		fiber_poll(&writable, 1, -1);
+
+		int error = 0;
+		socklen_t error_size = sizeof(error);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+		result = error ? -1 : 0;
+		errno = error;
+	}
+
+	int saved_errno = errno;
+	fcntl(fd, F_SETFL, flags);
+	errno = saved_errno;
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WAITING
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A waiting fiber, on its own stack. It's only touched with the condition's
+ * mutex held, so a broadcast can't write to the eventfd once it's closed.
+ */
+struct fiber_waiter
+{
+	FiberWaiter* next;
+	int fd;
+};
+
+void fiber_cond_init(FiberCond* cond)
+{
+	pthread_cond_init(&cond->cond, 0);
+	cond->fibers = 0;
+}
+
+void fiber_cond_destroy(FiberCond* cond)
+{
+	pthread_cond_destroy(&cond->cond);
+}
+
+int fiber_cond_timedwait(FiberCond* cond, pthread_mutex_t* mutex,
+	const struct timespec* deadline)
+{
+	if(!fiber_current())
+		return pthread_cond_timedwait(&cond->cond, mutex, deadline);
+
+	//Out of descriptors: give up on the wait rather than spin on it
+	FiberWaiter waiter = { .next = cond->fibers,
+		.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+	if(waiter.fd < 0)
+		return ETIMEDOUT;
+	cond->fibers = &waiter;
+	pthread_mutex_unlock(mutex);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long timeout = (deadline->tv_sec - now.tv_sec) * 1000L +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	int ready = 0;
+	if(timeout > 0)
+	{
+		struct pollfd woken = { .fd = waiter.fd, .events = POLLIN };
+		ready = fiber_poll(&woken, 1, timeout);
+	}
+
+	//Still on the list means nobody woke it
+	pthread_mutex_lock(mutex);
+	for(FiberWaiter** link = &cond->fibers; *link; link = &(*link)->next)
+	{
+		if(*link == &waiter)
+		{
+			*link = waiter.next;
+			break;
+		}
+	}
+	close(waiter.fd);
+	return ready > 0 ? 0 : ETIMEDOUT;
+}
+
+void fiber_cond_broadcast(FiberCond* cond)
+{
+	pthread_cond_broadcast(&cond->cond);
+	while(cond->fibers)
+	{
+		FiberWaiter* waiter = cond->fibers;
+		cond->fibers = waiter->next;
+		uint64_t one = 1;
+		if(write(waiter->fd, &one, sizeof(one))) {}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OFFLOADING
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Offloaded calls go to a pool of helper threads. It grows as calls come in,
+ * up to FIBER_HELPERS; past that, calls queue for the next free helper, which
+ * is fine because they're all short (long waits go through FiberCond). A
+ * helper that's been idle for FIBER_HELPER_IDLE seconds exits. Each call
+ * signals its fiber through an eventfd, so waiting is just fiber_poll.
+ */
+typedef struct offload_job
+{
+	struct offload_job* next;
+	void (*function)(void*);
+	void* arg;
+	int done_fd;
+} OffloadJob;
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t signal;
+	OffloadJob* begin;
+	OffloadJob* end;
+	int queued;
+	int helpers;
+	int idle; //Helpers waiting for a job
+} offload = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void* offload_thread(void* arg)
+{
+	pthread_mutex_lock(&offload.lock);
+	while(1)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += FIBER_HELPER_IDLE;
+
+		++offload.idle;
+		int wait_result = 0;
+		while(!offload.begin && wait_result == 0)
+			wait_result = pthread_cond_timedwait(&offload.signal, &offload.lock,
+				&deadline);
+		--offload.idle;
+
+		//Nothing came, so there are more helpers than there's work for
+		if(!offload.begin)
+			break;
+
+		OffloadJob* job = offload.begin;
+		offload.begin = job->next;
+		if(!offload.begin) offload.end = 0;
+		--offload.queued;
+		pthread_mutex_unlock(&offload.lock);
+
+		//The job is on the fiber's stack, and it's gone once it's signalled
+		int done_fd = job->done_fd;
+		job->function(job->arg);
+		uint64_t one = 1;
+		if(write(done_fd, &one, sizeof(one))) {}
+
+		pthread_mutex_lock(&offload.lock);
+	}
+	--offload.helpers;
+	pthread_mutex_unlock(&offload.lock);
+	return 0;
+}
+
+static int start_helper()
+{
+	pthread_t helper;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	affinity_helper_attr(&attributes);
+	int result = pthread_create(&helper, &attributes, offload_thread, 0);
+	pthread_attr_destroy(&attributes);
+	return result;
+}
+
+void fiber_offload(void (*function)(void*), void* arg)
+{
+	OffloadJob job = { .function = function, .arg = arg };
+	if(!fiber_current() ||
+			(job.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	{
+		function(arg);
+		return;
+	}
+
+	pthread_mutex_lock(&offload.lock);
+
+	//Another helper, if the idle ones are all spoken for and there's room
+	if(offload.queued >= offload.idle && offload.helpers < FIBER_HELPERS &&
+			start_helper() == 0) //It waits for the lock, then the job
+		++offload.helpers;
+
+	bool available = offload.helpers > 0;
+	if(available)
+	{
+		if(offload.end)
+			offload.end->next = &job;
+		else
+			offload.begin = &job;
+		offload.end = &job;
+		++offload.queued;
+		pthread_cond_signal(&offload.signal);
+	}
+	pthread_mutex_unlock(&offload.lock);
+
+	//No helper to be had, so do it here
+	if(!available)
+	{
+		close(job.done_fd);
+		function(arg);
+		return;
+	}
+
+	struct pollfd done = { .fd = job.done_fd, .events = POLLIN };
+	while(fiber_poll(&done, 1, -1) <= 0) {}
+	close(job.done_fd);
+}
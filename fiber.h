@@ -0,0 +1,104 @@
+/*
+ * fiber.h
+ *
+ *  Created on: Mar 19, 2014
+ *      Author: nathan
+ *
+ *  Fibers: lightweight threads, so the worker's straight-line blocking code
+ *  can run many connections on a few OS threads (-f). Each fiber has a small
+ *  mmap'd stack with a guard page below it, and stays on the scheduler thread
+ *  it started on. A scheduler runs its ready fibers, then sleeps in
+ *  epoll_wait until one of the sockets they're waiting on is ready.
+ *
+ *  Code doesn't need to know whether it's on a fiber. The blocking helpers
+ *  below behave like the calls they're named after on a plain thread, and on
+ *  a fiber they switch to another fiber instead of blocking. Waits on a
+ *  condition go through FiberCond, which parks a fiber rather than a thread.
+ *  Anything else that can only block (getaddrinfo) goes to fiber_offload,
+ *  which runs it on a small pool of helper threads.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Start count scheduler threads. After this, fiber_spawn can be used.
+ * Returns 0, or -1 if they couldn't be started.
+ */
+int fiber_start(int count);
+
+//True once fiber_start has succeeded
+bool fibers_running();
+
+/*
+ * Run entry(arg) on a new fiber, on one of the schedulers: the one nearest
+ * cpu, with -a (see affinity.h), or the next in turn if cpu is -1. The return
+ * value of entry is ignored; it has the pthread signature so thread entry
+ * points can be used as-is. Returns 0, or -1 if the fiber couldn't be created.
+ */
+int fiber_spawn(void* (*entry)(void*), void* arg, int cpu);
+
+//True if the calling code is running on a fiber
+bool fiber_current();
+
+//End the calling fiber. Nothing after it on the fiber's stack is unwound.
+void fiber_exit() __attribute__((noreturn));
+
+/*
+ * Per-fiber versions of thread-locals, for per-connection state that was
+ * kept in __thread variables. On a plain thread, it's the thread's own slot.
+ */
+enum { fiber_local_timer, fiber_local_capture, fiber_locals };
+void** fiber_local(int slot);
+
+//// BLOCKING HELPERS
+//poll; on a fiber, timeout may be -1 or 0 or a number of milliseconds
+int fiber_poll(struct pollfd* fds, nfds_t count, int timeout);
+
+//recv; on a fiber it waits for data with fiber_poll
+ssize_t fiber_recv(int fd, void* buffer, size_t size, int flags);
+
+//connect; on a fiber it connects non-blocking, and waits with fiber_poll
+int fiber_connect(int fd, const struct sockaddr* address, socklen_t size);
+
+/*
+ * Run function(arg) on a helper thread, and wait for it. For short calls
+ * that block with no file descriptor to wait on. Calls queue when every
+ * helper is busy, so long waits belong on a FiberCond instead. Off a fiber,
+ * it's just a call.
+ */
+void fiber_offload(void (*function)(void*), void* arg);
+
+//// WAITING
+/*
+ * A condition variable that fibers can wait on without holding a thread. It's
+ * used with a mutex, like pthread_cond_t. A plain thread waits on the pthread
+ * condition; a fiber goes on a list with an eventfd, and parks on it through
+ * its scheduler until it's broadcast.
+ */
+typedef struct fiber_waiter FiberWaiter;
+typedef struct
+{
+	pthread_cond_t cond;
+	FiberWaiter* fibers;
+} FiberCond;
+
+void fiber_cond_init(FiberCond* cond);
+void fiber_cond_destroy(FiberCond* cond);
+
+/*
+ * Like pthread_cond_timedwait, with a CLOCK_REALTIME deadline: the mutex is
+ * dropped while waiting. Returns 0 when woken, which can be spurious, or
+ * ETIMEDOUT.
+ */
+int fiber_cond_timedwait(FiberCond* cond, pthread_mutex_t* mutex,
+	const struct timespec* deadline);
+
+//Wake every waiter. The mutex must be held.
+void fiber_cond_broadcast(FiberCond* cond);
@@ -0,0 +1,140 @@
+/*
+ * h2.h
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ *
+ *  HTTP/2 (RFC 7540) framing: the constants, and the few helpers needed to
+ *  read and write frame headers. Shared by the upstream client and the h2c
+ *  stand-in origin in bench.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "EasyString/easy_string.h"
+
+//What a client sends first, before its SETTINGS
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define H2_FRAME_HEADER_SIZE 9
+
+//Frames may be this big until the peer allows more
+#define H2_DEFAULT_FRAME_SIZE 16384
+
+//The flow control window every stream and connection starts with
+#define H2_DEFAULT_WINDOW 65535
+
+typedef enum
+{
+	h2_data = 0,
+	h2_headers = 1,
+	h2_priority = 2,
+	h2_rst_stream = 3,
+	h2_settings = 4,
+	h2_push_promise = 5,
+	h2_ping = 6,
+	h2_goaway = 7,
+	h2_window_update = 8,
+	h2_continuation = 9
+} H2FrameType;
+
+enum
+{
+	h2_flag_end_stream = 0x1,
+	h2_flag_ack = 0x1,
+	h2_flag_end_headers = 0x4,
+	h2_flag_padded = 0x8,
+	h2_flag_priority = 0x20
+};
+
+enum
+{
+	h2_settings_header_table_size = 1,
+	h2_settings_enable_push = 2,
+	h2_settings_max_concurrent_streams = 3,
+	h2_settings_initial_window_size = 4,
+	h2_settings_max_frame_size = 5,
+	h2_settings_max_header_list_size = 6
+};
+
+enum
+{
+	h2_no_error = 0,
+	h2_protocol_error = 1,
+	h2_internal_error = 2,
+	h2_flow_control_error = 3,
+	h2_stream_closed = 5,
+	h2_frame_size_error = 6,
+	h2_refused_stream = 7,
+	h2_cancel = 8,
+	h2_compression_error = 9
+};
+
+typedef struct
+{
+	uint32_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t stream;
+} H2Frame;
+
+static inline uint32_t h2_read32(const char* bytes)
+{
+	const unsigned char* b = (const unsigned char*)bytes;
+	return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static inline void h2_write32(char* bytes, uint32_t value)
+{
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
+
+//Parse a frame header from the first H2_FRAME_HEADER_SIZE bytes
+static inline H2Frame h2_parse_frame(const char* bytes)
+{
+	const unsigned char* b = (const unsigned char*)bytes;
+	H2Frame frame =
+	{
+		.length = (uint32_t)b[0] << 16 | b[1] << 8 | b[2],
+		.type = b[3],
+		.flags = b[4],
+		.stream = h2_read32(bytes + 5) & 0x7fffffff
+	};
+	return frame;
+}
+
+//Append a frame header, followed by its payload
+static inline void h2_append_frame(String* output, uint8_t type,
+	uint8_t flags, uint32_t stream, StringRef payload)
+{
+	char header[H2_FRAME_HEADER_SIZE] =
+	{
+		payload.size >> 16, payload.size >> 8, payload.size, type, flags
+	};
+	h2_write32(header + 5, stream);
+	es_append(output, es_tempn(header, sizeof(header)));
+	es_append(output, payload);
+}
+
+//The payload of a frame with one 32 bit value: WINDOW_UPDATE, RST_STREAM
+static inline void h2_append_u32_frame(String* output, uint8_t type,
+	uint32_t stream, uint32_t value)
+{
+	char payload[4];
+	h2_write32(payload, value);
+	h2_append_frame(output, type, 0, stream, es_tempn(payload, 4));
+}
+
+//Append one setting to a SETTINGS payload being built
+static inline void h2_append_setting(String* payload, uint16_t id,
+	uint32_t value)
+{
+	char setting[6] = { id >> 8, id };
+	h2_write32(setting + 2, value);
+	es_append(payload, es_tempn(setting, 6));
+}
@@ -0,0 +1,1320 @@
+/*
+ * h2_upstream.c
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For POLLRDHUP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "h2_upstream.h"
+#include "h2.h"
+#include "hpack.h"
+#include "buffer_pool.h"
+#include "socket_options.h"
+#include "stat_tracking.h"
+#include "print_thread.h"
+#include "affinity.h"
+#include "config.h"
+
+typedef struct h2_stream H2Stream;
+
+/*
+ * One request, from the moment a worker submits it until its response has
+ * been handed over. Streams waiting for a slot on the connection have no id.
+ */
+struct h2_stream
+{
+	H2Stream* next; //In a queue
+	int fd; //The origin thread's end of the socketpair
+	uint32_t id;
+	int retries;
+	bool idempotent;
+	bool head_request;
+
+	//The request, kept until it's answered, in case it has to be sent again
+	String header_block;
+	String body;
+	size_t body_sent;
+	size_t unread_body; //Still to come from the worker
+	bool upload_started; //Some of the unread body is gone, so no retries
+	int64_t send_window;
+	bool end_sent;
+
+	//The response, as HTTP/1.1, and how much of it the worker has taken
+	String pending;
+	size_t pending_sent;
+	size_t uncredited; //Received, but not yet given back to the window
+	bool head_done;
+	bool chunked;
+	bool no_body;
+	bool end_received;
+};
+
+struct h2_origin
+{
+	H2Origin* next;
+	String domain;
+	String port;
+	struct addrinfo* address;
+
+	pthread_t thread;
+	int wake_fd;
+
+	pthread_mutex_t lock;
+	H2Stream* submitted; //Reversed; the thread puts them back in order
+	bool shutdown;
+};
+
+//Everything the origin's thread knows about its connection
+typedef struct
+{
+	H2Origin* origin;
+	int fd; //-1 if it isn't connected
+
+	HpackTable table;
+	char* input;
+	size_t input_size;
+	String output;
+	size_t output_sent;
+
+	uint32_t next_id;
+	bool draining; //No new streams; close once the last one finishes
+	int64_t send_window;
+	size_t uncredited;
+
+	//The origin's SETTINGS
+	uint32_t peer_window;
+	uint32_t peer_streams;
+	uint32_t peer_frame_size;
+
+	//A header block that's still coming in CONTINUATION frames
+	uint32_t header_stream;
+	uint8_t header_flags;
+	String header_fragments;
+
+	//Waiting for a slot, in order
+	H2Stream* queue;
+	H2Stream* queue_end;
+
+	H2Stream* active[H2_MAX_STREAMS];
+	int num_active;
+} H2Connection;
+
+//Configured with -2. Only changed before the proxy starts serving.
+static H2Origin* origins;
+
+/*
+ * The connection's receive window covers every stream's. It's credited back
+ * as soon as data arrives; what bounds the memory is the stream windows,
+ * which aren't credited back until their worker has taken the data.
+ */
+const static size_t connection_window = H2_MAX_STREAMS * H2_STREAM_WINDOW;
+
+//Big enough for a whole frame of the largest size we allow
+const static size_t input_buffer_size = 64 * 1024;
+
+//Stop making DATA frames once this much is waiting to go out
+const static size_t output_limit = 64 * 1024;
+
+static inline size_t min_size(size_t a, size_t b) { return a < b ? a : b; }
+
+//////////////////////////////////////////////////////////////////////////////
+// REQUESTS
+//////////////////////////////////////////////////////////////////////////////
+
+//Headers that only mean something to one HTTP/1.1 connection
+static inline bool connection_specific(HeaderID id)
+{
+	return id == hdr_connection || id == hdr_keep_alive ||
+		id == hdr_proxy_connection || id == hdr_transfer_encoding ||
+		id == hdr_upgrade || id == hdr_te || id == hdr_host;
+}
+
+//Continuation lines become spaces, since HTTP/2 values can't hold newlines
+static inline String fold_value(StringRef value)
+{
+	char* folded = malloc(value.size);
+	for(size_t i = 0; i < value.size; ++i)
+		folded[i] = value.begin[i] == '\r' || value.begin[i] == '\n' ? ' ' :
+			value.begin[i];
+	return es_move_cstrn(folded, value.size);
+}
+
+/*
+ * The request's header block. The pseudo-headers come from the request line,
+ * and :authority stands in for Host. The rest are the headers as they'd be
+ * forwarded over HTTP/1.1, names lowercased, less the connection ones.
+ */
+static String encode_request(HTTP_Message* request)
+{
+	String block = es_empty_string;
+	const HTTP_ReqLine* line = &request->request;
+
+	String authority = line->port.size ?
+		es_printf("%.*s:%.*s", ES_STRINGPRINT(&line->domain),
+			ES_STRINGPRINT(&line->port)) :
+		es_copy(es_ref(&line->domain));
+	String path = es_printf("/%.*s", ES_STRINGPRINT(&line->path));
+
+	hpack_encode(&block, es_temp(":method"), method_name(line->method));
+	hpack_encode(&block, es_temp(":scheme"), es_temp("http"));
+	hpack_encode(&block, es_temp(":authority"), es_ref(&authority));
+	hpack_encode(&block, es_temp(":path"), es_ref(&path));
+	es_free(&authority);
+	es_free(&path);
+
+	//Skip the request line
+	String head = serialize_request_head(request);
+	StringRef text = es_ref(&head);
+	const char* line_end = memchr(text.begin, '\n', text.size);
+	text = es_slice(text, line_end ? line_end - text.begin + 1 : text.size,
+		text.size);
+
+	StringRef header_line, name, value;
+	while(next_raw_header(&text, &header_line, &name, &value) == 0 &&
+		header_line.size)
+	{
+		if(connection_specific(intern_header(name)))
+			continue;
+
+		String lower = es_tolower(name);
+		String folded = fold_value(value);
+		hpack_encode(&block, es_ref(&lower), trim_lws(es_ref(&folded)));
+		es_free(&lower);
+		es_free(&folded);
+	}
+
+	es_free(&head);
+	return block;
+}
+
+static void free_stream(H2Stream* stream)
+{
+	close(stream->fd);
+	es_free(&stream->header_block);
+	es_free(&stream->body);
+	es_free(&stream->pending);
+	free(stream);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// STREAMS
+//////////////////////////////////////////////////////////////////////////////
+
+static inline size_t output_backlog(H2Connection* conn)
+{
+	return conn->output.size - conn->output_sent;
+}
+
+static inline int stream_limit(H2Connection* conn)
+{
+	return conn->peer_streams < H2_MAX_STREAMS ? conn->peer_streams :
+		H2_MAX_STREAMS;
+}
+
+static H2Stream* find_stream(H2Connection* conn, uint32_t id)
+{
+	for(int i = 0; i < conn->num_active; ++i)
+		if(conn->active[i]->id == id)
+			return conn->active[i];
+	return 0;
+}
+
+static void remove_stream(H2Connection* conn, H2Stream* stream)
+{
+	for(int i = 0; i < conn->num_active; ++i)
+	{
+		if(conn->active[i] == stream)
+		{
+			conn->active[i] = conn->active[--conn->num_active];
+			return;
+		}
+	}
+}
+
+static inline void send_reset(H2Connection* conn, H2Stream* stream,
+	uint32_t code)
+{
+	h2_append_u32_frame(&conn->output, h2_rst_stream, stream->id, code);
+}
+
+/*
+ * Give up on a stream. The worker sees its connection close, and deals with
+ * that like any other origin hanging up on it.
+ */
+static void drop_stream(H2Connection* conn, H2Stream* stream)
+{
+	remove_stream(conn, stream);
+	free_stream(stream);
+}
+
+//The worker's gone, or the stream is broken; tell the origin and forget it
+static void reset_stream(H2Connection* conn, H2Stream* stream, uint32_t code)
+{
+	send_reset(conn, stream, code);
+	drop_stream(conn, stream);
+}
+
+//True if the request could go again on another stream
+static inline bool retryable(H2Stream* stream)
+{
+	return stream->retries == 0 && !stream->head_done &&
+		!stream->upload_started;
+}
+
+//Put a stream back at the front of the queue, to go out as a new one
+static void retry_stream(H2Connection* conn, H2Stream* stream)
+{
+	remove_stream(conn, stream);
+	stream->id = 0;
+	stream->retries++;
+	stream->body_sent = 0;
+	stream->end_sent = false;
+	stream->uncredited = 0;
+
+	stream->next = conn->queue;
+	conn->queue = stream;
+	if(!conn->queue_end)
+		conn->queue_end = stream;
+
+	stat_add_h2_retry();
+}
+
+//True if the worker has already given up on a stream that hasn't started
+static inline bool hung_up(H2Stream* stream)
+{
+	struct pollfd check = { .fd = stream->fd, .events = POLLRDHUP };
+	return poll(&check, 1, 0) > 0;
+}
+
+//Send a header block, split into HEADERS and CONTINUATION frames
+static void send_headers(H2Connection* conn, H2Stream* stream, bool end)
+{
+	StringRef block = es_ref(&stream->header_block);
+	size_t offset = 0;
+	do
+	{
+		size_t size = min_size(block.size - offset, conn->peer_frame_size);
+		uint8_t type = offset ? h2_continuation : h2_headers;
+		uint8_t flags = offset + size == block.size ? h2_flag_end_headers : 0;
+		if(!offset && end)
+			flags |= h2_flag_end_stream;
+
+		h2_append_frame(&conn->output, type, flags, stream->id,
+			es_slice(block, offset, size));
+		offset += size;
+	} while(offset < block.size);
+}
+
+//Open streams for waiting requests, as far as the origin allows
+static void start_streams(H2Connection* conn)
+{
+	while(conn->fd >= 0 && !conn->draining && conn->queue &&
+		conn->num_active < stream_limit(conn))
+	{
+		//Stream ids can't be reused, so a connection that's used them up is done
+		if(conn->next_id > 0x7fffffff)
+		{
+			conn->draining = true;
+			break;
+		}
+
+		H2Stream* stream = conn->queue;
+		conn->queue = stream->next;
+		if(!conn->queue)
+			conn->queue_end = 0;
+
+		if(hung_up(stream))
+		{
+			free_stream(stream);
+			continue;
+		}
+
+		stream->id = conn->next_id;
+		conn->next_id += 2;
+		stream->send_window = conn->peer_window;
+		conn->active[conn->num_active++] = stream;
+
+		bool end = stream->body.size == 0 && stream->unread_body == 0;
+		send_headers(conn, stream, end);
+		stream->end_sent = end;
+
+		stat_add_h2_stream();
+	}
+}
+
+//Send what the windows allow of the buffered request bodies
+static void send_bodies(H2Connection* conn)
+{
+	for(int i = 0; i < conn->num_active; ++i)
+	{
+		H2Stream* stream = conn->active[i];
+		while(!stream->end_sent && stream->body_sent < stream->body.size &&
+			stream->send_window > 0 && conn->send_window > 0 &&
+			output_backlog(conn) < output_limit)
+		{
+			size_t size = min_size(stream->body.size - stream->body_sent,
+				conn->peer_frame_size);
+			size = min_size(size, stream->send_window);
+			size = min_size(size, conn->send_window);
+
+			stream->body_sent += size;
+			stream->send_window -= size;
+			conn->send_window -= size;
+
+			bool end = stream->body_sent == stream->body.size &&
+				stream->unread_body == 0;
+			h2_append_frame(&conn->output, h2_data,
+				end ? h2_flag_end_stream : 0, stream->id,
+				es_slice(es_ref(&stream->body), stream->body_sent - size, size));
+			stream->end_sent = end;
+		}
+	}
+}
+
+//True if the stream is ready for more of the body the worker is relaying
+static inline bool wants_upload(H2Connection* conn, H2Stream* stream)
+{
+	return !stream->end_sent && stream->body_sent == stream->body.size &&
+		stream->unread_body && stream->send_window > 0 &&
+		conn->send_window > 0 && output_backlog(conn) < output_limit;
+}
+
+//Send a DATA frame of the worker's relayed body. Returns false if it's gone.
+static bool send_upload(H2Connection* conn, H2Stream* stream)
+{
+	char buffer[H2_DEFAULT_FRAME_SIZE];
+	size_t size = min_size(stream->unread_body, conn->peer_frame_size);
+	size = min_size(size, sizeof(buffer));
+	size = min_size(size, stream->send_window);
+	size = min_size(size, conn->send_window);
+
+	ssize_t received = recv(stream->fd, buffer, size, MSG_DONTWAIT);
+	if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return true;
+	if(received <= 0)
+	{
+		reset_stream(conn, stream, h2_cancel);
+		return false;
+	}
+
+	stream->upload_started = true;
+	stream->unread_body -= received;
+	stream->send_window -= received;
+	conn->send_window -= received;
+
+	bool end = stream->unread_body == 0;
+	h2_append_frame(&conn->output, h2_data, end ? h2_flag_end_stream : 0,
+		stream->id, es_tempn(buffer, received));
+	stream->end_sent = end;
+	return true;
+}
+
+/*
+ * The response is all delivered. If the origin answered before taking the
+ * whole request, the rest of it is cancelled.
+ */
+static void finish_stream(H2Connection* conn, H2Stream* stream)
+{
+	if(!stream->end_sent)
+		send_reset(conn, stream, h2_cancel);
+	drop_stream(conn, stream);
+}
+
+/*
+ * Hand the worker as much of the response as it'll take. Once it's taken
+ * everything, the stream's window is reopened. Returns false if the stream
+ * is finished, or the worker is gone.
+ */
+static bool write_pending(H2Connection* conn, H2Stream* stream)
+{
+	if(stream->pending_sent < stream->pending.size)
+	{
+		StringRef rest = es_slice(es_ref(&stream->pending), stream->pending_sent,
+			stream->pending.size);
+		ssize_t sent = send(stream->fd, rest.begin, rest.size,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if(sent < 0)
+		{
+			reset_stream(conn, stream, h2_cancel);
+			return false;
+		}
+		stream->pending_sent += sent;
+		if(stream->pending_sent < stream->pending.size)
+			return true;
+	}
+
+	es_clear(&stream->pending);
+	stream->pending_sent = 0;
+
+	if(stream->end_received)
+	{
+		finish_stream(conn, stream);
+		return false;
+	}
+
+	if(stream->uncredited >= H2_STREAM_WINDOW / 4)
+	{
+		h2_append_u32_frame(&conn->output, h2_window_update, stream->id,
+			stream->uncredited);
+		stream->uncredited = 0;
+	}
+	return true;
+}
+
+static void deliver(H2Connection* conn, H2Stream* stream, StringRef data)
+{
+	es_append(&stream->pending, data);
+	write_pending(conn, stream);
+}
+
+static void end_response(H2Connection* conn, H2Stream* stream)
+{
+	stream->end_received = true;
+	deliver(conn, stream, stream->chunked ? es_temp("0\r\n\r\n") :
+		es_temp(""));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CONNECTION
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The connection is gone. Streams the origin can't have started on are sent
+ * again on the next one, and so are unanswered GETs and HEADs, which are
+ * safe to repeat; the rest fail.
+ */
+static void lose_connection(H2Connection* conn)
+{
+	submit_debug_c("Lost connection to HTTP/2 origin");
+
+	close(conn->fd);
+	conn->fd = -1;
+	hpack_free(&conn->table);
+	es_clear(&conn->output);
+	conn->output_sent = 0;
+	conn->input_size = 0;
+	conn->header_stream = 0;
+	es_clear(&conn->header_fragments);
+
+	while(conn->num_active)
+	{
+		H2Stream* stream = conn->active[conn->num_active - 1];
+		if(retryable(stream) && stream->idempotent)
+			retry_stream(conn, stream);
+		else
+			drop_stream(conn, stream);
+	}
+}
+
+//Send everything that's ready. Returns false if the connection was lost.
+static bool flush_output(H2Connection* conn)
+{
+	while(output_backlog(conn))
+	{
+		StringRef rest = es_slice(es_ref(&conn->output), conn->output_sent,
+			conn->output.size);
+		ssize_t sent = send(conn->fd, rest.begin, rest.size,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINPROGRESS))
+			return true;
+		if(sent < 0)
+		{
+			lose_connection(conn);
+			return false;
+		}
+		conn->output_sent += sent;
+	}
+
+	es_clear(&conn->output);
+	conn->output_sent = 0;
+	return true;
+}
+
+//Something about the connection is broken beyond repair
+static void fail_connection(H2Connection* conn, uint32_t code)
+{
+	submit_debug_c("HTTP/2 connection error");
+
+	char payload[8];
+	h2_write32(payload, 0);
+	h2_write32(payload + 4, code);
+	h2_append_frame(&conn->output, h2_goaway, 0, 0, es_tempn(payload, 8));
+	if(flush_output(conn))
+		lose_connection(conn);
+}
+
+static void connect_origin(H2Connection* conn)
+{
+	const struct addrinfo* address = conn->origin->address;
+
+	submit_debug_c("Connecting to HTTP/2 origin");
+
+	int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	int connect_error = -1;
+	if(fd >= 0)
+	{
+		tune_upstream(fd, true);
+		connect_error = connect(fd, address->ai_addr, address->ai_addrlen);
+		if(connect_error && errno == EINPROGRESS)
+		{
+			struct pollfd writable = { .fd = fd, .events = POLLOUT };
+			socklen_t size = sizeof(connect_error);
+			if(poll(&writable, 1, UPSTREAM_TIMEOUT * 1000) != 1 ||
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_error, &size))
+				connect_error = -1;
+		}
+	}
+
+	//Nothing waiting can go anywhere, so it all fails
+	if(connect_error)
+	{
+		submit_debug_c("Unable to connect to HTTP/2 origin");
+		if(fd >= 0) close(fd);
+		while(conn->queue)
+		{
+			H2Stream* stream = conn->queue;
+			conn->queue = stream->next;
+			free_stream(stream);
+		}
+		conn->queue_end = 0;
+		return;
+	}
+
+	conn->fd = fd;
+	conn->next_id = 1;
+	conn->draining = false;
+	conn->send_window = H2_DEFAULT_WINDOW;
+	conn->uncredited = 0;
+	conn->peer_window = H2_DEFAULT_WINDOW;
+	conn->peer_streams = H2_MAX_STREAMS;
+	conn->peer_frame_size = H2_DEFAULT_FRAME_SIZE;
+	hpack_init(&conn->table, H2_HEADER_TABLE_SIZE);
+
+	String settings = es_empty_string;
+	h2_append_setting(&settings, h2_settings_header_table_size,
+		H2_HEADER_TABLE_SIZE);
+	h2_append_setting(&settings, h2_settings_enable_push, 0);
+	h2_append_setting(&settings, h2_settings_initial_window_size,
+		H2_STREAM_WINDOW);
+	h2_append_setting(&settings, h2_settings_max_header_list_size,
+		MAX_HEADER_SIZE);
+
+	es_append(&conn->output, es_temp(H2_PREFACE));
+	h2_append_frame(&conn->output, h2_settings, 0, 0, es_ref(&settings));
+	h2_append_u32_frame(&conn->output, h2_window_update, 0,
+		connection_window - H2_DEFAULT_WINDOW);
+	es_free(&settings);
+
+	stat_add_h2_connection();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// FRAMES
+//////////////////////////////////////////////////////////////////////////////
+
+//A response head being rebuilt as HTTP/1.1 while it's decoded
+typedef struct
+{
+	String fields;
+	String content_length;
+	int status;
+	bool malformed;
+} ResponseHead;
+
+/*
+ * True for a regular field name HTTP/2 allows: a token, all in lowercase.
+ * The name is copied into an HTTP/1.1 head, so anything else (CR, LF, a
+ * colon, whitespace) could add headers of the origin's choosing.
+ */
+static inline bool valid_field_name(StringRef name)
+{
+	if(!name.size)
+		return false;
+
+	for(size_t i = 0; i < name.size; ++i)
+	{
+		char c = name.begin[i];
+		if(!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+				(c && strchr("!#$%&'*+-.^_`|~", c))))
+			return false;
+	}
+	return true;
+}
+
+static void collect_header(void* arg, StringRef name, StringRef value)
+{
+	ResponseHead* head = arg;
+
+	if(memchr(value.begin, '\r', value.size) ||
+		memchr(value.begin, '\n', value.size) ||
+		memchr(value.begin, '\0', value.size))
+	{
+		head->malformed = true;
+		return;
+	}
+
+	if(name.size && name.begin[0] == ':')
+	{
+		unsigned long status;
+		if(es_compare(name, es_temp(":status")) || value.size != 3 ||
+			es_toul(&status, value))
+			head->malformed = true;
+		else
+			head->status = status;
+		return;
+	}
+
+	if(!valid_field_name(name))
+	{
+		head->malformed = true;
+		return;
+	}
+
+	HeaderID id = intern_header(name);
+	if(id == hdr_content_length)
+	{
+		es_free(&head->content_length);
+		head->content_length = es_copy(value);
+		return;
+	}
+	if(connection_specific(id))
+		return;
+
+	es_append(&head->fields, name);
+	es_append(&head->fields, es_temp(": "));
+	es_append(&head->fields, value);
+	es_append(&head->fields, es_temp("\r\n"));
+}
+
+/*
+ * Pass on a final response head. The worker needs to know where the body
+ * ends, so it gets a Content-Length, or is chunked if the origin didn't
+ * say. Responses that can't have a body get neither.
+ */
+static void start_response(H2Connection* conn, H2Stream* stream,
+	ResponseHead* head, bool end)
+{
+	StringRef phrase = response_phrase(head->status);
+	String text = es_printf("HTTP/1.1 %d %.*s\r\n", head->status,
+		ES_STRREFPRINT(&phrase));
+	es_append(&text, es_ref(&head->fields));
+
+	stream->no_body = stream->head_request || head->status == 204 ||
+		head->status == 304;
+	if(stream->no_body)
+	{
+		//The worker would wait for a body that isn't coming
+	}
+	else if(head->content_length.size)
+	{
+		es_append(&text, es_temp("Content-Length: "));
+		es_append(&text, es_ref(&head->content_length));
+		es_append(&text, es_temp("\r\n"));
+	}
+	else if(end)
+	{
+		es_append(&text, es_temp("Content-Length: 0\r\n"));
+	}
+	else
+	{
+		es_append(&text, es_temp("Transfer-Encoding: chunked\r\n"));
+		stream->chunked = true;
+	}
+	es_append(&text, es_temp("\r\n"));
+
+	stream->head_done = true;
+	deliver(conn, stream, es_ref(&text));
+	es_free(&text);
+}
+
+//A complete header block has arrived
+static void handle_header_block(H2Connection* conn, uint32_t id, bool end)
+{
+	ResponseHead head = { .status = 0 };
+
+	//Every block has to be decoded, or the table goes out of sync
+	int decode_error = hpack_decode(&conn->table,
+		es_ref(&conn->header_fragments), collect_header, &head);
+	es_clear(&conn->header_fragments);
+
+	H2Stream* stream = find_stream(conn, id);
+	if(decode_error)
+	{
+		fail_connection(conn, h2_compression_error);
+	}
+
+	//Trailers: nothing to do with them, but they might end the stream
+	else if(stream && stream->head_done)
+	{
+		if(end)
+			end_response(conn, stream);
+	}
+
+	else if(stream && (head.malformed || head.status < 100 ||
+		(head.status < 200 && end)))
+	{
+		reset_stream(conn, stream, h2_protocol_error);
+	}
+
+	//Anything 1xx is just news. The real response is still coming.
+	else if(stream && head.status >= 200)
+	{
+		start_response(conn, stream, &head, end);
+		if(end && find_stream(conn, id))
+			end_response(conn, stream);
+	}
+
+	es_free(&head.fields);
+	es_free(&head.content_length);
+}
+
+//Strip a frame's padding. Returns false if there's more padding than frame.
+static inline bool unpad(H2Frame* frame, StringRef* payload)
+{
+	if(!(frame->flags & h2_flag_padded))
+		return true;
+
+	if(payload->size < 1 || (unsigned char)payload->begin[0] >= payload->size)
+		return false;
+
+	size_t padding = (unsigned char)payload->begin[0];
+	*payload = es_slice(*payload, 1, payload->size - 1 - padding);
+	return true;
+}
+
+static void handle_data(H2Connection* conn, H2Frame* frame, StringRef payload)
+{
+	conn->uncredited += frame->length;
+	if(conn->uncredited >= H2_STREAM_WINDOW)
+	{
+		h2_append_u32_frame(&conn->output, h2_window_update, 0,
+			conn->uncredited);
+		conn->uncredited = 0;
+	}
+
+	if(frame->stream == 0 || !unpad(frame, &payload))
+	{
+		fail_connection(conn, h2_protocol_error);
+		return;
+	}
+
+	//Data for a stream that's been dropped is just thrown away
+	H2Stream* stream = find_stream(conn, frame->stream);
+	if(!stream)
+		return;
+
+	if(!stream->head_done)
+	{
+		reset_stream(conn, stream, h2_protocol_error);
+		return;
+	}
+
+	stream->uncredited += frame->length;
+
+	if(stream->no_body || payload.size == 0)
+		;
+	else if(stream->chunked)
+	{
+		char chunk_line[32];
+		int size = sprintf(chunk_line, "%zx\r\n", payload.size);
+		es_append(&stream->pending, es_tempn(chunk_line, size));
+		es_append(&stream->pending, payload);
+		es_append(&stream->pending, es_temp("\r\n"));
+	}
+	else
+		es_append(&stream->pending, payload);
+
+	if(frame->flags & h2_flag_end_stream)
+		end_response(conn, stream);
+	else
+		write_pending(conn, stream);
+}
+
+static void handle_headers(H2Connection* conn, H2Frame* frame,
+	StringRef payload)
+{
+	if(frame->stream == 0 || !unpad(frame, &payload))
+	{
+		fail_connection(conn, h2_protocol_error);
+		return;
+	}
+	if(frame->flags & h2_flag_priority)
+		payload = es_slice(payload, 5, payload.size);
+
+	es_append(&conn->header_fragments, payload);
+	conn->header_flags = frame->flags;
+	if(frame->flags & h2_flag_end_headers)
+		handle_header_block(conn, frame->stream,
+			frame->flags & h2_flag_end_stream);
+	else
+		conn->header_stream = frame->stream;
+}
+
+static void handle_continuation(H2Connection* conn, H2Frame* frame,
+	StringRef payload)
+{
+	es_append(&conn->header_fragments, payload);
+	if(conn->header_fragments.size > MAX_HEADER_SIZE)
+	{
+		fail_connection(conn, h2_protocol_error);
+		return;
+	}
+
+	if(frame->flags & h2_flag_end_headers)
+	{
+		conn->header_stream = 0;
+		handle_header_block(conn, frame->stream,
+			conn->header_flags & h2_flag_end_stream);
+	}
+}
+
+static void handle_settings(H2Connection* conn, H2Frame* frame,
+	StringRef payload)
+{
+	if(frame->flags & h2_flag_ack)
+		return;
+	if(frame->stream != 0 || payload.size % 6)
+	{
+		fail_connection(conn, h2_frame_size_error);
+		return;
+	}
+
+	for(size_t i = 0; i < payload.size; i += 6)
+	{
+		const unsigned char* setting = (const unsigned char*)payload.begin + i;
+		uint16_t id = setting[0] << 8 | setting[1];
+		uint32_t value = h2_read32(payload.begin + i + 2);
+
+		switch(id)
+		{
+		case h2_settings_max_concurrent_streams:
+			conn->peer_streams = value;
+			break;
+
+		//Open streams' windows move by the difference
+		case h2_settings_initial_window_size:
+			if(value > 0x7fffffff)
+			{
+				fail_connection(conn, h2_flow_control_error);
+				return;
+			}
+			for(int s = 0; s < conn->num_active; ++s)
+				conn->active[s]->send_window += (int64_t)value -
+					conn->peer_window;
+			conn->peer_window = value;
+			break;
+
+		case h2_settings_max_frame_size:
+			if(value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff)
+			{
+				fail_connection(conn, h2_protocol_error);
+				return;
+			}
+			conn->peer_frame_size = value;
+			break;
+		}
+	}
+
+	h2_append_frame(&conn->output, h2_settings, h2_flag_ack, 0, es_temp(""));
+}
+
+/*
+ * The origin is going away. Streams past the last one it'll process never
+ * reached it, so they're sent again on a new connection; the rest get to
+ * finish on this one.
+ */
+static void handle_goaway(H2Connection* conn, StringRef payload)
+{
+	if(payload.size < 8)
+	{
+		fail_connection(conn, h2_frame_size_error);
+		return;
+	}
+
+	submit_debug_c("HTTP/2 origin sent GOAWAY");
+
+	uint32_t last_id = h2_read32(payload.begin) & 0x7fffffff;
+	conn->draining = true;
+
+	for(int i = conn->num_active - 1; i >= 0; --i)
+	{
+		H2Stream* stream = conn->active[i];
+		if(stream->id <= last_id)
+			continue;
+		if(retryable(stream))
+			retry_stream(conn, stream);
+		else
+			drop_stream(conn, stream);
+	}
+}
+
+static void handle_frame(H2Connection* conn, H2Frame* frame, StringRef payload)
+{
+	//A header block can't be interrupted
+	if(conn->header_stream && (frame->type != h2_continuation ||
+		frame->stream != conn->header_stream))
+	{
+		fail_connection(conn, h2_protocol_error);
+		return;
+	}
+
+	H2Stream* stream;
+	switch(frame->type)
+	{
+	case h2_data:
+		handle_data(conn, frame, payload);
+		break;
+
+	case h2_headers:
+		handle_headers(conn, frame, payload);
+		break;
+
+	case h2_continuation:
+		if(!conn->header_stream)
+			fail_connection(conn, h2_protocol_error);
+		else
+			handle_continuation(conn, frame, payload);
+		break;
+
+	//Refused streams were never processed, so they can go again
+	case h2_rst_stream:
+		if(payload.size != 4)
+			fail_connection(conn, h2_frame_size_error);
+		else if((stream = find_stream(conn, frame->stream)))
+		{
+			if(h2_read32(payload.begin) == h2_refused_stream &&
+				retryable(stream))
+				retry_stream(conn, stream);
+			else
+				drop_stream(conn, stream);
+		}
+		break;
+
+	case h2_settings:
+		handle_settings(conn, frame, payload);
+		break;
+
+	//We said no to server push
+	case h2_push_promise:
+		fail_connection(conn, h2_protocol_error);
+		break;
+
+	case h2_ping:
+		if(payload.size != 8)
+			fail_connection(conn, h2_frame_size_error);
+		else if(!(frame->flags & h2_flag_ack))
+			h2_append_frame(&conn->output, h2_ping, h2_flag_ack, 0, payload);
+		break;
+
+	case h2_goaway:
+		handle_goaway(conn, payload);
+		break;
+
+	case h2_window_update:
+		if(payload.size != 4)
+			fail_connection(conn, h2_frame_size_error);
+		else if(frame->stream == 0)
+			conn->send_window += h2_read32(payload.begin) & 0x7fffffff;
+		else if((stream = find_stream(conn, frame->stream)))
+			stream->send_window += h2_read32(payload.begin) & 0x7fffffff;
+		break;
+
+	//PRIORITY, and anything we don't know, is ignored
+	default:
+		break;
+	}
+}
+
+//Read and handle whatever frames have arrived
+static void read_frames(H2Connection* conn)
+{
+	ssize_t received = recv(conn->fd, conn->input + conn->input_size,
+		input_buffer_size - conn->input_size, MSG_DONTWAIT);
+	if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if(received <= 0)
+	{
+		lose_connection(conn);
+		return;
+	}
+	conn->input_size += received;
+
+	size_t offset = 0;
+	while(conn->input_size - offset >= H2_FRAME_HEADER_SIZE)
+	{
+		H2Frame frame = h2_parse_frame(conn->input + offset);
+		if(frame.length > H2_DEFAULT_FRAME_SIZE)
+		{
+			fail_connection(conn, h2_frame_size_error);
+			return;
+		}
+		if(conn->input_size - offset < H2_FRAME_HEADER_SIZE + frame.length)
+			break;
+
+		handle_frame(conn, &frame, es_tempn(conn->input + offset +
+			H2_FRAME_HEADER_SIZE, frame.length));
+		if(conn->fd < 0)
+			return;
+		offset += H2_FRAME_HEADER_SIZE + frame.length;
+	}
+
+	memmove(conn->input, conn->input + offset, conn->input_size - offset);
+	conn->input_size -= offset;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// THREAD
+//////////////////////////////////////////////////////////////////////////////
+
+//Queue up newly submitted streams. Returns false at shutdown.
+static bool take_submissions(H2Connection* conn)
+{
+	H2Origin* origin = conn->origin;
+
+	pthread_mutex_lock(&origin->lock);
+	H2Stream* submitted = origin->submitted;
+	origin->submitted = 0;
+	bool shutdown = origin->shutdown;
+	pthread_mutex_unlock(&origin->lock);
+
+	//They were pushed on the front, so reverse them into the queue
+	H2Stream* in_order = 0;
+	while(submitted)
+	{
+		H2Stream* next = submitted->next;
+		submitted->next = in_order;
+		in_order = submitted;
+		submitted = next;
+	}
+	if(in_order)
+	{
+		if(conn->queue_end)
+			conn->queue_end->next = in_order;
+		else
+			conn->queue = in_order;
+		while(in_order->next)
+			in_order = in_order->next;
+		conn->queue_end = in_order;
+	}
+
+	return !shutdown;
+}
+
+static void* h2_origin_thread(void* arg)
+{
+	H2Connection conn = { .origin = arg, .fd = -1 };
+	conn.input = buffer_borrow(input_buffer_size);
+
+	struct pollfd fds[H2_MAX_STREAMS + 2];
+	H2Stream* polled[H2_MAX_STREAMS];
+
+	while(take_submissions(&conn))
+	{
+		//A connection that's done for closes once its last stream finishes
+		if(conn.fd >= 0 && conn.draining && !conn.num_active)
+		{
+			flush_output(&conn);
+			if(conn.fd >= 0)
+				lose_connection(&conn);
+		}
+
+		if(conn.fd < 0 && conn.queue)
+			connect_origin(&conn);
+
+		start_streams(&conn);
+		send_bodies(&conn);
+		if(conn.fd >= 0)
+			flush_output(&conn);
+
+		int count = 0;
+		fds[count++] = (struct pollfd){ .fd = conn.origin->wake_fd,
+			.events = POLLIN };
+		if(conn.fd >= 0)
+			fds[count++] = (struct pollfd){ .fd = conn.fd,
+				.events = POLLIN | (output_backlog(&conn) ? POLLOUT : 0) };
+		int first_stream = count;
+		for(int i = 0; i < conn.num_active; ++i)
+		{
+			H2Stream* stream = conn.active[i];
+			polled[i] = stream;
+			fds[count++] = (struct pollfd){ .fd = stream->fd,
+				.events = POLLRDHUP |
+					(stream->pending_sent < stream->pending.size ? POLLOUT : 0) |
+					(wants_upload(&conn, stream) ? POLLIN : 0) };
+		}
+
+		if(poll(fds, count, -1) < 0)
+			continue;
+
+		uint64_t wakes;
+		if(fds[0].revents &&
+			read(conn.origin->wake_fd, &wakes, sizeof(wakes)) < 0)
+			submit_debug_c("Unable to read HTTP/2 origin thread wakeup");
+
+		//Workers first, since the frames can end their streams
+		for(int i = first_stream; i < count; ++i)
+		{
+			H2Stream* stream = polled[i - first_stream];
+			short revents = fds[i].revents;
+			if(!revents)
+				continue;
+
+			if(revents & POLLOUT && !write_pending(&conn, stream))
+				continue;
+			if(revents & POLLIN && wants_upload(&conn, stream))
+			{
+				send_upload(&conn, stream);
+				continue;
+			}
+			if(revents & (POLLHUP | POLLRDHUP | POLLERR))
+				reset_stream(&conn, stream, h2_cancel);
+		}
+
+		if(first_stream == 2 && conn.fd >= 0 &&
+			fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+			read_frames(&conn);
+		if(conn.fd >= 0 && output_backlog(&conn))
+			flush_output(&conn);
+	}
+
+	//Shutting down: whoever's still waiting finds their origin gone
+	if(conn.fd >= 0)
+		lose_connection(&conn);
+	while(conn.queue)
+	{
+		H2Stream* stream = conn.queue;
+		conn.queue = stream->next;
+		free_stream(stream);
+	}
+	es_free(&conn.output);
+	es_free(&conn.header_fragments);
+	buffer_return(conn.input, input_buffer_size);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// WORKERS
+//////////////////////////////////////////////////////////////////////////////
+
+int h2_add_origin(const char* authority)
+{
+	const char* colon = strrchr(authority, ':');
+	if(!colon)
+		return -1;
+
+	H2Origin* origin = calloc(1, sizeof(H2Origin));
+	origin->domain = es_copy(es_tempn(authority, colon - authority));
+	origin->port = es_copy(es_temp(colon + 1));
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	origin->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pthread_mutex_init(&origin->lock, 0);
+
+	if(getaddrinfo(es_cstrc(&origin->domain), es_cstrc(&origin->port), &hints,
+			&origin->address) || origin->wake_fd < 0 ||
+		pthread_create(&origin->thread, 0, h2_origin_thread, origin))
+	{
+		if(origin->address) freeaddrinfo(origin->address);
+		if(origin->wake_fd >= 0) close(origin->wake_fd);
+		pthread_mutex_destroy(&origin->lock);
+		es_free(&origin->domain);
+		es_free(&origin->port);
+		free(origin);
+		return -1;
+	}
+
+	affinity_register(origin->thread, affinity_housekeeping, 0);
+
+	origin->next = origins;
+	origins = origin;
+	return 0;
+}
+
+H2Origin* h2_find_origin(const HTTP_Message* request)
+{
+	const HTTP_ReqLine* line = &request->request;
+	StringRef port = line->port.size ? es_ref(&line->port) : es_temp("80");
+
+	for(H2Origin* origin = origins; origin; origin = origin->next)
+	{
+		if(origin->domain.size == line->domain.size &&
+			strncasecmp(es_cstrc(&origin->domain), es_ref(&line->domain).begin,
+				line->domain.size) == 0 &&
+			es_compare(es_ref(&origin->port), port) == 0)
+			return origin;
+	}
+	return 0;
+}
+
+int h2_open_stream(H2Origin* origin, HTTP_Message* request)
+{
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+		return -1;
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+	H2Stream* stream = calloc(1, sizeof(H2Stream));
+	stream->fd = fds[1];
+	stream->idempotent = request->request.method != post;
+	stream->head_request = request->request.method == head;
+	stream->header_block = encode_request(request);
+	stream->body = es_copy(es_ref(&request->body));
+	stream->unread_body = request->unread_body;
+
+	pthread_mutex_lock(&origin->lock);
+	stream->next = origin->submitted;
+	origin->submitted = stream;
+	pthread_mutex_unlock(&origin->lock);
+
+	uint64_t wake = 1;
+	if(write(origin->wake_fd, &wake, sizeof(wake)) < 0)
+		submit_debug_c("Unable to wake HTTP/2 origin thread");
+
+	return fds[0];
+}
+
+__attribute__((destructor (MODULE_H2_PRI)))
+void deinit_h2_upstream()
+{
+	if(DEBUG_PRINT && origins) puts("Closing HTTP/2 upstreams");
+
+	while(origins)
+	{
+		H2Origin* origin = origins;
+		origins = origin->next;
+
+		pthread_mutex_lock(&origin->lock);
+		origin->shutdown = true;
+		pthread_mutex_unlock(&origin->lock);
+
+		uint64_t wake = 1;
+		if(write(origin->wake_fd, &wake, sizeof(wake)) == sizeof(wake))
+			pthread_join(origin->thread, 0);
+
+		close(origin->wake_fd);
+		freeaddrinfo(origin->address);
+		pthread_mutex_destroy(&origin->lock);
+		es_free(&origin->domain);
+		es_free(&origin->port);
+		free(origin);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * h2_upstream.h
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ *
+ *  HTTP/2 cleartext, with prior knowledge, to the origins configured with -2.
+ *  Each one gets a thread that owns a single connection to it, opened when
+ *  the first request comes in, and multiplexes every request for that origin
+ *  onto it as streams, up to H2_MAX_STREAMS at once; the rest wait their
+ *  turn.
+ *
+ *  Workers don't speak HTTP/2. Each stream is handed to its worker as one end
+ *  of a socketpair that behaves like an HTTP/1.1 origin connection: the
+ *  worker relays any unread request body into it, then reads an HTTP/1.1
+ *  response back out, exactly as it would from a TCP socket. The origin's
+ *  thread does the translation, and the flow control: a stream's window is
+ *  only reopened once the worker has taken what was sent on it.
+ *
+ *  Requests that the origin refused, or that went unanswered on a connection
+ *  that closed (GET and HEAD only), are retried once on a new connection.
+ */
+
+#pragma once
+
+#include "http.h"
+
+typedef struct h2_origin H2Origin;
+
+/*
+ * Send requests for host:port over HTTP/2. The origin has to speak h2c with
+ * prior knowledge. Returns 0, or -1 if it doesn't resolve.
+ */
+int h2_add_origin(const char* authority);
+
+//The HTTP/2 origin for a request, or 0 if it should go over HTTP/1.1
+H2Origin* h2_find_origin(const HTTP_Message* request);
+
+/*
+ * Send a request, already prepared for forwarding, as a new stream. Returns
+ * the worker's end of the stream, to be used and closed like a connection to
+ * the origin, or -1. If the request has an unread body, it's expected to be
+ * relayed into the stream.
+ */
+int h2_open_stream(H2Origin* origin, HTTP_Message* request);
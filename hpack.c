@@ -0,0 +1,534 @@
+/*
+ * hpack.c
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "config.h"
+
+struct hpack_entry
+{
+	String name;
+	String value;
+};
+
+//Every entry costs its name and value, plus this
+#define ENTRY_OVERHEAD 32
+
+///////////////////////////////////////////////////////////////////////////////
+// TABLES FROM RFC 7541
+///////////////////////////////////////////////////////////////////////////////
+
+static const struct { const char* name; const char* value; } static_table[] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },};
+
+#define STATIC_ENTRIES (sizeof(static_table) / sizeof(static_table[0]))
+
+//The Huffman code for each byte, and for EOS (256): the code, and its length
+static const struct { uint32_t code; uint8_t bits; } huffman_codes[257] =
+{
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+/*
+ * The Huffman code as a binary tree, for decoding a bit at a time. Each node
+ * has two children; a child >= 0 is another node, and a negative one is the
+ * leaf for symbol -child - 1.
+ */
+static int16_t huffman_tree[256][2];
+
+__attribute__((constructor (MODULE_HPACK_PRI)))
+void init_hpack()
+{
+	if(DEBUG_PRINT) puts("Building HPACK Huffman tree");
+
+	int nodes = 1;
+	memset(huffman_tree, 0, sizeof(huffman_tree));
+
+	for(int symbol = 0; symbol < 257; ++symbol)
+	{
+		int node = 0;
+		for(int bit = huffman_codes[symbol].bits - 1; bit >= 0; --bit)
+		{
+			int branch = (huffman_codes[symbol].code >> bit) & 1;
+			if(bit == 0)
+				huffman_tree[node][branch] = -symbol - 1;
+			else
+			{
+				if(huffman_tree[node][branch] == 0)
+					huffman_tree[node][branch] = nodes++;
+				node = huffman_tree[node][branch];
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE DYNAMIC TABLE
+///////////////////////////////////////////////////////////////////////////////
+
+void hpack_init(HpackTable* table, size_t limit)
+{
+	table->entries = 0;
+	table->capacity = table->newest = table->count = 0;
+	table->size = 0;
+	table->max_size = table->limit = limit;
+}
+
+//The entry at a dynamic index, 0 being the newest
+static inline HpackEntry* dynamic_entry(HpackTable* table, size_t index)
+{
+	return &table->entries[(table->newest + index) % table->capacity];
+}
+
+static inline void evict_oldest(HpackTable* table)
+{
+	HpackEntry* oldest = dynamic_entry(table, table->count - 1);
+	table->size -= oldest->name.size + oldest->value.size + ENTRY_OVERHEAD;
+	es_free(&oldest->name);
+	es_free(&oldest->value);
+	--table->count;
+}
+
+static inline void evict_to(HpackTable* table, size_t size)
+{
+	while(table->count && table->size > size)
+		evict_oldest(table);
+}
+
+void hpack_free(HpackTable* table)
+{
+	evict_to(table, 0);
+	free(table->entries);
+	table->entries = 0;
+	table->capacity = 0;
+}
+
+/*
+ * Add an entry. The name and value are copied before anything is evicted,
+ * since the name may belong to an entry that's about to go.
+ */
+static void table_insert(HpackTable* table, StringRef name, StringRef value)
+{
+	HpackEntry entry = { es_copy(name), es_copy(value) };
+	size_t size = name.size + value.size + ENTRY_OVERHEAD;
+
+	//An entry bigger than the table just empties it
+	evict_to(table, size > table->max_size ? 0 : table->max_size - size);
+	if(size > table->max_size)
+	{
+		es_free(&entry.name);
+		es_free(&entry.value);
+		return;
+	}
+
+	if(table->count == table->capacity)
+	{
+		size_t capacity = table->capacity ? table->capacity * 2 : 16;
+		HpackEntry* entries = malloc(capacity * sizeof(HpackEntry));
+		for(size_t i = 0; i < table->count; ++i)
+			entries[i] = *dynamic_entry(table, i);
+		free(table->entries);
+		table->entries = entries;
+		table->capacity = capacity;
+		table->newest = 0;
+	}
+
+	table->newest = (table->newest + table->capacity - 1) % table->capacity;
+	*dynamic_entry(table, 0) = entry;
+	++table->count;
+	table->size += size;
+}
+
+//Look up an index in both tables. Returns -1 if it's out of range.
+static int table_lookup(HpackTable* table, uint64_t index, StringRef* name,
+	StringRef* value)
+{
+	if(index == 0)
+		return -1;
+
+	if(index <= STATIC_ENTRIES)
+	{
+		*name = es_temp(static_table[index - 1].name);
+		*value = es_temp(static_table[index - 1].value);
+		return 0;
+	}
+
+	index -= STATIC_ENTRIES + 1;
+	if(index >= table->count)
+		return -1;
+
+	HpackEntry* entry = dynamic_entry(table, index);
+	*name = es_ref(&entry->name);
+	*value = es_ref(&entry->value);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DECODING
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Decode an integer with an N bit prefix, the first byte of which is at the
+ * front of block. Returns -1 if it's truncated or absurdly large.
+ */
+static int decode_integer(StringRef* block, int prefix_bits, uint64_t* result)
+{
+	if(!block->size)
+		return -1;
+
+	uint64_t mask = (1 << prefix_bits) - 1;
+	*result = (unsigned char)block->begin[0] & mask;
+	*block = es_slice(*block, 1, block->size);
+
+	if(*result < mask)
+		return 0;
+
+	for(int shift = 0; shift <= 56; shift += 7)
+	{
+		if(!block->size)
+			return -1;
+
+		unsigned char byte = block->begin[0];
+		*block = es_slice(*block, 1, block->size);
+		*result += (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+//Decode Huffman coded text onto the end of output. Returns 0 or -1.
+static int huffman_decode(StringRef text, String* output)
+{
+	char decoded[256];
+	size_t decoded_size = 0;
+
+	int node = 0;
+	int pending_bits = 0; //Bits since the last symbol
+	bool all_ones = true; //Whether they could be padding
+
+	for(size_t i = 0; i < text.size; ++i)
+	{
+		for(int bit = 7; bit >= 0; --bit)
+		{
+			int branch = ((unsigned char)text.begin[i] >> bit) & 1;
+			int next = huffman_tree[node][branch];
+			++pending_bits;
+			all_ones = all_ones && branch;
+
+			if(next >= 0)
+			{
+				node = next;
+				continue;
+			}
+
+			//EOS in the data is an error
+			int symbol = -next - 1;
+			if(symbol == 256)
+				return -1;
+
+			decoded[decoded_size++] = symbol;
+			if(decoded_size == sizeof(decoded))
+			{
+				es_append(output, es_tempn(decoded, decoded_size));
+				decoded_size = 0;
+			}
+
+			node = 0;
+			pending_bits = 0;
+			all_ones = true;
+		}
+	}
+
+	es_append(output, es_tempn(decoded, decoded_size));
+
+	//Padding is the start of EOS: at most 7 bits, all ones
+	return pending_bits > 7 || !all_ones ? -1 : 0;
+}
+
+/*
+ * Decode a string literal. Huffman coded ones are decoded into scratch,
+ * which is cleared first, and the result refers to it.
+ */
+static int decode_string(StringRef* block, String* scratch, StringRef* result)
+{
+	if(!block->size)
+		return -1;
+
+	bool huffman = block->begin[0] & 0x80;
+	uint64_t size;
+	if(decode_integer(block, 7, &size) || size > block->size)
+		return -1;
+
+	StringRef text = es_slice(*block, 0, size);
+	*block = es_slice(*block, size, block->size);
+
+	if(!huffman)
+	{
+		*result = text;
+		return 0;
+	}
+
+	es_clear(scratch);
+	if(huffman_decode(text, scratch))
+		return -1;
+	*result = es_ref(scratch);
+	return 0;
+}
+
+int hpack_decode(HpackTable* table, StringRef block,
+	void (*emit)(void* arg, StringRef name, StringRef value), void* arg)
+{
+	String name_scratch = es_empty_string;
+	String value_scratch = es_empty_string;
+	int error = 0;
+
+	#define FAIL { error = -1; break; }
+
+	while(block.size)
+	{
+		unsigned char first = block.begin[0];
+		uint64_t index;
+		StringRef name, value;
+
+		//Indexed header field
+		if(first & 0x80)
+		{
+			if(decode_integer(&block, 7, &index) ||
+					table_lookup(table, index, &name, &value))
+				FAIL
+			emit(arg, name, value);
+			continue;
+		}
+
+		//Dynamic table size update
+		if((first & 0xe0) == 0x20)
+		{
+			if(decode_integer(&block, 5, &index) || index > table->limit)
+				FAIL
+			table->max_size = index;
+			evict_to(table, index);
+			continue;
+		}
+
+		//A literal, with incremental indexing or without
+		bool indexing = (first & 0xc0) == 0x40;
+		if(decode_integer(&block, indexing ? 6 : 4, &index))
+			FAIL
+
+		if(index)
+		{
+			StringRef unused;
+			if(table_lookup(table, index, &name, &unused))
+				FAIL
+		}
+		else if(decode_string(&block, &name_scratch, &name))
+			FAIL
+
+		if(decode_string(&block, &value_scratch, &value))
+			FAIL
+
+		emit(arg, name, value);
+		if(indexing)
+			table_insert(table, name, value);
+	}
+
+	#undef FAIL
+
+	es_free(&name_scratch);
+	es_free(&value_scratch);
+	return error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ENCODING
+///////////////////////////////////////////////////////////////////////////////
+
+static void encode_integer(String* block, unsigned char first, int prefix_bits,
+	uint64_t value)
+{
+	char bytes[16];
+	size_t size = 0;
+	uint64_t mask = (1 << prefix_bits) - 1;
+
+	if(value < mask)
+		bytes[size++] = first | value;
+	else
+	{
+		bytes[size++] = first | mask;
+		value -= mask;
+		while(value >= 0x80)
+		{
+			bytes[size++] = (value & 0x7f) | 0x80;
+			value >>= 7;
+		}
+		bytes[size++] = value;
+	}
+
+	es_append(block, es_tempn(bytes, size));
+}
+
+//Strings go out as they are; Huffman coding them isn't worth the CPU here
+static inline void encode_string(String* block, StringRef text)
+{
+	encode_integer(block, 0, 7, text.size);
+	es_append(block, text);
+}
+
+void hpack_encode(String* block, StringRef name, StringRef value)
+{
+	size_t name_index = 0;
+	for(size_t i = 0; i < STATIC_ENTRIES; ++i)
+	{
+		if(es_compare(name, es_temp(static_table[i].name)) != 0)
+			continue;
+
+		if(es_compare(value, es_temp(static_table[i].value)) == 0)
+		{
+			encode_integer(block, 0x80, 7, i + 1);
+			return;
+		}
+		if(!name_index)
+			name_index = i + 1;
+	}
+
+	//Literal without indexing
+	encode_integer(block, 0, 4, name_index);
+	if(!name_index)
+		encode_string(block, name);
+	encode_string(block, value);
+}
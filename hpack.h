@@ -0,0 +1,52 @@
+/*
+ * hpack.h
+ *
+ *  Created on: Mar 22, 2014
+ *      Author: nathan
+ *
+ *  HPACK (RFC 7541), HTTP/2's header compression. The decoder is complete:
+ *  static and dynamic tables, Huffman coded strings, and table size updates.
+ *  The encoder keeps it simple and never adds to the dynamic table. Headers
+ *  go out as static table references where one matches, and as literals
+ *  that aren't indexed otherwise, so the peer's table size doesn't matter.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "EasyString/easy_string.h"
+
+typedef struct hpack_entry HpackEntry;
+
+/*
+ * A decoder's dynamic table. Entries are kept in a ring, newest first, and
+ * sized the way HPACK counts them: name, value, and 32 bytes of overhead.
+ */
+typedef struct
+{
+	HpackEntry* entries;
+	size_t capacity;
+	size_t newest;
+	size_t count;
+
+	size_t size;
+	size_t max_size; //Set by the encoder, with size updates
+	size_t limit; //The most it may set, from our SETTINGS_HEADER_TABLE_SIZE
+} HpackTable;
+
+//Set up a decoder's table. limit is the table size we advertise.
+void hpack_init(HpackTable* table, size_t limit);
+void hpack_free(HpackTable* table);
+
+/*
+ * Decode a complete header block, calling emit with each header in order.
+ * The name and value are only valid during the call. Returns 0, or -1 if the
+ * block is malformed, which is a connection error: the table can't be
+ * trusted after that.
+ */
+int hpack_decode(HpackTable* table, StringRef block,
+	void (*emit)(void* arg, StringRef name, StringRef value), void* arg);
+
+//Append a header to a block. The name must already be lowercase.
+void hpack_encode(String* block, StringRef name, StringRef value);
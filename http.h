@@ -10,25 +10,35 @@
 #pragma once
 
 #include <string.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 #include "EasyString/easy_string.h"
 
 /*
  * HTTP_ReqLine contains the data for a single request line. Members:
- *   method: an enum set to either head, get, or post
+ *   method: an enum set to either head, get, post, or connect_method
  *   domain: a null-terminated string with the domain (www.reddit.com)
+ *   port: the port from the request target, if it had one (8080). Always set
+ *     for CONNECT.
  *   path: a null-terminated string with the path (r/python)
- *     No leading '/' character
+ *     No leading '/' character. Always empty for CONNECT.
  *   http_version: the character '0' or '1', depending on the http version
+ *   origin_form: true if the request line had no domain (GET /r/python), as
+ *     sent to a server rather than a proxy. It's written back out that way
+ *     even if domain has been filled in since.
  */
 
-typedef enum { head, get, post } MethodType;
+//connect_method, because connect() is taken
+typedef enum { head, get, post, connect_method } MethodType;
 
 typedef struct
 {
 	String domain;
+	String port;
 	String path;
 	MethodType method;
 	char http_version; //0->1.0, 1->1.1
+	bool origin_form;
 } HTTP_ReqLine;
 
 /*
@@ -45,13 +55,96 @@ typedef struct
 } HTTP_RespLine;
 
 /*
- * HTTP_Header contains the data for a single header. It has 2 null-terminated
- * strings for each of the name and value.
+ * The well-known header names. Each of these is interned to a HeaderID when
+ * a header is added to a message, so that the proxy's own lookups (Host,
+ * Content-Length, etc) never have to compare strings. The second column is
+ * the canonical spelling, used when the proxy generates a header itself.
+ */
+#define HTTP_WELL_KNOWN_HEADERS(X) \
+	X(hdr_accept, "Accept") \
+	X(hdr_accept_charset, "Accept-Charset") \
+	X(hdr_accept_encoding, "Accept-Encoding") \
+	X(hdr_accept_language, "Accept-Language") \
+	X(hdr_accept_ranges, "Accept-Ranges") \
+	X(hdr_age, "Age") \
+	X(hdr_allow, "Allow") \
+	X(hdr_authorization, "Authorization") \
+	X(hdr_cache_control, "Cache-Control") \
+	X(hdr_connection, "Connection") \
+	X(hdr_content_encoding, "Content-Encoding") \
+	X(hdr_content_language, "Content-Language") \
+	X(hdr_content_length, "Content-Length") \
+	X(hdr_content_location, "Content-Location") \
+	X(hdr_content_range, "Content-Range") \
+	X(hdr_content_type, "Content-Type") \
+	X(hdr_cookie, "Cookie") \
+	X(hdr_date, "Date") \
+	X(hdr_etag, "ETag") \
+	X(hdr_expect, "Expect") \
+	X(hdr_expires, "Expires") \
+	X(hdr_from, "From") \
+	X(hdr_host, "Host") \
+	X(hdr_if_match, "If-Match") \
+	X(hdr_if_modified_since, "If-Modified-Since") \
+	X(hdr_if_none_match, "If-None-Match") \
+	X(hdr_if_range, "If-Range") \
+	X(hdr_if_unmodified_since, "If-Unmodified-Since") \
+	X(hdr_keep_alive, "Keep-Alive") \
+	X(hdr_last_modified, "Last-Modified") \
+	X(hdr_location, "Location") \
+	X(hdr_max_forwards, "Max-Forwards") \
+	X(hdr_pragma, "Pragma") \
+	X(hdr_proxy_authenticate, "Proxy-Authenticate") \
+	X(hdr_proxy_authorization, "Proxy-Authorization") \
+	X(hdr_proxy_connection, "Proxy-Connection") \
+	X(hdr_range, "Range") \
+	X(hdr_referer, "Referer") \
+	X(hdr_retry_after, "Retry-After") \
+	X(hdr_server, "Server") \
+	X(hdr_set_cookie, "Set-Cookie") \
+	X(hdr_te, "TE") \
+	X(hdr_trailer, "Trailer") \
+	X(hdr_transfer_encoding, "Transfer-Encoding") \
+	X(hdr_upgrade, "Upgrade") \
+	X(hdr_user_agent, "User-Agent") \
+	X(hdr_vary, "Vary") \
+	X(hdr_via, "Via") \
+	X(hdr_warning, "Warning") \
+	X(hdr_www_authenticate, "WWW-Authenticate")
+
+/*
+ * HeaderID is the interned form of a header name. hdr_unknown is used for any
+ * name not in the list above.
+ */
+#define HEADER_ID_ENUM(ID, NAME) ID,
+typedef enum
+{
+	hdr_unknown,
+	HTTP_WELL_KNOWN_HEADERS(HEADER_ID_ENUM)
+	num_header_ids
+} HeaderID;
+#undef HEADER_ID_ENUM
+
+/*
+ * HTTP_Header contains the data for a single header: the name and value, and
+ * the interned ID of the name. The name and value are StringRefs; for headers
+ * read off the wire they point straight into the message's header_block, so
+ * parsing doesn't copy anything. Headers added or modified by the proxy own a
+ * copy of their text in storage instead.
+ *
+ * line is the header's complete raw text in the header_block (including any
+ * continuation lines and the trailing newline), or empty for headers the
+ * proxy added. When a message is written, unmodified headers are forwarded
+ * as their original bytes; removed headers are skipped.
  */
 typedef struct _http_header
 {
-	String name;
-	String value;
+	StringRef name;
+	StringRef value;
+	StringRef line;
+	String storage; //Empty unless the header owns its text
+	HeaderID id;
+	bool removed;
 	struct _http_header* next;
 } HTTP_Header;
 
@@ -62,11 +155,22 @@ typedef struct _http_header
  * responsibility to keep track of what a given message is. Members:
  *   request: an HTTP_ReqLine structure
  *   response: an HTTP_RespLine structure
- *   num_headers: the number of headers
- *   headers: an array of HTTP_Header data structures. Contains num_headers
- *     headers.
- *   body_length: the size, in bytes, of the body
+ *   headers: a linked list of HTTP_Header data structures, in the order they
+ *     appeared on the wire, followed by any the proxy added.
+ *   last_header: the end of the headers list, for appending.
+ *   header_index: for each well-known HeaderID, the first header with that
+ *     ID, or null. Maintained by add_header.
+ *   header_block: the raw header text as it was received. Headers read by
+ *     read_headers reference ranges of this buffer, so it lives as long as the
+ *     message does. With HEADER_PASSTHROUGH, only the well-known headers are
+ *     parsed out of it at all; the rest are forwarded as part of the block.
  *   body: the binary body content.
+ *   unread_body: for bodies too big to buffer, the number of body bytes
+ *     left waiting on the connection by read_body. The body is left empty,
+ *     and the real one is forwarded with relay_body after the message is
+ *     written.
+ *   budget: the bytes this message has charged to the memory budget, given
+ *     back when it's cleared.
  *
  * The read_* functions in this header dynamically allocate all the arrays and
  * strings. However, the write functions do not assume anything about the
@@ -82,8 +186,13 @@ typedef struct
 	};
 
 	HTTP_Header* headers;
+	HTTP_Header* last_header;
+	HTTP_Header* header_index[num_header_ids];
+	String header_block;
 
 	String body;
+	size_t unread_body;
+	size_t budget;
 } HTTP_Message;
 
 static const HTTP_Message empty_message;
@@ -99,13 +208,15 @@ enum
 
 	malformed_line, //regex didn't match
 
-	bad_method, //method isn't GET, HEAD, or POST
+	bad_method, //method isn't GET, HEAD, POST, or CONNECT
 	bad_version, //HTTP version isn't 1.0 or 1.1
 
 	bad_content_length, //content length header is invalid
 
 	too_long, //Something was too long
-	too_many_headers //There are too many headers
+	too_many_headers, //There are too many headers
+
+	over_budget //No room in the memory budget for the body
 };
 
 //// READS
@@ -113,33 +224,117 @@ enum
 int read_request_line(HTTP_Message* message, int fd);
 int read_response_line(HTTP_Message* message, int fd);
 
+/*
+ * Split a host[:port] authority into the request line's domain and port. The
+ * port, if there is one, has to be a number. Returns 0 or malformed_line.
+ */
+int split_authority(HTTP_ReqLine* line, StringRef authority);
+
 //Read all headers
 int read_headers(HTTP_Message* message, int fd);
 
-//Read the body
+/*
+ * Read the body. Bodies over MAX_BUFFERED_BODY_SIZE aren't read; see
+ * unread_body and relay_body.
+ */
 int read_body(HTTP_Message* message, int fd);
 
+/*
+ * Forward a message's unread body from one connection to another, through a
+ * buffer bounded by the relay watermarks. Returns 0 or connection_error.
+ */
+int relay_body(HTTP_Message* message, int from_fd, int to_fd);
+
+/*
+ * Split the next header off the front of a raw header block, without the
+ * regex: its complete line (including continuations), its name, and its
+ * value. At the block's terminating empty line, line is set to empty. Returns
+ * 0, or malformed_line.
+ */
+int next_raw_header(StringRef* header_text, StringRef* line, StringRef* name,
+	StringRef* value);
+
 //// WRITES
 int write_request(HTTP_Message* message, int fd);
 int write_response(HTTP_Message* message, int fd);
 
+//The request or response line and headers, up to and including the empty line
+String serialize_request_head(HTTP_Message* message);
+String serialize_response_head(HTTP_Message* message);
+
+//Send a list of buffers, handling partial sends. Modifies parts.
+int write_parts(int fd, struct iovec* parts, int num_parts);
+
 //// CLEARS
 void clear_request(HTTP_Message* message);
 void clear_response(HTTP_Message* message);
 
 ////MANIPULATORS
-//Find a header.
+/*
+ * Find a header. With HEADER_PASSTHROUGH, unknown headers read off the wire
+ * don't have HTTP_Header nodes; use find_header_value to search for those.
+ */
 const HTTP_Header* find_header(const HTTP_Message* message, StringRef header);
 
+/*
+ * Find the value of any header, including unparsed ones in the header block.
+ * Returns true and sets value if it's found. Doesn't allocate.
+ */
+bool find_header_value(const HTTP_Message* message, StringRef header,
+	StringRef* value);
+
+//Find a well-known header by ID. O(1).
+static inline const HTTP_Header* find_header_id(const HTTP_Message* message,
+	HeaderID id)
+{ return message->header_index[id]; }
+
+//Get the interned ID of a header name (hdr_unknown if it isn't well-known)
+HeaderID intern_header(StringRef name);
+
+//Get the canonical spelling of a well-known header name
+StringRef header_id_name(HeaderID id);
+
+//Case-insensitive header name comparison. Doesn't allocate.
+bool header_names_equal(StringRef name1, StringRef name2);
+
+//Trim linear whitespace off both ends of a header value
+StringRef trim_lws(StringRef text);
+
+/*
+ * Split the next comma-separated element off the front of a header value
+ * list, trimmed. Returns false when the list is used up.
+ */
+bool next_list_element(StringRef* list, StringRef* element);
+
 //Get an appropriate phrase for a given response code
 StringRef response_phrase(int code);
 
 //Get the method name
 StringRef method_name(MethodType method);
 
-//Add a header
+//Add a header. The name and value are copied.
 void add_header(HTTP_Message* message, StringRef name, StringRef value);
 
+/*
+ * Add a header without copying. The name, value, and line must remain valid
+ * for the life of the message; in practice, they must point into its
+ * header_block.
+ */
+void add_header_ref(HTTP_Message* message, StringRef name, StringRef value,
+	StringRef line);
+
+//Change the value of a header. The header takes ownership of a copy.
+void set_header_value(HTTP_Header* header, StringRef value);
+
+//Set a header's value if it's present, or add it if it isn't
+void set_header(HTTP_Message* message, StringRef name, StringRef value);
+
+//Remove all the headers with a given name
+void remove_header(HTTP_Message* message, StringRef name);
+
+//Set the Content-Length header
+void set_content_length(HTTP_Message* message, size_t length);
+
 //Set the response code, and an appropriate phrase
 void set_response(HTTP_Message* message, int code);
 
@@ -8,14 +8,15 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "http.h"
+#include "memory_budget.h"
 
 static inline void clear_headers(HTTP_Header* header)
 {
 	if(header)
 	{
-		es_free(&header->name);
-		es_free(&header->value);
+		es_free(&header->storage);
 		clear_headers(header->next);
 		free(header);
 	}
@@ -25,13 +26,21 @@ static inline void clear_common(HTTP_Message* message)
 {
 	clear_headers(message->headers);
 	message->headers = 0;
+	message->last_header = 0;
+	memset(message->header_index, 0, sizeof(message->header_index));
+	es_clear(&message->header_block);
 	es_clear(&message->body);
+	message->unread_body = 0;
+	budget_release(message->budget);
+	message->budget = 0;
 }
 
 static inline void clear_request_line(HTTP_ReqLine* line)
 {
 	es_clear(&line->domain);
+	es_clear(&line->port);
 	es_clear(&line->path);
+	line->origin_form = false;
 }
 
 static inline void clear_response_line(HTTP_RespLine* line)
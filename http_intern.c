@@ -0,0 +1,125 @@
+/*
+ * http_intern.c
+ *
+ *  Created on: Mar 6, 2014
+ *      Author: nathan
+ *
+ *  Interning of the well-known header names to HeaderIDs. The names are
+ *  placed in a perfect hash table (no two well-known names share a slot), so
+ *  interning a name is one hash over its bytes and at most one
+ *  case-insensitive comparison. Nothing here allocates.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+#include "config.h"
+
+/*
+ * There's no build step in this project to run a generator like gperf, so the
+ * perfect hash is found when the module is initialized instead: we just try
+ * seeds until one of them gives every well-known name its own slot. With 50
+ * names in 256 slots this takes a few dozen tries at most.
+ */
+#define HEADER_TABLE_SIZE 256
+
+//Canonical names, indexed by HeaderID
+#define HEADER_ID_NAME(ID, NAME) [ID] = NAME,
+static const char* const header_names[num_header_ids] =
+{
+	[hdr_unknown] = 0,
+	HTTP_WELL_KNOWN_HEADERS(HEADER_ID_NAME)
+};
+#undef HEADER_ID_NAME
+
+//Lengths of the canonical names, so we don't have to strlen them
+static size_t header_name_lengths[num_header_ids];
+
+//The longest well-known name. Anything longer is trivially unknown.
+static size_t max_header_name_length;
+
+//Hash slot -> HeaderID. hdr_unknown (0) is an empty slot.
+static uint8_t header_table[HEADER_TABLE_SIZE];
+
+//The seed that makes the hash perfect for the current list of names
+static uint32_t header_hash_seed;
+
+//Seeded FNV-1a over the lowercased bytes of the name
+static inline uint32_t header_hash(StringRef name, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+	for(size_t i = 0; i < name.size; ++i)
+	{
+		//ASCII lowercase. Header names are tokens, so this is fine.
+		unsigned char c = name.begin[i];
+		if(c >= 'A' && c <= 'Z') c |= 0x20;
+
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash ^ (hash >> 15);
+}
+
+static inline size_t header_slot(StringRef name, uint32_t seed)
+{
+	return header_hash(name, seed) & (HEADER_TABLE_SIZE - 1);
+}
+
+//Try to build the table with a given seed. Returns false on any collision.
+static inline bool try_header_seed(uint32_t seed)
+{
+	memset(header_table, 0, sizeof(header_table));
+	for(int id = hdr_unknown + 1; id < num_header_ids; ++id)
+	{
+		size_t slot = header_slot(
+			es_tempn(header_names[id], header_name_lengths[id]), seed);
+		if(header_table[slot] != hdr_unknown)
+			return false;
+		header_table[slot] = id;
+	}
+	return true;
+}
+
+__attribute__((constructor (MODULE_HTTP_INTERN_PRI)))
+void init_header_intern()
+{
+	if(DEBUG_PRINT) puts("Initializing header intern table");
+
+	for(int id = hdr_unknown + 1; id < num_header_ids; ++id)
+	{
+		header_name_lengths[id] = strlen(header_names[id]);
+		if(header_name_lengths[id] > max_header_name_length)
+			max_header_name_length = header_name_lengths[id];
+	}
+
+	for(header_hash_seed = 0; !try_header_seed(header_hash_seed);
+			++header_hash_seed);
+}
+
+bool header_names_equal(StringRef name1, StringRef name2)
+{
+	return name1.size == name2.size &&
+		strncasecmp(name1.begin, name2.begin, name1.size) == 0;
+}
+
+HeaderID intern_header(StringRef name)
+{
+	if(name.size == 0 || name.size > max_header_name_length)
+		return hdr_unknown;
+
+	HeaderID id = header_table[header_slot(name, header_hash_seed)];
+
+	//The slot may belong to a different name that happens to hash the same
+	if(id != hdr_unknown && header_names_equal(name, header_id_name(id)))
+		return id;
+
+	return hdr_unknown;
+}
+
+StringRef header_id_name(HeaderID id)
+{
+	return es_tempn(header_names[id], header_name_lengths[id]);
+}
@@ -14,6 +14,9 @@
 #include "http_worker_thread.h"
 #include "config.h"
 #include "print_thread.h"
+#include "fiber.h"
+#include "affinity.h"
+#include "client_limits.h"
 
 /*
  * If this looks like it's copy-pasted from the print_thread.c global queue
@@ -157,6 +160,8 @@ void begin_http_manager()
 	pthread_cond_init(&manager_data.signal, 0);
 
 	_manager_status = pthread_create(&manager_data.manager, 0, http_manager, 0);
+	if(_manager_status == 0)
+		affinity_register(manager_data.manager, affinity_housekeeping, 0);
 }
 
 __attribute__((destructor (MODULE_HTTP_MANAGE_PRI)))
@@ -179,16 +184,49 @@ int manager_status()
 
 int handle_connection(int fd, struct sockaddr_in* addr)
 {
-	HTTP_Data* data = malloc(sizeof(HTTP_Data));
+	//Over-limit clients cost a send and a close, and never get a worker
+	if(client_admit(addr) != client_admitted)
+	{
+		reject_connection(fd);
+		return 0;
+	}
+
+	HTTP_Data* data = http_data_alloc();
+	if(!data)
+	{
+		client_release(addr);
+		return -1;
+	}
+
 	data->connection_fd = fd;
 	data->connection_sockaddr = *addr;
 
+	//Keep the connection on the node that received it
+	int cpu = affinity_connection_cpu(fd);
+
+	//Fibers finish up in their schedulers, so the manager never sees them
+	if(fibers_running())
+	{
+		int result = fiber_spawn(http_worker_thread, data, cpu);
+		if(result)
+		{
+			client_release(addr);
+			http_data_free(data);
+		}
+		return result;
+	}
+
 	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	affinity_worker_attr(&attributes, cpu);
 
-	int result = pthread_create(&thread, 0, http_worker_thread, data);
+	int result = pthread_create(&thread, &attributes, http_worker_thread, data);
+	pthread_attr_destroy(&attributes);
 	if(result)
 	{
-		free(data);
+		client_release(addr);
+		http_data_free(data);
 	}
 	else
 	{
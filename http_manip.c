@@ -6,8 +6,11 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "http.h"
+#include "config.h"
 
 
 #define CASE(CODE, STR) case CODE: return es_temp(STR);
@@ -20,41 +23,258 @@ StringRef method_name(MethodType method)
 	CASE(get, "GET")
 	CASE(head, "HEAD")
 	CASE(post, "POST")
+	CASE(connect_method, "CONNECT")
 	DEFAULT(0)
 	}
 }
 
+StringRef trim_lws(StringRef text)
+{
+	while(text.size && (text.begin[0] == ' ' || text.begin[0] == '\t'))
+		text = es_slice(text, 1, text.size);
+	while(text.size && (text.begin[text.size-1] == ' ' ||
+			text.begin[text.size-1] == '\t'))
+		text.size--;
+	return text;
+}
+
+bool next_list_element(StringRef* list, StringRef* element)
+{
+	while(list->size)
+	{
+		const char* comma = memchr(list->begin, ',', list->size);
+		size_t size = comma ? (size_t)(comma - list->begin) : list->size;
+
+		*element = trim_lws(es_slice(*list, 0, size));
+		*list = es_slice(*list, comma ? size + 1 : size, list->size);
+
+		if(element->size)
+			return true;
+	}
+	return false;
+}
+
 //Find a header
 const HTTP_Header* find_header(const HTTP_Message* message, StringRef header_name)
 {
-	String name_lower = es_tolower(header_name);
-	StringRef name_lower_ref = es_ref(&name_lower);
-
-	#define RETURN(HEADER) { es_free(&name_lower); return (HEADER); }
+	//Well-known headers are indexed
+	HeaderID id = intern_header(header_name);
+	if(id != hdr_unknown)
+		return find_header_id(message, id);
 
+	//Anything else is a case-insensitive walk of the list
 	for(const HTTP_Header* header = message->headers; header;
 			header = header->next)
 	{
-		String lower = es_tolower(es_ref(&header->name));
-		int cmp = es_compare(name_lower_ref, es_ref(&lower));
-		es_free(&lower);
-		if(cmp == 0) RETURN(header);
+		if(header->id == hdr_unknown && !header->removed &&
+				header_names_equal(header_name, header->name))
+			return header;
 	}
 
-	RETURN(0)
+	return 0;
+}
 
-	#undef RETURN
+//Find the node, if any, that was made for a given raw header line
+static inline HTTP_Header* find_line_node(const HTTP_Message* message,
+	StringRef line)
+{
+	for(HTTP_Header* header = message->headers; header; header = header->next)
+		if(header->line.begin == line.begin)
+			return header;
+	return 0;
+}
+
+bool find_header_value(const HTTP_Message* message, StringRef header_name,
+	StringRef* value)
+{
+	const HTTP_Header* header = find_header(message, header_name);
+	if(header)
+	{
+		*value = header->value;
+		return true;
+	}
+
+	//Without passthrough, or for well-known names, every header has a node
+	if(!HEADER_PASSTHROUGH || intern_header(header_name) != hdr_unknown)
+		return false;
+
+	//Otherwise scan the raw block for it
+	StringRef text = es_ref(&message->header_block);
+	StringRef line, name, raw_value;
+	while(next_raw_header(&text, &line, &name, &raw_value) == 0 && line.size)
+	{
+		if(!header_names_equal(header_name, name))
+			continue;
+
+		//Skip it if it was removed
+		const HTTP_Header* node = find_line_node(message, line);
+		if(node && node->removed)
+			continue;
+
+		*value = raw_value;
+		return true;
+	}
+	return false;
+}
+
+//Point the index entry for an ID at the first remaining header with that ID
+static inline void reindex_header(HTTP_Message* message, HeaderID id)
+{
+	message->header_index[id] = 0;
+	for(HTTP_Header* header = message->headers; header; header = header->next)
+	{
+		if(header->id == id && !header->removed)
+		{
+			message->header_index[id] = header;
+			return;
+		}
+	}
+}
+
+//Link a header onto the end of the message
+static inline void push_header(HTTP_Message* message, HTTP_Header* header)
+{
+	header->id = intern_header(header->name);
+	header->removed = false;
+	header->next = 0;
+
+	if(message->last_header)
+		message->last_header->next = header;
+	else
+		message->headers = header;
+	message->last_header = header;
+
+	//The index has the first header with each ID
+	if(header->id != hdr_unknown && !message->header_index[header->id])
+		message->header_index[header->id] = header;
+}
+
+//Give a header its own copy of a name and value
+static inline void own_header_text(HTTP_Header* header, StringRef name,
+	StringRef value)
+{
+	String storage = es_copy(name);
+	es_append(&storage, value);
+
+	StringRef storage_ref = es_ref(&storage);
+	header->name = es_slice(storage_ref, 0, name.size);
+	header->value = es_slice(storage_ref, name.size, value.size);
+	header->storage = storage;
 }
 
 //Add a header
 void add_header(HTTP_Message* message, StringRef name, StringRef value)
 {
 	HTTP_Header* header = malloc(sizeof(HTTP_Header));
+	own_header_text(header, name, value);
+	header->line = es_temp(0);
+	push_header(message, header);
+}
 
-	header->name = es_copy(name);
-	header->value = es_copy(value);
-	header->next = message->headers;
-	message->headers = header;
+//Add a header that references someone else's memory
+void add_header_ref(HTTP_Message* message, StringRef name, StringRef value,
+	StringRef line)
+{
+	HTTP_Header* header = malloc(sizeof(HTTP_Header));
+	header->name = name;
+	header->value = value;
+	header->line = line;
+	header->storage = es_empty_string;
+	push_header(message, header);
+}
+
+/*
+ * With HEADER_PASSTHROUGH, unknown headers in the block don't have nodes.
+ * Before changing or removing one, give it a node, in its wire position.
+ */
+static inline void materialize_headers(HTTP_Message* message,
+	StringRef header_name)
+{
+	if(!HEADER_PASSTHROUGH || intern_header(header_name) != hdr_unknown)
+		return;
+
+	StringRef text = es_ref(&message->header_block);
+	StringRef line, name, value;
+	while(next_raw_header(&text, &line, &name, &value) == 0 && line.size)
+	{
+		if(!header_names_equal(header_name, name) ||
+				find_line_node(message, line))
+			continue;
+
+		HTTP_Header* header = malloc(sizeof(HTTP_Header));
+		header->name = name;
+		header->value = value;
+		header->line = line;
+		header->storage = es_empty_string;
+		header->id = hdr_unknown;
+		header->removed = false;
+
+		//Insert it before the first header that comes after it on the wire
+		HTTP_Header** link = &message->headers;
+		while(*link && (*link)->line.size && (*link)->line.begin < line.begin)
+			link = &(*link)->next;
+
+		header->next = *link;
+		*link = header;
+		if(!header->next)
+			message->last_header = header;
+	}
+}
+
+//Replace the value of a header. The old text may be what name points into.
+void set_header_value(HTTP_Header* header, StringRef value)
+{
+	String old_storage = header->storage;
+	own_header_text(header, header->name, value);
+	es_free(&old_storage);
+}
+
+//Set the first header with this name, and remove any others
+void set_header(HTTP_Message* message, StringRef name, StringRef value)
+{
+	materialize_headers(message, name);
+
+	bool found = false;
+	for(HTTP_Header* header = message->headers; header; header = header->next)
+	{
+		if(header->removed || !header_names_equal(name, header->name))
+			continue;
+
+		if(found)
+			header->removed = true;
+		else
+			set_header_value(header, value);
+		found = true;
+	}
+
+	if(!found)
+		add_header(message, name, value);
+	else
+	{
+		HeaderID id = intern_header(name);
+		if(id != hdr_unknown) reindex_header(message, id);
+	}
+}
+
+void remove_header(HTTP_Message* message, StringRef name)
+{
+	materialize_headers(message, name);
+
+	for(HTTP_Header* header = message->headers; header; header = header->next)
+		if(header_names_equal(name, header->name))
+			header->removed = true;
+
+	HeaderID id = intern_header(name);
+	if(id != hdr_unknown) message->header_index[id] = 0;
+}
+
+void set_content_length(HTTP_Message* message, size_t length)
+{
+	char length_str[80];
+	int size = snprintf(length_str, 80, "%zu", length);
+
+	set_header(message, header_id_name(hdr_content_length),
+		es_tempn(length_str, size));
 }
 
 StringRef response_phrase(int code)
@@ -95,6 +315,7 @@ StringRef response_phrase(int code)
 		CASE(415, "Unsupported Media Type")
 		CASE(416, "Requested Range Not Satisfiable")
 		CASE(417, "Expectation Failed")
+		CASE(429, "Too Many Requests")
 		CASE(500, "Internal Server Error")
 		CASE(501, "Not Implemented")
 		CASE(502, "Bad Gateway")
@@ -113,9 +334,6 @@ void set_response(HTTP_Message* message, int code)
 
 void set_body(HTTP_Message* message, String body)
 {
-	char length_str[80];
-	int size = snprintf(length_str, 80, "%zu", body.size);
-
-	add_header(message, es_temp("Content-Length"), es_tempn(length_str, size));
+	set_content_length(message, body.size);
 	message->body = body;
 }
@@ -10,12 +10,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <regex.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "http.h"
 #include "ReadableRegex/readable_regex.h"
+#include "memory_budget.h"
+#include "buffer_pool.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "fiber.h"
 #include "config.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -94,6 +101,16 @@ inline static int regex_match(const regex_t* regex, RegexMatches matches,
 		HTTP_VERSION /* HTTP VERSION: index 7 */ \
 		CR_LF)
 
+//CONNECT request regex string. The target is always host:port.
+#define CONNECT_REGEX_STR \
+	FULL_ANCHOR( \
+		"CONNECT" \
+		AT_LEAST_ONE(LWS) \
+		SUBMATCH(AT_LEAST_ONE(URI_DOMAIN_CHARACTER)) /* AUTHORITY: index 1 */ \
+		AT_LEAST_ONE(LWS) \
+		HTTP_VERSION /* HTTP VERSION: index 3 */ \
+		CR_LF)
+
 //Full response regex string
 #define RESPONSE_REGEX_STR \
 	FULL_ANCHOR( HTTP_VERSION /* HTTP VERSION: index 1*/ \
@@ -151,6 +168,14 @@ enum
 	request_num_matches
 } request_match_which;
 
+enum
+{
+	connect_match_all,
+	connect_match_authority=1,
+	connect_match_version=3,
+	connect_num_matches
+} connect_match_which;
+
 enum
 {
 	response_match_all,
@@ -177,6 +202,7 @@ enum
 
 //Globals to store the compiled regexes
 static regex_t request_regex; //matches the request line
+static regex_t connect_regex; //matches a CONNECT request line
 static regex_t response_regex; //matches the response line
 static regex_t header_regex; //matches a single header
 static regex_t chunk_regex; //matches the chunk header line
@@ -195,6 +221,7 @@ void init_http_regex()
 {
 	if(DEBUG_PRINT) puts("Initializing HTTP regex");
 	REGEX_COMPILE(&request_regex, REQUEST_REGEX_STR);
+	REGEX_COMPILE(&connect_regex, CONNECT_REGEX_STR);
 	REGEX_COMPILE(&response_regex, RESPONSE_REGEX_STR);
 	REGEX_COMPILE(&header_regex, HEADER_REGEX_STR);
 	REGEX_COMPILE(&chunk_regex, CHUNK_REGEX_STR);
@@ -206,6 +233,7 @@ void deinit_http_regex()
 {
 	if(DEBUG_PRINT) puts("Clearing HTTP regex");
 	regfree(&request_regex);
+	regfree(&connect_regex);
 	regfree(&response_regex);
 	regfree(&header_regex);
 	regfree(&chunk_regex);
@@ -221,52 +249,139 @@ void deinit_http_regex()
 //Perform a fixed-length TCP read
 static inline int tcp_read_fixed(int fd, char* buffer, size_t size)
 {
-	return recv(fd, buffer, size, MSG_WAITALL) == size ? 0 : connection_error;
+	//Take it as it comes, so the connection timer sees the progress
+	while(size)
+	{
+		ssize_t amount = fiber_recv(fd, buffer, size, 0);
+		if(amount <= 0)
+			return connection_error;
+
+		timer_progress(amount);
+		capture_bytes(fd, buffer, amount);
+		buffer += amount;
+		size -= amount;
+	}
+	return 0;
 }
 
 /*
  * Read up to delimiting character.
  *
- * Here's where we see the real advantage of a string library. Normally this
- * sort of code would involve an unpleasant amount of pointer manipulation,
- * but by using es_append we can use a static, stack-allocated local buffer
- * and let the library take care of automatic allocation. NO EXPLICT POINTERS.
- * Plus, es_append smartly doubles the allocation size every time, so the only
- * library overhead (besides increased memory use on the stack) is perhaps a
- * few too many memcpys
+ * Rather than a recv per byte, this peeks at whatever has already arrived,
+ * finds the delimiter in it, and then takes exactly that much off the socket,
+ * so nothing past the line is consumed. The peek goes into a pooled buffer
+ * that's only borrowed while there's data to read; a connection waiting for
+ * its next request holds nothing but its 1-byte peek.
  */
-const static size_t tcp_read_buffer_size = 256;
-String tcp_read_line(int fd, char delim, size_t max)
+const static size_t tcp_read_buffer_size = 4096;
+static size_t tcp_read_line_append(int fd, String* result, char delim,
+	size_t max)
 {
-	String result = es_empty_string;
-	char c;
-	int read_error = 0;
+	size_t total_read = 0;
+	bool found = false;
 
-	do
+	while(!found && max)
 	{
-		char buffer[tcp_read_buffer_size];
-		size_t amount_read = 0;
+		char* buffer = buffer_borrow(tcp_read_buffer_size);
+		if(!buffer)
+			break;
 
-		for(size_t i = 0; i < tcp_read_buffer_size; ++i)
+		size_t want = max < tcp_read_buffer_size ? max : tcp_read_buffer_size;
+		ssize_t peeked = recv(fd, buffer, want, MSG_PEEK | MSG_DONTWAIT);
+
+		//Nothing here yet. Wait for it without holding the buffer.
+		if(peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR))
 		{
-			if((read_error = tcp_read_fixed(fd, &c, 1)))
+			buffer_return(buffer, tcp_read_buffer_size);
+
+			char c;
+			if(fiber_recv(fd, &c, 1, MSG_PEEK) <= 0)
 				break;
+			continue;
+		}
 
-			buffer[i] = c;
-			++amount_read;
-			--max;
+		if(peeked <= 0)
+		{
+			buffer_return(buffer, tcp_read_buffer_size);
+			break;
+		}
 
-			if(c == delim)
-				break;
+		const char* end = memchr(buffer, delim, peeked);
+		size_t amount = end ? (size_t)(end - buffer) + 1 : (size_t)peeked;
+		found = end;
+
+		//It's already here, so this just copies it out
+		int read_error = tcp_read_fixed(fd, buffer, amount);
+		if(!read_error)
+		{
+			es_append(result, es_tempn(buffer, amount));
+			total_read += amount;
+			max -= amount;
 		}
 
-		es_append(&result, es_tempn(buffer, amount_read));
+		buffer_return(buffer, tcp_read_buffer_size);
+		if(read_error)
+			break;
+	}
 
-	} while(c != delim && read_error == 0 && max);
+	return total_read;
+}
 
+String tcp_read_line(int fd, char delim, size_t max)
+{
+	String result = es_empty_string;
+	tcp_read_line_append(fd, &result, delim, max);
 	return result;
 }
 
+int split_authority(HTTP_ReqLine* line, StringRef authority)
+{
+	const char* colon = authority.begin + authority.size;
+	while(colon > authority.begin && *--colon != ':');
+	if(authority.size == 0 || *colon != ':')
+	{
+		line->domain = es_copy(authority);
+		return 0;
+	}
+
+	StringRef port = es_slice(authority, colon - authority.begin + 1,
+		authority.size);
+	if(port.size == 0 || port.size > 5)
+		return malformed_line;
+	for(size_t i = 0; i < port.size; ++i)
+		if(port.begin[i] < '0' || port.begin[i] > '9')
+			return malformed_line;
+
+	line->domain = es_copy(es_slice(authority, 0, colon - authority.begin));
+	line->port = es_copy(port);
+	return 0;
+}
+
+//Parse a CONNECT request line
+static inline int read_connect_line(HTTP_Message* message, StringRef line)
+{
+	StringRef matches[connect_num_matches];
+	if(regex_match(&connect_regex, matches, line, connect_num_matches))
+		return malformed_line;
+
+	StringRef version = REGEX_PART(connect_match_version);
+	if(es_compare(es_temp("1.1"), version) &&
+			es_compare(es_temp("1.0"), version))
+		return bad_version;
+
+	message->request.method = connect_method;
+	message->request.http_version = version.begin[2];
+
+	//Tunnels have to say where they go
+	if(split_authority(&message->request, REGEX_PART(connect_match_authority)))
+		return malformed_line;
+	if(message->request.port.size == 0)
+		return malformed_line;
+
+	return 0;
+}
+
 //FIXME: SO MUCH CODE REPITITION
 //Especially the tcp_read_line error checking, http version, etc
 int read_request_line(HTTP_Message* message, int connection)
@@ -286,6 +401,13 @@ int read_request_line(HTTP_Message* message, int connection)
 			RETURN(connection_error)
 	}
 
+	//CONNECT has its own form: just an authority, no scheme or path
+	if(es_compare(es_slice(es_ref(&line), 0, 8), es_temp("CONNECT ")) == 0)
+	{
+		int error = read_connect_line(message, es_ref(&line));
+		RETURN(error)
+	}
+
 	//Match the regex
 	StringRef matches[request_num_matches];
 	if(regex_match(&request_regex, matches, es_ref(&line),
@@ -320,8 +442,10 @@ int read_request_line(HTTP_Message* message, int connection)
 			message->request.http_version = version.begin[2];
 	}
 
-	//Get the domain
-	message->request.domain = es_copy(REGEX_PART(request_match_domain));
+	//Get the domain, and the port if there is one
+	message->request.origin_form = REGEX_PART(request_match_domain).size == 0;
+	if(split_authority(&message->request, REGEX_PART(request_match_domain)))
+		RETURN(malformed_line)
 
 	//Get the path
 	message->request.path = es_copy(REGEX_PART(request_match_path));
@@ -379,7 +503,89 @@ static inline int empty_line(StringRef line)
 		es_compare(es_temp("\n"), line) == 0;
 }
 
-static inline int parse_headers(HTTP_Message* message, StringRef header_text)
+//True for the linear whitespace characters
+static inline bool is_lws(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+int next_raw_header(StringRef* header_text, StringRef* line, StringRef* name,
+	StringRef* value)
+{
+	StringRef text = *header_text;
+
+	//The empty line ends the block
+	if(text.size == 0 || empty_line(text))
+	{
+		*line = es_slice(text, 0, 0);
+		return 0;
+	}
+
+	//Find the end of this header, including any continuation lines
+	size_t end = 0;
+	do
+	{
+		const char* newline = memchr(text.begin + end, '\n', text.size - end);
+		if(!newline) return malformed_line;
+		end = newline - text.begin + 1;
+	} while(end < text.size && is_lws(text.begin[end]));
+
+	*line = es_slice(text, 0, end);
+	*header_text = es_slice(text, end, text.size);
+
+	//The name is everything before the colon, and has to be printable
+	const char* colon = memchr(line->begin, ':', line->size);
+	if(!colon || colon == line->begin) return malformed_line;
+	for(const char* c = line->begin; c < colon; ++c)
+		if(*c <= ' ' || *c >= 127) return malformed_line;
+	*name = es_tempn(line->begin, colon - line->begin);
+
+	//The value is the rest, minus leading whitespace and the trailing newline
+	const char* value_begin = colon + 1;
+	const char* value_end = line->begin + line->size - 1;
+	if(value_end > value_begin && value_end[-1] == '\r') --value_end;
+	while(value_begin < value_end && is_lws(*value_begin)) ++value_begin;
+	*value = es_tempn(value_begin, value_end - value_begin);
+
+	return 0;
+}
+
+/*
+ * Scan the headers in the message's header_block without the regex, and
+ * link in nodes only for the well-known headers. Everything else stays in the
+ * block, and is forwarded as-is.
+ */
+static inline int scan_headers(HTTP_Message* message, StringRef header_text)
+{
+	size_t header_i;
+	for(header_i = 0; header_i < MAX_NUM_HEADERS; ++header_i)
+	{
+		StringRef line, name, value;
+		int error = next_raw_header(&header_text, &line, &name, &value);
+		if(error) return error;
+
+		//Done on empty line
+		if(line.size == 0)
+			break;
+
+		if(intern_header(name) != hdr_unknown)
+			add_header_ref(message, name, value, line);
+	}
+
+	//If there are too many headers, discard and return
+	if(header_i >= MAX_NUM_HEADERS)
+		return too_many_headers;
+
+	return 0;
+}
+
+/*
+ * Parse the headers out of header_text. If retained is true, header_text is
+ * the message's header_block, and the headers just reference it. Otherwise
+ * (trailers after a chunked body), each header gets its own copy.
+ */
+static inline int parse_headers(HTTP_Message* message, StringRef header_text,
+	bool retained)
 {
 	size_t header_i;
 	for(header_i = 0; header_i < MAX_NUM_HEADERS; ++header_i)
@@ -394,8 +600,12 @@ static inline int parse_headers(HTTP_Message* message, StringRef header_text)
 			return malformed_line;
 
 		//Add the header
-		add_header(message, REGEX_PART(header_match_name),
-			REGEX_PART(header_match_value));
+		if(retained)
+			add_header_ref(message, REGEX_PART(header_match_name),
+				REGEX_PART(header_match_value), REGEX_PART(header_match_all));
+		else
+			add_header(message, REGEX_PART(header_match_name),
+				REGEX_PART(header_match_value));
 
 		//Remove this header from the text
 		header_text = es_slice(header_text, REGEX_PART(header_match_all).size,
@@ -407,7 +617,6 @@ static inline int parse_headers(HTTP_Message* message, StringRef header_text)
 		return too_many_headers;
 
 	return 0;
-	#undef CLEAR_RETURN
 }
 
 int read_headers(HTTP_Message* message, int connection)
@@ -419,14 +628,15 @@ int read_headers(HTTP_Message* message, int connection)
 	int done = 0;
 	do
 	{
-		//Read a line
-		String line = tcp_read_line(connection, '\n', MAX_HEADER_LINE_SIZE);
+		//Read a line straight onto the end of the header block
+		size_t line_begin = headers.size;
+		size_t line_size = tcp_read_line_append(connection, &headers, '\n',
+			MAX_HEADER_LINE_SIZE);
+		StringRef line = es_slice(es_ref(&headers), line_begin, line_size);
 
 		//If the last character isn't a newline, something went wrong
-		if(es_cstrc(&line)[line.size-1] != '\n')
+		if(line.size == 0 || line.begin[line.size-1] != '\n')
 		{
-			es_free(&line);
-
 			//If we hit the max
 			if(line.size >= MAX_HEADER_LINE_SIZE) RETURN(too_long)
 
@@ -434,14 +644,8 @@ int read_headers(HTTP_Message* message, int connection)
 			else RETURN(connection_error)
 		}
 
-		//Append this line
-		es_append(&headers, es_ref(&line));
-
 		//If we found the empty line, we're done
-		if(empty_line(es_ref(&line))) done = 1;
-
-		//Free the line
-		es_free(&line);
+		if(empty_line(line)) done = 1;
 
 		//Continue while we haven't found the empty line, or gone over MAX
 	} while(!done && headers.size <= MAX_HEADER_SIZE);
@@ -449,22 +653,58 @@ int read_headers(HTTP_Message* message, int connection)
 	//If all headers are too long, error
 	if(headers.size > MAX_HEADER_SIZE) RETURN(too_long);
 
-	//Parse headers
-	int error = parse_headers(message, es_ref(&headers));
+	/*
+	 * The first header block read into a message is retained, and the parsed
+	 * headers point into it. Moving the String doesn't move its buffer, so the
+	 * references stay valid. Trailers (a second block) are just copied.
+	 */
+	int error;
+	if(message->header_block.size == 0)
+	{
+		message->header_block = es_move(&headers);
+		if(HEADER_PASSTHROUGH)
+			error = scan_headers(message, es_ref(&message->header_block));
+		else
+			error = parse_headers(message, es_ref(&message->header_block), true);
+	}
+	else
+	{
+		error = parse_headers(message, es_ref(&headers), false);
+	}
 
 	RETURN(error)
 
 	#undef RETURN
 }
 
+//Charge the message for some more bytes of the memory budget
+static inline int charge_budget(HTTP_Message* message, size_t bytes)
+{
+	if(!budget_acquire(bytes))
+		return over_budget;
+	message->budget += bytes;
+	return 0;
+}
+
 static inline int read_fixed_body(HTTP_Message* message, int connection, size_t size)
 {
 	//Real simple fixed size read
 	if(size > MAX_BODY_SIZE)
 		return too_long;
 
+	//Too big to hold. It'll be relayed, which only costs the relay buffer.
+	else if(size > MAX_BUFFERED_BODY_SIZE)
+	{
+		int error = charge_budget(message, RELAY_HIGH_WATERMARK);
+		if(error) return error;
+		message->unread_body = size;
+	}
+
 	else if(size)
 	{
+		int error = charge_budget(message, size);
+		if(error) return error;
+
 		char* buffer = malloc(size);
 		if(tcp_read_fixed(connection, buffer, size))
 		{
@@ -476,6 +716,9 @@ static inline int read_fixed_body(HTTP_Message* message, int connection, size_t
 	return 0;
 }
 
+//Size of the buffer chunked bodies are read through
+const static size_t chunk_buffer_size = 64 * 1024;
+
 static inline int read_chunked_body(HTTP_Message* message, int connection)
 {
 	//length of the next chunk
@@ -487,12 +730,16 @@ static inline int read_chunked_body(HTTP_Message* message, int connection)
 	//String to read the chunk size lines into
 	String chunk_head = es_empty_string;
 
-	//buffer to read each chunk into. Reused, but reallocated if necessary
-	char* read_buffer = 0;
-	size_t buffer_size = 0;
+	//Pooled buffer that each chunk is read through, a piece at a time
+	char* read_buffer = buffer_borrow(chunk_buffer_size);
+	if(!read_buffer)
+	{
+		es_free(&body);
+		return over_budget;
+	}
 
 	#define RETURN(CODE) { es_free(&body); es_free(&chunk_head);\
-		free(read_buffer); return (CODE); }
+		buffer_return(read_buffer, chunk_buffer_size); return (CODE); }
 
 	//Read each chunk till a length 0 chunk
 	do
@@ -523,25 +770,34 @@ static inline int read_chunked_body(HTTP_Message* message, int connection)
 		//self explanatory
 		if(chunk_length > MAX_CHUNK_SIZE) RETURN(too_long)
 
-		//For the trailing \r\n
-		size_t full_chunk_length = chunk_length + 2;
+		/*
+		 * The last chunk has no data, and no \r\n of its own; the empty line
+		 * after it ends the trailers, which are read below.
+		 */
+		if(chunk_length == 0)
+		{
+			es_clear(&chunk_head);
+			break;
+		}
+
+		//The body grows by the chunk, so it has to fit in the budget
+		int budget_error = charge_budget(message, chunk_length);
+		if(budget_error) RETURN(budget_error)
 
-		//Reallocate buffer if needed
-		if(full_chunk_length > buffer_size)
+		//Read the chunk, and append it
+		for(size_t left = chunk_length; left; )
 		{
-			free(read_buffer);
-			read_buffer = malloc(full_chunk_length);
-			buffer_size = full_chunk_length;
+			size_t piece = left < chunk_buffer_size ? left : chunk_buffer_size;
+			if(tcp_read_fixed(connection, read_buffer, piece))
+				RETURN(connection_error)
+			es_append(&body, es_tempn(read_buffer, piece));
+			left -= piece;
 		}
 
-		//Read the chunk
-		if(tcp_read_fixed(connection, read_buffer, full_chunk_length))
+		//TODO: check that this is \r\n
+		if(tcp_read_fixed(connection, read_buffer, 2))
 			RETURN(connection_error)
 
-		//TODO: check that
-		//Append the chunk
-		es_append(&body, es_tempn(read_buffer, chunk_length));
-
 		//Clear the chunk line
 		es_clear(&chunk_head);
 
@@ -565,17 +821,27 @@ int read_body(HTTP_Message* message, int connection)
 
 	//Try chunked first. Ignore Content-Length
 	//https://stackoverflow.com/questions/3304126/chunked-encoding-and-content-length-header
-	header = find_header(message, es_temp("Transfer-Encoding"));
-	if(header && es_compare(es_ref(&header->value), es_temp("chunked")) == 0)
-		return read_chunked_body(message, connection);
+	header = find_header_id(message, hdr_transfer_encoding);
+	if(header && es_compare(header->value, es_temp("chunked")) == 0)
+	{
+		int error = read_chunked_body(message, connection);
+
+		//The body is forwarded de-chunked, so the headers have to say so
+		if(error == 0)
+		{
+			remove_header(message, header_id_name(hdr_transfer_encoding));
+			set_content_length(message, message->body.size);
+		}
+		return error;
+	}
 
 	//Try content-length
-	header = find_header(message, es_temp("Content-Length"));
+	header = find_header_id(message, hdr_content_length);
 	if(header)
 	{
 		//Extract content length
 		unsigned long content_length = 0;
-		if(es_toul(&content_length, es_ref(&header->value)))
+		if(es_toul(&content_length, header->value))
 			return bad_content_length;
 
 		return read_fixed_body(message, connection, content_length);
@@ -0,0 +1,142 @@
+/*
+ * http_relay.c
+ *
+ *  Created on: Mar 10, 2014
+ *      Author: nathan
+ *
+ *  Relaying of bodies too big to buffer. The body is copied through a single
+ *  pooled buffer of RELAY_HIGH_WATERMARK bytes with both sockets non-blocking,
+ *  so reading and writing overlap. When the destination can't keep up and the
+ *  buffer fills, the relay stops reading from the source (leaving the data in
+ *  the kernel, and eventually the sender, to wait) until the destination has
+ *  drained it to RELAY_LOW_WATERMARK.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "uring.h"
+#include "buffer_pool.h"
+#include "fiber.h"
+#include "config.h"
+
+//Set or clear O_NONBLOCK. Returns the old flags.
+static inline int set_nonblocking(int fd, bool nonblocking)
+{
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+	return flags;
+}
+
+static inline bool would_block(ssize_t result)
+{
+	return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int relay_body(HTTP_Message* message, int from_fd, int to_fd)
+{
+	if(uring_active())
+	{
+		int result = uring_relay_body(message->unread_body, from_fd, to_fd);
+		if(result != uring_unsupported)
+			return result;
+	}
+
+	size_t remaining = message->unread_body; //Still to be read
+	char* buffer = buffer_borrow(RELAY_HIGH_WATERMARK);
+	if(!buffer)
+		return connection_error;
+
+	size_t begin = 0, end = 0; //The buffered bytes
+	bool paused = false; //Reading stopped at the high watermark
+	int error = 0;
+
+	int from_flags = set_nonblocking(from_fd, true);
+	int to_flags = set_nonblocking(to_fd, true);
+
+	while(remaining || begin != end)
+	{
+		size_t buffered = end - begin;
+
+		//Hysteresis: stop at the high watermark, restart at the low one
+		if(buffered >= RELAY_HIGH_WATERMARK) paused = true;
+		else if(buffered <= RELAY_LOW_WATERMARK) paused = false;
+
+		struct pollfd fds[2] =
+		{
+			{ .fd = from_fd, .events = remaining && !paused ? POLLIN : 0 },
+			{ .fd = to_fd, .events = buffered ? POLLOUT : 0 },
+		};
+
+		if(fiber_poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			error = connection_error;
+			break;
+		}
+
+		if(fds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+		{
+			error = connection_error;
+			break;
+		}
+
+		if(fds[1].revents & POLLOUT)
+		{
+			ssize_t sent = send(to_fd, buffer + begin, buffered, MSG_NOSIGNAL);
+			if(sent < 0 && !would_block(sent))
+			{
+				error = connection_error;
+				break;
+			}
+			if(sent > 0)
+			{
+				timer_progress(sent);
+				begin += sent;
+			}
+			if(begin == end) begin = end = 0;
+		}
+
+		if(fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+		{
+			//Make room at the end of the buffer, if the front has drained
+			if(end == RELAY_HIGH_WATERMARK && begin)
+			{
+				memmove(buffer, buffer + begin, end - begin);
+				end -= begin;
+				begin = 0;
+			}
+
+			size_t space = RELAY_HIGH_WATERMARK - end;
+			if(space > remaining) space = remaining;
+
+			ssize_t received = space ? recv(from_fd, buffer + end, space, 0) : 0;
+			if(space && (received == 0 || (received < 0 && !would_block(received))))
+			{
+				error = connection_error;
+				break;
+			}
+			if(received > 0)
+			{
+				timer_progress(received);
+				capture_bytes(from_fd, buffer + end, received);
+				end += received;
+				remaining -= received;
+			}
+		}
+	}
+
+	fcntl(from_fd, F_SETFL, from_flags);
+	fcntl(to_fd, F_SETFL, to_flags);
+	buffer_return(buffer, RELAY_HIGH_WATERMARK);
+
+	return error;
+}
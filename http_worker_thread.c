@@ -6,27 +6,77 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include "http_worker_thread.h"
 #include "print_thread.h"
 #include "stat_tracking.h"
 #include "filters.h"
 #include "http.h"
+#include "cache_policy.h"
+#include "response_cache.h"
+#include "compression.h"
+#include "disk_cache.h"
+#include "collapsed_forwarding.h"
+#include "timer_wheel.h"
+#include "tunnel.h"
+#include "h2_upstream.h"
+#include "socket_options.h"
+#include "capture.h"
+#include "fiber.h"
+#include "slab.h"
+#include "client_limits.h"
+#include "balancer.h"
+#include "reverse_proxy.h"
+#include "probes.h"
+#include "config.h"
 
 typedef enum { cs_unknown, cs_persist, cs_close } ConnState;
 
+//Everything a worker knows about its connection
+typedef struct
+{
+	struct sockaddr_in client_addr;
+	int client_fd;
+	int server_fd;
+
+	ConnState state;
+
+	HTTP_Message request;
+	HTTP_Message response;
+
+	Flight* flight; //Set while leading a collapsed fetch
+	Upstream* upstream; //The origin address picked, if it was picked
+	Route* route; //Set when reverse proxying
+	Backend* backend; //The route's backend picked
+	ConnTimer timer;
+	CaptureSession capture;
+} ThreadData;
+
+/*
+ * Each connection's state comes from a slab, instead of sitting on its
+ * worker's stack, so it's packed with everyone else's and counted
+ */
+static Slab thread_data_slab;
+static Slab http_data_slab;
+
 /*
  * Some potential, unhandled bugs:
  * - If the server responds with 405 Method not allowed, and provides an Allow:
  *   header listing the allowed methods, those methods may not contain all of
  *   GET, HEAD, and POST. Currently, the proxy doesn't filter this.
- * - Same with the reverse. The proxy currently adds Allow: GET, HEAD, POST to
- *   proxy-generated error responses
+ * - Same with the reverse. The proxy currently adds Allow: GET, HEAD, POST,
+ *   CONNECT to proxy-generated error responses
  * - We don't currently acknowledge that the client recieved the error before
  *   closing the socket, in the event of an error; this "may erase the client's
  *   unacknowledged input buffers before they can be read and interpreted by
@@ -57,31 +107,37 @@ const static char* error_template =
 	"<body><h1>%d %.*s</h1>%.*s</body>" // code phrase message
 	"</html>";
 
-//Send a formatted HTTP error to the client
-static inline void handle_error(int fd, int code, StringRef text)
+//Build a formatted HTTP error
+static inline void build_error(HTTP_Message* message, int code, StringRef text)
 {
-	HTTP_Message message = empty_message;
-
 	//Set the request line
-	message.response.http_version = '1';
-	set_response(&message, code);
+	message->response.http_version = '1';
+	set_response(message, code);
 
 	//Set some headers
-	add_header(&message, es_temp("Connection"), es_temp("close"));
-	add_header(&message, es_temp("Content-Type"), es_temp("text/html"));
+	add_header(message, es_temp("Connection"), es_temp("close"));
+	add_header(message, es_temp("Content-Type"), es_temp("text/html"));
 
 	if(code == 405)
-		add_header(&message, es_temp("Allow"), es_temp("GET, HEAD, POST"));
+		add_header(message, es_temp("Allow"),
+			es_temp("GET, HEAD, POST, CONNECT"));
 
 	//Get the phrase
 	StringRef phrase = response_phrase(code);
 
 	//Build the body
-	set_body(&message,
+	set_body(message,
 		es_printf(error_template,
 			code, ES_STRREFPRINT(&phrase),
 			code, ES_STRREFPRINT(&phrase),
 			ES_STRREFPRINT(&text)));
+}
+
+//Send a formatted HTTP error to the client
+static inline void handle_error(int fd, int code, StringRef text)
+{
+	HTTP_Message message = empty_message;
+	build_error(&message, code, text);
 
 	//Send the response
 	if(write_response(&message, fd))
@@ -91,18 +147,135 @@ static inline void handle_error(int fd, int code, StringRef text)
 	clear_response(&message);
 }
 
-//Global, thread-local thread data
-typedef struct
+//The response to a filtered request never changes, so it's built once
+static String filtered_response;
+
+//Nor does the one to a client over its limits
+static String limited_response;
+
+//If set, every upstream connection goes here; see set_upstream_override
+static struct addrinfo* upstream_override;
+
+__attribute__((constructor (MODULE_HTTP_WORKER_PRI)))
+void init_http_worker()
 {
-	struct sockaddr_in client_addr;
-	int client_fd;
-	int server_fd;
+	if(DEBUG_PRINT) puts("Initializing fixed responses");
 
-	ConnState state;
+	slab_init(&thread_data_slab, sizeof(ThreadData));
+	slab_init(&http_data_slab, sizeof(HTTP_Data));
 
-	HTTP_Message request;
-	HTTP_Message response;
-} ThreadData;
+	HTTP_Message message = empty_message;
+	build_error(&message, 403, es_temp("Blocked by Proxy Filter"));
+	filtered_response = serialize_response_head(&message);
+	es_append(&filtered_response, es_ref(&message.body));
+	clear_response(&message);
+
+	message = empty_message;
+	build_error(&message, 429, es_temp("Too many connections from this client"));
+	add_header(&message, es_temp("Retry-After"), es_temp("1"));
+	limited_response = serialize_response_head(&message);
+	es_append(&limited_response, es_ref(&message.body));
+	clear_response(&message);
+}
+
+__attribute__((destructor (MODULE_HTTP_WORKER_PRI)))
+void deinit_http_worker()
+{
+	if(DEBUG_PRINT) puts("Clearing fixed responses");
+	es_free(&filtered_response);
+	es_free(&limited_response);
+	if(upstream_override) freeaddrinfo(upstream_override);
+
+	slab_destroy(&thread_data_slab);
+	slab_destroy(&http_data_slab);
+}
+
+HTTP_Data* http_data_alloc()
+{
+	return slab_alloc(&http_data_slab);
+}
+
+void http_data_free(HTTP_Data* data)
+{
+	slab_free(&http_data_slab, data);
+}
+
+void connection_memory(size_t* connections, size_t* state_bytes)
+{
+	size_t in_use, reserved;
+	slab_usage(&thread_data_slab, &in_use, &reserved);
+	*connections = in_use;
+	*state_bytes = reserved;
+
+	slab_usage(&http_data_slab, &in_use, &reserved);
+	*state_bytes += reserved;
+}
+
+size_t connections_in_flight()
+{
+	//A connection has its HTTP_Data until its ThreadData exists, so no gaps
+	size_t waiting, serving, reserved;
+	slab_usage(&http_data_slab, &waiting, &reserved);
+	slab_usage(&thread_data_slab, &serving, &reserved);
+	return waiting + serving;
+}
+
+void reject_connection(int fd)
+{
+	//Never wait on a client we're refusing; if it can't take this, tough
+	if(send(fd, es_ref(&limited_response).begin, limited_response.size,
+			MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		submit_debug_c("Error writing 429 to client");
+
+	/*
+	 * Closing with the request unread would reset the connection, and the
+	 * client could lose the 429 with it. Take whatever's already arrived.
+	 */
+	shutdown(fd, SHUT_WR);
+	char discard[4096];
+	if(recv(fd, discard, sizeof(discard), MSG_DONTWAIT) < 0) {}
+	close(fd);
+}
+
+int set_upstream_override(const char* authority)
+{
+	const char* colon = strrchr(authority, ':');
+	if(!colon)
+		return -1;
+
+	String host = es_copy(es_tempn(authority, colon - authority));
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	int lookup_error = getaddrinfo(es_cstrc(&host), colon + 1, &hints,
+		&upstream_override);
+	es_free(&host);
+	return lookup_error ? -1 : 0;
+}
+
+/*
+ * Throw away whatever is left of a request that's already been answered, so
+ * that closing the socket doesn't reset the connection before the client has
+ * read the response. MSG_TRUNC makes the kernel discard the data without
+ * copying it out. Returns the number of bytes discarded.
+ */
+static inline unsigned long discard_request(int fd)
+{
+	shutdown(fd, SHUT_WR);
+
+	unsigned long discarded = 0;
+	while(discarded < FILTER_DRAIN_LIMIT)
+	{
+		struct pollfd readable = { .fd = fd, .events = POLLIN };
+		if(fiber_poll(&readable, 1, FILTER_DRAIN_TIMEOUT * 1000) <= 0)
+			break;
+
+		ssize_t size = recv(fd, 0, FILTER_DRAIN_LIMIT - discarded,
+			MSG_TRUNC | MSG_DONTWAIT);
+		if(size <= 0)
+			break;
+		discarded += size;
+	}
+	return discarded;
+}
 
 static inline void init_thread_data(ThreadData* thread_data, void* ptr)
 {
@@ -112,17 +285,46 @@ static inline void init_thread_data(ThreadData* thread_data, void* ptr)
 	thread_data->server_fd = -1;
 	thread_data->state = cs_unknown;
 	thread_data->request = thread_data->response = empty_message;
-	free(ptr);
+	thread_data->flight = 0;
+	thread_data->upstream = 0;
+	thread_data->route = 0;
+	thread_data->backend = 0;
+	timer_start(&thread_data->timer, thread_data->client_fd);
+	capture_begin(&thread_data->capture, thread_data->client_fd);
+	tune_client(thread_data->client_fd);
+	http_data_free(data);
 }
 
 static void cleanup_thread_data(void* td)
 {
 	ThreadData* thread_data = td;
+	timer_stop(&thread_data->timer);
+	capture_end(&thread_data->capture);
 	if(thread_data->client_fd >= 0) close(thread_data->client_fd);
+	client_release(&thread_data->client_addr);
 	if(thread_data->server_fd >= 0) close(thread_data->server_fd);
 
+	//Don't leave anyone waiting on a fetch that died with us
+	if(thread_data->flight) flight_fail(thread_data->flight);
+	upstream_done(thread_data->upstream);
+	backend_done(thread_data->backend);
+
 	clear_request(&thread_data->request);
 	clear_response(&thread_data->response);
+
+	slab_free(&thread_data_slab, thread_data);
+}
+
+/*
+ * Leave the worker from anywhere, cleaning up on the way out. The thread
+ * ends, or on a fiber, just the fiber.
+ */
+static inline void worker_exit(ThreadData* thread_data)
+{
+	cleanup_thread_data(thread_data);
+	if(fiber_current())
+		fiber_exit();
+	pthread_exit(0);
 }
 
 static inline String get_log_string(ThreadData* thread_data)
@@ -134,12 +336,36 @@ static inline String get_log_string(ThreadData* thread_data)
 	//Get the method
 	StringRef method_text = method_name(thread_data->request.request.method);
 
+	const HTTP_ReqLine* line = &thread_data->request.request;
+
+	//CONNECT's destination is just host:port
+	if(line->method == connect_method)
+		return es_printf("%.*s: %.*s %.*s:%.*s",
+			INET_ADDRSTRLEN, ip_text,
+			ES_STRREFPRINT(&method_text),
+			ES_STRINGPRINT(&line->domain),
+			ES_STRINGPRINT(&line->port));
+
 	//Attach the domain, method, and destination to the log
-	return es_printf("%.*s: %.*s http://%.*s/%.*s",
+	return es_printf("%.*s: %.*s http://%.*s%s%.*s/%.*s",
 		INET_ADDRSTRLEN, ip_text,
 		ES_STRREFPRINT(&method_text),
-		ES_STRINGPRINT(&thread_data->request.request.domain),
-		ES_STRINGPRINT(&thread_data->request.request.path));
+		ES_STRINGPRINT(&line->domain),
+		line->port.size ? ":" : "",
+		ES_STRINGPRINT(&line->port),
+		ES_STRINGPRINT(&line->path));
+}
+
+//The request's domain, for probes
+static inline const char* probe_domain(ThreadData* thread_data)
+{
+	return es_ref(&thread_data->request.request.domain).begin;
+}
+
+//Body bytes, whether they were buffered or relayed
+static inline unsigned long body_bytes(const HTTP_Message* message)
+{
+	return message->body.size + message->unread_body;
 }
 
 static inline String get_just_client(ThreadData* thread_data)
@@ -155,41 +381,409 @@ static inline void error(ThreadData* thread_data, int code, const char* msg)
 {
 	stat_add_error();
 	String log_string_base = get_just_client(thread_data);
-	String log_string = es_printf("%.*s [ERROR] %s",
-		ES_STRINGPRINT(&log_string_base), msg);
+	String log_string = es_printf("%.*s [%s] %s",
+		ES_STRINGPRINT(&log_string_base),
+		timer_expired(&thread_data->timer) ? "TIMEOUT" : "ERROR", msg);
 	es_free(&log_string_base);
 	submit_print(log_string);
+	PROBE2(error, thread_data->client_fd, code);
 	if(code > 0) handle_error(thread_data->client_fd, code, es_temp(msg));
-	pthread_exit(0);
+	worker_exit(thread_data);
 }
 
-#define ERROR(MSG) error(&thread_data, 0, MSG)
-#define RESPOND_ERROR(CODE, MSG) error(&thread_data, CODE, MSG)
+#define ERROR(MSG) error(thread_data, 0, MSG)
+#define RESPOND_ERROR(CODE, MSG) error(thread_data, CODE, MSG)
+
+//A failure talking to the origin is a 504 if it was because it timed out
+#define UPSTREAM_ERROR(MSG) error(thread_data, \
+	timer_expired(&thread_data->timer) ? 504 : 502, MSG)
 
 static inline void success(ThreadData* thread_data)
 {
+	PROBE6(done, thread_data->client_fd, probe_domain(thread_data),
+		thread_data->response.response.status,
+		body_bytes(&thread_data->request), body_bytes(&thread_data->response),
+		probe_origin);
 	stat_add_success();
 	submit_print(get_log_string(thread_data));
 }
 
+static inline void success_cached(ThreadData* thread_data,
+	const CacheServed* served)
+{
+	PROBE6(done, thread_data->client_fd, probe_domain(thread_data),
+		served->status, body_bytes(&thread_data->request), served->body_size,
+		probe_cache);
+	stat_add_success();
+	String log_string = get_log_string(thread_data);
+	es_append(&log_string, es_temp(" [CACHED]"));
+	submit_print(log_string);
+}
+
+static inline void success_collapsed(ThreadData* thread_data,
+	const CacheServed* served)
+{
+	PROBE6(done, thread_data->client_fd, probe_domain(thread_data),
+		served->status, body_bytes(&thread_data->request), served->body_size,
+		probe_collapsed);
+	stat_add_success();
+	String log_string = get_log_string(thread_data);
+	es_append(&log_string, es_temp(" [COLLAPSED]"));
+	submit_print(log_string);
+}
+
+/*
+ * Filtering happens right after the request line, so the headers and body of
+ * a blocked request are never parsed or buffered, just discarded. Reverse
+ * proxied requests only get a domain from their Host header, so they're
+ * filtered after the headers instead.
+ */
 static inline void filter(ThreadData* thread_data)
 {
 	stat_add_filtered();
 	String log_string = get_log_string(thread_data);
 	es_append(&log_string, es_temp(" [FILTERED]"));
 	submit_print(log_string);
-	handle_error(thread_data->client_fd, 403, es_temp("Blocked by Proxy Filter"));
-	pthread_exit(0);
+
+	struct iovec response = {
+		.iov_base = (void*)es_ref(&filtered_response).begin,
+		.iov_len = filtered_response.size };
+	if(write_parts(thread_data->client_fd, &response, 1))
+		submit_debug(es_copy(es_temp("Error writing error to client")));
+	else
+		stat_add_filter_discarded(discard_request(thread_data->client_fd));
+
+	worker_exit(thread_data);
 }
 
-void* http_worker_thread(void* ptr)
+//Filter the request if its domain is blocked
+static inline void check_filters(ThreadData* thread_data)
+{
+	bool blocked = filter_match_any(
+		es_ref(&thread_data->request.request.domain));
+	PROBE3(filter, thread_data->client_fd, probe_domain(thread_data),
+		blocked);
+	if(blocked)
+		filter(thread_data);
+}
+
+/*
+ * The proxy closes both connections after one exchange, so rewrite the
+ * connection headers to say so. Everything else is forwarded untouched.
+ */
+static inline void prepare_for_close(HTTP_Message* message)
+{
+	set_header(message, header_id_name(hdr_connection), es_temp("close"));
+	remove_header(message, header_id_name(hdr_proxy_connection));
+	remove_header(message, header_id_name(hdr_keep_alive));
+}
+
+typedef struct
+{
+	const char* host;
+	const char* port;
+	int family;
+	struct addrinfo* result;
+	int error;
+} HostLookup;
+
+//getaddrinfo blocks, so fibers run this through fiber_offload
+static void lookup_host(void* arg)
+{
+	HostLookup* lookup = arg;
+	struct addrinfo hints = { .ai_family = lookup->family,
+		.ai_socktype = SOCK_STREAM };
+	if(lookup->family == AF_INET6)
+		hints.ai_flags = AI_NUMERICHOST;
+	lookup->error = getaddrinfo(lookup->host, lookup->port, &hints,
+		&lookup->result);
+}
+
+static inline unsigned long microseconds_since(const struct timespec* begin)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - begin->tv_sec) * 1000000 +
+		(end.tv_nsec - begin->tv_nsec) / 1000;
+}
+
+//Drop the connection to the server, so another attempt makes a new one
+static inline void close_server_socket(ThreadData* thread_data)
+{
+	if(thread_data->server_fd >= 0)
+	{
+		timer_set_server(&thread_data->timer, -1);
+		close(thread_data->server_fd);
+		thread_data->server_fd = -1;
+	}
+}
+
+//A failed connect leaves its socket useless, so another try needs a new one
+static inline void open_server_socket(ThreadData* thread_data, int family,
+	bool fastopen)
+{
+	close_server_socket(thread_data);
+
+	thread_data->server_fd = socket(family, SOCK_STREAM, 0);
+	if(thread_data->server_fd < 0)
+		error(thread_data, 500, "Error: Unable to open socket");
+	timer_set_server(&thread_data->timer, thread_data->server_fd);
+	capture_set_server(&thread_data->capture, thread_data->server_fd);
+	tune_upstream(thread_data->server_fd, fastopen);
+}
+
+typedef enum
+{
+	attempt_connected, //And the request, if any, written
+	attempt_unconnected, //The connect failed, or was refused at the first write
+	attempt_broken //Connected, but writing the request failed
+} AttemptResult;
+
+/*
+ * Connect to an address, and write the request if there is one. With Fast
+ * Open, connect() returns before the handshake, so a refused connect only
+ * shows up at the first write, as ECONNREFUSED or EPIPE, or if the request
+ * went out in the SYN, once the handshake is over. Waiting for that costs
+ * nothing, since the response can't come any sooner.
+ */
+static inline AttemptResult attempt_server(ThreadData* thread_data,
+	const struct sockaddr* address, socklen_t address_size,
+	HTTP_Message* request)
+{
+	PROBE2(connect_start, thread_data->client_fd, thread_data->server_fd);
+	int connect_error = fiber_connect(thread_data->server_fd, address,
+		address_size);
+	PROBE3(connect_end, thread_data->client_fd, thread_data->server_fd,
+		connect_error);
+	if(connect_error < 0)
+		return attempt_unconnected;
+
+	if(!request)
+		return attempt_connected;
+
+	submit_debug_c("Writing request");
+	if(write_request(request, thread_data->server_fd))
+		return errno == ECONNREFUSED || errno == EPIPE ?
+			attempt_unconnected : attempt_broken;
+
+	//A socket isn't writable until it's established, or it's failed
+	struct pollfd writable = { .fd = thread_data->server_fd, .events = POLLOUT };
+	int socket_error = 0;
+	socklen_t size = sizeof(socket_error);
+	if(fiber_poll(&writable, 1, -1) < 0 ||
+			getsockopt(thread_data->server_fd, SOL_SOCKET, SO_ERROR,
+			&socket_error, &size) || socket_error)
+		return attempt_unconnected;
+	return attempt_connected;
+}
+
+/*
+ * Open the connection to the origin (or the request's backend), to the
+ * request's port if it has one, and write request to it if it isn't null. A
+ * failed connect or write is retried at another address, up to
+ * UPSTREAM_CONNECT_ATTEMPTS tries in all; nothing has been read from the
+ * client for the request yet, so that's safe. Like the other error paths,
+ * this ends the worker if it fails.
+ */
+static inline void connect_to_server(ThreadData* thread_data,
+	HTTP_Message* request)
+{
+	struct addrinfo* host_info = 0;
+	if(!thread_data->route && !upstream_override)
+	{
+		submit_debug_c("Looking up host");
+
+		const HTTP_ReqLine* line = &thread_data->request.request;
+		String port = line->port.size ? es_copy(es_ref(&line->port)) :
+			es_copy(es_temp("http"));
+
+		/*
+		 * Names are only looked up over IPv4, but an IPv6 literal is taken as
+		 * it is. Its brackets are part of the authority, not the address.
+		 */
+		StringRef host = es_ref(&line->domain);
+		int family = AF_INET;
+		if(host.size >= 2 && host.begin[0] == '[' &&
+			host.begin[host.size - 1] == ']')
+		{
+			host = es_slice(host, 1, host.size - 2);
+			family = AF_INET6;
+		}
+		String domain = es_copy(host);
+
+		HostLookup lookup = { .host = es_cstrc(&domain),
+			.port = es_cstrc(&port), .family = family };
+		PROBE2(dns_start, thread_data->client_fd, lookup.host);
+		fiber_offload(lookup_host, &lookup);
+		PROBE3(dns_end, thread_data->client_fd, lookup.host, lookup.error);
+		host_info = lookup.result;
+		int lookup_error = lookup.error;
+		es_free(&domain);
+		es_free(&port);
+		if(lookup_error)
+			error(thread_data, 500, "Error: error looking up host");
+	}
+
+	submit_debug_c("Connecting to server");
+
+	//The best backend or address, and if that fails, the next best
+	AttemptResult result = attempt_unconnected;
+	for(int attempt = 0; attempt < UPSTREAM_CONNECT_ATTEMPTS; ++attempt)
+	{
+		const struct sockaddr* address;
+		socklen_t address_size;
+		bool repeat;
+
+		if(thread_data->route)
+		{
+			Backend* failed = thread_data->backend;
+			thread_data->backend = route_pick(thread_data->route, failed);
+			backend_done(failed);
+			repeat = thread_data->backend == failed;
+			address = (const struct sockaddr*)backend_address(
+				thread_data->backend);
+			address_size = sizeof(struct sockaddr_in);
+		}
+		else if(upstream_override)
+		{
+			repeat = true;
+			address = upstream_override->ai_addr;
+			address_size = upstream_override->ai_addrlen;
+		}
+		else
+		{
+			Upstream* failed = thread_data->upstream;
+			thread_data->upstream = upstream_pick(host_info, failed);
+			upstream_done(failed);
+			repeat = !thread_data->upstream || thread_data->upstream == failed;
+			address = host_info->ai_addr;
+			address_size = host_info->ai_addrlen;
+			if(thread_data->upstream)
+			{
+				address = (const struct sockaddr*)upstream_address(
+					thread_data->upstream);
+				address_size = sizeof(struct sockaddr_in);
+			}
+		}
+
+		if(attempt > 0)
+		{
+			//Nowhere else to go, or no time left to go there
+			if(repeat || timer_expired(&thread_data->timer))
+				break;
+			stat_add_upstream_retry();
+		}
+
+		//A tunnel has no first write to show a refused connect
+		open_server_socket(thread_data, address->sa_family, request != 0);
+
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+
+		result = attempt_server(thread_data, address, address_size, request);
+
+		if(thread_data->backend && result != attempt_connected)
+			backend_failed(thread_data->backend);
+		if(thread_data->upstream)
+		{
+			upstream_connected(thread_data->upstream,
+				result != attempt_unconnected, microseconds_since(&begin));
+			if(result == attempt_broken)
+				upstream_failed(thread_data->upstream);
+		}
+
+		if(result == attempt_connected)
+			break;
+	}
+
+	if(host_info)
+		freeaddrinfo(host_info);
+
+	if(result != attempt_connected)
+	{
+		if(timer_expired(&thread_data->timer))
+			error(thread_data, 504, "Error: timed out connecting to server");
+		if(result == attempt_broken)
+			error(thread_data, 502, "Error: error writing request to server");
+		error(thread_data, 500, "Error: unable to connect to server");
+	}
+}
+
+//True if CONNECT_PORTS lets tunnels go to this port
+static inline bool tunnel_port_allowed(StringRef port)
+{
+	unsigned long number = 0;
+	for(size_t i = 0; i < port.size; ++i)
+		number = number * 10 + (port.begin[i] - '0');
+
+	for(size_t i = 0; i < sizeof(CONNECT_PORTS) / sizeof(CONNECT_PORTS[0]); ++i)
+		if(CONNECT_PORTS[i] == number)
+			return true;
+	return false;
+}
+
+const static char tunnel_established[] =
+	"HTTP/1.1 200 Connection Established\r\n\r\n";
+
+/*
+ * CONNECT: open a tunnel to the origin, and relay bytes both ways until both
+ * sides are done. The request has already passed the filters.
+ */
+static inline void tunnel(ThreadData* thread_data)
 {
-	ThreadData thread_data;
-	init_thread_data(&thread_data, ptr);
+	submit_debug_c("Opening tunnel");
+
+	timer_deadline(&thread_data->timer, deadline_upstream);
+	connect_to_server(thread_data, 0);
+
+	struct iovec established = { .iov_base = (void*)tunnel_established,
+		.iov_len = sizeof(tunnel_established) - 1 };
+	if(write_parts(thread_data->client_fd, &established, 1))
+		error(thread_data, 0, "Error writing tunnel response");
+
+	timer_deadline(&thread_data->timer, deadline_tunnel);
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	TunnelCounts counts = { 0, 0 };
+	int tunnel_error = tunnel_relay(thread_data->client_fd,
+		thread_data->server_fd, &counts);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long milliseconds = (end.tv_sec - begin.tv_sec) * 1000 +
+		(end.tv_nsec - begin.tv_nsec) / 1000000;
+	stat_add_tunnel(counts.up, counts.down, milliseconds);
+
+	if(tunnel_error)
+		error(thread_data, 0, "Error relaying tunnel");
 
-	pthread_cleanup_push(&cleanup_thread_data, &thread_data);
+	PROBE6(done, thread_data->client_fd, probe_domain(thread_data), 200,
+		counts.up, counts.down, probe_tunnel);
+
+	stat_add_success();
+	String log_string = get_log_string(thread_data);
+	String tunnel_info = es_printf(" [TUNNEL %llu up, %llu down, %lu ms]",
+		counts.up, counts.down, milliseconds);
+	es_append(&log_string, es_ref(&tunnel_info));
+	es_free(&tunnel_info);
+	submit_print(log_string);
+}
+
+void* http_worker_thread(void* ptr)
+{
+	ThreadData* thread_data = slab_alloc(&thread_data_slab);
+	if(!thread_data)
+	{
+		HTTP_Data* data = ptr;
+		close(data->connection_fd);
+		client_release(&data->connection_sockaddr);
+		http_data_free(data);
+		return 0;
+	}
+	init_thread_data(thread_data, ptr);
 
-	while(thread_data.state != cs_close)
+	while(thread_data->state != cs_close)
 	{
 		submit_debug_c("Reading request");
 
@@ -198,7 +792,9 @@ void* http_worker_thread(void* ptr)
 		///////////////////////////////////////////////////////////////////////
 		submit_debug_c("Reading request line");
 
-		switch(read_request_line(&thread_data.request, thread_data.client_fd))
+		timer_deadline(&thread_data->timer, deadline_idle);
+
+		switch(read_request_line(&thread_data->request, thread_data->client_fd))
 		{
 		case connection_error:
 			ERROR("Error: Connection Error");
@@ -217,9 +813,17 @@ void* http_worker_thread(void* ptr)
 			break;
 		}
 
+		PROBE3(request_line, thread_data->client_fd, probe_domain(thread_data),
+			thread_data->request.request.method);
+
+		//Check filters before reading any more of the request
+		check_filters(thread_data);
+
 		submit_debug_c("Reading headers");
 
-		switch(read_headers(&thread_data.request, thread_data.client_fd))
+		timer_deadline(&thread_data->timer, deadline_headers);
+
+		switch(read_headers(&thread_data->request, thread_data->client_fd))
 		{
 		case connection_error:
 			ERROR("Error: Connection Error");
@@ -235,9 +839,14 @@ void* http_worker_thread(void* ptr)
 			break;
 		}
 
+		PROBE2(headers, thread_data->client_fd,
+			thread_data->request.header_block.size);
+
 		submit_debug_c("Reading body");
 
-		switch(read_body(&thread_data.request, thread_data.client_fd))
+		timer_deadline(&thread_data->timer, deadline_transfer);
+
+		switch(read_body(&thread_data->request, thread_data->client_fd))
 		{
 		case connection_error:
 			ERROR("Error: Connection Error");
@@ -252,6 +861,9 @@ void* http_worker_thread(void* ptr)
 		case malformed_line:
 			RESPOND_ERROR(400, "Error: Chunk size line malformed");
 			break;
+		case over_budget:
+			RESPOND_ERROR(503, "Error: Proxy too busy to take the body");
+			break;
 		}
 
 		///////////////////////////////////////////////////////////////////////
@@ -261,21 +873,28 @@ void* http_worker_thread(void* ptr)
 		submit_debug_c("Checking HTTP");
 
 		//Force shutdown of persistent connections
-		thread_data.state = cs_close;
-
-		//Check filters
-		if(filter_match_any(es_ref(&thread_data.request.request.domain)))
-			filter(&thread_data);
+		thread_data->state = cs_close;
 
 		//Check host
 		//Only need to check host in HTTP/1.1
-		if(thread_data.request.request.http_version == '1')
+		if(thread_data->request.request.http_version == '1')
 		{
 			//Just check for the precence of host and assume correctness
-			if(!find_header(&thread_data.request, es_temp("Host")))
+			if(!find_header_id(&thread_data->request, hdr_host))
 				RESPOND_ERROR(400, "Error: missing Host: header");
 		}
 
+		//Requests without a domain are for a route, not for the proxy to fetch
+		if(thread_data->request.request.origin_form && reverse_active())
+		{
+			thread_data->route = reverse_route(&thread_data->request);
+			if(!thread_data->route)
+				RESPOND_ERROR(404, "Error: no route for this host and path");
+
+			//Its domain only came from the Host header just now
+			check_filters(thread_data);
+		}
+
 		//Check for content-length in POST
 		/*
 		 * NOTE: I'M NOT ACTUALLY DOING THIS, AND HERE'S WHY:
@@ -289,77 +908,228 @@ void* http_worker_thread(void* ptr)
 		 */
 
 		///////////////////////////////////////////////////////////////////////
-		// SEND REQUEST
+		// TUNNEL
 		///////////////////////////////////////////////////////////////////////
 
-		submit_debug_c("Forwarding request");
+		if(thread_data->request.request.method == connect_method)
+		{
+			if(!tunnel_port_allowed(es_ref(&thread_data->request.request.port)))
+				RESPOND_ERROR(403, "Error: tunnels aren't allowed to that port");
+			tunnel(thread_data);
+			clear_request(&thread_data->request);
+			continue;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// CHECK CACHE
+		///////////////////////////////////////////////////////////////////////
 
-		//This if is here for hypothetical persistant connections
-		if(thread_data.server_fd < 0)
+		if(cache_request_allowed(&thread_data->request))
 		{
-			submit_debug_c("Opening initial connection to server");
+			CacheServed served;
+			CacheEntry* cached = cache_lookup(&thread_data->request);
+			if(cached)
+			{
+				submit_debug_c("Serving response from cache");
+				int write_error = cache_write(cached, thread_data->client_fd,
+					thread_data->request.request.method == head,
+					compress_coding(&thread_data->request), &served);
+				cache_release(cached);
 
-			thread_data.server_fd = socket(PF_INET, SOCK_STREAM, 0);
-			if(thread_data.server_fd < 0)
-				RESPOND_ERROR(500, "Error: Unable to open socket");
+				if(write_error)
+					ERROR("Error writing cached response");
+
+				success_cached(thread_data, &served);
+				clear_request(&thread_data->request);
+				continue;
+			}
+
+			switch(disk_cache_serve(&thread_data->request, thread_data->client_fd,
+				thread_data->request.request.method == head,
+				compress_coding(&thread_data->request), &served))
+			{
+			case -1:
+				ERROR("Error writing cached response");
+				break;
+			case 1:
+				success_cached(thread_data, &served);
+				clear_request(&thread_data->request);
+				continue;
+			}
+		}
 
-			submit_debug_c("Looking up host");
+		///////////////////////////////////////////////////////////////////////
+		// COLLAPSE INTO AN IN-FLIGHT FETCH
+		///////////////////////////////////////////////////////////////////////
 
-			struct addrinfo* host_info;
-			if(getaddrinfo(es_cstrc(&thread_data.request.request.domain),
-					"http", 0, &host_info))
-				RESPOND_ERROR(500, "Error: error looking up host");
+		if(flight_allowed(&thread_data->request))
+		{
+			//Waiting on a flight has its own timeout
+			timer_deadline(&thread_data->timer, deadline_none);
 
-			submit_debug_c("Connecting to host");
+			Flight* flight;
+			FlightRole role = flight_join(&thread_data->request, &flight);
+			timer_deadline(&thread_data->timer, deadline_transfer);
 
-			if(connect(thread_data.server_fd, host_info->ai_addr, sizeof(*(host_info->ai_addr))) < 0)
+			switch(role)
 			{
-				freeaddrinfo(host_info);
-				RESPOND_ERROR(500, "Error: unable to connect to host");
+			case flight_lead:
+				thread_data->flight = flight;
+				break;
+			case flight_follow:
+			{
+				submit_debug_c("Serving response from another fetch");
+				CacheServed served;
+				int write_error = flight_write(flight, thread_data->client_fd,
+					compress_coding(&thread_data->request), &served);
+				flight_release(flight);
+
+				if(write_error)
+					ERROR("Error writing collapsed response");
+
+				success_collapsed(thread_data, &served);
+				clear_request(&thread_data->request);
+				continue;
+			}
+			case flight_alone:
+				break;
 			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// SEND REQUEST
+		///////////////////////////////////////////////////////////////////////
+
+		submit_debug_c("Forwarding request");
+
+		prepare_for_close(&thread_data->request);
+
+		timer_deadline(&thread_data->timer, deadline_upstream);
+
+		//HTTP/2 origins take the request as a stream on their connection
+		H2Origin* h2_origin = upstream_override || thread_data->route ? 0 :
+			h2_find_origin(&thread_data->request);
+		if(h2_origin)
+		{
+			submit_debug_c("Opening HTTP/2 stream");
 
-			freeaddrinfo(host_info);
+			thread_data->server_fd = h2_open_stream(h2_origin,
+				&thread_data->request);
+			if(thread_data->server_fd < 0)
+				RESPOND_ERROR(502, "Error: unable to open HTTP/2 stream");
+			timer_set_server(&thread_data->timer, thread_data->server_fd);
+			capture_set_server(&thread_data->capture, thread_data->server_fd);
+
+			timer_deadline(&thread_data->timer, deadline_transfer);
 		}
+		else
+		{
+			//The upstream deadline covers every attempt, writes included
+			connect_to_server(thread_data, &thread_data->request);
 
-		submit_debug_c("Writing request");
+			timer_deadline(&thread_data->timer, deadline_transfer);
+		}
 
-		if(write_request(&thread_data.request, thread_data.server_fd))
-			RESPOND_ERROR(502, "Error: error writing request to server");
+		if(thread_data->request.unread_body && relay_body(&thread_data->request,
+				thread_data->client_fd, thread_data->server_fd))
+			ERROR("Error relaying request body");
+
+		timer_deadline(&thread_data->timer, deadline_upstream);
 
 		///////////////////////////////////////////////////////////////////////
 		// GET RESPONSE
 		///////////////////////////////////////////////////////////////////////
 		submit_debug_c("Reading response");
 
+		struct timespec sent;
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+
 		/*
 		 * TODO: better error messages back to the client. This isn't really
 		 * a prioirty because these errors are all for various forms of
 		 * invalid HTTP response, not valid HTTP responses that are just errors.
 		 */
-		if(read_response_line(&thread_data.response, thread_data.server_fd))
-			RESPOND_ERROR(502, "Error reading response line");
-		if(read_headers(&thread_data.response, thread_data.server_fd))
-			RESPOND_ERROR(502, "Error reading response headers");
-		if(read_body(&thread_data.response, thread_data.server_fd))
+		if(read_response_line(&thread_data->response, thread_data->server_fd))
+		{
+			if(thread_data->upstream) upstream_failed(thread_data->upstream);
+			if(thread_data->backend) backend_failed(thread_data->backend);
+			UPSTREAM_ERROR("Error reading response line");
+		}
+		PROBE2(first_byte, thread_data->client_fd,
+			thread_data->response.response.status);
+		unsigned long first_byte = microseconds_since(&sent);
+		if(read_headers(&thread_data->response, thread_data->server_fd))
+		{
+			if(thread_data->upstream) upstream_failed(thread_data->upstream);
+			if(thread_data->backend) backend_failed(thread_data->backend);
+			UPSTREAM_ERROR("Error reading response headers");
+		}
+		if(thread_data->upstream)
+			upstream_first_byte(thread_data->upstream, first_byte);
+
+		note_fastopen(thread_data->server_fd, true);
+
+		timer_deadline(&thread_data->timer, deadline_transfer);
+
+		switch(read_body(&thread_data->response, thread_data->server_fd))
+		{
+		case 0:
+			break;
+		case over_budget:
+			RESPOND_ERROR(503, "Error: Proxy too busy to take the response");
+			break;
+		default:
 			RESPOND_ERROR(502, "Error reading response body");
+			break;
+		}
 
 		///////////////////////////////////////////////////////////////////////
 		// SEND RESPONSE
 		///////////////////////////////////////////////////////////////////////
 		submit_debug_c("Writing response");
-		if(write_response(&thread_data.response, thread_data.client_fd))
-			ERROR("Error writing response");
+		prepare_for_close(&thread_data->response);
+
+		//Let anyone waiting on this fetch have it too
+		if(thread_data->flight)
+		{
+			flight_finish(thread_data->flight, &thread_data->request,
+				&thread_data->response);
+			thread_data->flight = 0;
+		}
+
+		//Eligible responses go through compression even if it's identity
+		if(compress_eligible(&thread_data->response))
+		{
+			if(compress_response(&thread_data->request, &thread_data->response,
+					compress_coding(&thread_data->request),
+					thread_data->server_fd, thread_data->client_fd))
+				ERROR("Error writing compressed response");
+		}
+		else
+		{
+			if(write_response(&thread_data->response, thread_data->client_fd))
+				ERROR("Error writing response");
+
+			if(thread_data->response.unread_body &&
+					relay_body(&thread_data->response, thread_data->server_fd,
+					thread_data->client_fd))
+				ERROR("Error relaying response body");
+		}
 
 		//NO ERRORS! WE SURVIVED!
-		success(&thread_data);
+		success(thread_data);
+
+		//Keep it, if it's cacheable
+		cache_store(&thread_data->request, &thread_data->response);
+		disk_cache_store(&thread_data->request, &thread_data->response);
 
-		clear_request(&thread_data.request);
-		clear_response(&thread_data.response);
+		clear_request(&thread_data->request);
+		clear_response(&thread_data->response);
 
 		//This will loop is the connection is persistent
 	}
 
-	pthread_cleanup_pop(1);
+	cleanup_thread_data(thread_data);
 
 	return 0;
 }
@@ -16,5 +16,31 @@ typedef struct
 	struct sockaddr_in connection_sockaddr;
 } HTTP_Data;
 
-//Send in a pointer to a malloc'd HTTP_Data
+//HTTP_Data comes from a slab, so use these instead of malloc and free
+HTTP_Data* http_data_alloc();
+void http_data_free(HTTP_Data* data);
+
+//Send in a pointer to an HTTP_Data from http_data_alloc
 void* http_worker_thread(void* ptr);
+
+/*
+ * How many connections are open, and the bytes set aside for their state.
+ * Their I/O buffers are borrowed separately; see buffer_pool.h.
+ */
+void connection_memory(size_t* connections, size_t* state_bytes);
+
+/*
+ * Refuse a connection before starting a worker for it: send the client a
+ * 429 if it'll take it straight away, and close it.
+ */
+void reject_connection(int fd);
+
+//Nonzero while any connection is still being served, or waiting to be
+size_t connections_in_flight();
+
+/*
+ * Send every request to one origin, host:port, instead of the one in its
+ * URI. The request itself is forwarded unchanged. Used to replay captured
+ * traffic against a local stand-in. Returns 0, or -1 if it doesn't resolve.
+ */
+int set_upstream_override(const char* authority);
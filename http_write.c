@@ -5,98 +5,244 @@
  *      Author: nathan
  */
 
-#include <sys/socket.h>
+#include <stdio.h>
 #include <stdbool.h>
-#include "http.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include "http.h"
+#include "timer_wheel.h"
+#include "fiber.h"
 #include "config.h"
 
+/*
+ * Messages are written with as few syscalls as possible: all the pieces (the
+ * first line, runs of the original header block, rewritten headers, body) are
+ * gathered into an iovec batch and sent together. The batch only gets flushed
+ * early if a message has a truly silly number of modified headers.
+ */
+#define WRITE_BATCH_SIZE 64
+
+typedef struct
+{
+	struct iovec parts[WRITE_BATCH_SIZE];
+	int num_parts;
+	int connection;
+	String* output; //If set, the batch is appended here instead of sent
+	int error;
+} WriteBatch;
 
-static inline int write_ref(StringRef ref, int connection)
+/*
+ * Send a list of buffers, handling partial sends. Modifies parts. Sends don't
+ * block; instead it waits for room with poll, so every partial send counts as
+ * progress for the connection timer.
+ */
+int write_parts(int connection, struct iovec* parts, int num_parts)
 {
-	return send(connection, ref.begin, ref.size, 0) < 0;
+	while(num_parts)
+	{
+		struct msghdr msg = { .msg_iov = parts, .msg_iovlen = num_parts };
+		ssize_t sent = sendmsg(connection, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			struct pollfd writable = { .fd = connection, .events = POLLOUT };
+			if(fiber_poll(&writable, 1, -1) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+		if(sent < 0)
+			return -1;
+
+		timer_progress(sent);
+
+		//Skip over what was sent
+		while(num_parts && (size_t)sent >= parts->iov_len)
+		{
+			sent -= parts->iov_len;
+			++parts;
+			--num_parts;
+		}
+		if(num_parts)
+		{
+			parts->iov_base = (char*)parts->iov_base + sent;
+			parts->iov_len -= sent;
+		}
+	}
+	return 0;
 }
 
-static inline int write_str(String str, int connection)
+//Send (or append) everything in the batch
+static inline void flush_batch(WriteBatch* batch)
 {
-	int result = write_ref(es_ref(&str), connection);
-	es_free(&str);
-	return result;
+	if(batch->output)
+	{
+		for(int i = 0; i < batch->num_parts; ++i)
+			es_append(batch->output, es_tempn(batch->parts[i].iov_base,
+				batch->parts[i].iov_len));
+	}
+	else if(!batch->error && batch->num_parts)
+	{
+		batch->error = write_parts(batch->connection, batch->parts,
+			batch->num_parts) ? 1 : 0;
+	}
+	batch->num_parts = 0;
+}
+
+//Add a piece to the batch. The memory must stay valid until it's flushed.
+static inline void batch_ref(WriteBatch* batch, StringRef ref)
+{
+	if(ref.size == 0) return;
+	if(batch->num_parts == WRITE_BATCH_SIZE) flush_batch(batch);
+
+	batch->parts[batch->num_parts].iov_base = (void*)ref.begin;
+	batch->parts[batch->num_parts].iov_len = ref.size;
+	++batch->num_parts;
 }
 
-static inline int write_request_line(HTTP_ReqLine* line, int connection)
+static inline void batch_request_line(WriteBatch* batch, HTTP_ReqLine* line,
+	char* version_buffer)
 {
-	if(write_ref(method_name(line->method), connection)) return 1;
-	if(write_ref(es_temp(" "), connection)) return 1;
+	batch_ref(batch, method_name(line->method));
+	batch_ref(batch, es_temp(" "));
 
-	if(line->domain.size)
+	if(line->domain.size && !line->origin_form)
 	{
-		if(write_ref(es_temp("http://"), connection)) return 1;
-		if(write_ref(es_ref(&line->domain), connection)) return 1;
+		batch_ref(batch, es_temp("http://"));
+		batch_ref(batch, es_ref(&line->domain));
+		if(line->port.size)
+		{
+			batch_ref(batch, es_temp(":"));
+			batch_ref(batch, es_ref(&line->port));
+		}
 	}
 
-	if(write_str(es_printf("/%.*s HTTP/1.%c\r\n", ES_STRINGPRINT(&line->path),
-			line->http_version), connection))
-		return 1;
-	return 0;
+	batch_ref(batch, es_temp("/"));
+	batch_ref(batch, es_ref(&line->path));
+
+	int size = sprintf(version_buffer, " HTTP/1.%c\r\n", line->http_version);
+	batch_ref(batch, es_tempn(version_buffer, size));
 }
 
-//Write the response line
-static inline int write_response_line(HTTP_RespLine* line, int connection)
+//Write the response line. status_buffer must be at least 32 bytes
+static inline void batch_response_line(WriteBatch* batch, HTTP_RespLine* line,
+	char* status_buffer)
 {
-	if(write_str(es_printf("HTTP/1.%c %d %.*s\r\n",
-			line->http_version,
-			line->status,
-			ES_STRINGPRINT(&line->phrase)), connection))
-		return 1;
-	return 0;
+	int size = sprintf(status_buffer, "HTTP/1.%c %d ", line->http_version,
+		line->status);
+	batch_ref(batch, es_tempn(status_buffer, size));
+	batch_ref(batch, es_ref(&line->phrase));
+	batch_ref(batch, es_temp("\r\n"));
+}
+
+//A header written from its name and value
+static inline void batch_header(WriteBatch* batch, const HTTP_Header* header)
+{
+	batch_ref(batch, header->name);
+	batch_ref(batch, es_temp(": "));
+	batch_ref(batch, header->value);
+	batch_ref(batch, es_temp("\r\n"));
 }
 
-//Write a header
-static inline int write_headers(HTTP_Header* header, int connection)
+//The header block, less its terminating empty line
+static inline StringRef header_block_content(HTTP_Message* message)
 {
-	while(header)
+	StringRef block = es_ref(&message->header_block);
+	if(block.size && block.begin[block.size - 1] == '\n') --block.size;
+	if(block.size && block.begin[block.size - 1] == '\r') --block.size;
+	return block;
+}
+
+/*
+ * Write all the headers. The original header block is forwarded byte for byte,
+ * in order, except for the lines of headers that were modified or removed.
+ * Headers the proxy added come after it.
+ */
+static inline void batch_headers(WriteBatch* batch, HTTP_Message* message)
+{
+	StringRef block = header_block_content(message);
+	const char* cursor = block.begin;
+
+	for(const HTTP_Header* header = message->headers; header;
+			header = header->next)
 	{
-		if(write_str(es_printf("%.*s: %.*s\r\n",
-				ES_STRINGPRINT(&header->name),
-				ES_STRINGPRINT(&header->value)), connection))
-			return 1;
-		header = header->next;
+		//Untouched headers are just part of the block
+		bool modified = header->storage.size != 0 || header->removed;
+		if(header->line.size == 0 || !modified)
+			continue;
+
+		batch_ref(batch, es_tempn(cursor, header->line.begin - cursor));
+		if(!header->removed)
+			batch_header(batch, header);
+		cursor = header->line.begin + header->line.size;
 	}
-	return 0;
+	batch_ref(batch, es_tempn(cursor, block.begin + block.size - cursor));
+
+	for(const HTTP_Header* header = message->headers; header;
+			header = header->next)
+		if(header->line.size == 0 && !header->removed)
+			batch_header(batch, header);
+
+	batch_ref(batch, es_temp("\r\n"));
 }
 
 //Write all headers, empty line, and body
 //TODO: support for live forwarding of chunked encoding.
-static inline int write_common(HTTP_Message* message, int connection)
+static inline int write_common(WriteBatch* batch, HTTP_Message* message)
 {
-	//Write headers
-	if(write_headers(message->headers, connection)) return 1;
-
-	//Write blank line
-	if(write_ref(es_temp("\r\n"), connection)) return 1;
-
-	//Write body
-	if(write_ref(es_ref(&message->body), connection)) return 1;
+	batch_headers(batch, message);
+	batch_ref(batch, es_ref(&message->body));
+	flush_batch(batch);
 
-	return 0;
+	return batch->error;
 }
 
 //Write a whole request
 int write_request(HTTP_Message* request, int connection)
 {
-	if(write_request_line(&request->request, connection))
-		return -1;
-	if(write_common(request, connection) == -1)
+	WriteBatch batch = { .num_parts = 0, .connection = connection };
+	char version_buffer[32];
+
+	batch_request_line(&batch, &request->request, version_buffer);
+	if(write_common(&batch, request))
 		return -1;
 	return 0;
 }
 
 int write_response(HTTP_Message* response, int connection)
 {
-	if(write_response_line(&response->response, connection))
-		return -1;
-	if(write_common(response, connection))
+	WriteBatch batch = { .num_parts = 0, .connection = connection };
+	char status_buffer[32];
+
+	batch_response_line(&batch, &response->response, status_buffer);
+	if(write_common(&batch, response))
 		return -1;
 	return 0;
 }
+
+String serialize_request_head(HTTP_Message* request)
+{
+	String result = es_empty_string;
+	WriteBatch batch = { .num_parts = 0, .connection = -1, .output = &result };
+	char version_buffer[32];
+
+	batch_request_line(&batch, &request->request, version_buffer);
+	batch_headers(&batch, request);
+	flush_batch(&batch);
+
+	return result;
+}
+
+String serialize_response_head(HTTP_Message* response)
+{
+	String result = es_empty_string;
+	WriteBatch batch = { .num_parts = 0, .connection = -1, .output = &result };
+	char status_buffer[32];
+
+	batch_response_line(&batch, &response->response, status_buffer);
+	batch_headers(&batch, response);
+	flush_batch(&batch);
+
+	return result;
+}
@@ -8,20 +8,132 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "filters.h"
 #include "server_listener.h"
 #include "stat_tracking.h"
+#include "disk_cache.h"
+#include "capture.h"
+#include "http_worker_thread.h"
+#include "h2_upstream.h"
+#include "uring.h"
+#include "fiber.h"
+#include "upgrade.h"
+#include "affinity.h"
+#include "client_limits.h"
+#include "reverse_proxy.h"
 
+/*
+ * Usage: proxy [-d cache_dir] [-c capture_file] [-u host:port] [-b backend]
+ *   [-f threads] [-2 host:port]... [-a cpus] [-l rate:burst:connections]
+ *   [-r host/prefix=host:port,...]... port [filter...]
+ *   -d: keep a persistent response cache in cache_dir
+ *   -c: record all traffic to capture_file, for bench/replay
+ *   -u: send all requests to this origin instead of the ones they name
+ *   -b: the I/O backend, "blocking" (the default) or "uring"
+ *   -f: run connections as fibers on this many threads, instead of a thread
+ *     per connection
+ *   -2: talk to this origin over HTTP/2 cleartext, multiplexing its requests
+ *     onto one connection. Can be given more than once.
+ *   -a: run connections on these CPUs (like 0-7,16-23), NUMA node by node,
+ *     and everything else on the rest
+ *   -l: limit each client IP to rate new connections a second, in bursts of
+ *     burst, with at most connections open; 0 for no limit
+ *   -r: reverse proxy requests without a domain (GET /path) for this Host
+ *     (* for any) and path prefix to these backends, health checked in the
+ *     background. Can be given more than once; the longest prefix wins.
+ *
+ * SIGHUP starts a new proxy from the same binary and arguments, and hands it
+ * the listening socket; this one then finishes its connections and exits.
+ */
 int main(int argc, char **argv)
 {
-	if(argc < 2)
+	int option;
+
+	upgrade_init(argv);
+
+	//The + stops at the port, so filters can never be mistaken for options
+	while((option = getopt(argc, argv, "+d:c:u:b:f:2:a:l:r:")) != -1)
+	{
+		switch(option)
+		{
+		case 'd':
+			if(disk_cache_open(optarg))
+			{
+				puts("BETTER CACHE DIRECTORY PLEASE");
+				return 1;
+			}
+			break;
+		case 'c':
+			if(capture_open(optarg))
+			{
+				puts("BETTER CAPTURE FILE PLEASE");
+				return 1;
+			}
+			break;
+		case 'u':
+			if(set_upstream_override(optarg))
+			{
+				puts("BETTER UPSTREAM PLEASE");
+				return 1;
+			}
+			break;
+		case 'b':
+			if(io_backend_select(optarg))
+			{
+				puts("BETTER BACKEND PLEASE");
+				return 1;
+			}
+			break;
+		case 'f':
+			if(fiber_start(strtol(optarg, 0, 10)))
+			{
+				puts("BETTER FIBER THREADS PLEASE");
+				return 1;
+			}
+			break;
+		case '2':
+			if(h2_add_origin(optarg))
+			{
+				puts("BETTER HTTP/2 ORIGIN PLEASE");
+				return 1;
+			}
+			break;
+		case 'a':
+			if(affinity_set(optarg))
+			{
+				puts("BETTER CPUS PLEASE");
+				return 1;
+			}
+			break;
+		case 'l':
+			if(client_limits_set(optarg))
+			{
+				puts("BETTER LIMITS PLEASE");
+				return 1;
+			}
+			break;
+		case 'r':
+			if(reverse_add_route(optarg))
+			{
+				puts("BETTER ROUTE PLEASE");
+				return 1;
+			}
+			break;
+		default:
+			puts("BETTER ARGS PLEASE");
+			return 1;
+		}
+	}
+
+	if(optind >= argc)
 	{
 		puts("BETTER ARGS PLEASE");
 		return 1;
 	}
 
-	long port_l = strtol(argv[1], 0, 10);
+	long port_l = strtol(argv[optind], 0, 10);
 
 	if(port_l > USHRT_MAX)
 	{
@@ -29,7 +141,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	for(unsigned i = 2; i < argc; ++i)
+	for(int i = optind + 1; i < argc; ++i)
 	{
 		filter_add(es_copy(es_temp(argv[i])));
 		stat_filter(es_temp(argv[i]));
@@ -37,4 +149,3 @@ int main(int argc, char **argv)
 
 	return serve_forever(port_l);
 }
-
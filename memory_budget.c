@@ -0,0 +1,90 @@
+/*
+ * memory_budget.c
+ *
+ *  Created on: Mar 10, 2014
+ *      Author: nathan
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "memory_budget.h"
+#include "stat_tracking.h"
+#include "fiber.h"
+#include "config.h"
+
+static size_t budget_used;
+static pthread_mutex_t budget_lock;
+static FiberCond budget_freed;
+
+__attribute__((constructor (MODULE_BUDGET_PRI)))
+void init_memory_budget()
+{
+	if(DEBUG_PRINT) puts("Initializing memory budget");
+	pthread_mutex_init(&budget_lock, 0);
+	fiber_cond_init(&budget_freed);
+}
+
+__attribute__((destructor (MODULE_BUDGET_PRI)))
+void deinit_memory_budget()
+{
+	if(DEBUG_PRINT) puts("Clearing memory budget");
+	fiber_cond_destroy(&budget_freed);
+	pthread_mutex_destroy(&budget_lock);
+}
+
+bool budget_acquire(size_t bytes)
+{
+	if(bytes == 0)
+		return true;
+
+	//Never going to fit, so don't make anyone wait for it
+	if(bytes > MEMORY_BUDGET)
+	{
+		stat_add_budget_rejection();
+		return false;
+	}
+
+	pthread_mutex_lock(&budget_lock);
+
+	//Usually there's room right away, and nobody has to wait
+	if(budget_used + bytes > MEMORY_BUDGET)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += MEMORY_BUDGET_WAIT / 1000;
+		deadline.tv_nsec += (MEMORY_BUDGET_WAIT % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+
+		//On a fiber, this parks the fiber, not the thread
+		int wait_result = 0;
+		while(budget_used + bytes > MEMORY_BUDGET && wait_result == 0)
+			wait_result = fiber_cond_timedwait(&budget_freed, &budget_lock,
+				&deadline);
+	}
+
+	bool acquired = budget_used + bytes <= MEMORY_BUDGET;
+	if(acquired)
+		budget_used += bytes;
+
+	pthread_mutex_unlock(&budget_lock);
+
+	if(!acquired) stat_add_budget_rejection();
+	return acquired;
+}
+
+void budget_release(size_t bytes)
+{
+	if(bytes == 0)
+		return;
+
+	pthread_mutex_lock(&budget_lock);
+	budget_used -= bytes;
+	fiber_cond_broadcast(&budget_freed);
+	pthread_mutex_unlock(&budget_lock);
+}
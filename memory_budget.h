@@ -0,0 +1,26 @@
+/*
+ * memory_budget.h
+ *
+ *  Created on: Mar 10, 2014
+ *      Author: nathan
+ *
+ *  A process-wide budget for the bytes held by in-flight messages: buffered
+ *  bodies and relay buffers. Anything big enough to matter charges the budget
+ *  before allocating, so a burst of large transfers makes new ones wait (and
+ *  eventually fail with a 503) instead of pushing the machine into swap.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Charge bytes to the budget. If there isn't room, waits up to
+ * MEMORY_BUDGET_WAIT milliseconds for other transfers to finish, then gives
+ * up and returns false.
+ */
+bool budget_acquire(size_t bytes);
+
+//Give bytes back to the budget
+void budget_release(size_t bytes);
@@ -14,6 +14,7 @@
 
 #include "config.h"
 #include "print_thread.h"
+#include "affinity.h"
 
 typedef struct message_node
 {
@@ -181,6 +182,8 @@ void begin_print_thread()
 
 	//Launch thread
 	_print_thread_status = pthread_create(&queue.printer, 0, &print_thread, 0);
+	if(_print_thread_status == 0)
+		affinity_register(queue.printer, affinity_housekeeping, 0);
 }
 
 __attribute__((destructor (MODULE_PRINT_PRI)))
@@ -0,0 +1,108 @@
+/*
+ * probes.h
+ *
+ *  Created on: Mar 17, 2014
+ *      Author: nathan
+ *
+ *  USDT (SystemTap SDT) static tracepoints, for tracing a running proxy with
+ *  bpftrace, perf or SystemTap without a debug build. A probe is a single nop
+ *  plus a note in the ELF file describing where it is and where its arguments
+ *  live, so it costs next to nothing until a tracer attaches. There's no
+ *  runtime dependency: sys/sdt.h is used if it's installed, and otherwise the
+ *  same notes are emitted here (x86-64 only; elsewhere probes compile out).
+ *
+ *  All probes are in the "proxy" provider. See tracing/ for example scripts.
+ *  Arguments are all 64 bits; strings are passed as char pointers.
+ *
+ *    accept(fd)
+ *    request_line(fd, domain, method)
+ *    filter(fd, domain, blocked)
+ *    headers(fd, header_bytes)
+ *    dns_start(fd, domain)
+ *    dns_end(fd, domain, error)
+ *    connect_start(fd, server_fd)
+ *    connect_end(fd, server_fd, error)
+ *    first_byte(fd, status)
+ *    done(fd, domain, status, request_bytes, response_bytes, source)
+ *      source: 0 origin, 1 cache, 2 collapsed, 3 tunnel
+ *    error(fd, code)
+ *      code: the status sent to the client, or 0 if none was
+ */
+
+#pragma once
+
+#include "config.h"
+
+#if TRACE_PROBES && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_FROM_SDT 1
+#endif
+#endif
+
+#if TRACE_PROBES && PROBES_FROM_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(proxy, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#define PROBE6(name, a, b, c, d, e, f) \
+	DTRACE_PROBE6(proxy, name, a, b, c, d, e, f)
+
+#elif TRACE_PROBES && defined(__x86_64__)
+
+/*
+ * The note is laid out exactly like sys/sdt.h's: the probe's address, the
+ * .stapsdt.base address (so tools can adjust for prelinking), a semaphore
+ * address (none), then the provider, name and argument descriptions. Each
+ * argument is described as "-8@operand", a signed 8 byte value in whatever
+ * register, memory location or constant the compiler chose.
+ */
+#define PROBE_NOTE(name, args, ...) \
+	__asm__ __volatile__ ( \
+		"990: nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b\n" \
+		".8byte _.stapsdt.base\n" \
+		".8byte 0\n" \
+		".asciz \"proxy\"\n" \
+		".asciz \"" #name "\"\n" \
+		".asciz \"" args "\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		:: __VA_ARGS__)
+
+#define PROBE_ARG(x) "nor" ((long)(x))
+
+#define PROBE1(name, a) PROBE_NOTE(name, "-8@%0", PROBE_ARG(a))
+#define PROBE2(name, a, b) PROBE_NOTE(name, "-8@%0 -8@%1", \
+	PROBE_ARG(a), PROBE_ARG(b))
+#define PROBE3(name, a, b, c) PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2", \
+	PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c))
+#define PROBE6(name, a, b, c, d, e, f) PROBE_NOTE(name, \
+	"-8@%0 -8@%1 -8@%2 -8@%3 -8@%4 -8@%5", PROBE_ARG(a), PROBE_ARG(b), \
+	PROBE_ARG(c), PROBE_ARG(d), PROBE_ARG(e), PROBE_ARG(f))
+
+#else
+
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE6(name, a, b, c, d, e, f) ((void)0)
+
+#endif
+
+//The source argument of the done probe
+enum { probe_origin, probe_cache, probe_collapsed, probe_tunnel };
@@ -0,0 +1,397 @@
+/*
+ * response_cache.c
+ *
+ *  Created on: Mar 7, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "response_cache.h"
+#include "cache_policy.h"
+#include "compression.h"
+#include "stat_tracking.h"
+#include "config.h"
+
+#define CACHE_BUCKETS 1024
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15 //Counters saturate here, like 4 bit counters
+
+/*
+ * Entries are reference counted. The shard's table holds one reference, and
+ * each client being served from the entry holds another, so an entry can be
+ * evicted while it's still being sent.
+ */
+struct cache_entry
+{
+	struct cache_entry* bucket_next;
+	struct cache_entry* lru_prev; //Towards the most recently used
+	struct cache_entry* lru_next; //Towards the least recently used
+
+	uint64_t hash;
+	String key;
+	String vary_names; //The response's Vary header
+	String vary_values; //The request's values for those headers
+
+	String head; //Response line and headers, without the empty line
+	String body;
+
+	time_t stored_at;
+	CacheLifetime lifetime;
+	int status;
+	bool compressible; //Can be sent compressed; see compression.h
+
+	size_t size; //Bytes charged against the shard
+	int refs;
+};
+
+typedef struct
+{
+	pthread_mutex_t lock;
+
+	CacheEntry* buckets[CACHE_BUCKETS];
+	CacheEntry* lru_front;
+	CacheEntry* lru_back;
+	size_t bytes;
+
+	//TinyLFU count-min sketch of recent request frequency
+	uint8_t sketch[SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+	unsigned sketch_additions;
+} CacheShard;
+
+static CacheShard* shards;
+
+static inline size_t shard_capacity()
+{
+	return CACHE_SIZE / CACHE_SHARDS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SHARDS AND THE FREQUENCY SKETCH
+///////////////////////////////////////////////////////////////////////////////
+
+static inline CacheShard* hash_shard(uint64_t hash)
+{
+	return &shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static inline size_t hash_bucket(uint64_t hash)
+{
+	return (hash >> 8) % CACHE_BUCKETS;
+}
+
+//Double hashing picks the counter in each row
+static inline size_t sketch_index(uint64_t hash, int row)
+{
+	uint32_t h1 = hash >> 32;
+	uint32_t h2 = (uint32_t)hash | 1;
+	return (h1 + row * h2) & (CACHE_SKETCH_WIDTH - 1);
+}
+
+static inline void sketch_increment(CacheShard* shard, uint64_t hash)
+{
+	for(int row = 0; row < SKETCH_ROWS; ++row)
+	{
+		uint8_t* counter = &shard->sketch[row][sketch_index(hash, row)];
+		if(*counter < SKETCH_MAX) ++*counter;
+	}
+
+	//Periodically halve everything, so old popularity fades out
+	if(++shard->sketch_additions >= 10 * CACHE_SKETCH_WIDTH)
+	{
+		for(int row = 0; row < SKETCH_ROWS; ++row)
+			for(size_t i = 0; i < CACHE_SKETCH_WIDTH; ++i)
+				shard->sketch[row][i] >>= 1;
+		shard->sketch_additions /= 2;
+	}
+}
+
+static inline unsigned sketch_estimate(CacheShard* shard, uint64_t hash)
+{
+	unsigned estimate = SKETCH_MAX;
+	for(int row = 0; row < SKETCH_ROWS; ++row)
+	{
+		unsigned counter = shard->sketch[row][sketch_index(hash, row)];
+		if(counter < estimate) estimate = counter;
+	}
+	return estimate;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ENTRIES
+///////////////////////////////////////////////////////////////////////////////
+
+static inline void free_entry(CacheEntry* entry)
+{
+	es_free(&entry->key);
+	es_free(&entry->vary_names);
+	es_free(&entry->vary_values);
+	es_free(&entry->head);
+	es_free(&entry->body);
+	free(entry);
+}
+
+void cache_release(CacheEntry* entry)
+{
+	if(__sync_sub_and_fetch(&entry->refs, 1) == 0)
+		free_entry(entry);
+}
+
+//All of the below must be called with the shard locked
+
+static inline void lru_unlink(CacheShard* shard, CacheEntry* entry)
+{
+	if(entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else shard->lru_front = entry->lru_next;
+
+	if(entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else shard->lru_back = entry->lru_prev;
+}
+
+static inline void lru_push_front(CacheShard* shard, CacheEntry* entry)
+{
+	entry->lru_prev = 0;
+	entry->lru_next = shard->lru_front;
+	if(shard->lru_front) shard->lru_front->lru_prev = entry;
+	else shard->lru_back = entry;
+	shard->lru_front = entry;
+}
+
+static inline CacheEntry** find_entry(CacheShard* shard, uint64_t hash,
+	StringRef key)
+{
+	CacheEntry** link = &shard->buckets[hash_bucket(hash)];
+	while(*link && ((*link)->hash != hash ||
+			es_compare(es_ref(&(*link)->key), key) != 0))
+		link = &(*link)->bucket_next;
+	return link;
+}
+
+//Take an entry out of the shard, and drop the shard's reference to it
+static inline void remove_entry(CacheShard* shard, CacheEntry** link)
+{
+	CacheEntry* entry = *link;
+	*link = entry->bucket_next;
+	lru_unlink(shard, entry);
+	shard->bytes -= entry->size;
+	cache_release(entry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// INIT
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_CACHE_PRI)))
+void init_response_cache()
+{
+	if(DEBUG_PRINT) puts("Initializing response cache");
+	if(CACHE_SIZE == 0)
+		return;
+
+	shards = calloc(CACHE_SHARDS, sizeof(CacheShard));
+	for(int i = 0; i < CACHE_SHARDS; ++i)
+		pthread_mutex_init(&shards[i].lock, 0);
+}
+
+__attribute__((destructor (MODULE_CACHE_PRI)))
+void deinit_response_cache()
+{
+	if(DEBUG_PRINT) puts("Clearing response cache");
+	if(!shards)
+		return;
+
+	for(int i = 0; i < CACHE_SHARDS; ++i)
+	{
+		for(size_t bucket = 0; bucket < CACHE_BUCKETS; ++bucket)
+			while(shards[i].buckets[bucket])
+				remove_entry(&shards[i], &shards[i].buckets[bucket]);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	free(shards);
+	shards = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+CacheEntry* cache_lookup(const HTTP_Message* request)
+{
+	if(!shards)
+		return 0;
+
+	String key = cache_key(request);
+	uint64_t hash = cache_key_hash(es_ref(&key));
+	CacheShard* shard = hash_shard(hash);
+	CacheEntry* result = 0;
+
+	pthread_mutex_lock(&shard->lock);
+
+	sketch_increment(shard, hash);
+
+	CacheEntry** link = find_entry(shard, hash, es_ref(&key));
+	CacheEntry* entry = *link;
+
+	if(entry && entry->lifetime.expires <= time(0))
+	{
+		remove_entry(shard, link);
+	}
+	else if(entry)
+	{
+		//The request has to select the same variant
+		bool variant_match = true;
+		if(entry->vary_names.size)
+		{
+			String vary_values = cache_vary_values(request,
+				es_ref(&entry->vary_names));
+			variant_match = es_compare(es_ref(&vary_values),
+				es_ref(&entry->vary_values)) == 0;
+			es_free(&vary_values);
+		}
+
+		if(variant_match)
+		{
+			lru_unlink(shard, entry);
+			lru_push_front(shard, entry);
+			__sync_add_and_fetch(&entry->refs, 1);
+			result = entry;
+		}
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+	es_free(&key);
+
+	if(result) stat_add_cache_hit();
+	else stat_add_cache_miss();
+
+	return result;
+}
+
+int cache_write(const CacheEntry* entry, int fd, bool head_only,
+	ContentCoding coding, CacheServed* served)
+{
+	served->status = entry->status;
+	served->body_size = head_only ? 0 : entry->body.size;
+
+	char age_line[64];
+	long age = entry->lifetime.initial_age + (time(0) - entry->stored_at);
+	int age_size = snprintf(age_line, sizeof(age_line), "Age: %ld\r\n\r\n",
+		age);
+
+	//The entry holds the original; compress it on the way out
+	if(entry->compressible && !head_only)
+	{
+		String head = es_copy(es_ref(&entry->head));
+		es_append(&head, es_tempn(age_line, age_size));
+		int error = compress_write(es_ref(&head), es_ref(&entry->body), coding,
+			entry->hash, fd);
+		es_free(&head);
+		return error;
+	}
+
+	//A HEAD gets the same headers a GET would have
+	StringRef vary = entry->compressible ? compress_vary_line() : es_temp(0);
+	struct iovec parts[4] =
+	{
+		{ .iov_base = (void*)es_ref(&entry->head).begin,
+			.iov_len = entry->head.size },
+		{ .iov_base = (void*)vary.begin, .iov_len = vary.size },
+		{ .iov_base = age_line, .iov_len = age_size },
+		{ .iov_base = (void*)es_ref(&entry->body).begin,
+			.iov_len = entry->body.size },
+	};
+	return write_parts(fd, parts, head_only ? 3 : 4);
+}
+
+void cache_store(const HTTP_Message* request, HTTP_Message* response)
+{
+	if(!shards)
+		return;
+
+	if(response->body.size > CACHE_MAX_OBJECT_SIZE)
+		return;
+
+	CacheLifetime lifetime;
+	if(!cache_response_allowed(request, response, &lifetime))
+		return;
+
+	//Serialize the head, without the empty line, so Age can go on the end
+	remove_header(response, header_id_name(hdr_age));
+	String head_text = serialize_response_head(response);
+	String head = es_copy(es_slice(es_ref(&head_text), 0, head_text.size - 2));
+	es_free(&head_text);
+
+	CacheEntry* entry = malloc(sizeof(CacheEntry));
+	entry->key = cache_key(request);
+	entry->hash = cache_key_hash(es_ref(&entry->key));
+	entry->head = head;
+	entry->body = es_copy(es_ref(&response->body));
+	entry->stored_at = time(0);
+	entry->lifetime = lifetime;
+	entry->status = response->response.status;
+	entry->compressible = compress_eligible(response);
+	entry->refs = 1;
+
+	const HTTP_Header* vary = find_header_id(response, hdr_vary);
+	entry->vary_names = vary ? es_copy(vary->value) : es_empty_string;
+	entry->vary_values = vary ?
+		cache_vary_values(request, vary->value) : es_empty_string;
+
+	entry->size = sizeof(CacheEntry) + entry->key.size + entry->head.size +
+		entry->body.size + entry->vary_names.size + entry->vary_values.size;
+
+	CacheShard* shard = hash_shard(entry->hash);
+	size_t capacity = shard_capacity();
+	unsigned evictions = 0;
+	bool admitted = entry->size <= capacity;
+
+	pthread_mutex_lock(&shard->lock);
+
+	//A new version replaces the old one outright
+	CacheEntry** link = find_entry(shard, entry->hash, es_ref(&entry->key));
+	if(*link)
+		remove_entry(shard, link);
+
+	/*
+	 * TinyLFU admission: make room by evicting from the LRU end, but only
+	 * while the newcomer has been requested more often than the victim.
+	 */
+	unsigned frequency = sketch_estimate(shard, entry->hash);
+	while(admitted && shard->bytes + entry->size > capacity)
+	{
+		CacheEntry* victim = shard->lru_back;
+		if(frequency <= sketch_estimate(shard, victim->hash))
+		{
+			admitted = false;
+			break;
+		}
+
+		remove_entry(shard, find_entry(shard, victim->hash,
+			es_ref(&victim->key)));
+		++evictions;
+	}
+
+	if(admitted)
+	{
+		CacheEntry** bucket = &shard->buckets[hash_bucket(entry->hash)];
+		entry->bucket_next = *bucket;
+		*bucket = entry;
+		lru_push_front(shard, entry);
+		shard->bytes += entry->size;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if(evictions) stat_add_cache_evictions(evictions);
+
+	if(!admitted)
+	{
+		stat_add_cache_rejection();
+		cache_release(entry);
+	}
+}
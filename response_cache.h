@@ -0,0 +1,45 @@
+/*
+ * response_cache.h
+ *
+ *  Created on: Mar 7, 2014
+ *      Author: nathan
+ *
+ *  The in-memory response cache. Fresh GET responses are stored, serialized,
+ *  and can be sent straight to later clients asking for the same thing (by
+ *  GET or HEAD). The cache is split into shards, each with its own lock, LRU
+ *  list and byte budget. New responses only get in by evicting old ones if a
+ *  TinyLFU frequency sketch says they've been asked for more often than what
+ *  they'd replace, so a stream of one-off requests can't flush the hot set.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "http.h"
+#include "compression.h"
+#include "cache_policy.h"
+
+typedef struct cache_entry CacheEntry;
+
+/*
+ * Find a fresh cached response for a request. The entry stays valid until
+ * cache_release is called, even if it's evicted in the meantime. Returns null
+ * on a miss. Also counts the request for the admission sketch.
+ */
+CacheEntry* cache_lookup(const HTTP_Message* request);
+void cache_release(CacheEntry* entry);
+
+/*
+ * Send a cached response to a client, compressed with coding if it's
+ * eligible, and fill in served. Returns 0 on success.
+ */
+int cache_write(const CacheEntry* entry, int fd, bool head_only,
+	ContentCoding coding, CacheServed* served);
+
+/*
+ * Store the response to a request, if the cache policy allows it and the
+ * admission policy accepts it. The response is serialized as it stands, and
+ * its Age header is removed (cache_write adds a current one).
+ */
+void cache_store(const HTTP_Message* request, HTTP_Message* response);
@@ -0,0 +1,479 @@
+/*
+ * reverse_proxy.c
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "reverse_proxy.h"
+#include "print_thread.h"
+#include "stat_tracking.h"
+#include "affinity.h"
+#include "config.h"
+
+struct backend
+{
+	struct sockaddr_in address;
+	String name; //host:port, as given in the route
+
+	unsigned outstanding;
+	bool healthy;
+	unsigned failures; //Failed checks in a row, while it's up
+	unsigned passes; //Passed checks in a row, while it's down
+	uint64_t recovered; //Milliseconds, when it last came back; 0 if it never left
+};
+
+struct route
+{
+	Route* next;
+	String host; //Empty for any host
+	String prefix; //No leading '/', like a request line's path
+
+	Backend* backends;
+	unsigned backend_count;
+	unsigned rotation; //Where the next pick starts, so ties take turns
+};
+
+/*
+ * Routes are only added at startup, before any requests, and are never
+ * removed, so they're read without the lock. The lock covers the backends'
+ * counts and health.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake; //Signalled to stop the health checks
+	Route* routes;
+
+	pthread_t thread;
+	bool checking; //The health check thread is running
+	bool shutdown;
+} reverse;
+
+//Share of the traffic a backend gets the moment it comes back
+#define SLOW_START_FLOOR 0.1
+
+static inline uint64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HEALTH CHECKS
+///////////////////////////////////////////////////////////////////////////////
+
+//Wait for fd to be ready, until the deadline. Returns false if it never was.
+static bool wait_for(int fd, short events, uint64_t deadline)
+{
+	while(true)
+	{
+		uint64_t now = now_ms();
+		if(now >= deadline)
+			return false;
+
+		struct pollfd poll_fd = { .fd = fd, .events = events };
+		int ready = poll(&poll_fd, 1, deadline - now);
+		if(ready > 0)
+			return true;
+		if(ready < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+/*
+ * One check: connect, GET REVERSE_HEALTH_PATH, and look at the status. All of
+ * it has to fit in REVERSE_HEALTH_TIMEOUT.
+ */
+static bool check(Route* route, Backend* backend)
+{
+	uint64_t deadline = now_ms() + REVERSE_HEALTH_TIMEOUT * 1000;
+
+	int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return false;
+
+	bool passed = false;
+	int connect_error = 0;
+	socklen_t error_size = sizeof(connect_error);
+	if((connect(fd, (const struct sockaddr*)&backend->address,
+			sizeof(backend->address)) == 0 || errno == EINPROGRESS) &&
+		wait_for(fd, POLLOUT, deadline) &&
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_error, &error_size) == 0 &&
+		connect_error == 0)
+	{
+		//A wildcard route has no host to ask for, so ask for the backend
+		String* host = route->host.size ? &route->host : &backend->name;
+		String request = es_printf("GET %s HTTP/1.0\r\nHost: %.*s\r\n"
+			"Connection: close\r\n\r\n", REVERSE_HEALTH_PATH,
+			(int)host->size, es_cstrc(host));
+
+		//"HTTP/1.x 200" is all that's needed
+		char status[12];
+		size_t have = 0;
+		if(send(fd, es_cstrc(&request), request.size, MSG_NOSIGNAL) ==
+				(ssize_t)request.size)
+		{
+			while(have < sizeof(status) && wait_for(fd, POLLIN, deadline))
+			{
+				ssize_t amount = recv(fd, status + have, sizeof(status) - have, 0);
+				if(amount <= 0)
+					break;
+				have += amount;
+			}
+		}
+		es_free(&request);
+
+		passed = have == sizeof(status) && memcmp(status, "HTTP/1.", 7) == 0 &&
+			(status[9] == '2' || status[9] == '3');
+	}
+
+	close(fd);
+	return passed;
+}
+
+typedef enum { backend_unchanged, backend_down, backend_up } BackendChange;
+
+//Count a check, or a failed request, towards taking a backend out or back in
+static BackendChange record(Backend* backend, bool passed)
+{
+	BackendChange change = backend_unchanged;
+
+	pthread_mutex_lock(&reverse.lock);
+	if(passed)
+	{
+		backend->failures = 0;
+		if(!backend->healthy && ++backend->passes >= REVERSE_HEALTH_RISE)
+		{
+			backend->healthy = true;
+			backend->passes = 0;
+			backend->recovered = now_ms();
+			change = backend_up;
+		}
+	}
+	else
+	{
+		backend->passes = 0;
+		if(backend->healthy && ++backend->failures >= REVERSE_HEALTH_FALL)
+		{
+			backend->healthy = false;
+			backend->failures = 0;
+			change = backend_down;
+		}
+	}
+	pthread_mutex_unlock(&reverse.lock);
+
+	if(change != backend_unchanged)
+	{
+		stat_add_backend_change(change == backend_up);
+		submit_print(es_printf("Backend %.*s is %s", (int)backend->name.size,
+			es_cstrc(&backend->name), change == backend_up ? "back up" : "down"));
+	}
+	return change;
+}
+
+static void* health_thread(void* unused)
+{
+	pthread_mutex_lock(&reverse.lock);
+	while(!reverse.shutdown)
+	{
+		//New routes go on the front, so this list stays as it is
+		Route* routes = reverse.routes;
+		pthread_mutex_unlock(&reverse.lock);
+
+		for(Route* route = routes; route; route = route->next)
+			for(unsigned i = 0; i < route->backend_count; ++i)
+				record(&route->backends[i], check(route, &route->backends[i]));
+
+		struct timespec wake_at;
+		clock_gettime(CLOCK_MONOTONIC, &wake_at);
+		wake_at.tv_sec += REVERSE_HEALTH_INTERVAL;
+
+		pthread_mutex_lock(&reverse.lock);
+		while(!reverse.shutdown &&
+				pthread_cond_timedwait(&reverse.wake, &reverse.lock, &wake_at) !=
+				ETIMEDOUT);
+	}
+	pthread_mutex_unlock(&reverse.lock);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ROUTES
+///////////////////////////////////////////////////////////////////////////////
+
+static void free_route(Route* route)
+{
+	for(unsigned i = 0; i < route->backend_count; ++i)
+		es_free(&route->backends[i].name);
+	free(route->backends);
+	es_free(&route->host);
+	es_free(&route->prefix);
+	free(route);
+}
+
+//Resolve host:port to its first IPv4 address
+static int add_backend(Route* route, StringRef name)
+{
+	const char* colon = name.begin + name.size;
+	while(colon > name.begin && *--colon != ':');
+	if(*colon != ':' || colon == name.begin ||
+			colon == name.begin + name.size - 1)
+		return -1;
+
+	Backend* backend = &route->backends[route->backend_count];
+	backend->name = es_copy(name);
+	String host = es_copy(es_slice(name, 0, colon - name.begin));
+	String port = es_copy(es_slice(name, colon - name.begin + 1, name.size));
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* info;
+	int lookup_error = getaddrinfo(es_cstrc(&host), es_cstrc(&port), &hints,
+		&info);
+	es_free(&host);
+	es_free(&port);
+	if(lookup_error)
+	{
+		es_free(&backend->name);
+		return -1;
+	}
+
+	backend->address = *(struct sockaddr_in*)info->ai_addr;
+	backend->healthy = true;
+	freeaddrinfo(info);
+	++route->backend_count;
+	return 0;
+}
+
+/*
+ * Whether a pick can land on a backend. The first pass only takes healthy
+ * ones; the second, when none are, takes any. Neither repeats a failure
+ * unless there's no other backend to try.
+ */
+static inline bool usable(const Route* route, const Backend* backend,
+	const Backend* avoid, bool healthy_only)
+{
+	if(backend == avoid && (healthy_only || route->backend_count > 1))
+		return false;
+	return backend->healthy || !healthy_only;
+}
+
+//How much of its share of requests a backend should get, while it warms up
+static inline double weight(const Backend* backend, uint64_t now)
+{
+	uint64_t ramp = REVERSE_SLOW_START * 1000;
+	if(!backend->recovered || now - backend->recovered >= ramp)
+		return 1;
+
+	double share = (double)(now - backend->recovered) / ramp;
+	return share < SLOW_START_FLOOR ? SLOW_START_FLOOR : share;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_REVERSE_PRI)))
+void init_reverse_proxy()
+{
+	if(DEBUG_PRINT) puts("Initializing reverse proxy");
+	pthread_mutex_init(&reverse.lock, 0);
+
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&reverse.wake, &attributes);
+	pthread_condattr_destroy(&attributes);
+}
+
+__attribute__((destructor (MODULE_REVERSE_PRI)))
+void deinit_reverse_proxy()
+{
+	if(DEBUG_PRINT) puts("Clearing reverse proxy");
+
+	pthread_mutex_lock(&reverse.lock);
+	reverse.shutdown = true;
+	pthread_cond_signal(&reverse.wake);
+	pthread_mutex_unlock(&reverse.lock);
+	if(reverse.checking)
+		pthread_join(reverse.thread, 0);
+
+	while(reverse.routes)
+	{
+		Route* route = reverse.routes;
+		reverse.routes = route->next;
+		free_route(route);
+	}
+	pthread_cond_destroy(&reverse.wake);
+	pthread_mutex_destroy(&reverse.lock);
+}
+
+int reverse_add_route(const char* spec)
+{
+	const char* equals = strchr(spec, '=');
+	if(!equals || equals == spec || !equals[1])
+		return -1;
+	const char* slash = memchr(spec, '/', equals - spec);
+	const char* host_end = slash ? slash : equals;
+	if(host_end == spec)
+		return -1;
+
+	Route* route = calloc(1, sizeof(Route));
+	if(!route)
+		return -1;
+
+	StringRef host = es_tempn(spec, host_end - spec);
+	if(es_compare(host, es_temp("*")))
+		route->host = es_copy(host);
+	if(slash)
+		route->prefix = es_copy(es_tempn(slash + 1, equals - slash - 1));
+
+	unsigned count = 1;
+	for(const char* at = equals + 1; *at; ++at)
+		count += *at == ',';
+	route->backends = calloc(count, sizeof(Backend));
+	if(!route->backends)
+	{
+		free_route(route);
+		return -1;
+	}
+
+	for(const char* at = equals + 1; *at;)
+	{
+		const char* end = strchr(at, ',');
+		if(!end)
+			end = at + strlen(at);
+		if(add_backend(route, es_tempn(at, end - at)))
+		{
+			free_route(route);
+			return -1;
+		}
+		at = *end ? end + 1 : end;
+	}
+
+	pthread_mutex_lock(&reverse.lock);
+	route->next = reverse.routes;
+	reverse.routes = route;
+	pthread_mutex_unlock(&reverse.lock);
+
+	if(!reverse.checking)
+	{
+		if(pthread_create(&reverse.thread, 0, health_thread, 0))
+			return -1;
+		affinity_register(reverse.thread, affinity_housekeeping, 0);
+		reverse.checking = true;
+	}
+	return 0;
+}
+
+bool reverse_active()
+{
+	return reverse.routes != 0;
+}
+
+Route* reverse_route(HTTP_Message* request)
+{
+	HTTP_ReqLine* line = &request->request;
+
+	//A bad Host is left out, and only a route for any host can take it
+	es_clear(&line->domain);
+	es_clear(&line->port);
+	const HTTP_Header* host = find_header_id(request, hdr_host);
+	if(host && split_authority(line, trim_lws(host->value)))
+	{
+		es_clear(&line->domain);
+		es_clear(&line->port);
+	}
+
+	StringRef domain = es_ref(&line->domain);
+	StringRef path = es_ref(&line->path);
+
+	//A named host beats any host, and then the longest prefix wins
+	Route* best = 0;
+	for(Route* route = reverse.routes; route; route = route->next)
+	{
+		if(route->host.size && (route->host.size != domain.size ||
+				strncasecmp(es_cstrc(&route->host), domain.begin, domain.size)))
+			continue;
+		if(route->prefix.size > path.size ||
+				memcmp(es_cstrc(&route->prefix), path.begin, route->prefix.size))
+			continue;
+
+		if(!best || (route->host.size && !best->host.size) ||
+				(!route->host.size == !best->host.size &&
+				route->prefix.size > best->prefix.size))
+			best = route;
+	}
+
+	stat_add_reverse_request(best != 0);
+	return best;
+}
+
+Backend* route_pick(Route* route, const Backend* avoid)
+{
+	uint64_t now = now_ms();
+	Backend* pick = 0;
+	double best = 0;
+
+	pthread_mutex_lock(&reverse.lock);
+
+	//Least outstanding, scaled by slow start; if nothing's healthy, anything
+	for(int healthy_only = 1; healthy_only >= 0 && !pick; --healthy_only)
+	{
+		for(unsigned i = 0; i < route->backend_count; ++i)
+		{
+			Backend* backend =
+				&route->backends[(route->rotation + i) % route->backend_count];
+			if(!usable(route, backend, avoid, healthy_only))
+				continue;
+
+			double load = (backend->outstanding + 1) / weight(backend, now);
+			if(!pick || load < best)
+			{
+				pick = backend;
+				best = load;
+			}
+		}
+	}
+
+	if(pick)
+		++pick->outstanding;
+	++route->rotation;
+
+	pthread_mutex_unlock(&reverse.lock);
+	return pick;
+}
+
+const struct sockaddr_in* backend_address(const Backend* backend)
+{
+	return &backend->address;
+}
+
+void backend_failed(Backend* backend)
+{
+	record(backend, false);
+}
+
+void backend_done(Backend* backend)
+{
+	if(!backend)
+		return;
+
+	pthread_mutex_lock(&reverse.lock);
+	--backend->outstanding;
+	pthread_mutex_unlock(&reverse.lock);
+}
@@ -0,0 +1,63 @@
+/*
+ * reverse_proxy.h
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: nathan
+ *
+ *  Reverse proxying, with -r. Requests in origin form (GET /path, rather
+ *  than GET http://host/path) are routed by their Host header and path to a
+ *  pool of backends, instead of to whatever they name. The route with a
+ *  matching host and the longest matching path prefix wins; a route for
+ *  host * matches any host, but only if no route names the host itself.
+ *
+ *  Within a pool, each request goes to the healthy backend with the fewest
+ *  requests outstanding. A thread checks every backend in the background
+ *  (GET REVERSE_HEALTH_PATH, which has to answer 2xx or 3xx): failing
+ *  REVERSE_HEALTH_FALL checks in a row takes a backend out, and passing
+ *  REVERSE_HEALTH_RISE brings it back. A backend that has just come back
+ *  only gets a share of the traffic at first, growing to its full share over
+ *  REVERSE_SLOW_START seconds, so a cold one isn't buried straight away.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "http.h"
+
+typedef struct route Route;
+typedef struct backend Backend;
+
+/*
+ * Add a route, "host/prefix=backend,backend...", where each backend is
+ * host:port. The host can be * for any host, and the prefix can be left out
+ * for all paths. Returns 0, or -1 if it's malformed or a backend doesn't
+ * resolve.
+ */
+int reverse_add_route(const char* spec);
+
+//True once there's a route
+bool reverse_active();
+
+/*
+ * The route for an origin-form request, or 0 if there isn't one. The
+ * request's domain and port are filled in from its Host header, so it can be
+ * cached and logged like any other, but it's still sent in origin form.
+ */
+Route* reverse_route(HTTP_Message* request);
+
+/*
+ * Pick a backend from a route's pool, other than avoid if there's a choice.
+ * It counts as outstanding until backend_done.
+ */
+Backend* route_pick(Route* route, const Backend* avoid);
+
+//The address to connect to
+const struct sockaddr_in* backend_address(const Backend* backend);
+
+//A connect or response failed; it counts like a failed health check
+void backend_failed(Backend* backend);
+
+//The request is finished with the backend. backend may be 0.
+void backend_done(Backend* backend);
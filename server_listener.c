@@ -17,6 +17,12 @@
 #include "http_manager_thread.h"
 #include "print_thread.h"
 #include "stat_tracking.h"
+#include "timer_wheel.h"
+#include "socket_options.h"
+#include "probes.h"
+#include "uring.h"
+#include "upgrade.h"
+#include "affinity.h"
 
 typedef struct sockaddr_in SockAddrIn;
 
@@ -31,6 +37,11 @@ static void quit_signal(int sig)
 	exit(0); //Registered cleanup handlers will ensure clean shutdown
 }
 
+static void upgrade_signal(int sig)
+{
+	upgrade_request();
+}
+
 int serve_forever(uint16_t port)
 {
 	if(manager_status() != 0)
@@ -45,57 +56,82 @@ int serve_forever(uint16_t port)
 		return 1;
 	}
 
+	if(timer_thread_status() != 0)
+	{
+		if(DEBUG_PRINT) puts("Timer thread failed to start");
+		return 1;
+	}
+
 	submit_debug_c("Core server beginning");
 
 	submit_debug_c("Installing signal handlers");
 
 	signal(SIGUSR1, &print_signal);
 	signal(SIGUSR2, &quit_signal);
+	signal(SIGHUP, &upgrade_signal);
 	signal(SIGINT, SIG_IGN);
 
 	#define PRINT_AND_ERROR(MESSAGE) \
 		{ submit_debug(es_copy(es_temp(MESSAGE))); return 1; }
 
-	submit_debug_c("Opening socket");
-	//Open socket
-	int listener_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if(listener_socket < 0)
-		PRINT_AND_ERROR("Error creating listener socket")
-
-	//Set SO_REUSEADDR so we can immediately relaunch on a crash
-	#ifdef DEBUG
+	//An upgrade takes over the old process's listener, already listening
+	int listener_socket = upgrade_take_listener();
+	if(listener_socket >= 0)
 	{
-		int sockopt = 1;
-		setsockopt(listener_socket,
-			SOL_SOCKET,
-			SO_REUSEADDR,
-			&sockopt,
-			sizeof(sockopt));
+		submit_debug_c("Took over listener from the old process");
 	}
-	#endif
-
-	submit_debug_c("Preparing listen address");
-	//Prepare port
-	SockAddrIn listener_addr;
-	listener_addr.sin_family = PF_INET;
-	listener_addr.sin_addr.s_addr = INADDR_ANY;
-	listener_addr.sin_port = htons(port);
-
-	submit_debug_c("Binding to listen address");
-	//Bind
-	if(bind(listener_socket,
-			(struct sockaddr*)&listener_addr,
-			sizeof(listener_addr)) < 0)
+	else
 	{
-		close(listener_socket);
-		PRINT_AND_ERROR("Error binding socket to port")
+		submit_debug_c("Opening socket");
+		//Open socket
+		listener_socket = socket(AF_INET, SOCK_STREAM, 0);
+		if(listener_socket < 0)
+			PRINT_AND_ERROR("Error creating listener socket")
+
+		//Apply the socket tuning profile (SO_REUSEADDR, Fast Open, etc)
+		tune_listener(listener_socket);
+
+		submit_debug_c("Preparing listen address");
+		//Prepare port
+		SockAddrIn listener_addr;
+		listener_addr.sin_family = PF_INET;
+		listener_addr.sin_addr.s_addr = INADDR_ANY;
+		listener_addr.sin_port = htons(port);
+
+		submit_debug_c("Binding to listen address");
+		//Bind
+		if(bind(listener_socket,
+				(struct sockaddr*)&listener_addr,
+				sizeof(listener_addr)) < 0)
+		{
+			close(listener_socket);
+			PRINT_AND_ERROR("Error binding socket to port")
+		}
+
+		submit_debug_c("Listening");
+		//Listen
+		listen(listener_socket, LISTEN_BACKLOG);
 	}
 
-	submit_debug_c("Listening");
-	//Listen
-	listen(listener_socket, 8);
+	//This thread accepts from here on
+	affinity_register(pthread_self(), affinity_accept, 0);
+
+	if(upgrade_start(listener_socket))
+		submit_debug_c("Upgrades unavailable");
 
-	while(1)
+	if(uring_active())
+	{
+		int result = uring_accept_loop(listener_socket);
+		if(result != uring_unsupported)
+		{
+			if(upgrade_handed_off())
+				upgrade_drain();
+			return result;
+		}
+		submit_debug_c("No multishot accept; accepting with blocking I/O");
+	}
+
+	while(!upgrade_handed_off())
 	{
 		struct sockaddr_in client_addr;
 		socklen_t len = sizeof(client_addr);
@@ -105,13 +141,20 @@ int serve_forever(uint16_t port)
 				&len);
 		if(client_fd < 0)
 		{
+			//Interrupted by a signal, possibly to check for an upgrade
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
 			break;
 		}
 		else
 		{
+			PROBE1(accept, client_fd);
 			handle_connection(client_fd, &client_addr);
 		}
 	}
 
+	if(upgrade_handed_off())
+		upgrade_drain();
+
 	return 0;
 }
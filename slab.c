@@ -0,0 +1,122 @@
+/*
+ * slab.c
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: nathan
+ */
+
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "config.h"
+
+struct slab_chunk
+{
+	SlabChunk* next;
+};
+
+struct slab_free
+{
+	SlabFree* next;
+};
+
+/*
+ * Objects are rounded up to a cache line, so two connections' state never
+ * shares one between threads
+ */
+static const size_t object_align = 64;
+
+void slab_init(Slab* slab, size_t size)
+{
+	pthread_mutex_init(&slab->lock, 0);
+	slab->object_size = (size + object_align - 1) & ~(object_align - 1);
+	slab->free = 0;
+	slab->chunks = 0;
+	slab->in_use = 0;
+	slab->reserved = 0;
+}
+
+void slab_destroy(Slab* slab)
+{
+	//Something's still running at exit; leave its memory to the OS
+	if(slab->in_use)
+		return;
+
+	SlabChunk* chunk = slab->chunks;
+	while(chunk)
+	{
+		SlabChunk* next = chunk->next;
+		munmap(chunk, SLAB_CHUNK_SIZE);
+		chunk = next;
+	}
+	slab->chunks = 0;
+	slab->free = 0;
+	slab->reserved = 0;
+	pthread_mutex_destroy(&slab->lock);
+}
+
+//Map another chunk and put its objects on the free list. Call with the lock.
+static inline int slab_grow(Slab* slab)
+{
+	char* memory = mmap(0, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(memory == MAP_FAILED)
+		return -1;
+
+	SlabChunk* chunk = (SlabChunk*)memory;
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	//The chunk header takes the first slot
+	char* end = memory + SLAB_CHUNK_SIZE;
+	for(char* object = memory + object_align; object + slab->object_size <= end;
+		object += slab->object_size)
+	{
+		SlabFree* node = (SlabFree*)object;
+		node->next = slab->free;
+		slab->free = node;
+	}
+
+	slab->reserved += SLAB_CHUNK_SIZE;
+	return 0;
+}
+
+void* slab_alloc(Slab* slab)
+{
+	pthread_mutex_lock(&slab->lock);
+
+	//A chunk too small to hold even one object is out of memory too
+	if(!slab->free && (slab_grow(slab) || !slab->free))
+	{
+		pthread_mutex_unlock(&slab->lock);
+		return 0;
+	}
+
+	SlabFree* node = slab->free;
+	slab->free = node->next;
+	++slab->in_use;
+
+	pthread_mutex_unlock(&slab->lock);
+	return node;
+}
+
+void slab_free(Slab* slab, void* object)
+{
+	if(!object) return;
+
+	SlabFree* node = object;
+
+	pthread_mutex_lock(&slab->lock);
+	node->next = slab->free;
+	slab->free = node;
+	--slab->in_use;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_usage(Slab* slab, size_t* in_use, size_t* reserved)
+{
+	pthread_mutex_lock(&slab->lock);
+	*in_use = slab->in_use;
+	*reserved = slab->reserved;
+	pthread_mutex_unlock(&slab->lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * slab.h
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: nathan
+ *
+ *  A slab allocator for fixed-size objects that come and go with connections
+ *  (the worker's state, the accept loop's handoff). Objects are carved out of
+ *  SLAB_CHUNK_SIZE mappings and kept on a free list when they're released, so
+ *  a busy proxy reuses the same warm memory instead of going to malloc, and
+ *  the slab knows exactly how much connection state is live.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct slab_chunk SlabChunk;
+typedef struct slab_free SlabFree;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	size_t object_size;
+
+	SlabFree* free;
+	SlabChunk* chunks;
+
+	size_t in_use;
+	size_t reserved;
+} Slab;
+
+//Set up a slab of objects of size bytes
+void slab_init(Slab* slab, size_t size);
+
+//Unmap all the slab's memory, unless some objects are still in use
+void slab_destroy(Slab* slab);
+
+//Get an object. Its contents are undefined. Returns 0 if out of memory.
+void* slab_alloc(Slab* slab);
+
+//Give an object back
+void slab_free(Slab* slab, void* object);
+
+//Objects handed out, and bytes mapped for objects, right now
+void slab_usage(Slab* slab, size_t* in_use, size_t* reserved);
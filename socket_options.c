@@ -0,0 +1,99 @@
+/*
+ * socket_options.c
+ *
+ *  Created on: Mar 13, 2014
+ *      Author: nathan
+ */
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket_options.h"
+#include "stat_tracking.h"
+#include "config.h"
+
+//Set an int option. 0 on success, -1 if the kernel refused it.
+static inline int set_int_option(int fd, int level, int option, int value)
+{
+	return setsockopt(fd, level, option, &value, sizeof(value));
+}
+
+//Options shared by both ends of a proxied exchange
+static inline void tune_connection(int fd)
+{
+	//The proxy writes whole messages, so Nagle only ever adds latency
+	if(SOCKET_NODELAY)
+		set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+
+	/*
+	 * Keep the unsent part of the send buffer small, so poll only says
+	 * writable when the data will actually go out soon. This keeps relays
+	 * from parking megabytes in the kernel for a slow reader.
+	 */
+	if(SOCKET_NOTSENT_LOWAT)
+		set_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, SOCKET_NOTSENT_LOWAT);
+
+	if(SOCKET_SEND_BUFFER)
+		set_int_option(fd, SOL_SOCKET, SO_SNDBUF, SOCKET_SEND_BUFFER);
+	if(SOCKET_RECEIVE_BUFFER)
+		set_int_option(fd, SOL_SOCKET, SO_RCVBUF, SOCKET_RECEIVE_BUFFER);
+}
+
+void tune_listener(int fd)
+{
+	//So we can immediately relaunch on a crash
+	if(SOCKET_REUSEADDR)
+		set_int_option(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+
+	//Accept data in the SYN from clients with a cookie. Needs tcp_fastopen & 2.
+	if(SOCKET_FASTOPEN_QUEUE)
+		set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN, SOCKET_FASTOPEN_QUEUE);
+
+	//Only wake accept once the request has started arriving
+	if(SOCKET_DEFER_ACCEPT)
+		set_int_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, SOCKET_DEFER_ACCEPT);
+
+	//Accepted sockets inherit the buffer sizes, and they must be set pre-SYN
+	if(SOCKET_SEND_BUFFER)
+		set_int_option(fd, SOL_SOCKET, SO_SNDBUF, SOCKET_SEND_BUFFER);
+	if(SOCKET_RECEIVE_BUFFER)
+		set_int_option(fd, SOL_SOCKET, SO_RCVBUF, SOCKET_RECEIVE_BUFFER);
+}
+
+void tune_client(int fd)
+{
+	tune_connection(fd);
+
+	//The handshake is already done, so this is known right away
+	if(SOCKET_FASTOPEN_QUEUE)
+	{
+		stat_add_fastopen_attempt(false);
+		note_fastopen(fd, false);
+	}
+}
+
+void tune_upstream(int fd, bool fastopen)
+{
+	tune_connection(fd);
+
+	/*
+	 * With TCP_FASTOPEN_CONNECT, connect() returns right away, and the
+	 * request goes out in the SYN if the kernel has a cookie for the origin.
+	 * The kernel keeps the cookies per destination, so every connection to an
+	 * origin after the first can save the round trip. Needs tcp_fastopen & 1.
+	 */
+	if(SOCKET_FASTOPEN_CONNECT && fastopen &&
+			set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) == 0)
+		stat_add_fastopen_attempt(true);
+}
+
+void note_fastopen(int fd, bool upstream)
+{
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0 &&
+			info.tcpi_options & TCPI_OPT_SYN_DATA)
+		stat_add_fastopen_success(upstream);
+}
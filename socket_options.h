@@ -0,0 +1,33 @@
+/*
+ * socket_options.h
+ *
+ *  Created on: Mar 13, 2014
+ *      Author: nathan
+ *
+ *  The socket tuning profile, set in config.h, applied to each kind of socket
+ *  the proxy opens. Options the kernel doesn't support are just skipped; none
+ *  of them are needed for correctness.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+//The listening socket: reuse, Fast Open, deferred accept, backlog buffers
+void tune_listener(int fd);
+
+//An accepted client connection
+void tune_client(int fd);
+
+/*
+ * An upstream socket, before it's connected. fastopen is false where nothing
+ * is written first, so a refused connect could only show up later on, as a
+ * failed read: tunnels.
+ */
+void tune_upstream(int fd, bool fastopen);
+
+/*
+ * After the first exchange on a connection: check whether Fast Open actually
+ * carried data in the SYN, and count it. upstream is true for origin sockets.
+ */
+void note_fastopen(int fd, bool upstream);
@@ -12,13 +12,67 @@
 #include "config.h"
 #include "stat_tracking.h"
 #include "print_thread.h"
+#include "http_worker_thread.h"
+#include "buffer_pool.h"
+#include "client_limits.h"
 
 typedef struct
 {
 	String filters;
 	unsigned num_successful;
 	unsigned num_filtered;
+	unsigned long long filter_discarded; //Bytes of filtered requests never parsed
 	unsigned num_errors;
+
+	unsigned cache_hits;
+	unsigned cache_misses;
+	unsigned cache_evictions;
+	unsigned cache_rejections; //Refused by the admission policy
+	unsigned disk_cache_hits;
+	unsigned disk_cache_stores;
+	unsigned collapsed; //Served from someone else's upstream fetch
+	unsigned budget_rejections; //Transfers refused for lack of memory
+
+	unsigned timeouts_idle;
+	unsigned timeouts_headers;
+	unsigned timeouts_transfer; //Too slow, rather than too long
+	unsigned timeouts_upstream;
+
+	unsigned tunnels;
+	unsigned long long tunnel_bytes_up;
+	unsigned long long tunnel_bytes_down;
+	unsigned long long tunnel_milliseconds; //Total time tunnels were open
+
+	unsigned compressed;
+	unsigned compress_reused; //Sent from the variant cache
+	unsigned long long compress_in; //Original bytes of compressed responses
+	unsigned long long compress_out; //Bytes actually sent for them
+	unsigned long long compress_cpu; //Nanoseconds spent in deflate
+
+	unsigned h2_connections;
+	unsigned h2_streams;
+	unsigned h2_retries; //Refused, or lost with the connection, and resent
+
+	unsigned upstream_choices;
+	unsigned upstream_retries;
+	unsigned upstream_ejections;
+
+	unsigned reverse_routed;
+	unsigned reverse_unrouted; //Answered with a 404
+	unsigned backends_down;
+	unsigned backends_up;
+
+	unsigned client_too_fast;
+	unsigned client_too_many;
+
+	unsigned affinity_connections;
+	unsigned affinity_by_cpu; //Placed on the node that received them
+
+	//TCP Fast Open: connections that could have used it, and that did
+	unsigned fastopen_client_attempts;
+	unsigned fastopen_client_successes;
+	unsigned fastopen_upstream_attempts;
+	unsigned fastopen_upstream_successes;
 } Stats;
 
 static Stats stats;
@@ -56,11 +110,176 @@ void stat_add_filtered()
 	DO_WITH_LOCK(++stats.num_filtered;)
 }
 
+void stat_add_filter_discarded(unsigned long bytes)
+{
+	DO_WITH_LOCK(stats.filter_discarded += bytes;)
+}
+
 void stat_add_error()
 {
 	DO_WITH_LOCK(++stats.num_errors;)
 }
 
+void stat_add_cache_hit()
+{
+	DO_WITH_LOCK(++stats.cache_hits;)
+}
+
+void stat_add_cache_miss()
+{
+	DO_WITH_LOCK(++stats.cache_misses;)
+}
+
+void stat_add_cache_evictions(unsigned count)
+{
+	DO_WITH_LOCK(stats.cache_evictions += count;)
+}
+
+void stat_add_cache_rejection()
+{
+	DO_WITH_LOCK(++stats.cache_rejections;)
+}
+
+void stat_add_disk_cache_hit()
+{
+	DO_WITH_LOCK(++stats.disk_cache_hits;)
+}
+
+void stat_add_disk_cache_store()
+{
+	DO_WITH_LOCK(++stats.disk_cache_stores;)
+}
+
+void stat_add_collapsed()
+{
+	DO_WITH_LOCK(++stats.collapsed;)
+}
+
+void stat_add_budget_rejection()
+{
+	DO_WITH_LOCK(++stats.budget_rejections;)
+}
+
+void stat_add_timeout_idle()
+{
+	DO_WITH_LOCK(++stats.timeouts_idle;)
+}
+
+void stat_add_timeout_headers()
+{
+	DO_WITH_LOCK(++stats.timeouts_headers;)
+}
+
+void stat_add_timeout_transfer()
+{
+	DO_WITH_LOCK(++stats.timeouts_transfer;)
+}
+
+void stat_add_timeout_upstream()
+{
+	DO_WITH_LOCK(++stats.timeouts_upstream;)
+}
+
+void stat_add_tunnel(unsigned long long up, unsigned long long down,
+	unsigned long milliseconds)
+{
+	DO_WITH_LOCK(
+		++stats.tunnels;
+		stats.tunnel_bytes_up += up;
+		stats.tunnel_bytes_down += down;
+		stats.tunnel_milliseconds += milliseconds;)
+}
+
+void stat_add_compressed(unsigned long long in, unsigned long long out,
+	unsigned long long cpu)
+{
+	DO_WITH_LOCK(
+		++stats.compressed;
+		stats.compress_in += in;
+		stats.compress_out += out;
+		stats.compress_cpu += cpu;)
+}
+
+void stat_add_compress_reused(unsigned long long in, unsigned long long out)
+{
+	DO_WITH_LOCK(
+		++stats.compress_reused;
+		stats.compress_in += in;
+		stats.compress_out += out;)
+}
+
+void stat_add_h2_connection()
+{
+	DO_WITH_LOCK(++stats.h2_connections;)
+}
+
+void stat_add_h2_stream()
+{
+	DO_WITH_LOCK(++stats.h2_streams;)
+}
+
+void stat_add_h2_retry()
+{
+	DO_WITH_LOCK(++stats.h2_retries;)
+}
+
+void stat_add_upstream_choice()
+{
+	DO_WITH_LOCK(++stats.upstream_choices;)
+}
+
+void stat_add_upstream_retry()
+{
+	DO_WITH_LOCK(++stats.upstream_retries;)
+}
+
+void stat_add_upstream_ejection()
+{
+	DO_WITH_LOCK(++stats.upstream_ejections;)
+}
+
+void stat_add_reverse_request(bool routed)
+{
+	DO_WITH_LOCK(
+		if(routed) ++stats.reverse_routed;
+		else ++stats.reverse_unrouted;)
+}
+
+void stat_add_backend_change(bool up)
+{
+	DO_WITH_LOCK(
+		if(up) ++stats.backends_up;
+		else ++stats.backends_down;)
+}
+
+void stat_add_client_limited(bool too_many)
+{
+	DO_WITH_LOCK(
+		if(too_many) ++stats.client_too_many;
+		else ++stats.client_too_fast;)
+}
+
+void stat_add_affinity_connection(bool by_cpu)
+{
+	DO_WITH_LOCK(
+		++stats.affinity_connections;
+		if(by_cpu) ++stats.affinity_by_cpu;)
+}
+
+void stat_add_fastopen_attempt(bool upstream)
+{
+	DO_WITH_LOCK(
+		if(upstream) ++stats.fastopen_upstream_attempts;
+		else ++stats.fastopen_client_attempts;)
+}
+
+void stat_add_fastopen_success(bool upstream)
+{
+	DO_WITH_LOCK(
+		if(upstream) ++stats.fastopen_upstream_successes;
+		else ++stats.fastopen_client_successes;)
+}
+
 void stat_filter(StringRef filter)
 {
 	DO_WITH_LOCK(
@@ -74,17 +293,91 @@ void print_stats()
 
 	DO_WITH_LOCK(stats_copy = stats;)
 
+	//Connection memory is counted where it's allocated
+	size_t connections, state_bytes, lent_bytes, pooled_bytes;
+	connection_memory(&connections, &state_bytes);
+	buffer_usage(&lent_bytes, &pooled_bytes);
+
 	String output = es_printf(
 		"Received SIGUSR1...reporting status:\n"
 		"-- Processed %u requests successfully\n"
 		"-- Filtering: %.*s\n"
-		"-- Filtered %u requests\n"
-		"-- Encountered %u requests in error",
+		"-- Filtered %u requests, discarding %llu bytes of them unparsed\n"
+		"-- Encountered %u requests in error\n"
+		"-- Cache: %u hits, %u misses, %u evictions, %u refused admission\n"
+		"-- Disk cache: %u hits, %u stores\n"
+		"-- Collapsed %u requests into in-flight fetches\n"
+		"-- Refused %u transfers over the memory budget\n"
+		"-- Timeouts: %u idle, %u reading headers, %u stalled transfers, "
+			"%u upstream\n"
+		"-- Tunnels: %u, %llu bytes up, %llu bytes down, %llu ms average\n"
+		"-- Compression: %u responses compressed, %u from the variant cache; "
+			"%llu bytes saved of %llu, for %llu ms of CPU\n"
+		"-- HTTP/2: %u streams on %u upstream connections, %u resent\n"
+		"-- Origin addresses: %u chosen between, %u connects retried "
+			"elsewhere, %u ejected\n"
+		"-- Reverse proxy: %u requests routed, %u with no route; backends "
+			"went down %u times and came back %u\n"
+		"-- Client limits: refused %u connections over the rate, %u over "
+			"the cap; %zu clients tracked\n"
+		"-- Affinity: %u of %u connections placed by their receiving CPU\n"
+		"-- TCP Fast Open saved a round trip on %u of %u client and "
+			"%u of %u upstream connections\n"
+		"-- Memory: %zu connections, %zu bytes each (%zu bytes of state, "
+			"%zu of buffers lent), %zu bytes in the buffer pool",
 
 		stats_copy.num_successful,
 		ES_STRINGPRINT(&stats_copy.filters),
 		stats_copy.num_filtered,
-		stats_copy.num_errors);
+		stats_copy.filter_discarded,
+		stats_copy.num_errors,
+		stats_copy.cache_hits,
+		stats_copy.cache_misses,
+		stats_copy.cache_evictions,
+		stats_copy.cache_rejections,
+		stats_copy.disk_cache_hits,
+		stats_copy.disk_cache_stores,
+		stats_copy.collapsed,
+		stats_copy.budget_rejections,
+		stats_copy.timeouts_idle,
+		stats_copy.timeouts_headers,
+		stats_copy.timeouts_transfer,
+		stats_copy.timeouts_upstream,
+		stats_copy.tunnels,
+		stats_copy.tunnel_bytes_up,
+		stats_copy.tunnel_bytes_down,
+		stats_copy.tunnels ?
+			stats_copy.tunnel_milliseconds / stats_copy.tunnels : 0,
+		stats_copy.compressed,
+		stats_copy.compress_reused,
+		stats_copy.compress_in > stats_copy.compress_out ?
+			stats_copy.compress_in - stats_copy.compress_out : 0,
+		stats_copy.compress_in,
+		stats_copy.compress_cpu / 1000000,
+		stats_copy.h2_streams,
+		stats_copy.h2_connections,
+		stats_copy.h2_retries,
+		stats_copy.upstream_choices,
+		stats_copy.upstream_retries,
+		stats_copy.upstream_ejections,
+		stats_copy.reverse_routed,
+		stats_copy.reverse_unrouted,
+		stats_copy.backends_down,
+		stats_copy.backends_up,
+		stats_copy.client_too_fast,
+		stats_copy.client_too_many,
+		client_count(),
+		stats_copy.affinity_by_cpu,
+		stats_copy.affinity_connections,
+		stats_copy.fastopen_client_successes,
+		stats_copy.fastopen_client_attempts,
+		stats_copy.fastopen_upstream_successes,
+		stats_copy.fastopen_upstream_attempts,
+		connections,
+		connections ? (state_bytes + lent_bytes) / connections : 0,
+		state_bytes,
+		lent_bytes,
+		pooled_bytes);
 
 	submit_print(output);
 }
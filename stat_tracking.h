@@ -7,11 +7,63 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 #include "EasyString/easy_string.h"
 
 void stat_add_success();
 void stat_add_filtered();
+void stat_add_filter_discarded(unsigned long bytes);
 void stat_add_error();
 void stat_filter(StringRef filter);
 
+void stat_add_cache_hit();
+void stat_add_cache_miss();
+void stat_add_cache_evictions(unsigned count);
+void stat_add_cache_rejection();
+void stat_add_disk_cache_hit();
+void stat_add_disk_cache_store();
+void stat_add_collapsed();
+void stat_add_budget_rejection();
+void stat_add_timeout_idle();
+void stat_add_timeout_headers();
+void stat_add_timeout_transfer();
+void stat_add_timeout_upstream();
+void stat_add_tunnel(unsigned long long up, unsigned long long down,
+	unsigned long milliseconds);
+
+//Bytes before and after, and nanoseconds of CPU spent compressing
+void stat_add_compressed(unsigned long long in, unsigned long long out,
+	unsigned long long cpu);
+//A compressed variant sent again without compressing it
+void stat_add_compress_reused(unsigned long long in, unsigned long long out);
+
+//HTTP/2 upstream connections opened, streams sent on them, and streams resent
+void stat_add_h2_connection();
+void stat_add_h2_stream();
+void stat_add_h2_retry();
+
+/*
+ * Picks between several origin addresses, connects moved to another address
+ * after a failure, and addresses taken out for failing
+ */
+void stat_add_upstream_choice();
+void stat_add_upstream_retry();
+void stat_add_upstream_ejection();
+
+//A reverse proxied request, and whether it matched a route
+void stat_add_reverse_request(bool routed);
+
+//A reverse proxy backend taken out for failing, or brought back
+void stat_add_backend_change(bool up);
+
+//A connection refused for its client's rate, or its number open
+void stat_add_client_limited(bool too_many);
+
+//A connection placed by affinity, and whether its receiving CPU was known
+void stat_add_affinity_connection(bool by_cpu);
+
+void stat_add_fastopen_attempt(bool upstream);
+void stat_add_fastopen_success(bool upstream);
+
 void print_stats();
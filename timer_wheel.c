@@ -0,0 +1,339 @@
+/*
+ * timer_wheel.c
+ *
+ *  Created on: Mar 11, 2014
+ *      Author: nathan
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "timer_wheel.h"
+#include "stat_tracking.h"
+#include "fiber.h"
+#include "affinity.h"
+#include "config.h"
+
+/*
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. A slot on level 0 is
+ * one tick; a slot on level n covers WHEEL_SIZE^n ticks. A timer goes in the
+ * lowest level whose range covers it, and whenever a higher level's slot
+ * comes around, its timers are cascaded down into the levels below. Adding,
+ * moving, and removing a timer are all O(1), however many there are.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+static struct
+{
+	ConnTimer* slots[WHEEL_LEVELS][WHEEL_SIZE];
+	unsigned long now; //In ticks
+
+	pthread_mutex_t lock;
+	bool shutdown;
+
+	pthread_t thread;
+} wheel;
+
+//The timer that timer_progress counts towards. One per thread, or per fiber.
+#define thread_timer (*(ConnTimer**)fiber_local(fiber_local_timer))
+
+static inline unsigned long seconds_to_ticks(unsigned long seconds)
+{
+	return seconds * 1000 / TIMER_TICK_MS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE WHEEL
+///////////////////////////////////////////////////////////////////////////////
+
+//All of these must be called with the wheel locked
+
+static inline void wheel_add(ConnTimer* timer)
+{
+	//Never in the past, and never past the end of the top level
+	if(timer->expires <= wheel.now)
+		timer->expires = wheel.now + 1;
+	unsigned long delta = timer->expires - wheel.now;
+
+	int level = 0;
+	while(level < WHEEL_LEVELS - 1 &&
+			delta >= 1UL << (WHEEL_BITS * (level + 1)))
+		++level;
+
+	unsigned long range = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+	if(delta >= range)
+		timer->expires = wheel.now + range - 1;
+
+	ConnTimer** slot =
+		&wheel.slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	timer->prev = 0;
+	timer->next = *slot;
+	if(*slot) (*slot)->prev = timer;
+	*slot = timer;
+	timer->slot = slot;
+	timer->linked = true;
+}
+
+static inline void wheel_remove(ConnTimer* timer)
+{
+	if(!timer->linked)
+		return;
+
+	if(timer->prev) timer->prev->next = timer->next;
+	else *timer->slot = timer->next;
+	if(timer->next) timer->next->prev = timer->prev;
+
+	timer->prev = timer->next = 0;
+	timer->linked = false;
+}
+
+static inline unsigned long deadline_ticks(DeadlineKind kind)
+{
+	switch(kind)
+	{
+	case deadline_idle: return seconds_to_ticks(IDLE_TIMEOUT);
+	case deadline_headers: return seconds_to_ticks(HEADER_TIMEOUT);
+	case deadline_transfer: return seconds_to_ticks(TRANSFER_WINDOW);
+	case deadline_upstream: return seconds_to_ticks(UPSTREAM_TIMEOUT);
+	case deadline_tunnel: return seconds_to_ticks(TUNNEL_IDLE_TIMEOUT);
+	default: return 0;
+	}
+}
+
+//A timer went off
+static inline void expire(ConnTimer* timer)
+{
+	/*
+	 * Transfers just have to have kept up the minimum rate, and tunnels just
+	 * have to have moved anything at all. If they did, they get another go.
+	 */
+	if(timer->kind == deadline_transfer || timer->kind == deadline_tunnel)
+	{
+		unsigned long progress = __atomic_load_n(&timer->progress,
+			__ATOMIC_RELAXED);
+		unsigned long needed = timer->kind == deadline_transfer ?
+			MIN_TRANSFER_RATE * TRANSFER_WINDOW : 1;
+		if(progress - timer->checked_progress >= needed)
+		{
+			timer->checked_progress = progress;
+			timer->expires = wheel.now + deadline_ticks(timer->kind);
+			wheel_add(timer);
+			return;
+		}
+	}
+
+	timer->expired = true;
+
+	/*
+	 * A timed out origin only loses its own connection, so the client can
+	 * still be told about it. Everything else loses both.
+	 */
+	if(timer->kind != deadline_upstream)
+		shutdown(timer->client_fd, SHUT_RDWR);
+	if(timer->server_fd >= 0)
+		shutdown(timer->server_fd, SHUT_RDWR);
+
+	switch(timer->kind)
+	{
+	case deadline_idle: stat_add_timeout_idle(); break;
+	case deadline_headers: stat_add_timeout_headers(); break;
+	case deadline_transfer:
+	case deadline_tunnel: stat_add_timeout_transfer(); break;
+	case deadline_upstream: stat_add_timeout_upstream(); break;
+	default: break;
+	}
+}
+
+//Move everything in a slot of a higher level down to where it belongs now
+static inline void cascade(int level, int index)
+{
+	ConnTimer* timer = wheel.slots[level][index];
+	wheel.slots[level][index] = 0;
+	while(timer)
+	{
+		ConnTimer* next = timer->next;
+		timer->linked = false;
+		wheel_add(timer);
+		timer = next;
+	}
+}
+
+static inline void tick()
+{
+	++wheel.now;
+
+	//Cascade each level whose slot just came around, from the top down
+	int top = 0;
+	while(top < WHEEL_LEVELS - 1 &&
+			(wheel.now & ((1UL << (WHEEL_BITS * (top + 1))) - 1)) == 0)
+		++top;
+	for(int level = top; level > 0; --level)
+		cascade(level, (wheel.now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+	//Then everything in the current level 0 slot is due
+	ConnTimer** slot = &wheel.slots[0][wheel.now & WHEEL_MASK];
+	while(*slot)
+	{
+		ConnTimer* timer = *slot;
+		*slot = timer->next;
+		if(*slot) (*slot)->prev = 0;
+		timer->prev = timer->next = 0;
+		timer->linked = false;
+		expire(timer);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE TIMER THREAD
+///////////////////////////////////////////////////////////////////////////////
+
+static void* timer_thread(void* arg)
+{
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&wheel.lock);
+	while(!wheel.shutdown)
+	{
+		pthread_mutex_unlock(&wheel.lock);
+
+		next.tv_nsec += TIMER_TICK_MS * 1000000L;
+		while(next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			++next.tv_sec;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+
+		pthread_mutex_lock(&wheel.lock);
+		tick();
+	}
+	pthread_mutex_unlock(&wheel.lock);
+	return 0;
+}
+
+static int _timer_thread_status = -1;
+
+int timer_thread_status()
+{
+	return _timer_thread_status;
+}
+
+__attribute__((constructor (MODULE_TIMER_PRI)))
+void begin_timer_thread()
+{
+	if(DEBUG_PRINT) puts("Launching timer thread");
+	pthread_mutex_init(&wheel.lock, 0);
+	_timer_thread_status = pthread_create(&wheel.thread, 0, &timer_thread, 0);
+	if(_timer_thread_status == 0)
+		affinity_register(wheel.thread, affinity_housekeeping, 0);
+}
+
+__attribute__((destructor (MODULE_TIMER_PRI)))
+void end_timer_thread()
+{
+	if(DEBUG_PRINT) puts("Stopping timer thread");
+
+	pthread_mutex_lock(&wheel.lock);
+	wheel.shutdown = true;
+	pthread_mutex_unlock(&wheel.lock);
+
+	if(_timer_thread_status == 0) pthread_join(wheel.thread, 0);
+
+	pthread_mutex_destroy(&wheel.lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+void timer_start(ConnTimer* timer, int client_fd)
+{
+	*timer = (ConnTimer){ .kind = deadline_none, .client_fd = client_fd,
+		.server_fd = -1 };
+	thread_timer = timer;
+}
+
+void timer_set_server(ConnTimer* timer, int server_fd)
+{
+	pthread_mutex_lock(&wheel.lock);
+	timer->server_fd = server_fd;
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+void timer_deadline(ConnTimer* timer, DeadlineKind kind)
+{
+	pthread_mutex_lock(&wheel.lock);
+	if(!timer->expired)
+	{
+		wheel_remove(timer);
+		timer->kind = kind;
+		timer->checked_progress = timer->progress;
+		if(kind != deadline_none)
+		{
+			timer->expires = wheel.now + deadline_ticks(kind);
+			wheel_add(timer);
+		}
+	}
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+void timer_stop(ConnTimer* timer)
+{
+	pthread_mutex_lock(&wheel.lock);
+	wheel_remove(timer);
+	timer->kind = deadline_none;
+	pthread_mutex_unlock(&wheel.lock);
+
+	if(thread_timer == timer)
+		thread_timer = 0;
+}
+
+bool timer_expired(ConnTimer* timer)
+{
+	pthread_mutex_lock(&wheel.lock);
+	bool expired = timer->expired;
+	pthread_mutex_unlock(&wheel.lock);
+	return expired;
+}
+
+void timer_progress(size_t bytes)
+{
+	//Only this thread writes it, so there's no need for a locked add
+	ConnTimer* timer = thread_timer;
+	if(timer)
+		__atomic_store_n(&timer->progress, timer->progress + bytes,
+			__ATOMIC_RELAXED);
+}
+
+void timer_expire_all()
+{
+	pthread_mutex_lock(&wheel.lock);
+	for(int level = 0; level < WHEEL_LEVELS; ++level)
+	{
+		for(int index = 0; index < WHEEL_SIZE; ++index)
+		{
+			ConnTimer* timer = wheel.slots[level][index];
+			wheel.slots[level][index] = 0;
+			while(timer)
+			{
+				ConnTimer* next = timer->next;
+				timer->prev = timer->next = 0;
+				timer->linked = false;
+				timer->expired = true;
+				shutdown(timer->client_fd, SHUT_RDWR);
+				if(timer->server_fd >= 0)
+					shutdown(timer->server_fd, SHUT_RDWR);
+				timer = next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&wheel.lock);
+}
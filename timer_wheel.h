@@ -0,0 +1,74 @@
+/*
+ * timer_wheel.h
+ *
+ *  Created on: Mar 11, 2014
+ *      Author: nathan
+ *
+ *  Connection deadlines. Each worker keeps one ConnTimer for its connection,
+ *  and moves it between kinds of deadline as the exchange goes on. A single
+ *  timer thread keeps all of them in a hierarchical timing wheel, and when one
+ *  expires, it shuts down the connection's sockets. That breaks the worker out
+ *  of whatever blocking read or write it's stuck in, and it errors out as
+ *  usual. This is what stops slowloris-style clients (and dead origins) from
+ *  pinning worker threads forever.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum
+{
+	deadline_none, //Not timed
+	deadline_idle, //Waiting for the request line. IDLE_TIMEOUT.
+	deadline_headers, //Reading the request headers. HEADER_TIMEOUT.
+	deadline_transfer, //Moving bodies; must keep up MIN_TRANSFER_RATE
+	deadline_upstream, //Connecting and waiting on the origin. UPSTREAM_TIMEOUT.
+	deadline_tunnel //A CONNECT tunnel; must not sit idle for TUNNEL_IDLE_TIMEOUT
+} DeadlineKind;
+
+typedef struct conn_timer
+{
+	struct conn_timer* prev;
+	struct conn_timer* next;
+	struct conn_timer** slot; //The wheel slot it's in, if linked
+	unsigned long expires; //In ticks
+
+	DeadlineKind kind;
+	int client_fd;
+	int server_fd;
+
+	//Bytes moved. Only written by the owning thread; see timer_progress.
+	unsigned long progress;
+	unsigned long checked_progress; //progress at the last rate check
+
+	bool linked;
+	bool expired;
+} ConnTimer;
+
+/*
+ * Start timing a connection. The timer becomes the calling thread's timer, so
+ * timer_progress counts towards it.
+ */
+void timer_start(ConnTimer* timer, int client_fd);
+
+//The upstream socket is shut down on expiry too, once there is one
+void timer_set_server(ConnTimer* timer, int server_fd);
+
+//Switch to a new kind of deadline, starting now. No effect once expired.
+void timer_deadline(ConnTimer* timer, DeadlineKind kind);
+
+//Stop timing. Must be called before the connection's sockets are closed.
+void timer_stop(ConnTimer* timer);
+
+//True if the timer went off
+bool timer_expired(ConnTimer* timer);
+
+//Count bytes read or written on the calling thread's connection
+void timer_progress(size_t bytes);
+
+//Expire every timed connection now, whatever its deadline. Used to drain.
+void timer_expire_all();
+
+int timer_thread_status();
@@ -0,0 +1,174 @@
+/*
+ * tunnel.c
+ *
+ *  Created on: Mar 12, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For splice and F_SETPIPE_SZ
+
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "tunnel.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "fiber.h"
+#include "config.h"
+
+//One direction of the tunnel
+typedef struct
+{
+	int from;
+	int to;
+	int pipe[2];
+	size_t in_pipe; //Bytes spliced in but not yet out
+	bool eof; //from has finished sending
+	bool done; //...and everything it sent has been passed on
+	unsigned long long* count;
+} TunnelHalf;
+
+static inline bool would_block()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static inline int open_half(TunnelHalf* half, int from, int to,
+	unsigned long long* count)
+{
+	*half = (TunnelHalf){ .from = from, .to = to, .count = count };
+	if(pipe2(half->pipe, O_NONBLOCK | O_CLOEXEC))
+		return -1;
+
+	//Bigger pipes mean fewer trips around the loop. It's fine if this fails.
+	fcntl(half->pipe[0], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+	return 0;
+}
+
+static inline void close_half(TunnelHalf* half)
+{
+	close(half->pipe[0]);
+	close(half->pipe[1]);
+}
+
+//Pull from the source into the pipe
+static inline int fill_half(TunnelHalf* half)
+{
+	ssize_t amount = splice(half->from, 0, half->pipe[1], 0,
+		TUNNEL_PIPE_SIZE - half->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if(amount > 0)
+		half->in_pipe += amount;
+	else if(amount == 0)
+		half->eof = true;
+	else if(!would_block() && errno != EINTR)
+		return -1;
+	return 0;
+}
+
+//Push from the pipe to the destination
+static inline int drain_half(TunnelHalf* half)
+{
+	ssize_t amount = splice(half->pipe[0], 0, half->to, 0, half->in_pipe,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if(amount > 0)
+	{
+		half->in_pipe -= amount;
+		*half->count += amount;
+		timer_progress(amount);
+	}
+	else if(amount < 0 && !would_block() && errno != EINTR)
+		return -1;
+	return 0;
+}
+
+int tunnel_relay(int client_fd, int server_fd, TunnelCounts* counts)
+{
+	if(uring_active())
+	{
+		int result = uring_tunnel(client_fd, server_fd, counts);
+		if(result != uring_unsupported)
+			return result;
+	}
+
+	TunnelHalf halves[2];
+	if(open_half(&halves[0], client_fd, server_fd, &counts->up))
+		return -1;
+	if(open_half(&halves[1], server_fd, client_fd, &counts->down))
+	{
+		close_half(&halves[0]);
+		return -1;
+	}
+
+	int client_flags = fcntl(client_fd, F_GETFL);
+	int server_flags = fcntl(server_fd, F_GETFL);
+	fcntl(client_fd, F_SETFL, client_flags | O_NONBLOCK);
+	fcntl(server_fd, F_SETFL, server_flags | O_NONBLOCK);
+
+	int error = 0;
+	while(!error && !(halves[0].done && halves[1].done))
+	{
+		/*
+		 * Each socket is the source of one half and the destination of the
+		 * other, so each gets one pollfd with both interests.
+		 */
+		struct pollfd fds[2];
+		for(int i = 0; i < 2; ++i)
+		{
+			TunnelHalf* reading = &halves[i];
+			TunnelHalf* writing = &halves[1 - i];
+			fds[i].fd = reading->from;
+			fds[i].events =
+				(!reading->eof && reading->in_pipe < TUNNEL_PIPE_SIZE ?
+					POLLIN : 0) |
+				(writing->in_pipe ? POLLOUT : 0);
+			fds[i].revents = 0;
+
+			//Otherwise a hung up socket would wake poll over and over
+			if(fds[i].events == 0)
+				fds[i].fd = -1;
+		}
+
+		if(fiber_poll(fds, 2, -1) < 0)
+		{
+			if(errno != EINTR) error = -1;
+			continue;
+		}
+
+		for(int i = 0; i < 2 && !error; ++i)
+		{
+			TunnelHalf* reading = &halves[i];
+			TunnelHalf* writing = &halves[1 - i];
+
+			if(fds[i].revents & (POLLIN | POLLHUP | POLLERR) &&
+					fds[i].events & POLLIN)
+				error = fill_half(reading);
+
+			if(!error && fds[i].revents & (POLLOUT | POLLERR) &&
+					fds[i].events & POLLOUT)
+				error = drain_half(writing);
+		}
+
+		//Pass each finished direction's half-close on
+		for(int i = 0; i < 2; ++i)
+		{
+			if(!halves[i].done && halves[i].eof && halves[i].in_pipe == 0)
+			{
+				shutdown(halves[i].to, SHUT_WR);
+				halves[i].done = true;
+			}
+		}
+	}
+
+	fcntl(client_fd, F_SETFL, client_flags);
+	fcntl(server_fd, F_SETFL, server_flags);
+	close_half(&halves[0]);
+	close_half(&halves[1]);
+
+	return error;
+}
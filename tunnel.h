@@ -0,0 +1,26 @@
+/*
+ * tunnel.h
+ *
+ *  Created on: Mar 12, 2014
+ *      Author: nathan
+ *
+ *  Opaque byte tunnels, for CONNECT. Once the tunnel is established the proxy
+ *  doesn't look at the bytes at all (they're usually TLS), it just moves them
+ *  in both directions with splice(), through a pipe per direction, so they
+ *  never get copied into user space.
+ */
+
+#pragma once
+
+typedef struct
+{
+	unsigned long long up; //Client to origin
+	unsigned long long down; //Origin to client
+} TunnelCounts;
+
+/*
+ * Relay bytes both ways until both sides have finished sending. When one side
+ * finishes, the other side's write half is shut down, so half-closes get
+ * passed along. Adds the bytes moved to counts. Returns 0, or -1 on error.
+ */
+int tunnel_relay(int client_fd, int server_fd, TunnelCounts* counts);
@@ -0,0 +1,380 @@
+/*
+ * upgrade.c
+ *
+ *  Created on: Mar 23, 2014
+ *      Author: nathan
+ */
+
+#define _GNU_SOURCE //For close_range
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#include "upgrade.h"
+#include "http_worker_thread.h"
+#include "disk_cache.h"
+#include "timer_wheel.h"
+#include "print_thread.h"
+#include "affinity.h"
+#include "config.h"
+
+//Tells a new process which fd to receive the listener on
+#define UPGRADE_VARIABLE "PROXY_UPGRADE_FD"
+
+//The fd the new process gets the channel on, just after stdin, out, and err
+const static int child_channel = 3;
+
+//What a new process sends back once it's accepting
+const static char ready_message = 'R';
+
+//How often the accept loop is poked, and the drain checked, in milliseconds
+const static long upgrade_poll_ms = 100;
+
+extern char** environ;
+
+static struct
+{
+	char** argv;
+	char exe[PATH_MAX];
+
+	int request_fd; //Written by upgrade_request
+	int stop_fd; //Written once the listener is handed over
+	int channel; //From the old process, until we're ready
+
+	int listener;
+	pthread_t accept_thread;
+	pthread_t thread;
+	bool started;
+
+	//Atomic
+	bool shutdown;
+	bool handed_off;
+	bool accept_stopped;
+} upgrade = { .request_fd = -1, .stop_fd = -1, .channel = -1,
+	.listener = -1 };
+
+static inline void sleep_ms(long milliseconds)
+{
+	struct timespec delay = { milliseconds / 1000,
+		milliseconds % 1000 * 1000000L };
+	nanosleep(&delay, 0);
+}
+
+static inline long now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE OLD PROCESS
+///////////////////////////////////////////////////////////////////////////////
+
+//The environment, with the channel's fd in place of any inherited one
+static char** child_environment(const char* variable)
+{
+	size_t count = 0;
+	while(environ[count]) ++count;
+
+	char** environment = malloc((count + 2) * sizeof(char*));
+	size_t size = 0;
+	for(size_t i = 0; i < count; ++i)
+		if(strncmp(environ[i], UPGRADE_VARIABLE "=",
+				sizeof(UPGRADE_VARIABLE)) != 0)
+			environment[size++] = environ[i];
+	environment[size++] = (char*)variable;
+	environment[size] = 0;
+	return environment;
+}
+
+static bool send_listener(int channel)
+{
+	char byte = 0;
+	struct iovec data = { .iov_base = &byte, .iov_len = 1 };
+
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr message = { .msg_iov = &data, .msg_iovlen = 1,
+		.msg_control = control.buffer, .msg_controllen = sizeof(control) };
+
+	struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(header), &upgrade.listener, sizeof(int));
+
+	return sendmsg(channel, &message, MSG_NOSIGNAL) == 1;
+}
+
+static bool wait_for_ready(int channel)
+{
+	struct pollfd readable = { .fd = channel, .events = POLLIN };
+	char reply = 0;
+	return poll(&readable, 1, UPGRADE_READY_TIMEOUT * 1000) == 1 &&
+		read(channel, &reply, 1) == 1 && reply == ready_message;
+}
+
+/*
+ * Start the new process and give it the listener. Returns true once it's
+ * accepting. If it isn't within UPGRADE_READY_TIMEOUT, it's killed.
+ */
+static bool hand_off()
+{
+	submit_debug_c("Starting the upgraded proxy");
+
+	int channel[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel))
+		return false;
+
+	/*
+	 * The new process opens the disk cache as it starts, and two writers
+	 * would corrupt the index, so this one lets go of it first
+	 */
+	disk_cache_hand_off();
+
+	//The child can't allocate between fork and exec, so this is done first
+	char variable[64];
+	snprintf(variable, sizeof(variable), UPGRADE_VARIABLE "=%d", child_channel);
+	char** environment = child_environment(variable);
+	long max_fds = sysconf(_SC_OPEN_MAX);
+
+	pid_t child = fork();
+	if(child == 0)
+	{
+		/*
+		 * Connections are accepted without FD_CLOEXEC, so close everything
+		 * but the channel; otherwise the new process would hold this one's
+		 * connections open after it's gone.
+		 */
+		if(channel[1] == child_channel)
+			fcntl(child_channel, F_SETFD, 0);
+		else
+			dup2(channel[1], child_channel);
+		if(close_range(child_channel + 1, ~0U, 0))
+			for(long fd = child_channel + 1; fd < max_fds; ++fd)
+				close(fd);
+		execve(upgrade.exe, upgrade.argv, environment);
+		_exit(127);
+	}
+
+	free(environment);
+	close(channel[1]);
+	if(child < 0)
+	{
+		close(channel[0]);
+		disk_cache_take_back();
+		return false;
+	}
+
+	bool ready = send_listener(channel[0]) && wait_for_ready(channel[0]);
+	close(channel[0]);
+	if(!ready)
+	{
+		kill(child, SIGKILL);
+		waitpid(child, 0, 0);
+		disk_cache_take_back();
+	}
+	return ready;
+}
+
+//Stop accepting: wake the io_uring loop, or keep interrupting accept()
+static void stop_accepting()
+{
+	__atomic_store_n(&upgrade.handed_off, true, __ATOMIC_RELEASE);
+
+	uint64_t stop = 1;
+	if(write(upgrade.stop_fd, &stop, sizeof(stop)) < 0)
+		submit_debug_c("Unable to signal the accept loop");
+
+	while(!__atomic_load_n(&upgrade.accept_stopped, __ATOMIC_ACQUIRE))
+	{
+		pthread_kill(upgrade.accept_thread, SIGURG);
+		sleep_ms(upgrade_poll_ms);
+	}
+}
+
+static void* upgrade_thread(void* arg)
+{
+	while(1)
+	{
+		uint64_t requests;
+		if(read(upgrade.request_fd, &requests, sizeof(requests)) < 0)
+		{
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(__atomic_load_n(&upgrade.shutdown, __ATOMIC_ACQUIRE))
+			break;
+
+		if(hand_off())
+		{
+			submit_debug_c("Upgraded proxy is accepting; draining");
+			stop_accepting();
+			break;
+		}
+		submit_debug_c("Upgrade failed; carrying on");
+	}
+	return 0;
+}
+
+//Only there to interrupt accept()
+static void interrupt_signal(int sig)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PUBLIC INTERFACE
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor (MODULE_UPGRADE_PRI)))
+void init_upgrade()
+{
+	if(DEBUG_PRINT) puts("Preparing for upgrades");
+	upgrade.request_fd = eventfd(0, EFD_CLOEXEC);
+	upgrade.stop_fd = eventfd(0, EFD_CLOEXEC);
+}
+
+__attribute__((destructor (MODULE_UPGRADE_PRI)))
+void deinit_upgrade()
+{
+	if(DEBUG_PRINT) puts("Stopping upgrades");
+
+	if(upgrade.started)
+	{
+		__atomic_store_n(&upgrade.shutdown, true, __ATOMIC_RELEASE);
+		upgrade_request();
+		pthread_join(upgrade.thread, 0);
+	}
+
+	if(upgrade.request_fd >= 0) close(upgrade.request_fd);
+	if(upgrade.stop_fd >= 0) close(upgrade.stop_fd);
+}
+
+void upgrade_init(char** argv)
+{
+	upgrade.argv = argv;
+	ssize_t size = readlink("/proc/self/exe", upgrade.exe,
+		sizeof(upgrade.exe) - 1);
+	upgrade.exe[size > 0 ? size : 0] = '\0';
+}
+
+int upgrade_take_listener()
+{
+	const char* variable = getenv(UPGRADE_VARIABLE);
+	if(!variable)
+		return -1;
+
+	upgrade.channel = strtol(variable, 0, 10);
+	fcntl(upgrade.channel, F_SETFD, FD_CLOEXEC);
+
+	char byte;
+	struct iovec data = { .iov_base = &byte, .iov_len = 1 };
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr message = { .msg_iov = &data, .msg_iovlen = 1,
+		.msg_control = control.buffer, .msg_controllen = sizeof(control) };
+
+	if(recvmsg(upgrade.channel, &message, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+
+	struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+	if(!header || header->cmsg_level != SOL_SOCKET ||
+			header->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	int listener;
+	memcpy(&listener, CMSG_DATA(header), sizeof(int));
+	return listener;
+}
+
+int upgrade_start(int listener)
+{
+	upgrade.listener = listener;
+	upgrade.accept_thread = pthread_self();
+
+	//Without SA_RESTART, so a blocking accept returns EINTR
+	struct sigaction interrupt = { .sa_handler = &interrupt_signal };
+	sigaction(SIGURG, &interrupt, 0);
+
+	if(upgrade.channel >= 0)
+	{
+		submit_debug_c("Took over the listener; telling the old proxy");
+		if(write(upgrade.channel, &ready_message, 1) != 1)
+			submit_debug_c("Old proxy went away during the upgrade");
+		close(upgrade.channel);
+		upgrade.channel = -1;
+	}
+
+	if(upgrade.request_fd < 0 || upgrade.stop_fd < 0 || !upgrade.exe[0])
+		return -1;
+	if(pthread_create(&upgrade.thread, 0, &upgrade_thread, 0))
+		return -1;
+	affinity_register(upgrade.thread, affinity_housekeeping, 0);
+	upgrade.started = true;
+	return 0;
+}
+
+void upgrade_request()
+{
+	uint64_t request = 1;
+	if(write(upgrade.request_fd, &request, sizeof(request)) < 0)
+		return;
+}
+
+bool upgrade_handed_off()
+{
+	return __atomic_load_n(&upgrade.handed_off, __ATOMIC_ACQUIRE);
+}
+
+int upgrade_stop_fd()
+{
+	return upgrade.stop_fd;
+}
+
+/*
+ * Connections keep going until they're done. Whatever's still open at the
+ * deadline (idle clients, long tunnels) is cut off through its timer.
+ */
+void upgrade_drain()
+{
+	__atomic_store_n(&upgrade.accept_stopped, true, __ATOMIC_RELEASE);
+	close(upgrade.listener);
+
+	submit_debug_c("Draining connections");
+
+	long deadline = now_ms() + UPGRADE_DRAIN_TIMEOUT * 1000;
+	while(connections_in_flight() && now_ms() < deadline)
+		sleep_ms(upgrade_poll_ms);
+
+	if(connections_in_flight())
+	{
+		submit_debug_c("Drain deadline passed; closing the rest");
+		timer_expire_all();
+
+		deadline = now_ms() + 1000;
+		while(connections_in_flight() && now_ms() < deadline)
+			sleep_ms(upgrade_poll_ms);
+	}
+
+	submit_debug_c("Drained");
+}
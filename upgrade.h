@@ -0,0 +1,49 @@
+/*
+ * upgrade.h
+ *
+ *  Created on: Mar 23, 2014
+ *      Author: nathan
+ *
+ *  Hot upgrades. On SIGHUP, the proxy starts a new copy of itself, from the
+ *  binary at the same path with the same arguments, and hands it the
+ *  listening socket over a Unix socket (SCM_RIGHTS). The listener never
+ *  closes, so connections that arrive during the switch just wait in its
+ *  backlog. Once the new process says it's accepting, the old one stops, and
+ *  gives the connections it has UPGRADE_DRAIN_TIMEOUT seconds to finish
+ *  before it exits. If the new process doesn't come up, the old one carries
+ *  on as if nothing happened.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+//Remember how the proxy was started, so its successor can be started the same
+void upgrade_init(char** argv);
+
+/*
+ * The listener handed over by the process this one is replacing, or -1 if
+ * this one wasn't started by an upgrade.
+ */
+int upgrade_take_listener();
+
+/*
+ * Call once the listener is ready, just before accepting on it, from the
+ * thread that accepts. If this process is an upgrade, this tells the old one
+ * to stop. Returns 0, or -1 if upgrades can't be done.
+ */
+int upgrade_start(int listener);
+
+//Ask for an upgrade. Safe to call from a signal handler.
+void upgrade_request();
+
+/*
+ * True once the listener has been handed over. The accept loop should stop,
+ * and call upgrade_drain. A blocking accept is interrupted with EINTR to get
+ * it to look; the io_uring loop watches upgrade_stop_fd instead.
+ */
+bool upgrade_handed_off();
+int upgrade_stop_fd();
+
+//Close the listener, and wait for this process's connections to finish
+void upgrade_drain();
@@ -0,0 +1,290 @@
+/*
+ * uring.c
+ *
+ *  Created on: Mar 18, 2014
+ *      Author: nathan
+ *
+ *  The ring plumbing for the io_uring backend: setup, submission and
+ *  completion, provided buffer rings, and checking what the kernel supports.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "buffer_pool.h"
+#include "config.h"
+
+static inline int sys_io_uring_setup(unsigned entries,
+	struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit,
+	unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		0, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void* arg,
+	unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RINGS
+///////////////////////////////////////////////////////////////////////////////
+
+int uring_init(Uring* ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = sys_io_uring_setup(entries, &params);
+	if(ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+			ring->sqes == MAP_FAILED)
+	{
+		uring_exit(ring);
+		return -1;
+	}
+
+	char* sq = ring->sq_ring;
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+
+	char* cq = ring->cq_ring;
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+void uring_exit(Uring* ring)
+{
+	if(ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if(ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if(ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if(ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_sqe(Uring* ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if(ring->sq_local_tail - head > ring->sq_mask)
+		return 0;
+
+	unsigned index = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	++ring->sq_local_tail;
+	return sqe;
+}
+
+int uring_submit(Uring* ring, unsigned wait_for)
+{
+	unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	while(1)
+	{
+		int result = sys_io_uring_enter(ring->fd, to_submit, wait_for,
+			wait_for ? IORING_ENTER_GETEVENTS : 0);
+		if(result >= 0)
+		{
+			ring->sq_submitted += result;
+			return 0;
+		}
+		if(errno != EINTR)
+			return -1;
+
+		//Interrupted waiting; whatever was submitted doesn't go in twice
+		to_submit = ring->sq_local_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		ring->sq_submitted = ring->sq_local_tail - to_submit;
+	}
+}
+
+struct io_uring_cqe* uring_peek(Uring* ring)
+{
+	unsigned head = *ring->cq_head;
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_seen(Uring* ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PROVIDED BUFFERS
+///////////////////////////////////////////////////////////////////////////////
+
+int uring_buffers_init(Uring* ring, UringBuffers* buffers, uint16_t group,
+	unsigned count, size_t buffer_size)
+{
+	buffers->ring_size = count * sizeof(struct io_uring_buf);
+	buffers->ring = mmap(0, buffers->ring_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buffers->ring == MAP_FAILED)
+		return -1;
+
+	//Borrowed from the pool for as long as the pump runs
+	buffers->memory = buffer_borrow(count * buffer_size);
+	if(!buffers->memory)
+	{
+		munmap(buffers->ring, buffers->ring_size);
+		buffers->ring = 0;
+		return -1;
+	}
+	buffers->buffer_size = buffer_size;
+	buffers->count = count;
+	buffers->group = group;
+
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (unsigned long)buffers->ring;
+	registration.ring_entries = count;
+	registration.bgid = group;
+	if(sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+			&registration, 1))
+	{
+		munmap(buffers->ring, buffers->ring_size);
+		buffer_return(buffers->memory, count * buffer_size);
+		buffers->ring = 0;
+		return -1;
+	}
+
+	buffers->ring->tail = 0;
+	for(unsigned id = 0; id < count; ++id)
+		uring_buffer_return(buffers, id);
+	return 0;
+}
+
+void uring_buffers_free(Uring* ring, UringBuffers* buffers)
+{
+	if(!buffers->ring)
+		return;
+
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.bgid = buffers->group;
+	sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING,
+		&registration, 1);
+
+	munmap(buffers->ring, buffers->ring_size);
+	buffer_return(buffers->memory, buffers->count * buffers->buffer_size);
+	buffers->ring = 0;
+}
+
+char* uring_buffer(UringBuffers* buffers, unsigned id)
+{
+	return buffers->memory + id * buffers->buffer_size;
+}
+
+void uring_buffer_return(UringBuffers* buffers, unsigned id)
+{
+	uint16_t tail = buffers->ring->tail;
+	struct io_uring_buf* buffer = &buffers->ring->bufs[tail & (buffers->count - 1)];
+	buffer->addr = (unsigned long)uring_buffer(buffers, id);
+	buffer->len = buffers->buffer_size;
+	buffer->bid = id;
+	__atomic_store_n(&buffers->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THE BACKEND
+///////////////////////////////////////////////////////////////////////////////
+
+static bool use_uring;
+
+/*
+ * Check for everything the backend uses: the opcodes, provided buffer rings,
+ * and (by kernel version, since there's no way to probe for it) multishot
+ * accept and recv. The pumps fall back on their own if multishot recv fails.
+ */
+static bool uring_supported()
+{
+	Uring ring;
+	if(uring_init(&ring, 4))
+		return false;
+
+	size_t probe_size = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc(1, probe_size);
+	bool supported = sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE,
+		probe, IORING_OP_LAST) == 0;
+
+	static const int needed[] =
+		{ IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL };
+	for(size_t i = 0; supported && i < sizeof(needed) / sizeof(int); ++i)
+		supported = needed[i] <= probe->last_op &&
+			(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+
+	//Buffer rings came with multishot accept, in 5.19
+	UringBuffers buffers;
+	if(supported && uring_buffers_init(&ring, &buffers, 0, 1, 64) == 0)
+		uring_buffers_free(&ring, &buffers);
+	else
+		supported = false;
+
+	uring_exit(&ring);
+	return supported;
+}
+
+int io_backend_select(const char* name)
+{
+	if(strcmp(name, "blocking") == 0)
+	{
+		use_uring = false;
+		return 0;
+	}
+	if(strcmp(name, "uring") != 0)
+		return -1;
+
+	use_uring = uring_supported();
+	if(!use_uring)
+		puts("io_uring isn't fully supported here; using blocking I/O");
+	return 0;
+}
+
+bool uring_active()
+{
+	return use_uring;
+}
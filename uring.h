@@ -0,0 +1,116 @@
+/*
+ * uring.h
+ *
+ *  Created on: Mar 18, 2014
+ *      Author: nathan
+ *
+ *  The io_uring I/O backend, selected at startup with -b uring. It talks to
+ *  the kernel with the raw syscalls, so there's no library dependency, and if
+ *  the kernel can't do everything it needs, the proxy says so and keeps using
+ *  the blocking path.
+ *
+ *  With it on, the listener takes connections with one multishot accept, and
+ *  the two long-running copy loops (relayed bodies and CONNECT tunnels) run
+ *  as pumps: a multishot recv into a ring of provided buffers, with the
+ *  filled buffers sent on as linked chains, so each io_uring_enter moves
+ *  several buffers in both directions. Parsing still reads through the
+ *  blocking helpers in http_read.c.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "tunnel.h"
+
+typedef struct
+{
+	int fd;
+
+	//Submission queue
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned sq_local_tail; //Queued, but not yet submitted
+	unsigned sq_submitted;
+
+	//Completion queue
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Uring;
+
+//A ring of equal-sized buffers the kernel picks from for receives
+typedef struct
+{
+	struct io_uring_buf_ring* ring;
+	size_t ring_size;
+	char* memory;
+	size_t buffer_size;
+	unsigned count;
+	uint16_t group;
+} UringBuffers;
+
+//// RINGS
+int uring_init(Uring* ring, unsigned entries);
+void uring_exit(Uring* ring);
+
+//A zeroed submission entry, or 0 if the queue is full
+struct io_uring_sqe* uring_sqe(Uring* ring);
+
+//Submit everything queued, and wait for at least wait_for completions
+int uring_submit(Uring* ring, unsigned wait_for);
+
+//The next completion, or 0. uring_seen releases it.
+struct io_uring_cqe* uring_peek(Uring* ring);
+void uring_seen(Uring* ring);
+
+//// PROVIDED BUFFERS
+int uring_buffers_init(Uring* ring, UringBuffers* buffers, uint16_t group,
+	unsigned count, size_t buffer_size);
+void uring_buffers_free(Uring* ring, UringBuffers* buffers);
+char* uring_buffer(UringBuffers* buffers, unsigned id);
+
+//Hand a buffer back to the kernel
+void uring_buffer_return(UringBuffers* buffers, unsigned id);
+
+//// THE BACKEND
+/*
+ * Pick the I/O backend by name: "blocking" or "uring". Returns -1 for an
+ * unknown name. If uring isn't supported, the blocking backend stays.
+ */
+int io_backend_select(const char* name);
+
+//True if the io_uring backend is in use
+bool uring_active();
+
+//Returned when the kernel turns out to be missing something; see below
+enum { uring_unsupported = -2 };
+
+/*
+ * Accept connections until the listener fails, handing each to
+ * handle_connection, like serve_forever's own loop. Returns 0, or
+ * uring_unsupported if multishot accept isn't available.
+ */
+int uring_accept_loop(int listener);
+
+/*
+ * io_uring versions of relay_body and tunnel_relay, with the same results.
+ * They return uring_unsupported, having done nothing, if the kernel turns out
+ * to be missing something; the caller should use the blocking version.
+ */
+int uring_relay_body(size_t size, int from_fd, int to_fd);
+int uring_tunnel(int client_fd, int server_fd, TunnelCounts* counts);
@@ -0,0 +1,599 @@
+/*
+ * uring_io.c
+ *
+ *  Created on: Mar 18, 2014
+ *      Author: nathan
+ *
+ *  The io_uring backend's accept loop and pumps.
+ *
+ *  A pump moves bytes from one socket to another. Receives land in the pump's
+ *  provided buffers; filled buffers are queued, and whenever no sends are in
+ *  flight, everything queued goes out as one linked chain of sends (so they
+ *  stay in order). Receiving stops when every buffer is in use and starts
+ *  again once the pump has drained to RELAY_LOW_WATERMARK, the same
+ *  hysteresis as the blocking relay.
+ *
+ *  Tunnels receive with a multishot recv, which stays armed until the buffers
+ *  run out. A relayed body has to stop at exactly its last byte (whatever is
+ *  after it belongs to the next message), so it uses one-shot receives capped
+ *  at what's left to read.
+ *
+ *  Setting up a ring and registering its buffers takes several syscalls and a
+ *  mapping, so rings aren't made per relay: finished ones go back to a pool
+ *  of up to URING_POOLED_RINGS, each with a buffer group for either pump.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+#include "http.h"
+#include "http_manager_thread.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "fiber.h"
+#include "probes.h"
+#include "upgrade.h"
+#include "config.h"
+
+//What a completion is for, in the low byte of its user_data
+enum { op_recv = 1, op_send, op_cancel, op_accept, op_stop };
+
+static inline __u64 op_data(int op, int pump, unsigned id)
+{
+	return op | pump << 8 | (__u64)id << 16;
+}
+
+typedef struct
+{
+	int from;
+	int to;
+	bool limited; //Stop after remaining bytes; otherwise run until EOF
+	size_t remaining;
+	unsigned long long* count; //Bytes sent on, if not 0
+
+	UringBuffers* buffers;
+	unsigned lengths[URING_BUFFERS];
+
+	//Filled buffers, in order, waiting for the current chain to finish
+	unsigned queue[URING_BUFFERS];
+	unsigned queue_start;
+	unsigned queued;
+
+	unsigned sending; //Sends in the chain in flight
+	bool armed; //A receive is outstanding
+	bool paused; //Every buffer was in use; waiting for the low watermark
+	bool started; //A receive has completed
+	bool eof;
+	bool done;
+} Pump;
+
+//A ring, with a group of provided buffers for each pump that can use it
+typedef struct pump_ring
+{
+	struct pump_ring* next;
+	Uring ring;
+	UringBuffers buffers[2];
+} PumpRing;
+
+static struct
+{
+	pthread_mutex_t lock;
+	PumpRing* free;
+	unsigned count;
+} pump_rings;
+
+typedef struct
+{
+	PumpRing* owner;
+	Uring* ring;
+	Pump pumps[2];
+	int count;
+	unsigned outstanding; //Operations the kernel hasn't finished with
+	int error; //0, -1, or uring_unsupported
+} PumpSet;
+
+static inline unsigned in_use(Pump* pump)
+{
+	return pump->queued + pump->sending;
+}
+
+static void pump_ring_free(PumpRing* pump_ring)
+{
+	for(int i = 0; i < 2; ++i)
+		uring_buffers_free(&pump_ring->ring, &pump_ring->buffers[i]);
+	uring_exit(&pump_ring->ring);
+	free(pump_ring);
+}
+
+//A ring from the pool, or a new one. Null if the kernel won't make one.
+static PumpRing* pump_ring_take()
+{
+	pthread_mutex_lock(&pump_rings.lock);
+	PumpRing* pump_ring = pump_rings.free;
+	if(pump_ring)
+	{
+		pump_rings.free = pump_ring->next;
+		--pump_rings.count;
+	}
+	pthread_mutex_unlock(&pump_rings.lock);
+	if(pump_ring)
+		return pump_ring;
+
+	pump_ring = calloc(1, sizeof(PumpRing));
+	if(!pump_ring)
+		return 0;
+	if(uring_init(&pump_ring->ring, URING_ENTRIES))
+	{
+		free(pump_ring);
+		return 0;
+	}
+	for(int i = 0; i < 2; ++i)
+	{
+		if(uring_buffers_init(&pump_ring->ring, &pump_ring->buffers[i], i,
+				URING_BUFFERS, URING_BUFFER_SIZE))
+		{
+			pump_ring_free(pump_ring);
+			return 0;
+		}
+	}
+	return pump_ring;
+}
+
+//Keep a ring for the next relay, unless the pool is full
+static void pump_ring_give(PumpRing* pump_ring)
+{
+	pthread_mutex_lock(&pump_rings.lock);
+	bool kept = pump_rings.count < URING_POOLED_RINGS;
+	if(kept)
+	{
+		pump_ring->next = pump_rings.free;
+		pump_rings.free = pump_ring;
+		++pump_rings.count;
+	}
+	pthread_mutex_unlock(&pump_rings.lock);
+
+	if(!kept)
+		pump_ring_free(pump_ring);
+}
+
+__attribute__((constructor (MODULE_URING_PRI)))
+void init_uring_pumps()
+{
+	if(DEBUG_PRINT) puts("Initializing io_uring pumps");
+	pthread_mutex_init(&pump_rings.lock, 0);
+}
+
+__attribute__((destructor (MODULE_URING_PRI)))
+void deinit_uring_pumps()
+{
+	if(DEBUG_PRINT) puts("Closing pooled io_uring rings");
+	while(pump_rings.free)
+	{
+		PumpRing* pump_ring = pump_rings.free;
+		pump_rings.free = pump_ring->next;
+		pump_ring_free(pump_ring);
+	}
+	pthread_mutex_destroy(&pump_rings.lock);
+}
+
+static int pumps_init(PumpSet* set, int count)
+{
+	memset(set, 0, sizeof(*set));
+	set->owner = pump_ring_take();
+	if(!set->owner)
+		return uring_unsupported;
+
+	set->ring = &set->owner->ring;
+	set->count = count;
+	for(int i = 0; i < count; ++i)
+		set->pumps[i].buffers = &set->owner->buffers[i];
+	return 0;
+}
+
+/*
+ * Put the ring back in the pool. If the kernel might still finish something
+ * on it, it can't be reused, so it's torn down instead.
+ */
+static void pumps_free(PumpSet* set)
+{
+	if(set->outstanding)
+	{
+		pump_ring_free(set->owner);
+		return;
+	}
+
+	//Buffers received into but never sent on go back to the kernel
+	for(int i = 0; i < set->count; ++i)
+	{
+		Pump* pump = &set->pumps[i];
+		for(; pump->queued; --pump->queued)
+		{
+			uring_buffer_return(pump->buffers, pump->queue[pump->queue_start]);
+			pump->queue_start = (pump->queue_start + 1) % URING_BUFFERS;
+		}
+	}
+	pump_ring_give(set->owner);
+}
+
+static void arm_recv(PumpSet* set, int index)
+{
+	Pump* pump = &set->pumps[index];
+	struct io_uring_sqe* sqe = uring_sqe(set->ring);
+	if(!sqe)
+		return; //Tried again next time around
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = pump->from;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = pump->buffers->group;
+	sqe->user_data = op_data(op_recv, index, 0);
+	if(pump->limited)
+	{
+		sqe->len = pump->remaining < URING_BUFFER_SIZE ?
+			pump->remaining : URING_BUFFER_SIZE;
+	}
+	else
+	{
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	}
+
+	pump->armed = true;
+	++set->outstanding;
+}
+
+//Send everything queued, as one chain
+static void send_queued(PumpSet* set, int index)
+{
+	Pump* pump = &set->pumps[index];
+	while(pump->queued)
+	{
+		struct io_uring_sqe* sqe = uring_sqe(set->ring);
+		if(!sqe)
+			break;
+
+		unsigned id = pump->queue[pump->queue_start];
+		pump->queue_start = (pump->queue_start + 1) % URING_BUFFERS;
+		--pump->queued;
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = pump->to;
+		sqe->addr = (unsigned long)uring_buffer(pump->buffers, id);
+		sqe->len = pump->lengths[id];
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = op_data(op_send, index, id);
+		if(pump->queued)
+			sqe->flags = IOSQE_IO_LINK;
+
+		++pump->sending;
+		++set->outstanding;
+	}
+}
+
+static void on_recv(PumpSet* set, int index, struct io_uring_cqe* cqe)
+{
+	Pump* pump = &set->pumps[index];
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		pump->armed = false;
+		--set->outstanding;
+	}
+
+	if(cqe->res > 0)
+	{
+		unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char* data = uring_buffer(pump->buffers, id);
+		pump->lengths[id] = cqe->res;
+		pump->queue[(pump->queue_start + pump->queued) % URING_BUFFERS] = id;
+		++pump->queued;
+
+		timer_progress(cqe->res);
+		capture_bytes(pump->from, data, cqe->res);
+		if(pump->limited)
+			pump->remaining -= cqe->res;
+	}
+	else if(cqe->res == 0)
+	{
+		pump->eof = true;
+		if(pump->limited) set->error = -1; //The body was cut short
+	}
+	else if(cqe->res == -ENOBUFS)
+	{
+		pump->paused = true;
+	}
+	else if(cqe->res == -EINVAL && !pump->started)
+	{
+		set->error = uring_unsupported; //No multishot recv
+	}
+	else if(cqe->res != -ECANCELED && !set->error)
+	{
+		set->error = -1;
+	}
+
+	pump->started = true;
+}
+
+static void on_send(PumpSet* set, int index, unsigned id, struct io_uring_cqe* cqe)
+{
+	Pump* pump = &set->pumps[index];
+	--pump->sending;
+	--set->outstanding;
+
+	//With MSG_WAITALL, a short send only happens on error
+	if(cqe->res != (int)pump->lengths[id])
+	{
+		if(cqe->res != -ECANCELED && !set->error)
+			set->error = -1;
+	}
+	else
+	{
+		timer_progress(cqe->res);
+		if(pump->count)
+			*pump->count += cqe->res;
+	}
+	uring_buffer_return(pump->buffers, id);
+}
+
+//Queue whatever each pump is ready for
+static void pumps_step(PumpSet* set)
+{
+	for(int i = 0; i < set->count; ++i)
+	{
+		Pump* pump = &set->pumps[i];
+		if(pump->done)
+			continue;
+
+		//Hysteresis: stop with every buffer in use, restart at the low watermark
+		if(in_use(pump) == URING_BUFFERS) pump->paused = true;
+		else if(in_use(pump) * URING_BUFFER_SIZE <= RELAY_LOW_WATERMARK)
+			pump->paused = false;
+
+		bool wants_more = pump->limited ? pump->remaining > 0 : !pump->eof;
+		if(!pump->armed && !pump->paused && wants_more)
+			arm_recv(set, i);
+
+		if(!pump->sending && pump->queued)
+			send_queued(set, i);
+
+		if(!wants_more && !pump->armed && in_use(pump) == 0)
+		{
+			//Pass a tunnel's half-close on
+			if(!pump->limited)
+				shutdown(pump->to, SHUT_WR);
+			pump->done = true;
+		}
+	}
+}
+
+static bool pumps_done(PumpSet* set)
+{
+	for(int i = 0; i < set->count; ++i)
+		if(!set->pumps[i].done)
+			return false;
+	return true;
+}
+
+static void pumps_complete(PumpSet* set, struct io_uring_cqe* cqe)
+{
+	int op = cqe->user_data & 0xff;
+	int index = (cqe->user_data >> 8) & 0xff;
+	unsigned id = cqe->user_data >> 16;
+
+	if(op == op_recv)
+		on_recv(set, index, cqe);
+	else if(op == op_send)
+		on_send(set, index, id, cqe);
+	else
+		--set->outstanding;
+}
+
+//Submit, and wait for a completion. A fiber waits in its scheduler instead.
+static inline int submit_and_wait(Uring* ring)
+{
+	if(!fiber_current())
+		return uring_submit(ring, 1);
+	if(uring_submit(ring, 0))
+		return -1;
+
+	struct pollfd completions = { .fd = ring->fd, .events = POLLIN };
+	while(!uring_peek(ring))
+		if(fiber_poll(&completions, 1, -1) < 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * Run the pumps until they finish or one fails. On failure, everything still
+ * outstanding is cancelled, and waited for, since the kernel may be using
+ * the buffers until it completes.
+ */
+static int pumps_run(PumpSet* set)
+{
+	bool cancelled = false;
+
+	while(1)
+	{
+		if(!set->error)
+			pumps_step(set);
+
+		if(set->error && set->outstanding && !cancelled)
+		{
+			struct io_uring_sqe* sqe = uring_sqe(set->ring);
+			if(sqe)
+			{
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = -1;
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+				sqe->user_data = op_data(op_cancel, 0, 0);
+				++set->outstanding;
+				cancelled = true;
+			}
+		}
+
+		if(set->outstanding == 0 && (set->error || pumps_done(set)))
+			break;
+
+		if(submit_and_wait(set->ring))
+		{
+			//Nothing sensible left to do; the ring teardown cancels it all
+			if(!set->error) set->error = -1;
+			break;
+		}
+
+		struct io_uring_cqe* cqe;
+		while((cqe = uring_peek(set->ring)))
+		{
+			pumps_complete(set, cqe);
+			uring_seen(set->ring);
+		}
+	}
+
+	return set->error;
+}
+
+int uring_relay_body(size_t size, int from_fd, int to_fd)
+{
+	PumpSet set;
+	if(pumps_init(&set, 1))
+		return uring_unsupported;
+
+	set.pumps[0].from = from_fd;
+	set.pumps[0].to = to_fd;
+	set.pumps[0].limited = true;
+	set.pumps[0].remaining = size;
+
+	int error = pumps_run(&set);
+	pumps_free(&set);
+
+	if(error == uring_unsupported)
+		return uring_unsupported;
+	return error ? connection_error : 0;
+}
+
+int uring_tunnel(int client_fd, int server_fd, TunnelCounts* counts)
+{
+	PumpSet set;
+	if(pumps_init(&set, 2))
+		return uring_unsupported;
+
+	set.pumps[0].from = client_fd;
+	set.pumps[0].to = server_fd;
+	set.pumps[0].count = &counts->up;
+	set.pumps[1].from = server_fd;
+	set.pumps[1].to = client_fd;
+	set.pumps[1].count = &counts->down;
+
+	int error = pumps_run(&set);
+	pumps_free(&set);
+
+	return error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ACCEPT
+///////////////////////////////////////////////////////////////////////////////
+
+static inline bool arm_accept(Uring* ring, int listener)
+{
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+	if(!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = op_data(op_accept, 0, 0);
+	return true;
+}
+
+//Wait for the listener to be handed over; see upgrade.h
+static inline bool arm_stop(Uring* ring)
+{
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+	if(!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = upgrade_stop_fd();
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = op_data(op_stop, 0, 0);
+	return true;
+}
+
+//The accept finishes with -ECANCELED, once it's handed over what it had
+static inline void cancel_accept(Uring* ring)
+{
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+	if(!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = op_data(op_accept, 0, 0);
+	sqe->user_data = op_data(op_cancel, 0, 0);
+}
+
+int uring_accept_loop(int listener)
+{
+	Uring ring;
+	if(uring_init(&ring, URING_ENTRIES))
+		return uring_unsupported;
+
+	bool armed = arm_accept(&ring, listener) && arm_stop(&ring);
+	bool started = false;
+	bool stopping = false;
+
+	while(armed && uring_submit(&ring, 1) == 0)
+	{
+		struct io_uring_cqe* cqe;
+		while(armed && (cqe = uring_peek(&ring)))
+		{
+			int op = cqe->user_data & 0xff;
+			int result = cqe->res;
+			bool more = cqe->flags & IORING_CQE_F_MORE;
+			uring_seen(&ring);
+
+			if(op == op_stop)
+			{
+				stopping = true;
+				cancel_accept(&ring);
+				continue;
+			}
+			if(op != op_accept)
+				continue;
+
+			if(result >= 0)
+			{
+				struct sockaddr_in client_addr;
+				socklen_t len = sizeof(client_addr);
+				getpeername(result, (struct sockaddr*)&client_addr, &len);
+
+				PROBE1(accept, result);
+				handle_connection(result, &client_addr);
+			}
+			else if(result == -EINVAL && !started)
+			{
+				uring_exit(&ring);
+				return uring_unsupported; //No multishot accept
+			}
+			else if(result != -ECONNABORTED && result != -EINTR)
+			{
+				armed = false;
+				break;
+			}
+
+			started = true;
+			if(!more)
+				armed = !stopping && arm_accept(&ring, listener);
+		}
+	}
+
+	uring_exit(&ring);
+	return 0;
+}